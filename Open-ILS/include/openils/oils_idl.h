@@ -10,9 +10,20 @@ extern "C" {
 #endif
 
 osrfHash* oilsIDLInit( const char* );
+osrfHash* oilsIDLInitLazy( const char* );
+struct _xmlDoc;
+osrfHash* oilsIDLInitDoc( struct _xmlDoc* doc );
 osrfHash* oilsIDL(void);
+osrfHash* oilsIDLGetClass( const char* classname );
 osrfHash* oilsIDLFindPath( const char*, ... );
 
+/* Support for reloading the IDL in a running process */
+osrfHash* oilsIDLLoad( const char* idl_filename );
+osrfHash* oilsIDLSwap( osrfHash* idl );
+int oilsIDLModified( void );
+void oilsIDLFree( osrfHash* idl );
+void oilsIDLFinalize( osrfHash* idl, int read_only );
+
 /* The oilsIDL hash looks like this:
 
 { aws : {
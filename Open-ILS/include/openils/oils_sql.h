@@ -31,6 +31,15 @@ void oilsSetSQLOptions( const char* module_name, int do_pcrud, int flesh_depth )
 void oilsSetDBConnection( dbi_conn conn );
 int oilsIsDBConnected( dbi_conn handle );
 int oilsExtendIDL( dbi_conn handle );
+void oilsSetIDLReload( void (*rebind)( void ) );
+void oilsSetQueryPlanCache( void );
+void oilsSetInListThreshold( void );
+void oilsSetResultCache( void );
+void oilsSetExplain( void );
+void oilsSetQueryLimits( void );
+void oilsSetResponseBatching( void );
+int oilsCheckIDL( osrfMethodContext* ctx );
+int oilsReloadIDL( osrfMethodContext* ctx );
 int str_is_true( const char* str );
 char* buildQuery( osrfMethodContext* ctx, jsonObject* query, int flags );
 
@@ -45,6 +54,7 @@ int releaseSavepoint ( osrfMethodContext* ctx );
 int rollbackSavepoint ( osrfMethodContext* ctx );
 
 int doJSONSearch ( osrfMethodContext* ctx );
+int doJSONBatch ( osrfMethodContext* ctx );
 
 int doCreate( osrfMethodContext* ctx );
 int doRetrieve( osrfMethodContext* ctx );
@@ -52,6 +62,8 @@ int doUpdate( osrfMethodContext* ctx );
 int doDelete( osrfMethodContext* ctx );
 int doSearch( osrfMethodContext* ctx );
 int doIdList( osrfMethodContext* ctx );
+int doCount( osrfMethodContext* ctx );
+int doExists( osrfMethodContext* ctx );
 
 int is_identifier( const char* s);
 int is_good_operator( const char* op );
@@ -1,3 +1,4 @@
+#include <time.h>
 #include "opensrf/osrf_json.h"
 #include "opensrf/log.h"
 
@@ -15,6 +16,22 @@
 #include "opensrf/osrf_settings.h"
 #include "opensrf/osrf_application.h"
 
+/**
+  True if messages at the given level (e.g. OSRF_LOG_DEBUG) would be logged.
+  Use it to skip building a message that is needed only for the log.
+ */
+#define OILS_LOG_ENABLED( level ) ( osrfLogGetLevel() >= (level) )
+
+/**
+  Like osrfLogDebug() and osrfLogInternal(), except that the arguments
+  are not evaluated at all unless the level is enabled.  Don't pass
+  arguments with side effects.
+ */
+#define OILS_LOG_DEBUG( ... ) \
+	do { if( OILS_LOG_ENABLED( OSRF_LOG_DEBUG )) osrfLogDebug( __VA_ARGS__ ); } while( 0 )
+#define OILS_LOG_INTERNAL( ... ) \
+	do { if( OILS_LOG_ENABLED( OSRF_LOG_INTERNAL )) osrfLogInternal( __VA_ARGS__ ); } while( 0 )
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,6 +44,13 @@ extern "C" {
  */
 osrfHash* oilsInitIDL( const char* idl_filename );
 
+/**
+  Like oilsInitIDL(), but builds each class only when it is
+  first looked up.  For short-lived programs that use only a
+  few classes; see oilsIDLInitLazy().
+ */
+osrfHash* oilsInitIDLLazy( const char* idl_filename );
+
 const char* oilsFMGetStringConst( const jsonObject* object, const char* field );
 
 char* oilsFMGetString( const jsonObject* object, const char* field );
@@ -110,6 +134,18 @@ int oilsUtilsIsDBTrue( const char* val );
 
 long oilsUtilsIntervalToSeconds( const char* interval );
 
+/** Size of a buffer big enough for any string built by oilsUtilsFormatDatetime(). */
+#define OILS_DATETIME_BUFSIZE 64
+
+/**
+ * Formats a time_t the way a datetime column is returned to clients:
+ * "HH:MM:SS" (UTC) if want_date is zero, "YYYY-MM-DD" (UTC) if want_time
+ * is zero, otherwise "YYYY-MM-DDTHH:MM:SS+hhmm" in the local time zone.
+ * buf must hold at least OILS_DATETIME_BUFSIZE bytes.
+ * @return The length of the formatted string.
+ */
+int oilsUtilsFormatDatetime( char* buf, time_t when, int want_date, int want_time );
+
 /**
  * Creates actor.usr_activity entries
  * @return The number of rows created.  0 or 1.
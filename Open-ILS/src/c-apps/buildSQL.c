@@ -373,7 +373,7 @@ static void buildFrom( BuildSQLState* state, const FromRelation* core_from ) {
 				}
 
 				// Look up table name, view name, or source_definition in the IDL
-				osrfHash* class_hash = osrfHashGet( oilsIDL(), core_from->class_name );
+				osrfHash* class_hash = oilsIDLGetClass( core_from->class_name );
 				relation = oilsGetRelation( class_hash );
 			}
 
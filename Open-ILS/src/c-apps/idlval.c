@@ -1,6 +1,24 @@
 /**
 	@file idlval.c
 	@brief Validator for IDL files.
+
+	Synopsis:
+
+	idlval [-f IDL_file] [-j threads] [-w] [-h] [class ...]
+
+	-f supplies the name of the IDL file.  If no IDL file is specified, idlval uses the
+	   value of the environmental variable OILS_IDL_FILENAME, if it is defined, or
+	   defaults to "/openils/conf/fm_IDL.xml".
+
+	-j sets the number of threads that validate the classes.  The default is one thread
+	   per CPU.  It doesn't apply when specific classes are named.
+
+	-w reports warnings as well as errors.
+
+	-h displays a summary of these options and exits.
+
+	If one or more class names follow the options, idlval validates only those classes.
+	Otherwise it validates them all.
 */
 
 /*
@@ -20,17 +38,22 @@ GNU General Public License for more details.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <libxml/globals.h>
 #include <libxml/xmlerror.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/debugXML.h>
 #include <libxml/xmlmemory.h>
+#include <libxml/xinclude.h>
 
 #include <opensrf/utils.h>
 #include <opensrf/osrf_hash.h>
+#include "openils/oils_idl.h"
 
 /* Represents the command line */
 struct Opts {
@@ -40,6 +63,8 @@ struct Opts {
 	char * idl_file_name;
 	int idl_file_name_found;
 	int warning;
+	int jobs;          // number of validating threads; 0 if not specified
+	int help;          // boolean; true if -h present
 };
 typedef struct Opts Opts;
 
@@ -99,8 +124,30 @@ typedef struct {
 	Link* links;       // linked list
 } Class;
 
+/* One class to be validated by the thread pool, with its messages */
+typedef struct {
+	Class* class;
+	const char* id;
+	growing_buffer* messages;  // everything reported about this class, in order
+	int rc;                    // 1 if errors found, or 0 if not
+} ClassJob;
+
+/* The work shared by the threads of the pool */
+typedef struct {
+	ClassJob* jobs;            // in the same order as the classes hash
+	int count;
+	int next;                  // index of the next job to be claimed
+	int phase;                 // 1 = validate locally; 2 = cross-validate
+	pthread_mutex_t lock;      // guards next
+} JobQueue;
+
 static int get_Opts( int argc, char * argv[], Opts * pOpts );;
-static int val_idl( void );
+static void usage( FILE* out, const char* progname );
+static int val_idl( int jobs );
+static void run_jobs( JobQueue* queue, int phase, int threads );
+static void* job_worker( void* arg );
+static void report( const char* format, ... );
+static int check_service_model( const Class* class, const char* id );
 static int cross_validate_classes( Class* class, const char* id );
 static int cross_validate_linkage( Class* class, const char*id, Link* link );
 static int val_class( Class* class, const char* id );
@@ -132,14 +179,25 @@ static void freeLink( Link* link );
 /* Stores an in-memory representation of the IDL */
 static osrfHash* classes = NULL;
 
+/* The same IDL as loaded by the services, for cross-checking our own model */
+static osrfHash* service_idl = NULL;
+
 static int warn = 0;       // boolean; true if -w present on command line
 
+/* Where report() puts messages for the current thread; NULL means stdout */
+static __thread growing_buffer* report_buf = NULL;
+
 int main( int argc, char* argv[] ) {
 
 	// Examine command line
 	Opts opts;
-	if( get_Opts( argc, argv, &opts ) )
+	if( get_Opts( argc, argv, &opts ) ) {
+		usage( stderr, argv[ 0 ] );
 		return 1;
+	} else if( opts.help ) {
+		usage( stdout, argv[ 0 ] );
+		return 0;
+	}
 
 	const char* IDL_filename = NULL;
 	if( opts.idl_file_name_found )
@@ -157,6 +215,13 @@ int main( int argc, char* argv[] ) {
 
 	xmlLineNumbersDefault(1);
 	xmlDocPtr doc = xmlReadFile( IDL_filename, NULL, XML_PARSE_XINCLUDE );
+
+	// Expand any XIncludes, as the services do, but without leaving marker nodes behind
+	if( doc && xmlXIncludeProcessFlags( doc, XML_PARSE_XINCLUDE | XML_PARSE_NOXINCNODE ) < 0 ) {
+		xmlFreeDoc( doc );
+		doc = NULL;
+	}
+
 	if ( ! doc ) {
 		fprintf( stderr, "Could not load or parse the IDL XML file %s\n", IDL_filename );
 		rc = 1;
@@ -169,10 +234,23 @@ int main( int argc, char* argv[] ) {
 		if( scan_idl( doc ) )
 			rc = 1;
 
+		// Build it again the way the services do, so that we can make sure that the
+		// services see the same classes, fields, and links that we do
+		service_idl = oilsIDLInitDoc( doc );
+		if( ! service_idl ) {
+			printf( "The services could not load %s\n", IDL_filename );
+			rc = 1;
+		}
+
 		if( opts.new_argc < 2 ) {
 
 			// No classes specified: validate all classes
-			if( val_idl() )
+			int jobs = opts.jobs;
+			if( jobs < 1 ) {
+				long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+				jobs = cpus > 0 ? (int) cpus : 1;
+			}
+			if( val_idl( jobs ) )
 				rc = 1;
 		} else {
 
@@ -182,7 +260,7 @@ int main( int argc, char* argv[] ) {
 				const char* classname = opts.new_argv[ i ];
 				Class* class = osrfHashGet( classes, classname );
 				if( ! class ) {
-					printf( "Class \"%s\" does not exist\n", classname );
+					report( "Class \"%s\" does not exist\n", classname );
 					rc = 1;
 				} else {
 					// Validate the class in isolation
@@ -191,6 +269,8 @@ int main( int argc, char* argv[] ) {
 					// Cross-validate with linked classes
 					if( cross_validate_classes( class, classname ) )
 						rc = 1;
+					if( check_service_model( class, classname ) )
+						rc = 1;
 				}
 				++i;
 			}
@@ -215,7 +295,7 @@ static int get_Opts( int argc, char * argv[], Opts * pOpts ) {
 
 	/* Define valid option characters */
 
-	const char optstring[] = ":f:w";
+	const char optstring[] = ":f:hj:w";
 
 	/* Initialize members of struct */
 
@@ -225,6 +305,8 @@ static int get_Opts( int argc, char * argv[], Opts * pOpts ) {
 	pOpts->idl_file_name_found = 0;
 	pOpts->idl_file_name = NULL;
 	pOpts->warning = 0;
+	pOpts->jobs = 0;
+	pOpts->help = 0;
 
 	/* Suppress error messages from getopt() */
 
@@ -244,6 +326,17 @@ static int get_Opts( int argc, char * argv[], Opts * pOpts ) {
 
 				pOpts->idl_file_name = optarg;
 				break;
+				case 'h' :   /* Get help */
+					pOpts->help = 1;
+					break;
+				case 'j' :   /* Get number of threads */
+					pOpts->jobs = atoi( optarg );
+					if( pOpts->jobs < 1 ) {
+						fprintf( stderr, "Invalid number of threads \"%s\" on -j option\n",
+								optarg );
+						rc = 1;
+					}
+					break;
 				case 'w' :   /* Get warning */
 					pOpts->warning = 1;
 					break;
@@ -281,27 +374,243 @@ static int get_Opts( int argc, char * argv[], Opts * pOpts ) {
 	return rc;
 }
 
+/**
+	@brief Describe the command line.
+	@param out The stream to write to.
+	@param progname The name of the program, as invoked.
+*/
+static void usage( FILE* out, const char* progname ) {
+	fprintf( out,
+		"Usage: %s [-f IDL_file] [-j threads] [-w] [-h] [class ...]\n"
+		"\n"
+		"  -f  IDL file to validate (default: $OILS_IDL_FILENAME, or\n"
+		"      /openils/conf/fm_IDL.xml)\n"
+		"  -j  number of threads validating classes (default: one per CPU)\n"
+		"  -w  report warnings as well as errors\n"
+		"  -h  show this message\n"
+		"\n"
+		"With no class names, validate every class in the IDL.\n",
+		progname );
+}
+
 /**
 	@brief Validate all classes.
+	@param jobs The number of threads to validate with.
 	@return 1 if errors found, or 0 if not.
 
-	Traverse the class list and validate each class in turn.
+	Validation proceeds in two phases.  First we validate each class in isolation, which
+	touches nothing but the class itself.  Then, once every class is loaded, we cross-validate
+	each class against the classes it links to, and against the services' model of the IDL,
+	which by then are read-only.  Within each phase the classes are divided among a pool of
+	threads.
+
+	Each class accumulates its own messages in a buffer.  We print the buffers at the end in
+	the order of the classes hash, so that the output doesn't depend on the number of threads
+	or on how they happen to be scheduled.
 */
-static int val_idl( void ) {
+static int val_idl( int jobs ) {
 	int rc = 0;
+	JobQueue queue;
+	queue.count = osrfHashGetCount( classes );
+	queue.jobs = safe_malloc( ( queue.count ? queue.count : 1 ) * sizeof( ClassJob ) );
+	pthread_mutex_init( &queue.lock, NULL );
+
+	// Line up the classes in a deterministic order
 	osrfHashIterator* itr = osrfNewHashIterator( classes );
 	Class* class = NULL;
+	int i = 0;
+	while( (class = osrfHashIteratorNext( itr )) && i < queue.count ) {
+		ClassJob* job = queue.jobs + i++;
+		job->class = class;
+		job->id = osrfHashIteratorKey( itr );
+		job->messages = buffer_init( 256 );
+		job->rc = 0;
+	}
+	osrfHashIteratorFree( itr );
+	queue.count = i;
+
+	if( jobs > queue.count )
+		jobs = queue.count;
+
+	run_jobs( &queue, 1, jobs );    // validate each class separately
+	run_jobs( &queue, 2, jobs );    // cross-validate with linked classes
 
-	// For each class
-	while( (class = osrfHashIteratorNext( itr )) ) {
-		const char* id = osrfHashIteratorKey( itr );
-		if( val_class( class, id ) )               // validate class separately
+	// Report the results in order
+	for( i = 0; i < queue.count; ++i ) {
+		ClassJob* job = queue.jobs + i;
+		fputs( OSRF_BUFFER_C_STR( job->messages ), stdout );
+		buffer_free( job->messages );
+		if( job->rc )
 			rc = 1;
-		if( cross_validate_classes( class, id ) )  // cross-validate with linked classes
+	}
+
+	pthread_mutex_destroy( &queue.lock );
+	free( queue.jobs );
+	return rc;
+}
+
+/**
+	@brief Run one phase of validation over every class in a queue.
+	@param queue Pointer to the JobQueue.
+	@param phase 1 to validate each class locally, or 2 to cross-validate.
+	@param threads The number of threads to use.
+
+	With only one thread we do the work in the calling thread.  Either way, we return only
+	when every class has been through the phase.
+*/
+static void run_jobs( JobQueue* queue, int phase, int threads ) {
+	queue->next = 0;
+	queue->phase = phase;
+
+	if( threads <= 1 ) {
+		job_worker( queue );
+		return;
+	}
+
+	pthread_t* tids = safe_malloc( threads * sizeof( pthread_t ) );
+	int started = 0;
+	while( started < threads ) {
+		if( pthread_create( tids + started, NULL, job_worker, queue ) )
+			break;     // Make do with however many we got
+		++started;
+	}
+
+	if( 0 == started )
+		job_worker( queue );
+
+	int i;
+	for( i = 0; i < started; ++i )
+		pthread_join( tids[ i ], NULL );
+
+	free( tids );
+}
+
+/**
+	@brief Claim and process classes from a JobQueue until there are none left.
+	@param arg Pointer to the JobQueue, cast to a void pointer.
+	@return NULL.
+*/
+static void* job_worker( void* arg ) {
+	JobQueue* queue = arg;
+
+	for( ;; ) {
+		pthread_mutex_lock( &queue->lock );
+		int i = queue->next++;
+		pthread_mutex_unlock( &queue->lock );
+		if( i >= queue->count )
+			break;
+
+		ClassJob* job = queue->jobs + i;
+		report_buf = job->messages;
+		if( 1 == queue->phase ) {
+			if( val_class( job->class, job->id ) )
+				job->rc = 1;
+		} else {
+			if( cross_validate_classes( job->class, job->id ) )
+				job->rc = 1;
+			if( check_service_model( job->class, job->id ) )
+				job->rc = 1;
+		}
+		report_buf = NULL;
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Report a message about the IDL.
+	@param format A printf-style format string.
+	@param ... Values to be formatted.
+
+	If the current thread is validating a class, append the message to that class's buffer;
+	otherwise write it to standard output.
+*/
+static void report( const char* format, ... ) {
+	VA_LIST_TO_STRING( format );
+	if( report_buf )
+		buffer_add( report_buf, VA_BUF );
+	else
+		fputs( VA_BUF, stdout );
+}
+
+/**
+	@brief Make sure that the services see a class the same way that we do.
+	@param class Pointer to the current Class.
+	@param id Class id.
+	@return 1 if discrepancies found, or 0 if not.
+
+	The services load the IDL with their own parser (in oils_idl-core.c).  If it disagrees
+	with ours about the primary key, the fields, or the links of a class, then one of the
+	two parsers has drifted, and the validation we just did may not mean what we think.
+*/
+static int check_service_model( const Class* class, const char* id ) {
+	if( ! service_idl )
+		return 0;     // Already complained about it
+
+	osrfHash* service_class = osrfHashGet( service_idl, id );
+	if( ! service_class ) {
+		report( "Class \"%s\" is missing from the services' IDL\n", id );
+		return 1;
+	}
+
+	int rc = 0;
+
+	const char* primary = osrfHashGet( service_class, "primarykey" );
+	if( ( primary ? 1 : 0 ) != ( class->primary ? 1 : 0 )
+			|| ( primary && strcmp( primary, (char*) class->primary ) ) ) {
+		report( "In class \"%s\": services see primary key \"%s\" instead of \"%s\"\n",
+			id, primary ? primary : "", class->primary ? (char*) class->primary : "" );
+		rc = 1;
+	}
+
+	osrfHash* service_fields = osrfHashGet( service_class, "fields" );
+	const Field* field = class->fields;
+	while( field ) {
+		osrfHash* service_field = service_fields ?
+			osrfHashGet( service_fields, (char*) field->name ) : NULL;
+		if( ! service_field ) {
+			report( "In class \"%s\": field \"%s\" is missing from the services' IDL\n",
+				id, (char*) field->name );
 			rc = 1;
+		} else if( strcmp( (char*) field->name, "isnew" )
+				&& strcmp( (char*) field->name, "ischanged" )
+				&& strcmp( (char*) field->name, "isdeleted" ) ) {
+			// (The services always treat the three standard fields as virtual)
+			const char* virt = osrfHashGet( service_field, "virtual" );
+			int service_virtual = virt && !strcmp( virt, "true" );
+			if( service_virtual != field->is_virtual ) {
+				report( "In class \"%s\": services see field \"%s\" as %svirtual\n",
+					id, (char*) field->name, service_virtual ? "" : "non-" );
+				rc = 1;
+			}
+		}
+		field = field->next;
+	}
+
+	osrfHash* service_links = osrfHashGet( service_class, "links" );
+	const Link* link = class->links;
+	while( link ) {
+		osrfHash* service_link = service_links ?
+			osrfHashGet( service_links, (char*) link->field ) : NULL;
+		if( ! service_link ) {
+			report( "In class \"%s\": link for field \"%s\" is missing from the services' IDL\n",
+				id, (char*) link->field );
+			rc = 1;
+		} else {
+			const char* reltype = osrfHashGet( service_link, "reltype" );
+			const char* key = osrfHashGet( service_link, "key" );
+			const char* classref = osrfHashGet( service_link, "class" );
+			if( translate_reltype( (const xmlChar*) reltype ) != link->reltype
+					|| !key || strcmp( key, (char*) link->key )
+					|| !classref || strcmp( classref, (char*) link->classref ) ) {
+				report( "In class \"%s\": services see the link for field \"%s\" differently\n",
+					id, (char*) link->field );
+				rc = 1;
+			}
+		}
+		link = link->next;
 	}
 
-	osrfHashIteratorFree( itr );
 	return rc;
 }
 
@@ -342,7 +651,7 @@ static int cross_validate_linkage( Class* class, const char*id, Link* link ) {
 	int rc = 0;
 	Class* other_class = osrfHashGet( classes, (char*) link->classref );
 	if( ! other_class ) {
-		printf( "In class \"%s\": class \"%s\", referenced by \"%s\" field, does not exist\n",
+		report( "In class \"%s\": class \"%s\", referenced by \"%s\" field, does not exist\n",
 				id, (char*) link->classref, (char*) link->field );
 		rc = 1;
 	} else {
@@ -365,7 +674,7 @@ static int cross_validate_linkage( Class* class, const char*id, Link* link ) {
 			// Link is not reciprocated?  That's okay, as long as
 			// the referenced field exists in the referenced class.
 			if( !searchFieldByName( other_class, link->key ) ) {
-				printf( "In class \"%s\": field \"%s\" links to field \"%s\" of class \"%s\", "
+				report( "In class \"%s\": field \"%s\" links to field \"%s\" of class \"%s\", "
 					"but that field doesn't exist\n", id, (char*) link->field,
 					(char*) link->key, (char*) link->classref );
 				rc = 1;
@@ -380,11 +689,11 @@ static int cross_validate_linkage( Class* class, const char*id, Link* link ) {
 				++many_count;
 
 			if( 0 == many_count ) {
-				printf( "Classes \"%s\" and \"%s\" link to each other, but neither has a reltype "
+				report( "Classes \"%s\" and \"%s\" link to each other, but neither has a reltype "
 						"of \"has_many\"\n", id, (char*) link->classref );
 				rc = 1;
 			} else if( 2 == many_count ) {
-				printf( "Classes \"%s\" and \"%s\" link to each other, but both have a reltype "
+				report( "Classes \"%s\" and \"%s\" link to each other, but both have a reltype "
 						"of \"has_many\"\n", id, (char*) link->classref );
 				rc = 1;
 			}
@@ -445,13 +754,13 @@ static int val_class( Class* class, const char* id ) {
 					end[ 1 ] = '\0';
 				}
 
-				printf( "Unexpected text in class \"%s\": \"%s\"\n", id,
+				report( "Unexpected text in class \"%s\": \"%s\"\n", id,
 					(char*) begin );
 				xmlFree( content );
 			}
 		} else if( !strcmp( child_name, "fields" ) ) {
 			if( fields ) {
-				printf( "Multiple <fields> elements in class \"%s\"\n", id );
+				report( "Multiple <fields> elements in class \"%s\"\n", id );
 				rc = 1;
 			} else {
 				fields = child;
@@ -462,7 +771,7 @@ static int val_class( Class* class, const char* id ) {
 			}
 		} else if( !strcmp( child_name, "links" ) ) {
 			if( links ) {
-				printf( "Multiple <links> elements in class \"%s\"\n", id );
+				report( "Multiple <links> elements in class \"%s\"\n", id );
 				rc = 1;
 			} else {
 				links = child;
@@ -471,14 +780,14 @@ static int val_class( Class* class, const char* id ) {
 			}
 		} else if( !strcmp( child_name, "permacrud" ) ) {
 			if( permacrud ) {
-				printf( "Multiple <permacrud> elements in class \"%s\"\n", id );
+				report( "Multiple <permacrud> elements in class \"%s\"\n", id );
 				rc = 1;
 			} else {
 				permacrud = child;
 			}
 		} else if( !strcmp( child_name, "source_definition" ) ) {
 			if( src_def ) {
-				printf( "Multiple <source_definition> elements in class \"%s\"\n", id );
+				report( "Multiple <source_definition> elements in class \"%s\"\n", id );
 				rc = 1;
 			} else {
 				// To do: verify that there is nothing in <source_definition> except text and
@@ -488,7 +797,7 @@ static int val_class( Class* class, const char* id ) {
 		} else if( !strcmp( child_name, "comment" ) )
 			;  // ignore comment
 		else {
-			printf( "Line %ld: Unexpected <%s> element in class \"%s\"\n",
+			report( "Line %ld: Unexpected <%s> element in class \"%s\"\n",
 				xmlGetLineNo( child ), child_name, id );
 			rc = 1;
 		}
@@ -501,7 +810,7 @@ static int val_class( Class* class, const char* id ) {
 		if( val_fields_attributes( class, id, fields ) )
 			rc = 1;
 	} else {
-		printf( "No <fields> element in class \"%s\"\n", id );
+		report( "No <fields> element in class \"%s\"\n", id );
 		rc = 1;
 	}
 
@@ -547,7 +856,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			controller_found = 1;
 			xmlChar* value = xmlGetProp( class->node, (xmlChar*) "controller" );
 			if( '\0' == *value ) {
-				printf( "Line %ld: Value of controller attribute is empty in class \"%s\"\n",
+				report( "Line %ld: Value of controller attribute is empty in class \"%s\"\n",
 					xmlGetLineNo( class->node ), id );
 				rc = 1;
 			}
@@ -556,7 +865,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			fieldmapper_found = 1;
 			xmlChar* value = xmlGetProp( class->node, (xmlChar*) "fieldmapper" );
 			if( '\0' == *value ) {
-				printf( "Line %ld: Value of fieldmapper attribute is empty in class \"%s\"\n",
+				report( "Line %ld: Value of fieldmapper attribute is empty in class \"%s\"\n",
 						xmlGetLineNo( class->node ), id );
 				rc = 1;
 			}
@@ -564,7 +873,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 		} else if( !strcmp( (char*) attr_name, "label" ) ) {
 			xmlChar* value = xmlGetProp( class->node, (xmlChar*) "label" );
 			if( '\0' == *value ) {
-				printf( "Line %ld: Value of label attribute is empty in class \"%s\"\n",
+				report( "Line %ld: Value of label attribute is empty in class \"%s\"\n",
 						xmlGetLineNo( class->node ), id );
 				rc = 1;
 			}
@@ -573,7 +882,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			tablename_found = 1;
 			xmlChar* value = xmlGetProp( class->node, (xmlChar*) "tablename" );
 			if( '\0' == *value ) {
-				printf( "Line %ld: Value of tablename attribute is empty in class \"%s\"\n",
+				report( "Line %ld: Value of tablename attribute is empty in class \"%s\"\n",
 						xmlGetLineNo( class->node ), id );
 				rc = 1;
 			}
@@ -584,7 +893,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 				if( !strcmp( (char*) virtual_str, "true" ) ) {
 					class->is_virtual = 1;
 				} else if( strcmp( (char*) virtual_str, "false" ) ) {
-					printf(
+					report(
 						"Line %ld: Invalid value \"%s\" for virtual attribute of class\"%s\"\n",
 						xmlGetLineNo( class->node ), (char*) virtual_str, id );
 					rc = 1;
@@ -596,7 +905,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			if( readonly ) {
 				if(    strcmp( (char*) readonly, "true" )
 					&& strcmp( (char*) readonly, "false" ) ) {
-					printf(
+					report(
 						"Line %ld: Invalid value \"%s\" for readonly attribute of class\"%s\"\n",
 						xmlGetLineNo( class->node ), (char*) readonly, id );
 					rc = 1;
@@ -606,7 +915,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 		} else if( !strcmp( (char*) attr_name, "restrict_primary" ) ) {
 			xmlChar* value = xmlGetProp( class->node, (xmlChar*) "restrict_primary" );
 			if( '\0' == *value ) {
-				printf( "Line %ld: Value of restrict_primary attribute is empty in class \"%s\"\n",
+				report( "Line %ld: Value of restrict_primary attribute is empty in class \"%s\"\n",
 						xmlGetLineNo( class->node ), id );
 				rc = 1;
 			}
@@ -616,7 +925,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			if( core ) {
 				if(    strcmp( (char*) core, "true" )
 					&& strcmp( (char*) core, "false" ) ) {
-					printf(
+					report(
 					   "Line %ld: Invalid value \"%s\" for core attribute of class\"%s\"\n",
 						xmlGetLineNo( class->node ), (char*) core, id );
 					rc = 1;
@@ -628,7 +937,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 			if( field_safe ) {
 				if(    strcmp( (char*) field_safe, "true" )
 					&& strcmp( (char*) field_safe, "false" ) ) {
-					printf(
+					report(
 						"Line %ld: Invalid value \"%s\" for field_safe attribute of class\"%s\"\n",
 						xmlGetLineNo( class->node ), (char*) field_safe, id );
 					rc = 1;
@@ -636,7 +945,7 @@ static int val_class_attributes( Class* class, const char* id ) {
 				xmlFree( field_safe );
 			}
 		} else {
-			printf( "Line %ld: Unrecognized class attribute \"%s\" in class \"%s\"\n",
+			report( "Line %ld: Unrecognized class attribute \"%s\" in class \"%s\"\n",
 				xmlGetLineNo( class->node ), attr_name, id );
 			rc = 1;
 		}
@@ -644,19 +953,19 @@ static int val_class_attributes( Class* class, const char* id ) {
 	} // end while
 
 	if( ! controller_found ) {
-		printf( "Line %ld: No controller attribute for class \"%s\"\n",
+		report( "Line %ld: No controller attribute for class \"%s\"\n",
 			xmlGetLineNo( class->node ), id );
 		rc = 1;
 	}
 
 	if( ! fieldmapper_found ) {
-		printf( "Line %ld: No fieldmapper attribute for class \"\%s\"\n",
+		report( "Line %ld: No fieldmapper attribute for class \"\%s\"\n",
 			xmlGetLineNo( class->node ), id );
 		rc = 1;
 	}
 
 	if( class->is_virtual && tablename_found ) {
-		printf( "Line %ld: Virtual class \"%s\" shouldn't have a tablename",
+		report( "Line %ld: Virtual class \"%s\" shouldn't have a tablename",
 			xmlGetLineNo( class->node ), id );
 		rc = 1;
 	}
@@ -692,7 +1001,7 @@ static int check_labels( const Class* class, const char* id ) {
 	}
 
 	if( label_found && unlabel_found ) {
-		printf( "Class \"%s\" has a mixture of labeled and unlabeled fields\n", id );
+		report( "Class \"%s\" has a mixture of labeled and unlabeled fields\n", id );
 		rc = 1;
 	}
 
@@ -728,7 +1037,7 @@ static int val_fields_attributes( Class* class, const char* id, xmlNodePtr field
 		if( !strcmp( attr_name, "primary" ) ) {
 			primary = xmlGetProp( fields, (xmlChar*) "primary" );
 			if( '\0' == primary[0] ) {
-				printf(
+				report(
 					"Line %ld: value of primary attribute is an empty string for class \"%s\"\n",
 					xmlGetLineNo( fields ), id );
 				rc = 1;
@@ -736,18 +1045,18 @@ static int val_fields_attributes( Class* class, const char* id, xmlNodePtr field
 		} else if( !strcmp( attr_name, "sequence" )) {
 			sequence = xmlGetProp( fields, (xmlChar*) "sequence" );
 			if( '\0' == sequence[0] ) {
-				printf(
+				report(
 					"Line %ld: value of sequence attribute is an empty string for class \"%s\"\n",
 					xmlGetLineNo( fields ), id );
 				rc = 1;
 			} else if( !strchr( (const char*) sequence, '.' )) {
-				printf(
+				report(
 					"Line %ld: name of sequence for class \"%s\" is not qualified by schema\n",
 					xmlGetLineNo( fields ), id );
 				rc = 1;
 			}
 		} else {
-			printf( "Line %ld: Unexpected fields attribute \"%s\" in class \"%s\"\n",
+			report( "Line %ld: Unexpected fields attribute \"%s\" in class \"%s\"\n",
 				xmlGetLineNo( fields ), attr_name, id );
 			rc = 1;
 		}
@@ -756,7 +1065,7 @@ static int val_fields_attributes( Class* class, const char* id, xmlNodePtr field
 	}
 
 	if( sequence && ! primary ) {
-		printf( "Line %ld: class \"%s\" has a sequence identified but no primary key\n",
+		report( "Line %ld: class \"%s\" has a sequence identified but no primary key\n",
 			xmlGetLineNo( fields ), id );
 		rc = 1;
 	}
@@ -770,11 +1079,11 @@ static int val_fields_attributes( Class* class, const char* id, xmlNodePtr field
 			field = field->next;
 		}
 		if( !field ) {
-			printf( "Primary key field \"%s\" does not exist for class \"%s\"\n",
+			report( "Primary key field \"%s\" does not exist for class \"%s\"\n",
 				(char*) primary, id );
 			rc = 1;
 		} else if( DT_ID == field->datatype && ! sequence && ! class->is_virtual ) {
-			printf(
+			report(
 				"Line %ld: Primary key is an id; class \"%s\" may need a sequence attribute\n",
 				xmlGetLineNo( fields ), id );
 			rc = 1;
@@ -782,7 +1091,7 @@ static int val_fields_attributes( Class* class, const char* id, xmlNodePtr field
 				   && DT_INT != field->datatype
 				   && DT_ORG_UNIT != field->datatype
 				   && sequence ) {
-			printf(
+			report(
 				"Line %ld: Datatype of key for class \"%s\" does not allow a sequence attribute\n",
 				xmlGetLineNo( fields ), id );
 			rc = 1;
@@ -821,7 +1130,7 @@ static int val_links_to_fields( const Class* class, const char* id ) {
 				if( compareFieldAndLink( class, id, field, link ) )
 					rc = 1;
 			} else {
-				printf( "\"%s\" class has no <field> corresponding to <link> for \"%s\"\n",
+				report( "\"%s\" class has no <field> corresponding to <link> for \"%s\"\n",
 					id, (char*) link->field );
 				rc = 1;
 			}
@@ -863,13 +1172,13 @@ static int compareFieldAndLink( const Class* class, const char* id,
 		if( warn && field->is_virtual ) {
 			// This is the child class; field should usually be non-virtual,
 			// but there are legitimate exceptions.
-			printf( "WARNING: In class \"%s\": field \"%s\" is tied to a \"has_a\" or "
+			report( "WARNING: In class \"%s\": field \"%s\" is tied to a \"has_a\" or "
 				"\"might_have\" link; perhaps should not be virtual\n",
 				id, (char*) field->name );
 		}
 	} else if ( RT_HAS_MANY == link->reltype ) {
 		if( ! field->is_virtual ) {
-			printf( "In class \"%s\": field \"%s\" is tied to a \"has_many\" link "
+			report( "In class \"%s\": field \"%s\" is tied to a \"has_many\" link "
 					"and therefore should be virtual\n", id, (char*) field->name );
 			rc = 1;
 		}
@@ -879,29 +1188,29 @@ static int compareFieldAndLink( const Class* class, const char* id,
 	if( class->primary && !strcmp( (char*) class->primary, (char*) field->name ) ) {
 		; // For the primary key field, the datatype can be anything
 	} else if( DT_NONE == datatype || DT_INVALID == datatype ) {
-		printf( "In class \"%s\": \"%s\" field should have a datatype for linkage\n",
+		report( "In class \"%s\": \"%s\" field should have a datatype for linkage\n",
 				id, (char*) field->name );
 		rc = 1;
 	} else if( DT_ORG_UNIT == datatype ) {
 		if( strcmp( classref, "aou" ) ) {
-			printf( "In class \"%s\": \"%s\" field should have a datatype "
+			report( "In class \"%s\": \"%s\" field should have a datatype "
 					"\"link\", not \"org_unit\"\n", id, field->name );
 			rc = 1;
 		}
 	} else if( DT_LINK == datatype ) {
 		if( warn && !strcmp( classref, "aou" ) ) {
-			printf( "WARNING: In class \"%s\", field \"%s\": Consider changing datatype "
+			report( "WARNING: In class \"%s\", field \"%s\": Consider changing datatype "
 					"to \"org_unit\"\n", id, (char*) field->name );
 		}
 	} else {
 		// Datatype should be "link", or maybe "org_unit"
 		if( !strcmp( classref, "aou" ) ) {
-			printf( "In class \"%s\": \"%s\" field should have a datatype "
+			report( "In class \"%s\": \"%s\" field should have a datatype "
 					"\"org_unit\" or \"link\"\n",
 					id, (char*) field->name );
 			rc = 1;
 		} else {
-			printf( "In class \"%s\": \"%s\" field should have a datatype \"link\"\n",
+			report( "In class \"%s\": \"%s\" field should have a datatype \"link\"\n",
 					id, (char*) field->name );
 			rc = 1;
 		}
@@ -942,7 +1251,7 @@ static int val_fields_to_links( const Class* class, const char* id ) {
 				// datatype "org_unit", but it's not a foreign key.
 				;
 			} else {
-				printf( "In class \"%s\": Linked field \"%s\" has no matching <link>\n",
+				report( "In class \"%s\": Linked field \"%s\" has no matching <link>\n",
 						id, (char*) field->name );
 				rc = 1;
 			}
@@ -1009,7 +1318,7 @@ static int val_fields( Class* class, const char* id, xmlNodePtr fields ) {
 					end[ 1 ] = '\0';
 				}
 
-				printf( "Unexpected text in <fields> element of class \"%s\": \"%s\"\n", id,
+				report( "Unexpected text in <fields> element of class \"%s\": \"%s\"\n", id,
 					(char*) begin );
 				xmlFree( content );
 			}
@@ -1020,7 +1329,7 @@ static int val_fields( Class* class, const char* id, xmlNodePtr fields ) {
 		} else if( !strcmp( child_name, "comment" ) )
 			;  // ignore comment
 		else {
-			printf( "Line %ld: Unexpected <%s> element in <fields> of class \"%s\"\n",
+			report( "Line %ld: Unexpected <%s> element in <fields> of class \"%s\"\n",
 				xmlGetLineNo( child ), child_name, id );
 			rc = 1;
 		}
@@ -1028,7 +1337,7 @@ static int val_fields( Class* class, const char* id, xmlNodePtr fields ) {
 	}
 
 	if( !field_found ) {
-		printf( "No <field> element in class \"%s\"\n", id );
+		report( "No <field> element in class \"%s\"\n", id );
 		rc = 1;
 	}
 
@@ -1073,7 +1382,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 			if( !strcmp( (char*) virt, "true" ) )
 				is_virtual = 1;
 			else if( strcmp( (char*) virt, "false" ) ) {
-				printf( "Line %ld: Invalid value for virtual attribute: \"%s\"\n",
+				report( "Line %ld: Invalid value for virtual attribute: \"%s\"\n",
 					xmlGetLineNo( field ), (char*) virt );
 				rc = 1;
 			}
@@ -1082,7 +1391,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 		} else if( !strcmp( attr_name, "label" ) ) {
 			label = xmlGetProp( field, (xmlChar*) "label" );
 			if( '\0' == *label ) {
-				printf( "Line %ld: Empty value for label attribute for class \"%s\"\n",
+				report( "Line %ld: Empty value for label attribute for class \"%s\"\n",
 					xmlGetLineNo( field ), id );
 				xmlFree( label );
 				label = NULL;
@@ -1093,14 +1402,14 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 			xmlChar* dt_str = xmlGetProp( field, (xmlChar*) "datatype" );
 			datatype = translate_datatype( dt_str );
 			if( DT_INVALID == datatype ) {
-				printf( "Line %ld: Invalid datatype \"%s\" in class \"%s\"\n",
+				report( "Line %ld: Invalid datatype \"%s\" in class \"%s\"\n",
 					xmlGetLineNo( field ), (char*) dt_str, id );
 				rc = 1;
 			}
 			xmlFree( dt_str );
 			// To do: make sure that the namespace is reporter
 		} else if( !strcmp( attr_name, "array_position" ) ) {
-			printf( "Line %ld: WARNING: Deprecated array_position attribute "
+			report( "Line %ld: WARNING: Deprecated array_position attribute "
 					"for field \"%s\" in class \"%s\"\n",
 					xmlGetLineNo( field ), ((char*) field_name ? : ""), id );
 		} else if( !strcmp( attr_name, "selector" ) ) {
@@ -1108,7 +1417,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 		} else if( !strcmp( attr_name, "i18n" ) ) {
 			xmlChar* i18n = xmlGetProp( field, (xmlChar*) "i18n" );
 			if( strcmp( (char*) i18n, "true" ) && strcmp( (char*) i18n, "false" ) ) {
-				printf( "Line %ld: Invalid value for i18n attribute: \"%s\"\n",
+				report( "Line %ld: Invalid value for i18n attribute: \"%s\"\n",
 					xmlGetLineNo( field ), (char*) i18n );
 				rc = 1;
 			}
@@ -1117,7 +1426,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 		} else if( !strcmp( attr_name, "primitive" ) ) {
 			xmlChar* primitive = xmlGetProp( field, (xmlChar*) "primitive" );
 			if( strcmp( (char*) primitive, "string" ) && strcmp( (char*) primitive, "number" ) ) {
-				printf( "Line %ld: Invalid value for primitive attribute: \"%s\"\n",
+				report( "Line %ld: Invalid value for primitive attribute: \"%s\"\n",
 					xmlGetLineNo( field ), (char*) primitive );
 				rc = 1;
 			}
@@ -1126,7 +1435,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 			xmlChar* validate = xmlGetProp( field, (xmlChar*) "validate" );
 			if( !*validate ) {
 				// Value should be a regular expression to define a validation rule
-				printf( "Line %ld: Empty value for \"validate\" attribute "
+				report( "Line %ld: Empty value for \"validate\" attribute "
 					"for field \"%s\" in class \"%s\"\n",
 					xmlGetLineNo( field ), (char*) field_name ? : "", id );
 				rc = 1;
@@ -1136,7 +1445,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 		} else if( !strcmp( attr_name, "required" )) {
 			xmlChar* required = xmlGetProp( field, (xmlChar*) "required" );
 			if( strcmp( (char*) required, "true" ) && strcmp( (char*) required, "false" )) {
-				printf( 
+				report( 
 					"Line %ld: Invalid value \"%s\" for \"required\" attribute "
 					"for field \"%s\" in class \"%s\"\n",
 					xmlGetLineNo( field ), (char*) required,
@@ -1146,7 +1455,7 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 			xmlFree( required );
 			// To do: verify that the namespace is oils_obj
 		} else {
-			printf( "Line %ld: Unexpected field attribute \"%s\" in class \"%s\"\n",
+			report( "Line %ld: Unexpected field attribute \"%s\" in class \"%s\"\n",
 				xmlGetLineNo( field ), attr_name, id );
 			rc = 1;
 		}
@@ -1155,16 +1464,16 @@ static int val_one_field( Class* class, const char* id, xmlNodePtr field ) {
 	}
 
 	if( warn && (!is_virtual) && DT_NONE == datatype ) {
-		printf( "Line %ld: WARNING: No datatype attribute for field \"%s\" in class \"%s\"\n",
+		report( "Line %ld: WARNING: No datatype attribute for field \"%s\" in class \"%s\"\n",
 			xmlGetLineNo( field ), ((char*) field_name ? : ""), id );
 	}
 
 	if( ! field_name ) {
-		printf( "Line %ld: No name attribute for <field> element in class \"%s\"\n",
+		report( "Line %ld: No name attribute for <field> element in class \"%s\"\n",
 			xmlGetLineNo( field ), id );
 		rc = 1;
 	} else if( '\0' == *field_name ) {
-		printf( "Line %ld: Field name is empty for <field> element in class \"%s\"\n",
+		report( "Line %ld: Field name is empty for <field> element in class \"%s\"\n",
 			xmlGetLineNo( field ), id );
 		rc = 1;
 	} else {
@@ -1257,7 +1566,7 @@ static int val_links( Class* class, const char* id, xmlNodePtr links ) {
 					end[ 1 ] = '\0';
 				}
 
-				printf( "Unexpected text in <links> element of class \"%s\": \"%s\"\n", id,
+				report( "Unexpected text in <links> element of class \"%s\": \"%s\"\n", id,
 					(char*) begin );
 				xmlFree( content );
 			}
@@ -1268,7 +1577,7 @@ static int val_links( Class* class, const char* id, xmlNodePtr links ) {
 		} else if( !strcmp( child_name, "comment" ) )
 			;  // ignore comment
 		else {
-			printf( "Line %ld: Unexpected <%s> element in <link> of class \"%s\"\n",
+			report( "Line %ld: Unexpected <%s> element in <link> of class \"%s\"\n",
 				xmlGetLineNo( child ), child_name, id );
 				rc = 1;
 		}
@@ -1276,7 +1585,7 @@ static int val_links( Class* class, const char* id, xmlNodePtr links ) {
 	}
 
 	if( warn && !link_found ) {
-		printf( "WARNING: No <link> element in class \"%s\"\n", id );
+		report( "WARNING: No <link> element in class \"%s\"\n", id );
 	}
 
 	return rc;
@@ -1314,13 +1623,13 @@ static int val_one_link( Class* class, const char* id, xmlNodePtr link ) {
 			if( *rt ) {
 				reltype = translate_reltype( rt );
 				if( RT_INVALID == reltype ) {
-					printf(
+					report(
 						"Line %ld: Invalid value \"%s\" for reltype attribute in class \"%s\"\n",
 						xmlGetLineNo( link ), (char*) rt, id );
 					rc = 1;
 				}
 			} else {
-				printf( "Line %ld: Empty value for reltype attribute in class \"%s\"\n",
+				report( "Line %ld: Empty value for reltype attribute in class \"%s\"\n",
 					xmlGetLineNo( link ), id );
 				rc = 1;
 			}
@@ -1332,7 +1641,7 @@ static int val_one_link( Class* class, const char* id, xmlNodePtr link ) {
 		} else if (!strcmp( attr_name, "class" ) ) {
 			classref = xmlGetProp( link, (xmlChar*) "class" );
 		} else {
-			printf( "Line %ld: Unexpected attribute %s in links element of class \"%s\"\n",
+			report( "Line %ld: Unexpected attribute %s in links element of class \"%s\"\n",
 				xmlGetLineNo( link ), attr_name, id );
 			rc = 1;
 		}
@@ -1340,31 +1649,31 @@ static int val_one_link( Class* class, const char* id, xmlNodePtr link ) {
 	}
 
 	if( !field_name ) {
-		printf( "Line %ld: No field attribute found in <link> in class \"%s\"\n",
+		report( "Line %ld: No field attribute found in <link> in class \"%s\"\n",
 			xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( '\0' == *field_name ) {
-		printf( "Line %ld: Field name is empty for <link> element in class \"%s\"\n",
+		report( "Line %ld: Field name is empty for <link> element in class \"%s\"\n",
 			xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( !reltype ) {
-		printf( "Line %ld: No reltype attribute found in <link> in class \"%s\"\n",
+		report( "Line %ld: No reltype attribute found in <link> in class \"%s\"\n",
 			xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( !key ) {
-		printf( "Line %ld: No key attribute found in <link> in class \"%s\"\n",
+		report( "Line %ld: No key attribute found in <link> in class \"%s\"\n",
 				xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( '\0' == *key ) {
-		printf( "Line %ld: key attribute is empty for <link> element in class \"%s\"\n",
+		report( "Line %ld: key attribute is empty for <link> element in class \"%s\"\n",
 			xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( !classref ) {
-		printf( "Line %ld: No class attribute found in <link> in class \"%s\"\n",
+		report( "Line %ld: No class attribute found in <link> in class \"%s\"\n",
 			 xmlGetLineNo( link ), id );
 		rc = 1;
 	} else if( '\0' == *classref ) {
-		printf( "Line %ld: class attribute is empty for <link> element in class \"%s\"\n",
+		report( "Line %ld: class attribute is empty for <link> element in class \"%s\"\n",
 			xmlGetLineNo( link ), id );
 		rc = 1;
 	} else {
@@ -1435,7 +1744,7 @@ static int scan_idl( xmlDocPtr doc ) {
 					end[ 1 ] = '\0';
 				}
 
-				printf( "Unexpected text between class elements: \"%s\"\n",
+				report( "Unexpected text between class elements: \"%s\"\n",
 					(char*) begin );
 				xmlFree( content );
 			}
@@ -1445,7 +1754,7 @@ static int scan_idl( xmlDocPtr doc ) {
 		} else if( !strcmp( child_name, "comment" ) )
 			;  // ignore comment
 		else {
-			printf( "Line %ld: Unexpected <%s> element under root\n",
+			report( "Line %ld: Unexpected <%s> element under root\n",
 				xmlGetLineNo( child ), child_name );
 			rc = 1;
 		}
@@ -1474,10 +1783,10 @@ static int register_class( xmlNodePtr class ) {
 	xmlChar* id = xmlGetProp( class, (xmlChar*) "id" );
 
 	if( ! id ) {
-		printf( "Line %ld: Class has no \"id\" attribute\n", xmlGetLineNo( class ) );
+		report( "Line %ld: Class has no \"id\" attribute\n", xmlGetLineNo( class ) );
 		rc = 1;
 	} else if( ! *id ) {
-		printf( "Line %ld: Class id is an empty string\n", xmlGetLineNo( class ) );
+		report( "Line %ld: Class id is an empty string\n", xmlGetLineNo( class ) );
 		rc = 1;
 	} else {
 
@@ -1488,7 +1797,7 @@ static int register_class( xmlNodePtr class ) {
 			if( islower( *p ) || isdigit( *p ) || '_' == *p )
 				++p;
 			else if( warn ) {
-				printf( "Line %ld: WARNING: Dubious class id \"%s\"; not all lower case, "
+				report( "Line %ld: WARNING: Dubious class id \"%s\"; not all lower case, "
 						"digits, and underscores\n", xmlGetLineNo( class ), (char*) id );
 				break;
 			}
@@ -1496,7 +1805,7 @@ static int register_class( xmlNodePtr class ) {
 
 		// Warn about a suspiciously long id
 		if( warn && strlen( (char*) id ) > 12 ) {
-			printf( "Line %ld: WARNING: Class id is unusually long: \"%s\"\n",
+			report( "Line %ld: WARNING: Class id is unusually long: \"%s\"\n",
 				xmlGetLineNo( class ), (char*) id );
 		}
 
@@ -1506,7 +1815,7 @@ static int register_class( xmlNodePtr class ) {
 		unsigned long class_count = osrfHashGetCount( classes );
 		osrfHashSet( classes, entry, (char*) id );
 		if( osrfHashGetCount( classes ) == class_count ) {
-			printf( "Line %ld: Duplicate class name \"%s\"\n",
+			report( "Line %ld: Duplicate class name \"%s\"\n",
 				xmlGetLineNo( class ), (char*) id );
 			rc = 1;
 		}
@@ -1543,7 +1852,7 @@ static int addField( Class* class, const char* id, Field* new_field ) {
 
 		// Compare the ids
 		if( !strcmp( (char*) old_field->name, (char*) new_field->name ) ) {
-			printf( "Duplicate field name \"%s\" in class \"%s\"\n",
+			report( "Duplicate field name \"%s\" in class \"%s\"\n",
 				(char*) new_field->name, id );
 			dup_name = 1;
 			rc = 1;
@@ -1554,7 +1863,7 @@ static int addField( Class* class, const char* id, Field* new_field ) {
 		if( old_field->label && *old_field->label
 		 && new_field->label && *new_field->label
 		 && !strcmp( (char*) old_field->label, (char*) new_field->label )) {
-			printf( "Duplicate labels \"%s\" in class \"%s\"\n",
+			report( "Duplicate labels \"%s\" in class \"%s\"\n",
 				(char*) old_field->label, id );
 			rc = 1;
 		}
@@ -1594,7 +1903,7 @@ static int addLink( Class* class, const char* id, Link* new_link ) {
 	while( old_link ) {
 
 		if( !strcmp( (char*) old_link->field, (char*) new_link->field ) ) {
-			printf( "Duplicate field name \"%s\" in links of class \"%s\"\n",
+			report( "Duplicate field name \"%s\" in links of class \"%s\"\n",
 				(char*) old_link->field, id );
 			rc = 1;
 			dup_name = 1;
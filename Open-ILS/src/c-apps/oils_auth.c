@@ -235,7 +235,7 @@ static char* oilsAuthBuildInitCache(
         osrfCachePutObject(count_key, count_object, _oilsAuthBlockTimeout);
     }
 
-    osrfLogDebug(OSRF_LOG_MARK, 
+    OILS_LOG_DEBUG(OSRF_LOG_MARK, 
         "oilsAuthInit(): has seed %s and key %s", auth_seed, cache_key);
 
     free(cache_key);
@@ -1062,7 +1062,7 @@ int oilsAuthSessionDelete( osrfMethodContext* ctx ) {
 	jsonObject* resp = NULL;
 
 	if( authToken ) {
-		osrfLogDebug(OSRF_LOG_MARK, "Removing auth session: %s", authToken );
+		OILS_LOG_DEBUG(OSRF_LOG_MARK, "Removing auth session: %s", authToken );
 		char* key = va_list_to_string("%s%s", OILS_AUTH_CACHE_PRFX, authToken ); /**/
 		osrfCacheRemove(key);
 		resp = jsonNewObject(authToken); /**/
@@ -1139,7 +1139,7 @@ static oilsEvent*  _oilsAuthResetTimeout( const char* authToken, int reloadUser
 	oilsEvent* evt = NULL;
 	time_t timeout;
 
-	osrfLogDebug(OSRF_LOG_MARK, "Resetting auth timeout for session %s", authToken);
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Resetting auth timeout for session %s", authToken);
 	char* key = va_list_to_string("%s%s", OILS_AUTH_CACHE_PRFX, authToken );
 	jsonObject* cacheObj = osrfCacheGetObject( key );
 
@@ -1243,7 +1243,7 @@ int oilsAuthSessionRetrieve( osrfMethodContext* ctx ) {
 		} else {
 
 			// Retrieve the cached session object
-			osrfLogDebug(OSRF_LOG_MARK, "Retrieving auth session: %s", authToken);
+			OILS_LOG_DEBUG(OSRF_LOG_MARK, "Retrieving auth session: %s", authToken);
 			char* key = va_list_to_string("%s%s", OILS_AUTH_CACHE_PRFX, authToken );
 			cacheObj = osrfCacheGetObject( key );
 			if(cacheObj) {
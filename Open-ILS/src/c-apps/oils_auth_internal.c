@@ -169,7 +169,7 @@ static long oilsAuthGetTimeout(
     char* timeout = oilsUtilsFetchOrgSetting( orgloc, setting );
     if(!timeout) {
         if( orgloc != home_ou ) {
-            osrfLogDebug(OSRF_LOG_MARK, "Auth timeout not defined for org %d, "
+            OILS_LOG_DEBUG(OSRF_LOG_MARK, "Auth timeout not defined for org %d, "
                 "trying home_ou %d", orgloc, home_ou );
             timeout = oilsUtilsFetchOrgSetting( home_ou, setting );
         }
@@ -18,12 +18,14 @@
 #define E_ROLLBACKERROR -3
 
 static int sendCommand ( const char* );
+static const char* getMethodName ( const char* );
 static int startTransaction ( );
 static int commitTransaction ( );
 static int rollbackTransaction ( );
 
 
 static osrfHash* mnames = NULL;
+static char* method = NULL;
 static osrfAppSession* session = NULL;
 static const char* trans_id = NULL;
 
@@ -38,7 +40,7 @@ int main (int argc, char **argv) {
 
 	char* config = strdup( argv[1] );
 	char* context = strdup( argv[2] );
-	char* method = strdup( argv[3] );
+	method = strdup( argv[3] );
 
 	if (strcmp(method, "create") && strcmp(method, "update") && strcmp(method, "delete")) {
 		osrfLogError(OSRF_LOG_MARK, "Bad method name!  Use create, update, or delete.");
@@ -53,43 +55,15 @@ int main (int argc, char **argv) {
 		exit(1);
 	}
 
-	// Load the IDL
-	osrfHash* idl;
+	// Load the IDL.  We build the classes, and their method names, only as
+	// the input calls for them.
 	char* idl_filename = osrfConfigGetValue(NULL, "/IDL");
 
-	if (!(idl = oilsIDLInit( idl_filename ))) {
+	if (!oilsIDLInitLazy( idl_filename )) {
 		osrfLogError(OSRF_LOG_MARK, "Unable to load IDL!");
 		exit(1);
 	}
 
-	// Generate "create" method name for each
-	osrfStringArray* classes = osrfHashKeys(idl);
-	int c_index = 0;
-	const char* classname;
-	char* st_tmp = NULL;
-
-	while ((classname = osrfStringArrayGetString(classes, c_index++))) {
-		osrfHash* idlClass = oilsIDLFindPath("/%s", classname);
-
-		char* _fm = strdup( (char*)osrfHashGet(idlClass, "fieldmapper") );
-		char* part = strtok_r(_fm, ":", &st_tmp);
-
-		growing_buffer* _method_name =  buffer_init(64);
-		buffer_fadd(_method_name, "%s.direct.%s", CSTORE, part);
-
-		while ((part = strtok_r(NULL, ":", &st_tmp))) {
-			buffer_fadd(_method_name, ".%s", part);
-		}
-		buffer_fadd(_method_name, ".%s", method);
-
-		char* m = buffer_release(_method_name);
-		osrfHashSet( mnames, m, classname );
-
-		osrfLogDebug(OSRF_LOG_MARK, "Constructed %s method named %s for %s", method, m, classname);
-
-		free(_fm);
-	}
-
 	free(config);
 	free(context);
 	free(idl_filename);
@@ -227,8 +201,14 @@ static int sendCommand ( const char* json ) {
 	}
 
 	// Get the method name...
-	char* method_name = osrfHashGet( mnames, item->classname );
-	osrfLogDebug(OSRF_LOG_MARK, "Calling %s -> %s for %s", CSTORE, method_name, item->classname);
+	const char* method_name = getMethodName( item->classname );
+	if (!method_name) {
+		osrfLogError(OSRF_LOG_MARK,
+			"Class %s is not in the IDL.  Skipping [%s]!", item->classname, json);
+		jsonObjectFree(item);
+		return 0;
+	}
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Calling %s -> %s for %s", CSTORE, method_name, item->classname);
 
 	// make the param array
 	jsonObject* params = jsonNewObjectType( JSON_ARRAY );
@@ -252,3 +232,34 @@ static int sendCommand ( const char* json ) {
 
 	return ret;
 }
+
+// Construct the cstore method name for a class, and remember it for next time
+static const char* getMethodName ( const char* classname ) {
+	char* m = osrfHashGet( mnames, classname );
+	if (m)
+		return m;
+
+	const char* fieldmapper = osrfHashGet( oilsIDLGetClass( classname ), "fieldmapper" );
+	if (!fieldmapper)
+		return NULL;
+
+	char* st_tmp = NULL;
+	char* _fm = strdup( fieldmapper );
+	char* part = strtok_r(_fm, ":", &st_tmp);
+
+	growing_buffer* _method_name =  buffer_init(64);
+	buffer_fadd(_method_name, "%s.direct.%s", CSTORE, part);
+
+	while ((part = strtok_r(NULL, ":", &st_tmp))) {
+		buffer_fadd(_method_name, ".%s", part);
+	}
+	buffer_fadd(_method_name, ".%s", method);
+
+	m = buffer_release(_method_name);
+	osrfHashSet( mnames, m, classname );
+
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Constructed %s method named %s for %s", method, m, classname);
+
+	free(_fm);
+	return m;
+}
@@ -1,4 +1,5 @@
 #include "openils/oils_event.h"
+#include "openils/oils_utils.h"
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include "opensrf/osrf_settings.h"
@@ -257,14 +258,14 @@ static const char* lookup_desc( const char* lang, const char* code ) {
 	osrfHash* lang_hash = osrfHashGet( _oilsEventDescriptions, lang );
 	if( lang_hash ) {
 		// Within that language, search for the right message
-		osrfLogDebug( OSRF_LOG_MARK, "Loaded event lang hash for %s", lang );
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Loaded event lang hash for %s", lang );
 		desc = osrfHashGet( lang_hash, code );
 	}
 
 	if( desc )
-		osrfLogDebug( OSRF_LOG_MARK, "Found event description %s", desc );
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Found event description %s", desc );
 	else
-		osrfLogDebug( OSRF_LOG_MARK, "Event description not found for code %s", code );
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Event description not found for code %s", code );
 
 	return desc;
 }
@@ -313,7 +314,7 @@ static void _oilsEventParseEvents() {
 						if( !strcmp((char*) desc->name, "desc") ) {
 							xmlChar* lang = xmlGetProp( desc, BAD_CAST "lang");
 							if(lang) {
-								osrfLogInternal( OSRF_LOG_MARK,
+								OILS_LOG_INTERNAL( OSRF_LOG_MARK,
 									"Loaded event lang: %s", (char*) lang );
 								osrfHash* langHash = osrfHashGet(
 									_oilsEventDescriptions, (char*) lang);
@@ -324,7 +325,7 @@ static void _oilsEventParseEvents() {
 								char* content;
 								if( desc->children
 									&& (content = (char*) desc->children->content) ) {
-									osrfLogInternal( OSRF_LOG_MARK,
+									OILS_LOG_INTERNAL( OSRF_LOG_MARK,
 										"Loaded event desc: %s", content);
 									osrfHashSet( langHash, content, (char*) code );
 								}
@@ -11,6 +11,7 @@
 #include "opensrf/string_array.h"
 #include "opensrf/osrf_json.h"
 #include "opensrf/osrf_application.h"
+#include "openils/oils_utils.h"
 #include "openils/oils_sql.h"
 #include "openils/oils_buildq.h"
 
@@ -158,20 +159,11 @@ static jsonObject* get_row( BuildSQLState* state  ) {
 static jsonObject* get_date_column( dbi_result result, int col_idx ) {
 
 	time_t timestamp = dbi_result_get_datetime_idx( result, col_idx );
-	char timestring[ 256 ] = "";
+	char timestring[ OILS_DATETIME_BUFSIZE ];
 	int attr = dbi_result_get_field_attribs_idx( result, col_idx );
-	struct tm gmdt;
-
-	if( !( attr & DBI_DATETIME_DATE )) {
-		gmtime_r( &timestamp, &gmdt );
-		strftime( timestring, sizeof( timestring ), "%T", &gmdt );
-	} else if( !( attr & DBI_DATETIME_TIME )) {
-		gmtime_r( &timestamp, &gmdt );
-		strftime( timestring, sizeof( timestring ), "%F", &gmdt );
-	} else {
-		localtime_r( &timestamp, &gmdt );
-		strftime( timestring, sizeof( timestring ), "%FT%T%z", &gmdt );
-	}
+
+	oilsUtilsFormatDatetime( timestring, timestamp,
+		attr & DBI_DATETIME_DATE, attr & DBI_DATETIME_TIME );
 
 	return jsonNewObject( timestring );
 }
@@ -5,12 +5,18 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <libxml/globals.h>
 #include <libxml/xmlerror.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/debugXML.h>
 #include <libxml/xmlmemory.h>
+#include <libxml/xinclude.h>
+#include <libxml/uri.h>
 
 #define PERSIST_NS "http://open-ils.org/spec/opensrf/IDL/persistence/v1"
 #define OBJECT_NS "http://open-ils.org/spec/opensrf/IDL/objects/v1"
@@ -18,265 +24,741 @@
 #define REPORTER_NS "http://open-ils.org/spec/opensrf/IDL/reporter/v1"
 #define PERM_NS "http://open-ils.org/spec/opensrf/IDL/permacrud/v1"
 
-static xmlDocPtr idlDoc = NULL; // parse and store the IDL here
-
 /* parse and store the IDL here */
 static osrfHash* idlHash;
 
+/* The IDL file */
+static char* idlFile = NULL;
+
+/**
+	@brief A file read in loading the IDL, and its modification time when we read it.
+
+	The IDL file may XInclude other files, which may include others in turn.  We watch
+	all of them, so that oilsIDLModified() notices a change to any one.
+*/
+typedef struct IdlFileStruct {
+	struct IdlFileStruct* next;
+	char* name;
+	time_t mtime;
+} IdlFile;
+
+static IdlFile* idl_files = NULL;      // the files read when we last loaded idlFile
+static IdlFile* loading_files = NULL;  // the files read so far by the load in progress
+static xmlExternalEntityLoader next_loader = NULL;  // the loader that really reads them
+
+/**
+	@brief A block of memory holding strings for one copy of the IDL.
+
+	We map blocks directly from the kernel instead of taking them from the heap, so that
+	their pages hold nothing but IDL strings.  Once the IDL is finalized nothing writes to
+	them, so the drones forked by a listener keep sharing them with the listener instead of
+	each getting private copies.  The header sits at the front of the block.
+*/
+typedef struct IdlBlockStruct {
+	struct IdlBlockStruct* next;
+	size_t size;                    /**< Size of the whole mapping. */
+	size_t used;                    /**< Bytes used so far, including this header. */
+} IdlBlock;
+
+#define IDL_BLOCK_SIZE (256 * 1024)
+
+/**
+	@brief Bookkeeping for one loaded copy of the IDL.
+
+	The hashes making up the IDL don't own their contents.  The strings stored in them
+	live in a chain of blocks belonging to the copy, which we free when the copy is retired.
+*/
+typedef struct IdlCopyStruct {
+	osrfHash* idl;                  /**< The hash of classes. */
+	IdlBlock* blocks;               /**< Strings for this copy; most recent block first. */
+	int read_only;                  /**< Boolean; true if the blocks are write-protected. */
+	xmlDocPtr doc;                  /**< Parsed XML, kept only while classes are pending. */
+	osrfHash* pending;              /**< Class name -> XML node, for classes not yet built. */
+	struct IdlCopyStruct* next;
+} IdlCopy;
+
+static IdlCopy* idl_copies = NULL;     // every copy of the IDL not yet freed
+static IdlCopy* curr_copy = NULL;      // the copy whose classes we're building
+static IdlCopy* lazy_copy = NULL;      // a lazily loaded copy with classes still pending
+static int idlReadOnly = 0;            // Boolean; remembered by oilsIDLFinalize()
+
+static osrfHash* idl_init( const char* idl_filename, int lazy );
+static osrfHash* idl_load( const char* idl_filename, int lazy );
+static xmlDocPtr idl_read( const char* idl_filename, int watch );
+static xmlParserInputPtr idl_entity_loader( const char* URL, const char* ID,
+		xmlParserCtxtPtr ctxt );
+static void free_files( IdlFile* files );
+static osrfHash* idl_build( xmlDocPtr idlDoc, int lazy );
+static void idl_build_class( osrfHash* idl, xmlNodePtr kid );
+static osrfHash* idl_materialize( IdlCopy* copy, const char* classname );
+static void idl_materialize_all( IdlCopy* copy );
+static IdlCopy* find_copy( const osrfHash* idl );
+static char* idl_dup( const char* str );
+static char* idl_str( char* str );
+static void idl_free_class( osrfHash* class_def_hash );
 static void add_std_fld( osrfHash* fields_hash, const char* field_name, unsigned pos );
-osrfHash* oilsIDL(void) { return idlHash; }
+
+/**
+	@brief Return the complete IDL hash.
+	@return Pointer to the IDL hash, or NULL if no IDL is loaded.
+
+	If the IDL was loaded by oilsIDLInitLazy(), build any classes not built yet, since the
+	caller may want to look at all of them.  To look up a single class, oilsIDLGetClass()
+	is cheaper.
+*/
+osrfHash* oilsIDL(void) {
+	if( lazy_copy && lazy_copy->idl == idlHash )
+		idl_materialize_all( lazy_copy );
+	return idlHash;
+}
+
+/**
+	@brief Look up a class in the IDL.
+	@param classname Name of the class.
+	@return Pointer to the class definition, or NULL if there is no such class.
+
+	If the IDL was loaded by oilsIDLInitLazy(), build the class if it hasn't been built yet.
+*/
+osrfHash* oilsIDLGetClass( const char* classname ) {
+	if( !classname || !idlHash )
+		return NULL;
+
+	osrfHash* class_def_hash = osrfHashGet( idlHash, classname );
+	if( !class_def_hash && lazy_copy && lazy_copy->idl == idlHash )
+		class_def_hash = idl_materialize( lazy_copy, classname );
+
+	return class_def_hash;
+}
+
+/**
+	@brief Load the IDL, unless it is already loaded.
+	@param idl_filename Name of the IDL file.
+	@return Pointer to the IDL hash, or NULL upon error.
+
+	The file name is remembered so that oilsIDLModified() and oilsIDLLoad() can later
+	look at the same file.
+*/
 osrfHash* oilsIDLInit( const char* idl_filename ) {
+	return idl_init( idl_filename, 0 );
+}
+
+/**
+	@brief Load the IDL on demand, one class at a time, unless it is already loaded.
+	@param idl_filename Name of the IDL file.
+	@return Pointer to the IDL hash, or NULL upon error.
+
+	This is for short-lived programs that look at only a few classes.  We parse the XML
+	and note where each class is defined, but we don't build a class until someone looks
+	it up through oilsIDLGetClass(), oilsIDLFindPath(), or one of the other functions
+	taking a class name.  Calling oilsIDL() builds all the remaining classes.
+
+	Until then the returned hash is incomplete, so don't look classes up in it directly.
+*/
+osrfHash* oilsIDLInitLazy( const char* idl_filename ) {
+	return idl_init( idl_filename, 1 );
+}
+
+/**
+	@brief Build the IDL from an XML document already parsed, unless it is already loaded.
+	@param doc Pointer to the parsed IDL, with any XIncludes already processed.
+	@return Pointer to the IDL hash, or NULL upon error.
+
+	This is for programs like idlval that need the xmlDoc for their own purposes, and
+	would otherwise parse the same file twice.  The document still belongs to the caller,
+	who may free it as soon as this function returns.
+
+	No file name is remembered, so oilsIDLModified() always says that nothing has changed.
+*/
+osrfHash* oilsIDLInitDoc( struct _xmlDoc* doc ) {
 
 	if (idlHash) return idlHash;
 
-	char* prop_str = NULL;
+	if( !doc ) {
+		osrfLogError(OSRF_LOG_MARK, "No IDL document specified");
+		return NULL;
+	}
+
+	idlHash = idl_build( doc, 0 );
+	return idlHash;
+}
+
+static osrfHash* idl_init( const char* idl_filename, int lazy ) {
+
+	if (idlHash) return idlHash;
+
+	if( idl_filename ) {
+		free( idlFile );
+		idlFile = strdup( idl_filename );
+	}
 
-	idlHash = osrfNewHash();
+	idlHash = idl_load( idl_filename, lazy );
+	if( idlHash && lazy )
+		lazy_copy = find_copy( idlHash );
+
+	return idlHash;
+}
+
+/**
+	@brief Parse a fresh copy of the IDL without installing it.
+	@param idl_filename Name of the IDL file, or NULL for the file given to oilsIDLInit().
+	@return Pointer to the new IDL hash, or NULL upon error.
+
+	The new copy is invisible to oilsIDL() and friends until it is installed by
+	oilsIDLSwap().  If it is never installed, the caller should free it with oilsIDLFree().
+*/
+osrfHash* oilsIDLLoad( const char* idl_filename ) {
+	return idl_load( idl_filename, 0 );
+}
+
+static osrfHash* idl_load( const char* idl_filename, int lazy ) {
+
+	if( !idl_filename )
+		idl_filename = idlFile;
+
+	if( !idl_filename ) {
+		osrfLogError(OSRF_LOG_MARK, "No IDL file specified");
+		return NULL;
+	}
+
+	xmlDocPtr idlDoc = idl_read( idl_filename, idlFile && !strcmp( idl_filename, idlFile ));
+	if( !idlDoc )
+		return NULL;
+
+	osrfHash* idl = idl_build( idlDoc, lazy );
+
+	// A lazily loaded copy hangs onto the document until its last class is built
+	if( !lazy )
+		xmlFreeDoc( idlDoc );
+
+	return idl;
+}
+
+/**
+	@brief Install a new copy of the IDL.
+	@param idl Pointer to an IDL hash returned by oilsIDLLoad().
+	@return Pointer to the previously installed IDL hash, if any.
+
+	The previous copy stays intact, so that anything still pointing into it remains
+	valid.  Once nothing refers to it any more, the caller should free it with
+	oilsIDLFree().
+*/
+osrfHash* oilsIDLSwap( osrfHash* idl ) {
+	osrfHash* old_idl = idlHash;
+	if( idl )
+		idlHash = idl;
+	return old_idl;
+}
+
+/**
+	@brief Determine whether the IDL file has changed since we last loaded it.
+	@return 1 if it has changed, or zero if it hasn't (or if we can't tell).
+
+	We look at the modification times of the IDL file and of every file that it
+	XIncludes, directly or indirectly.  A file that we can't stat doesn't count as
+	changed; it may be in the middle of being replaced.
+*/
+int oilsIDLModified( void ) {
+	struct stat st;
+	const IdlFile* file = idl_files;
+	for( ; file; file = file->next ) {
+		if( !stat( file->name, &st ) && st.st_mtime != file->mtime )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+	@brief Free a copy of the IDL, loaded by oilsIDLLoad() or oilsIDLInit().
+	@param idl Pointer to the IDL hash to be freed.
+
+	The currently installed copy can't be freed; swap in another one first.
+*/
+void oilsIDLFree( osrfHash* idl ) {
+	if( !idl )
+		return;
+	else if( idl == idlHash ) {
+		osrfLogError(OSRF_LOG_MARK, "Refusing to free the IDL currently in use");
+		return;
+	}
+
+	// Find the bookkeeping for this copy, and unlink it
+	IdlCopy* copy = find_copy( idl );
+	if( !copy ) {
+		osrfLogError(OSRF_LOG_MARK, "Attempt to free an unknown copy of the IDL");
+		return;
+	}
+
+	if( copy == idl_copies )
+		idl_copies = copy->next;
+	else {
+		IdlCopy* prev = idl_copies;
+		while( prev->next != copy )
+			prev = prev->next;
+		prev->next = copy->next;
+	}
+
+	osrfHashIterator* class_itr = osrfNewHashIterator( idl );
 	osrfHash* class_def_hash = NULL;
+	while( (class_def_hash = osrfHashIteratorNext( class_itr )) )
+		idl_free_class( class_def_hash );
+	osrfHashIteratorFree( class_itr );
+
+	osrfHashFree( idl );
+
+	if( copy == lazy_copy )
+		lazy_copy = NULL;
+	if( copy->pending ) {
+		osrfHashFree( copy->pending );
+		xmlFreeDoc( copy->doc );
+	}
+
+	IdlBlock* block = copy->blocks;
+	while( block ) {
+		IdlBlock* next = block->next;
+		munmap( block, block->size );
+		block = next;
+	}
+	free( copy );
+}
+
+/**
+	@brief Get the strings of the IDL ready to be shared by forked processes.
+	@param idl Pointer to the IDL hash, normally after oilsExtendIDL() has extended it.
+	@param read_only If positive, write-protect the strings of the IDL; if zero, don't;
+	if negative, do whatever the previous call did.
+
+	Call this in the listener after the IDL is complete and before the drones are
+	forked.  The strings of the IDL already live in their own pages, away from the heap;
+	here we release the unused tail of each block, so that the pages we keep are full.
+
+	With @a read_only, any later attempt to write into an IDL string crashes on the spot,
+	instead of quietly unsharing a page in one drone.
+
+	Only the strings are shared this way.  The hashes and string arrays holding them are
+	allocated by OpenSRF, which gives us no say in where they go, so they stay on the
+	heap like anything else.
+*/
+void oilsIDLFinalize( osrfHash* idl, int read_only ) {
+	IdlCopy* copy = find_copy( idl );
+	if( !copy )
+		return;
+
+	// Build anything still pending; we won't be able to once it's write-protected
+	idl_materialize_all( copy );
+
+	if( read_only < 0 )
+		read_only = idlReadOnly;
+	else
+		idlReadOnly = read_only;
+
+	size_t page_size = (size_t) sysconf( _SC_PAGESIZE );
+	unsigned long pages = 0;
+
+	IdlBlock* block = copy->blocks;
+	while( block ) {
+		if( !copy->read_only ) {
+			// Give back whole pages that we never touched
+			size_t keep = ( ( block->used + page_size - 1 ) / page_size ) * page_size;
+			if( keep < block->size ) {
+				munmap( (char*) block + keep, block->size - keep );
+				block->size = keep;
+			}
+			if( read_only )
+				mprotect( block, block->size, PROT_READ );
+		}
+		pages += block->size / page_size;
+		block = block->next;
+	}
+
+	if( read_only )
+		copy->read_only = 1;
+
+	osrfLogInfo(OSRF_LOG_MARK, "IDL strings occupy %lu pages%s", pages,
+		copy->read_only ? ", write-protected" : "" );
+}
+
+// Find the bookkeeping for a given copy of the IDL
+static IdlCopy* find_copy( const osrfHash* idl ) {
+	IdlCopy* copy = idl_copies;
+	while( copy && copy->idl != idl )
+		copy = copy->next;
+	return copy;
+}
+
+/*
+	Parse the IDL file and whatever it XIncludes.  If watch is true, note every file read,
+	with its modification time as of just before reading it, for oilsIDLModified().  A
+	change made while we're parsing will then be picked up by the next check.
+*/
+static xmlDocPtr idl_read( const char* idl_filename, int watch ) {
 
 	osrfLogInfo(OSRF_LOG_MARK, "Parsing the IDL XML...");
-	idlDoc = xmlReadFile( idl_filename, NULL, XML_PARSE_XINCLUDE );
-	
-	if (!idlDoc) {
+
+	if( watch ) {
+		next_loader = xmlGetExternalEntityLoader();
+		xmlSetExternalEntityLoader( idl_entity_loader );
+	}
+
+	// XML_PARSE_XINCLUDE alone doesn't make xmlReadFile() process the XIncludes
+	xmlDocPtr idlDoc = xmlReadFile( idl_filename, NULL, XML_PARSE_XINCLUDE );
+	if( idlDoc && xmlXIncludeProcessFlags( idlDoc, XML_PARSE_XINCLUDE ) < 0 ) {
+		osrfLogError(OSRF_LOG_MARK, "Could not process the XIncludes of the IDL XML file!");
+		xmlFreeDoc( idlDoc );
+		idlDoc = NULL;
+	}
+
+	if( watch ) {
+		xmlSetExternalEntityLoader( next_loader );
+
+		// If we got nowhere, keep watching what we had, so as to notice when it's fixed
+		if( loading_files ) {
+			free_files( idl_files );
+			idl_files = loading_files;
+			loading_files = NULL;
+		}
+	}
+
+	if (!idlDoc)
 		osrfLogError(OSRF_LOG_MARK, "Could not load or parse the IDL XML file!");
-		return NULL;
+
+	return idlDoc;
+}
+
+// Note a file that libxml2 is about to read for the IDL, then let it read the file
+static xmlParserInputPtr idl_entity_loader( const char* URL, const char* ID,
+		xmlParserCtxtPtr ctxt ) {
+
+	char* name = NULL;
+	if( !URL )
+		;
+	else if( !strncmp( URL, "file://", 7 )) {
+		char* path = xmlURIUnescapeString( URL + 7, 0, NULL );
+		if( path ) {
+			name = strdup( path );
+			xmlFree( path );
+		}
+	}
+	else if( !strstr( URL, "://" ))
+		name = strdup( URL );
+
+	struct stat st;
+	if( name && !stat( name, &st )) {
+		const IdlFile* file = loading_files;
+		while( file && strcmp( file->name, name ))
+			file = file->next;
+
+		if( !file ) {
+			IdlFile* new_file = safe_malloc( sizeof( IdlFile ));
+			new_file->name = name;
+			new_file->mtime = st.st_mtime;
+			new_file->next = loading_files;
+			loading_files = new_file;
+			name = NULL;
+		}
 	}
+	free( name );
+
+	return next_loader( URL, ID, ctxt );
+}
+
+static void free_files( IdlFile* files ) {
+	while( files ) {
+		IdlFile* next = files->next;
+		free( files->name );
+		free( files );
+		files = next;
+	}
+}
+
+// Build an IDL hash from a parsed document.  If lazy, the copy takes over the document.
+static osrfHash* idl_build( xmlDocPtr idlDoc, int lazy ) {
 
 	osrfLogDebug(OSRF_LOG_MARK, "Initializing the Fieldmapper IDL...");
 
+	osrfHash* idl = osrfNewHash();
+
+	// Set up the bookkeeping for this copy
+	IdlCopy* copy = safe_malloc( sizeof( IdlCopy ) );
+	copy->idl = idl;
+	copy->blocks = NULL;
+	copy->read_only = 0;
+	copy->doc = NULL;
+	copy->pending = NULL;
+	copy->next = idl_copies;
+	idl_copies = copy;
+
+	if( lazy ) {
+		copy->doc = idlDoc;
+		copy->pending = osrfNewHash();
+	}
+
+	curr_copy = copy;
+
 	xmlNodePtr docRoot = xmlDocGetRootElement(idlDoc);
 	xmlNodePtr kid = docRoot->children;
 	while (kid) {
 		if (!strcmp( (char*)kid->name, "class" )) {
+			if( lazy ) {
+				// Just note where the class is; build it when somebody asks for it
+				char* class_name = (char*) xmlGetProp(kid, BAD_CAST "id");
+				if( class_name ) {
+					osrfHashSet( copy->pending, kid, class_name );
+					xmlFree( class_name );
+				}
+			} else
+				idl_build_class( idl, kid );
+		}
 
-			class_def_hash = osrfNewHash();
-			char* current_class_name = (char*) xmlGetProp(kid, BAD_CAST "id");
-			
-			osrfHashSet( class_def_hash, current_class_name, "classname" );
-			osrfHashSet( class_def_hash, xmlGetNsProp(kid, BAD_CAST "fieldmapper", BAD_CAST OBJECT_NS), "fieldmapper" );
-			osrfHashSet( class_def_hash, xmlGetNsProp(kid, BAD_CAST "readonly", BAD_CAST PERSIST_NS), "readonly" );
+		kid = kid->next;
+	} // end while
 
-			osrfHashSet( idlHash, class_def_hash, current_class_name );
+	curr_copy = NULL;
 
-			if ((prop_str = (char*)xmlGetNsProp(kid, BAD_CAST "tablename", BAD_CAST PERSIST_NS))) {
-				osrfLogDebug(OSRF_LOG_MARK, "Using table '%s' for class %s", prop_str, current_class_name );
-				osrfHashSet(
-					class_def_hash,
-					prop_str,
-					"tablename"
-				);
-			}
+	if( lazy )
+		osrfLogInfo(OSRF_LOG_MARK, "...IDL XML parsed; %lu classes to be built on demand",
+			(unsigned long) osrfHashGetCount( copy->pending ));
+	else
+		osrfLogInfo(OSRF_LOG_MARK, "...IDL XML parsed");
+
+	return idl;
+}
+
+// Build a class definition from its XML, and add it to the IDL
+static void idl_build_class( osrfHash* idl, xmlNodePtr kid ) {
+
+	char* prop_str = NULL;
+	osrfHash* class_def_hash = NULL;
+
+	class_def_hash = osrfNewHash();
+	char* current_class_name = idl_str( (char*) xmlGetProp(kid, BAD_CAST "id") );
+	
+	osrfHashSet( class_def_hash, current_class_name, "classname" );
+	osrfHashSet( class_def_hash, idl_str( (char*) xmlGetNsProp(kid, BAD_CAST "fieldmapper", BAD_CAST OBJECT_NS) ), "fieldmapper" );
+	osrfHashSet( class_def_hash, idl_str( (char*) xmlGetNsProp(kid, BAD_CAST "readonly", BAD_CAST PERSIST_NS) ), "readonly" );
+
+	osrfHashSet( idl, class_def_hash, current_class_name );
+
+	if ((prop_str = idl_str( (char*)xmlGetNsProp(kid, BAD_CAST "tablename", BAD_CAST PERSIST_NS) ))) {
+		osrfLogDebug(OSRF_LOG_MARK, "Using table '%s' for class %s", prop_str, current_class_name );
+		osrfHashSet(
+			class_def_hash,
+			prop_str,
+			"tablename"
+		);
+	}
+
+	if ((prop_str = idl_str( (char*)xmlGetNsProp(kid, BAD_CAST "restrict_primary", BAD_CAST PERSIST_NS) ))) {
+		osrfLogDebug(OSRF_LOG_MARK, "Delete restriction policy set at '%s' for pkey of class %s", prop_str, current_class_name );
+		osrfHashSet(
+			class_def_hash,
+			prop_str,
+			"restrict_primary"
+		);
+	}
+
+	if ((prop_str = idl_str( (char*)xmlGetNsProp(kid, BAD_CAST "virtual", BAD_CAST PERSIST_NS) ))) {
+		osrfHashSet(
+			class_def_hash,
+			prop_str,
+			"virtual"
+		);
+	}
 
-			if ((prop_str = (char*)xmlGetNsProp(kid, BAD_CAST "restrict_primary", BAD_CAST PERSIST_NS))) {
-				osrfLogDebug(OSRF_LOG_MARK, "Delete restriction policy set at '%s' for pkey of class %s", prop_str, current_class_name );
+	// Tokenize controller attribute into an osrfStringArray
+	prop_str = (char*) xmlGetProp(kid, BAD_CAST "controller");
+	if( prop_str )
+		osrfLogDebug(OSRF_LOG_MARK, "Controller list is %s", prop_str );
+	osrfStringArray* controller = osrfStringArrayTokenize( prop_str, ' ' );
+	xmlFree( prop_str );
+	osrfHashSet( class_def_hash, controller, "controller");
+
+	osrfHash* current_links_hash = osrfNewHash();
+	osrfHash* current_fields_hash = osrfNewHash();
+
+	osrfHashSet( class_def_hash, current_fields_hash, "fields" );
+	osrfHashSet( class_def_hash, current_links_hash, "links" );
+
+	xmlNodePtr _cur = kid->children;
+
+	while (_cur) {
+
+		if (!strcmp( (char*)_cur->name, "fields" )) {
+
+			if( (prop_str = idl_str( (char*)xmlGetNsProp(_cur, BAD_CAST "primary", BAD_CAST PERSIST_NS) )) ) {
 				osrfHashSet(
 					class_def_hash,
 					prop_str,
-					"restrict_primary"
+					"primarykey"
 				);
 			}
 
-			if ((prop_str = (char*)xmlGetNsProp(kid, BAD_CAST "virtual", BAD_CAST PERSIST_NS))) {
+			if( (prop_str = idl_str( (char*)xmlGetNsProp(_cur, BAD_CAST "sequence", BAD_CAST PERSIST_NS) )) ) {
 				osrfHashSet(
 					class_def_hash,
 					prop_str,
-					"virtual"
+					"sequence"
 				);
 			}
 
-			// Tokenize controller attribute into an osrfStringArray
-			prop_str = (char*) xmlGetProp(kid, BAD_CAST "controller");
-			if( prop_str )
-				osrfLogDebug(OSRF_LOG_MARK, "Controller list is %s", prop_str );
-			osrfStringArray* controller = osrfStringArrayTokenize( prop_str, ' ' );
-			xmlFree( prop_str );
-			osrfHashSet( class_def_hash, controller, "controller");
-
-			osrfHash* current_links_hash = osrfNewHash();
-			osrfHash* current_fields_hash = osrfNewHash();
-
-			osrfHashSet( class_def_hash, current_fields_hash, "fields" );
-			osrfHashSet( class_def_hash, current_links_hash, "links" );
+			unsigned int array_pos = 0;
+			char array_pos_buf[ 7 ];  // For up to 1,000,000 fields per class
 
-			xmlNodePtr _cur = kid->children;
-
-			while (_cur) {
-
-				if (!strcmp( (char*)_cur->name, "fields" )) {
+			xmlNodePtr _f = _cur->children;
+			while(_f) {
+				if (strcmp( (char*)_f->name, "field" )) {
+					_f = _f->next;
+					continue;
+				}
 
-					if( (prop_str = (char*)xmlGetNsProp(_cur, BAD_CAST "primary", BAD_CAST PERSIST_NS)) ) {
-						osrfHashSet(
-							class_def_hash,
-							prop_str,
-							"primarykey"
-						);
+				// Get the field name.  If it's one of the three standard
+				// fields that we always generate, ignore it.
+				char* field_name = (char*)xmlGetProp(_f, BAD_CAST "name");
+				if( field_name ) {
+					osrfLogDebug(OSRF_LOG_MARK, 
+							"Found field %s for class %s", field_name, current_class_name );
+					if(    !strcmp( field_name, "isnew" )
+						|| !strcmp( field_name, "ischanged" )
+						|| !strcmp( field_name, "isdeleted" ) ) {
+						free( field_name );
+						_f = _f->next;
+						continue;
 					}
+				} else {
+					osrfLogDebug(OSRF_LOG_MARK,
+							"Found field with no name for class %s", current_class_name );
+					_f = _f->next;
+					continue;
+				}
 
-					if( (prop_str = (char*)xmlGetNsProp(_cur, BAD_CAST "sequence", BAD_CAST PERSIST_NS)) ) {
-						osrfHashSet(
-							class_def_hash,
-							prop_str,
-							"sequence"
-						);
-					}
+				field_name = idl_str( field_name );
+				osrfHash* field_def_hash = osrfNewHash();
 
-					unsigned int array_pos = 0;
-					char array_pos_buf[ 7 ];  // For up to 1,000,000 fields per class
+				// Insert array_position
+				snprintf( array_pos_buf, sizeof( array_pos_buf ), "%u", array_pos++ );
+				osrfHashSet( field_def_hash, idl_dup( array_pos_buf ), "array_position" );
 
-					xmlNodePtr _f = _cur->children;
-					while(_f) {
-						if (strcmp( (char*)_f->name, "field" )) {
-							_f = _f->next;
-							continue;
-						}
+				// Tokenize suppress_controller attribute into an osrfStringArray
+				if( (prop_str = (char*)xmlGetProp(_f, BAD_CAST "suppress_controller")) ) {
+					osrfLogDebug(OSRF_LOG_MARK, "Controller suppression list is %s", prop_str );
+					osrfStringArray* controller = osrfStringArrayTokenize( prop_str, ' ' );
+					osrfHashSet( field_def_hash, controller, "suppress_controller");
+					xmlFree( prop_str );
+				}
 
-						// Get the field name.  If it's one of the three standard
-						// fields that we always generate, ignore it.
-						char* field_name = (char*)xmlGetProp(_f, BAD_CAST "name");
-						if( field_name ) {
-							osrfLogDebug(OSRF_LOG_MARK, 
-									"Found field %s for class %s", field_name, current_class_name );
-							if(    !strcmp( field_name, "isnew" )
-								|| !strcmp( field_name, "ischanged" )
-								|| !strcmp( field_name, "isdeleted" ) ) {
-								free( field_name );
-								_f = _f->next;
-								continue;
-							}
-						} else {
-							osrfLogDebug(OSRF_LOG_MARK,
-									"Found field with no name for class %s", current_class_name );
-							_f = _f->next;
-							continue;
-						}
- 
-						osrfHash* field_def_hash = osrfNewHash();
-
-						// Insert array_position
-						snprintf( array_pos_buf, sizeof( array_pos_buf ), "%u", array_pos++ );
-						osrfHashSet( field_def_hash, strdup( array_pos_buf ), "array_position" );
-
-						// Tokenize suppress_controller attribute into an osrfStringArray
-						if( (prop_str = (char*)xmlGetProp(_f, BAD_CAST "suppress_controller")) ) {
-							osrfLogDebug(OSRF_LOG_MARK, "Controller suppression list is %s", prop_str );
-							osrfStringArray* controller = osrfStringArrayTokenize( prop_str, ' ' );
-							osrfHashSet( field_def_hash, controller, "suppress_controller");
-						}
+				if( (prop_str = idl_str( (char*)xmlGetNsProp(_f, BAD_CAST "i18n", BAD_CAST PERSIST_NS) )) ) {
+					osrfHashSet(
+						field_def_hash,
+						prop_str,
+						"i18n"
+					);
+				}
 
-						if( (prop_str = (char*)xmlGetNsProp(_f, BAD_CAST "i18n", BAD_CAST PERSIST_NS)) ) {
-							osrfHashSet(
-								field_def_hash,
-								prop_str,
-								"i18n"
-							);
-						}
+				if( (prop_str = idl_str( (char*)xmlGetNsProp(_f, BAD_CAST "virtual", BAD_CAST PERSIST_NS) )) ) {
+					osrfHashSet(
+						field_def_hash,
+						prop_str,
+						"virtual"
+					);
+				} else {   // default to virtual
+					osrfHashSet(
+						field_def_hash,
+						"false",
+						"virtual"
+					);
+				}
 
-						if( (prop_str = (char*)xmlGetNsProp(_f, BAD_CAST "virtual", BAD_CAST PERSIST_NS)) ) {
-							osrfHashSet(
-								field_def_hash,
-								prop_str,
-								"virtual"
-							);
-						} else {   // default to virtual
-							osrfHashSet(
-								field_def_hash,
-								"false",
-								"virtual"
-							);
-						}
+				if( (prop_str = idl_str( (char*)xmlGetNsProp(_f, BAD_CAST "primitive", BAD_CAST PERSIST_NS) )) ) {
+					osrfHashSet(
+						field_def_hash,
+						prop_str,
+						"primitive"
+					);
+				}
 
-						if( (prop_str = (char*)xmlGetNsProp(_f, BAD_CAST "primitive", BAD_CAST PERSIST_NS)) ) {
-							osrfHashSet(
-								field_def_hash,
-								prop_str,
-								"primitive"
-							);
-						}
+				osrfHashSet( field_def_hash, field_name, "name" );
+				osrfHashSet(
+					current_fields_hash,
+					field_def_hash,
+					field_name
+				);
+				_f = _f->next;
+			}
 
-						osrfHashSet( field_def_hash, field_name, "name" );
-						osrfHashSet(
-							current_fields_hash,
-							field_def_hash,
-							field_name
-						);
-						_f = _f->next;
-					}
+			// Create three standard, stereotyped virtual fields for every class
+			add_std_fld( current_fields_hash, "isnew",     array_pos++ );
+			add_std_fld( current_fields_hash, "ischanged", array_pos++ );
+			add_std_fld( current_fields_hash, "isdeleted", array_pos   );
+
+		}
 
-					// Create three standard, stereotyped virtual fields for every class
-					add_std_fld( current_fields_hash, "isnew",     array_pos++ );
-					add_std_fld( current_fields_hash, "ischanged", array_pos++ );
-					add_std_fld( current_fields_hash, "isdeleted", array_pos   );
+		if (!strcmp( (char*)_cur->name, "links" )) {
+			xmlNodePtr _l = _cur->children;
 
+			while(_l) {
+				if (strcmp( (char*)_l->name, "link" )) {
+					_l = _l->next;
+					continue;
 				}
 
-				if (!strcmp( (char*)_cur->name, "links" )) {
-					xmlNodePtr _l = _cur->children;
+				osrfHash* link_def_hash = osrfNewHash();
+
+				if( (prop_str = idl_str( (char*)xmlGetProp(_l, BAD_CAST "reltype") )) ) {
+					osrfHashSet(
+						link_def_hash,
+						prop_str,
+						"reltype"
+					);
+					osrfLogDebug(OSRF_LOG_MARK, "Adding link with reltype %s", prop_str );
+				} else
+					osrfLogDebug(OSRF_LOG_MARK, "Adding link with no reltype" );
+
+				if( (prop_str = idl_str( (char*)xmlGetProp(_l, BAD_CAST "key") )) ) {
+					osrfHashSet(
+						link_def_hash,
+						prop_str,
+						"key"
+					);
+					osrfLogDebug(OSRF_LOG_MARK, "Link fkey is %s", prop_str );
+				} else
+					osrfLogDebug(OSRF_LOG_MARK, "Link with no fkey" );
+
+				if( (prop_str = idl_str( (char*)xmlGetProp(_l, BAD_CAST "class") )) ) {
+					osrfHashSet(
+						link_def_hash,
+						prop_str,
+						"class"
+					);
+					osrfLogDebug(OSRF_LOG_MARK, "Link fclass is %s", prop_str );
+				} else
+					osrfLogDebug(OSRF_LOG_MARK, "Link with no fclass" );
+
+				// Tokenize map attribute into an osrfStringArray
+				prop_str = (char*) xmlGetProp(_l, BAD_CAST "map");
+				if( prop_str )
+					osrfLogDebug(OSRF_LOG_MARK, "Link mapping list is %s", prop_str );
+				osrfStringArray* map = osrfStringArrayTokenize( prop_str, ' ' );
+				osrfHashSet( link_def_hash, map, "map");
+				xmlFree( prop_str );
+
+				if( (prop_str = idl_str( (char*)xmlGetProp(_l, BAD_CAST "field") )) ) {
+					osrfHashSet(
+						link_def_hash,
+						prop_str,
+						"field"
+					);
+					osrfLogDebug(OSRF_LOG_MARK, "Link fclass is %s", prop_str );
+				} else
+					osrfLogDebug(OSRF_LOG_MARK, "Link with no fclass" );
 
-					while(_l) {
-						if (strcmp( (char*)_l->name, "link" )) {
-							_l = _l->next;
-							continue;
-						}
+				osrfHashSet(
+					current_links_hash,
+					link_def_hash,
+					prop_str
+				);
 
-						osrfHash* link_def_hash = osrfNewHash();
-
-						if( (prop_str = (char*)xmlGetProp(_l, BAD_CAST "reltype")) ) {
-							osrfHashSet(
-								link_def_hash,
-								prop_str,
-								"reltype"
-							);
-							osrfLogDebug(OSRF_LOG_MARK, "Adding link with reltype %s", prop_str );
-						} else
-							osrfLogDebug(OSRF_LOG_MARK, "Adding link with no reltype" );
-
-						if( (prop_str = (char*)xmlGetProp(_l, BAD_CAST "key")) ) {
-							osrfHashSet(
-								link_def_hash,
-								prop_str,
-								"key"
-							);
-							osrfLogDebug(OSRF_LOG_MARK, "Link fkey is %s", prop_str );
-						} else
-							osrfLogDebug(OSRF_LOG_MARK, "Link with no fkey" );
-
-						if( (prop_str = (char*)xmlGetProp(_l, BAD_CAST "class")) ) {
-							osrfHashSet(
-								link_def_hash,
-								prop_str,
-								"class"
-							);
-							osrfLogDebug(OSRF_LOG_MARK, "Link fclass is %s", prop_str );
-						} else
-							osrfLogDebug(OSRF_LOG_MARK, "Link with no fclass" );
-
-						// Tokenize map attribute into an osrfStringArray
-						prop_str = (char*) xmlGetProp(_l, BAD_CAST "map");
-						if( prop_str )
-							osrfLogDebug(OSRF_LOG_MARK, "Link mapping list is %s", prop_str );
-						osrfStringArray* map = osrfStringArrayTokenize( prop_str, ' ' );
-						osrfHashSet( link_def_hash, map, "map");
-						xmlFree( prop_str );
-
-						if( (prop_str = (char*)xmlGetProp(_l, BAD_CAST "field")) ) {
-							osrfHashSet(
-								link_def_hash,
-								prop_str,
-								"field"
-							);
-							osrfLogDebug(OSRF_LOG_MARK, "Link fclass is %s", prop_str );
-						} else
-							osrfLogDebug(OSRF_LOG_MARK, "Link with no fclass" );
-
-						osrfHashSet(
-							current_links_hash,
-							link_def_hash,
-							prop_str
-						);
-
-						_l = _l->next;
-					}
-				}
+				_l = _l->next;
+			}
+		}
 /**** Structure of permacrud in memory ****
 
 { create :
@@ -295,159 +777,295 @@ osrfHash* oilsIDLInit( const char* idl_filename ) {
 
 **** Structure of permacrud in memory ****/
 
-				if (!strcmp( (char*)_cur->name, "permacrud" )) {
-					osrfHash* pcrud = osrfNewHash();
-					osrfHashSet( class_def_hash, pcrud, "permacrud" );
-					xmlNodePtr _l = _cur->children;
-					char * ignore_object_perms = (char*) xmlGetProp(_cur, BAD_CAST "ignore_object_perms");
+		if (!strcmp( (char*)_cur->name, "permacrud" )) {
+			osrfHash* pcrud = osrfNewHash();
+			osrfHashSet( class_def_hash, pcrud, "permacrud" );
+			xmlNodePtr _l = _cur->children;
+			char * ignore_object_perms = idl_str( (char*) xmlGetProp(_cur, BAD_CAST "ignore_object_perms") );
 
-					while(_l) {
-						if (strcmp( (char*)_l->name, "actions" )) {
-							_l = _l->next;
-							continue;
-						}
+			while(_l) {
+				if (strcmp( (char*)_l->name, "actions" )) {
+					_l = _l->next;
+					continue;
+				}
 
-						xmlNodePtr _a = _l->children;
-
-						while(_a) {
-							const char* action_name = (const char*) _a->name;
-							if (
-								strcmp( action_name, "create" ) &&
-								strcmp( action_name, "retrieve" ) &&
-								strcmp( action_name, "update" ) &&
-								strcmp( action_name, "delete" )
-							) {
-								_a = _a->next;
-								continue;
-							}
+				xmlNodePtr _a = _l->children;
+
+				while(_a) {
+					const char* action_name = (const char*) _a->name;
+					if (
+						strcmp( action_name, "create" ) &&
+						strcmp( action_name, "retrieve" ) &&
+						strcmp( action_name, "update" ) &&
+						strcmp( action_name, "delete" )
+					) {
+						_a = _a->next;
+						continue;
+					}
 
-							osrfLogDebug(OSRF_LOG_MARK, "Found Permacrud action %s for class %s",
-								action_name, current_class_name );
+					osrfLogDebug(OSRF_LOG_MARK, "Found Permacrud action %s for class %s",
+						action_name, current_class_name );
 
-							osrfHash* action_def_hash = osrfNewHash();
-							osrfHashSet( pcrud, action_def_hash, action_name );
+					osrfHash* action_def_hash = osrfNewHash();
+					osrfHashSet( pcrud, action_def_hash, action_name );
 
-							// Set the class-wide ignore_object_perms flag
-					    	osrfHashSet( action_def_hash, ignore_object_perms, "ignore_object_perms");
+					// Set the class-wide ignore_object_perms flag
+			    	osrfHashSet( action_def_hash, ignore_object_perms, "ignore_object_perms");
 
-							// Tokenize permission attribute into an osrfStringArray
-							prop_str = (char*) xmlGetProp(_a, BAD_CAST "permission");
-							if( prop_str )
-								osrfLogDebug(OSRF_LOG_MARK,
-									"Permacrud permission list is %s", prop_str );
-							osrfStringArray* map = osrfStringArrayTokenize( prop_str, ' ' );
-							osrfHashSet( action_def_hash, map, "permission");
-							xmlFree( prop_str );
+					// Tokenize permission attribute into an osrfStringArray
+					prop_str = (char*) xmlGetProp(_a, BAD_CAST "permission");
+					if( prop_str )
+						osrfLogDebug(OSRF_LOG_MARK,
+							"Permacrud permission list is %s", prop_str );
+					osrfStringArray* map = osrfStringArrayTokenize( prop_str, ' ' );
+					osrfHashSet( action_def_hash, map, "permission");
+					xmlFree( prop_str );
 
-					    	osrfHashSet( action_def_hash,
-								(char*)xmlGetNoNsProp(_a, BAD_CAST "owning_user"), "owning_user");
+			    	osrfHashSet( action_def_hash,
+						idl_str( (char*)xmlGetNoNsProp(_a, BAD_CAST "owning_user") ), "owning_user");
 
-					    	osrfHashSet( action_def_hash,
-								(char*)xmlGetNoNsProp(_a, BAD_CAST "global_required"), "global_required");
+			    	osrfHashSet( action_def_hash,
+						idl_str( (char*)xmlGetNoNsProp(_a, BAD_CAST "global_required") ), "global_required");
 
-							// Tokenize context_field attribute into an osrfStringArray
-							prop_str = (char*) xmlGetProp(_a, BAD_CAST "context_field");
-							if( prop_str )
-								osrfLogDebug(OSRF_LOG_MARK,
-									"Permacrud context_field list is %s", prop_str );
-							map = osrfStringArrayTokenize( prop_str, ' ' );
-							osrfHashSet( action_def_hash, map, "local_context");
+					// Tokenize context_field attribute into an osrfStringArray
+					prop_str = (char*) xmlGetProp(_a, BAD_CAST "context_field");
+					if( prop_str )
+						osrfLogDebug(OSRF_LOG_MARK,
+							"Permacrud context_field list is %s", prop_str );
+					map = osrfStringArrayTokenize( prop_str, ' ' );
+					osrfHashSet( action_def_hash, map, "local_context");
+					xmlFree( prop_str );
+
+					osrfHash* foreign_context = osrfNewHash();
+					osrfHashSet( action_def_hash, foreign_context, "foreign_context");
+
+					xmlNodePtr _f = _a->children;
+
+					while(_f) {
+						if ( strcmp( (char*)_f->name, "context" ) ) {
+							_f = _f->next;
+							continue;
+						}
+
+						if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "link")) ) {
+							osrfLogDebug(OSRF_LOG_MARK,
+								"Permacrud context link definition is %s", prop_str );
+
+							osrfHash* _tmp_fcontext = osrfNewHash();
+
+							// Store pointers to elements already stored
+							// from the <link> aggregate
+							osrfHash* _flink = osrfHashGet( current_links_hash, prop_str );
+							osrfHashSet( _tmp_fcontext, osrfHashGet(_flink, "field"), "fkey" );
+							osrfHashSet( _tmp_fcontext, osrfHashGet(_flink, "key"), "field" );
 							xmlFree( prop_str );
 
-							osrfHash* foreign_context = osrfNewHash();
-							osrfHashSet( action_def_hash, foreign_context, "foreign_context");
+						    if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "jump")) )
+							    osrfHashSet( _tmp_fcontext, osrfStringArrayTokenize( prop_str, '.' ), "jump" );
+							xmlFree( prop_str );
 
-							xmlNodePtr _f = _a->children;
+							// Tokenize field attribute into an osrfStringArray
+							char * field_list = (char*) xmlGetProp(_f, BAD_CAST "field");
+							if( field_list )
+								osrfLogDebug(OSRF_LOG_MARK,
+									"Permacrud foreign context field list is %s", field_list );
+							map = osrfStringArrayTokenize( field_list, ' ' );
+							osrfHashSet( _tmp_fcontext, map, "context");
+							xmlFree( field_list );
 
-							while(_f) {
-								if ( strcmp( (char*)_f->name, "context" ) ) {
-									_f = _f->next;
-									continue;
-								}
+							// Insert the new hash into a hash attached to the parent node
+							osrfHashSet( foreign_context, _tmp_fcontext, osrfHashGet( _flink, "class" ) );
 
-								if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "link")) ) {
-									osrfLogDebug(OSRF_LOG_MARK,
-										"Permacrud context link definition is %s", prop_str );
-
-									osrfHash* _tmp_fcontext = osrfNewHash();
-
-									// Store pointers to elements already stored
-									// from the <link> aggregate
-									osrfHash* _flink = osrfHashGet( current_links_hash, prop_str );
-									osrfHashSet( _tmp_fcontext, osrfHashGet(_flink, "field"), "fkey" );
-									osrfHashSet( _tmp_fcontext, osrfHashGet(_flink, "key"), "field" );
-									xmlFree( prop_str );
-
-								    if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "jump")) )
-									    osrfHashSet( _tmp_fcontext, osrfStringArrayTokenize( prop_str, '.' ), "jump" );
-									xmlFree( prop_str );
-
-									// Tokenize field attribute into an osrfStringArray
-									char * field_list = (char*) xmlGetProp(_f, BAD_CAST "field");
-									if( field_list )
-										osrfLogDebug(OSRF_LOG_MARK,
-											"Permacrud foreign context field list is %s", field_list );
-									map = osrfStringArrayTokenize( field_list, ' ' );
-									osrfHashSet( _tmp_fcontext, map, "context");
-									xmlFree( field_list );
-
-									// Insert the new hash into a hash attached to the parent node
-									osrfHashSet( foreign_context, _tmp_fcontext, osrfHashGet( _flink, "class" ) );
-
-								} else {
-
-									if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "field") )) {
-										char* map_list = prop_str;
-										osrfLogDebug(OSRF_LOG_MARK,
-											"Permacrud local context field list is %s", prop_str );
-			
-										if (strlen( map_list ) > 0) {
-											char* st_tmp = NULL;
-											char* _map_class = strtok_r(map_list, " ", &st_tmp);
-											osrfStringArrayAdd(
-												osrfHashGet( action_def_hash, "local_context"), _map_class);
-									
-											while ((_map_class = strtok_r(NULL, " ", &st_tmp))) {
-												osrfStringArrayAdd(
-													osrfHashGet( action_def_hash, "local_context"), _map_class);
-											}
-										}
-										xmlFree(map_list);
-									}
+						} else {
 
+							if( (prop_str = (char*)xmlGetNoNsProp(_f, BAD_CAST "field") )) {
+								char* map_list = prop_str;
+								osrfLogDebug(OSRF_LOG_MARK,
+									"Permacrud local context field list is %s", prop_str );
+	
+								if (strlen( map_list ) > 0) {
+									char* st_tmp = NULL;
+									char* _map_class = strtok_r(map_list, " ", &st_tmp);
+									osrfStringArrayAdd(
+										osrfHashGet( action_def_hash, "local_context"), _map_class);
+							
+									while ((_map_class = strtok_r(NULL, " ", &st_tmp))) {
+										osrfStringArrayAdd(
+											osrfHashGet( action_def_hash, "local_context"), _map_class);
+									}
 								}
-								_f = _f->next;
+								xmlFree(map_list);
 							}
-							_a = _a->next;
+
 						}
-						_l = _l->next;
+						_f = _f->next;
 					}
+					_a = _a->next;
 				}
+				_l = _l->next;
+			}
+		}
 
-				if (!strcmp( (char*)_cur->name, "source_definition" )) {
-					char* content_str;
-					if( (content_str = (char*)xmlNodeGetContent(_cur)) ) {
-						osrfLogDebug(OSRF_LOG_MARK, "Using source definition '%s' for class %s",
-							content_str, current_class_name );
-						osrfHashSet(
-							class_def_hash,
-							content_str,
-							"source_definition"
-						);
-					}
-
-				}
+		if (!strcmp( (char*)_cur->name, "source_definition" )) {
+			char* content_str;
+			if( (content_str = (char*)xmlNodeGetContent(_cur)) ) {
+				osrfLogDebug(OSRF_LOG_MARK, "Using source definition '%s' for class %s",
+					content_str, current_class_name );
+				osrfHashSet(
+					class_def_hash,
+					idl_str( content_str ),
+					"source_definition"
+				);
+			}
 
-				_cur = _cur->next;
-			} // end while
 		}
 
-		kid = kid->next;
+		_cur = _cur->next;
 	} // end while
+}
+
+// Build a pending class of a lazily loaded IDL
+static osrfHash* idl_materialize( IdlCopy* copy, const char* classname ) {
+	if( !copy->pending )
+		return NULL;
 
-	osrfLogInfo(OSRF_LOG_MARK, "...IDL XML parsed");
+	xmlNodePtr kid = osrfHashGet( copy->pending, classname );
+	if( !kid )
+		return NULL;     // No such class
 
-	return idlHash;
+	osrfLogDebug(OSRF_LOG_MARK, "Building IDL class %s on demand", classname );
+	osrfHashRemove( copy->pending, classname );
+
+	curr_copy = copy;
+	idl_build_class( copy->idl, kid );
+	curr_copy = NULL;
+
+	osrfHash* class_def_hash = osrfHashGet( copy->idl, classname );
+
+	// Once every class is built, we don't need the XML any more
+	if( 0 == osrfHashGetCount( copy->pending )) {
+		osrfHashFree( copy->pending );
+		copy->pending = NULL;
+		xmlFreeDoc( copy->doc );
+		copy->doc = NULL;
+		if( copy == lazy_copy )
+			lazy_copy = NULL;
+	}
+
+	return class_def_hash;
+}
+
+// Build all the pending classes of a lazily loaded IDL
+static void idl_materialize_all( IdlCopy* copy ) {
+	if( !copy || !copy->pending )
+		return;
+
+	osrfStringArray* classnames = osrfHashKeys( copy->pending );
+	int i = 0;
+	const char* classname;
+	while( (classname = osrfStringArrayGetString( classnames, i++ )) )
+		idl_materialize( copy, classname );
+	osrfStringArrayFree( classnames );
+}
+
+// Copy a string into the blocks of the IDL being parsed
+static char* idl_dup( const char* str ) {
+	size_t len = strlen( str ) + 1;
+	IdlBlock* block = curr_copy->blocks;
+
+	if( !block || block->size - block->used < len ) {
+		// Start a new block, big enough for the string in any case
+		size_t page_size = (size_t) sysconf( _SC_PAGESIZE );
+		size_t size = IDL_BLOCK_SIZE;
+		if( sizeof( IdlBlock ) + len > size )
+			size = ( ( sizeof( IdlBlock ) + len + page_size - 1 ) / page_size ) * page_size;
+
+		void* mem = mmap( NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if( MAP_FAILED == mem ) {
+			osrfLogError(OSRF_LOG_MARK, "Unable to map memory for the IDL");
+			exit( 1 );
+		}
+
+		block = mem;
+		block->next = curr_copy->blocks;
+		block->size = size;
+		block->used = sizeof( IdlBlock );
+		curr_copy->blocks = block;
+	}
+
+	char* dup = (char*) block + block->used;
+	memcpy( dup, str, len );
+	block->used += len;
+	return dup;
+}
+
+// Move a string from libxml2 into the blocks of the IDL being parsed
+static char* idl_str( char* str ) {
+	if( !str )
+		return NULL;
+
+	char* dup = idl_dup( str );
+	xmlFree( str );
+	return dup;
+}
+
+// Free a class definition and everything hanging from it, except for the strings,
+// which are freed along with the rest of the strings of the same copy of the IDL
+static void idl_free_class( osrfHash* class_def_hash ) {
+	osrfHashIterator* itr = NULL;
+	osrfHash* item = NULL;
+
+	osrfStringArrayFree( osrfHashGet( class_def_hash, "controller" ));
+
+	osrfHash* fields = osrfHashGet( class_def_hash, "fields" );
+	if( fields ) {
+		itr = osrfNewHashIterator( fields );
+		while( (item = osrfHashIteratorNext( itr )) ) {
+			osrfStringArrayFree( osrfHashGet( item, "suppress_controller" ));
+			osrfHashFree( item );
+		}
+		osrfHashIteratorFree( itr );
+		osrfHashFree( fields );
+	}
+
+	osrfHash* links = osrfHashGet( class_def_hash, "links" );
+	if( links ) {
+		itr = osrfNewHashIterator( links );
+		while( (item = osrfHashIteratorNext( itr )) ) {
+			osrfStringArrayFree( osrfHashGet( item, "map" ));
+			osrfHashFree( item );
+		}
+		osrfHashIteratorFree( itr );
+		osrfHashFree( links );
+	}
+
+	osrfHash* pcrud = osrfHashGet( class_def_hash, "permacrud" );
+	if( pcrud ) {
+		itr = osrfNewHashIterator( pcrud );
+		while( (item = osrfHashIteratorNext( itr )) ) {
+			osrfStringArrayFree( osrfHashGet( item, "permission" ));
+			osrfStringArrayFree( osrfHashGet( item, "local_context" ));
+
+			osrfHash* foreign_context = osrfHashGet( item, "foreign_context" );
+			if( foreign_context ) {
+				osrfHashIterator* fc_itr = osrfNewHashIterator( foreign_context );
+				osrfHash* fcontext = NULL;
+				while( (fcontext = osrfHashIteratorNext( fc_itr )) ) {
+					osrfStringArrayFree( osrfHashGet( fcontext, "jump" ));
+					osrfStringArrayFree( osrfHashGet( fcontext, "context" ));
+					osrfHashFree( fcontext );
+				}
+				osrfHashIteratorFree( fc_itr );
+				osrfHashFree( foreign_context );
+			}
+			osrfHashFree( item );
+		}
+		osrfHashIteratorFree( itr );
+		osrfHashFree( pcrud );
+	}
+
+	osrfHashFree( class_def_hash );
 }
 
 // Adds a standard virtual field to a fields hash
@@ -456,9 +1074,9 @@ static void add_std_fld( osrfHash* fields_hash, const char* field_name, unsigned
 	osrfHash* std_fld_hash = osrfNewHash();
 
 	snprintf( array_pos_buf, sizeof( array_pos_buf ), "%u", pos );
-	osrfHashSet( std_fld_hash, strdup( array_pos_buf ), "array_position" );
+	osrfHashSet( std_fld_hash, idl_dup( array_pos_buf ), "array_position" );
 	osrfHashSet( std_fld_hash, "true", "virtual" );
-	osrfHashSet( std_fld_hash, strdup( field_name ), "name" );
+	osrfHashSet( std_fld_hash, idl_dup( field_name ), "name" );
 	osrfHashSet( fields_hash, std_fld_hash, field_name );
 }
 
@@ -466,8 +1084,6 @@ static void add_std_fld( osrfHash* fields_hash, const char* field_name, unsigned
 osrfHash* oilsIDLFindPath( const char* path, ... ) {
 	if(!path || strlen(path) < 1) return NULL;
 
-	osrfHash* obj = idlHash;
-
 	VA_LIST_TO_STRING(path);
 	char* buf = VA_BUF;
 
@@ -478,18 +1094,17 @@ osrfHash* oilsIDLFindPath( const char* path, ... ) {
 	token = strtok_r(t, "/", &tt);
 	if(!token) return NULL;
 
-	do {
+	// The first step is a class name
+	osrfHash* obj = oilsIDLGetClass( token );
+
+	while( obj && (token = strtok_r(NULL, "/", &tt)) )
 		obj = osrfHashGet(obj, token);
-	} while( (token = strtok_r(NULL, "/", &tt)) && obj);
 
 	return obj;
 }
 
 static osrfHash* findClassDef( const char* classname ) {
-	if( !classname || !idlHash )
-		return NULL;
-	else
-		return osrfHashGet( idlHash, classname );
+	return oilsIDLGetClass( classname );
 }
 
 osrfHash* oilsIDL_links( const char* classname ) {
@@ -47,7 +47,7 @@ static CachedQuery* search_token( osrfMethodContext* ctx, const char* token );
 	This function is called when the server drone is about to terminate.
 */
 void osrfAppChildExit() {
-	osrfLogDebug( OSRF_LOG_MARK, "Child is exiting, disconnecting from database..." );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Child is exiting, disconnecting from database..." );
 
 	if ( dbhandle ) {
 		dbi_conn_query( dbhandle, "ROLLBACK;" );
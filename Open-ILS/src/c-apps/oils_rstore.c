@@ -20,13 +20,18 @@ static dbi_conn dbhandle; /* our CURRENT db connection */
 static const int enforce_pcrud = 0;     // Boolean
 static const char modulename[] = "open-ils.reporter-store";
 
+// Metadata for the class-specific methods, keyed on method name
+static osrfHash* class_methods = NULL;
+
+static void registerClassMethods( void );
+
 /**
 	@brief Disconnect from the database.
 
 	This function is called when the server drone is about to terminate.
 */
 void osrfAppChildExit( void ) {
-	osrfLogDebug(OSRF_LOG_MARK, "Child is exiting, disconnecting from database...");
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Child is exiting, disconnecting from database...");
 
 	int same = 0;
 	if (writehandle == dbhandle)
@@ -63,6 +68,7 @@ void osrfAppChildExit( void ) {
 	The general-purpose methods are as follows (minus their MODULENAME prefixes):
 
 	- json_query
+	- json_query.batch
 	- transaction.begin
 	- transaction.commit
 	- transaction.rollback
@@ -71,7 +77,7 @@ void osrfAppChildExit( void ) {
 	- savepoint.rollback
 	- set_audit_info
 
-	For each non-virtual class, create up to eight class-specific methods:
+	For each non-virtual class, create up to ten class-specific methods:
 
 	- create    (not for readonly classes)
 	- retrieve
@@ -79,6 +85,8 @@ void osrfAppChildExit( void ) {
 	- delete    (not for readonly classes
 	- search    (atomic and non-atomic versions)
 	- id_list   (atomic and non-atomic versions)
+	- count
+	- exists
 
 	The full method names follow the pattern "MODULENAME.direct.XXX.method_type", where XXX
 	is the fieldmapper name from the IDL, with every run of one or more consecutive colons
@@ -106,6 +114,13 @@ int osrfAppInitialize( void ) {
 	}
 	dbi_conn_close( handle );
 
+	// Now that the IDL is complete, trim the pages holding its strings, which the
+	// drones will share with the listener, and optionally write-protect them
+	char* protect_idl = osrf_settings_host_value(
+		"/apps/%s/app_settings/protect_idl", modulename );
+	oilsIDLFinalize( oilsIDL(), str_is_true( protect_idl ));
+	free( protect_idl );
+
 	// Get the maximum flesh depth from the settings
 	char* md = osrf_settings_host_value(
 		"/apps/%s/app_settings/max_query_recursion", modulename );
@@ -118,6 +133,13 @@ int osrfAppInitialize( void ) {
 		max_flesh_depth = 1000;
 
 	oilsSetSQLOptions( modulename, enforce_pcrud, max_flesh_depth );
+	oilsSetIDLReload( registerClassMethods );
+	oilsSetQueryPlanCache();
+	oilsSetInListThreshold();
+	oilsSetExplain();
+	oilsSetQueryLimits();
+	oilsSetResponseBatching();
+	oilsSetResultCache();
 
 	// Now register all the methods
 	growing_buffer* method_name = buffer_init(64);
@@ -128,6 +150,13 @@ int osrfAppInitialize( void ) {
 	osrfAppRegisterMethod( modulename, OSRF_BUFFER_C_STR( method_name ),
 		"doJSONSearch", "", 1, OSRF_METHOD_STREAMING );
 
+	// Several generic searches at once
+	buffer_reset( method_name );
+	buffer_add( method_name, modulename );
+	buffer_add( method_name, ".json_query.batch" );
+	osrfAppRegisterMethod( modulename, OSRF_BUFFER_C_STR( method_name ),
+		"doJSONBatch", "", 1, OSRF_METHOD_STREAMING );
+
 	// first we register all the transaction and savepoint methods
 	buffer_reset(method_name);
 	OSRF_BUFFER_ADD(method_name, modulename );
@@ -171,23 +200,57 @@ int osrfAppInitialize( void ) {
 	osrfAppRegisterMethod( modulename, OSRF_BUFFER_C_STR(method_name),
 			"setAuditInfo", "", 3, 0 );
 
+	buffer_free( method_name );
+
+	registerClassMethods();
+
+	return 0;
+}
+
+/**
+	@brief Register the class-specific methods, or repoint them at a reloaded IDL.
+
+	The first time through, register methods for each eligible class in the IDL, as
+	described for osrfAppInitialize().
+
+	After the IDL has been reloaded (see oilsReloadIDL()), point the metadata of the
+	methods already registered at the new class definitions, and register methods for
+	any new classes.  A method whose class is no longer in the IDL loses its class
+	pointer, and dispatchCRUDMethod() rejects any call to it.
+*/
+static void registerClassMethods( void ) {
+
+	if( !class_methods )
+		class_methods = osrfNewHash();
+	else {
+		// Forget the old class definitions; they're about to be freed
+		osrfHashIterator* meta_itr = osrfNewHashIterator( class_methods );
+		osrfHash* method_meta = NULL;
+		while( (method_meta = osrfHashIteratorNext( meta_itr )) )
+			osrfHashRemove( method_meta, "class" );
+		osrfHashIteratorFree( meta_itr );
+	}
+
 	static const char* global_method[] = {
 		"create",
 		"retrieve",
 		"update",
 		"delete",
 		"search",
-		"id_list"
+		"id_list",
+		"count",
+		"exists"
 	};
 	const int global_method_count
 		= sizeof( global_method ) / sizeof ( global_method[0] );
 
 	unsigned long class_count = osrfHashGetCount( oilsIDL() );
-	osrfLogDebug(OSRF_LOG_MARK, "%lu classes loaded", class_count );
-	osrfLogDebug(OSRF_LOG_MARK,
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "%lu classes loaded", class_count );
+	OILS_LOG_DEBUG(OSRF_LOG_MARK,
 		"At most %lu methods will be generated",
 		(unsigned long) (class_count * global_method_count) );
 
+	growing_buffer* method_name = buffer_init(64);
 	osrfHashIterator* class_itr = osrfNewHashIterator( oilsIDL() );
 	osrfHash* idlClass = NULL;
 
@@ -204,14 +267,14 @@ int osrfAppInitialize( void ) {
 		}
 
 		if ( str_is_true( osrfHashGet(idlClass, "virtual") ) ) {
-			osrfLogDebug(OSRF_LOG_MARK, "Class %s is virtual, skipping", classname );
+			OILS_LOG_DEBUG(OSRF_LOG_MARK, "Class %s is virtual, skipping", classname );
 			continue;
 		}
 
 		// Look up some other attributes of the current class
 		const char* idlClass_fieldmapper = osrfHashGet(idlClass, "fieldmapper");
 		if( !idlClass_fieldmapper ) {
-			osrfLogDebug( OSRF_LOG_MARK, "Skipping class \"%s\"; no fieldmapper in IDL",
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Skipping class \"%s\"; no fieldmapper in IDL",
 					classname );
 			continue;
 		}
@@ -221,12 +284,12 @@ int osrfAppInitialize( void ) {
 		int i;
 		for( i = 0; i < global_method_count; ++i ) {  // for each global method
 			const char* method_type = global_method[ i ];
-			osrfLogDebug(OSRF_LOG_MARK,
+			OILS_LOG_DEBUG(OSRF_LOG_MARK,
 				"Using files to build %s class methods for %s", method_type, classname);
 
 			// No create, update, or delete methods for a readonly class
 			if ( str_is_true( readonly )
-				&& ( *method_type == 'c' || *method_type == 'u' || *method_type == 'd') )
+				&& ( !strcmp( method_type, "create" ) || *method_type == 'u' || *method_type == 'd') )
 				continue;
 
 			buffer_reset( method_name );
@@ -249,6 +312,15 @@ int osrfAppInitialize( void ) {
 			OSRF_BUFFER_ADD(method_name, method_type);
 			free(_fm);
 
+			// If we have already registered this method, just point it at
+			// the current class definition
+			osrfHash* method_meta = osrfHashGet( class_methods,
+				OSRF_BUFFER_C_STR( method_name ));
+			if( method_meta ) {
+				osrfHashSet( method_meta, idlClass, "class" );
+				continue;
+			}
+
 			// For an id_list or search method we specify the OSRF_METHOD_STREAMING option.
 			// The consequence is that we implicitly create an atomic method in addition to
 			// the usual non-atomic method.
@@ -257,7 +329,7 @@ int osrfAppInitialize( void ) {
 				flags = flags | OSRF_METHOD_STREAMING;
 			}
 
-			osrfHash* method_meta = osrfNewHash();
+			method_meta = osrfNewHash();
 			osrfHashSet( method_meta, idlClass, "class");
 			osrfHashSet( method_meta, buffer_data( method_name ), "methodname" );
 			osrfHashSet( method_meta, strdup(method_type), "methodtype" );
@@ -273,14 +345,13 @@ int osrfAppInitialize( void ) {
 				flags,
 				(void*)method_meta
 			);
+			osrfHashSet( class_methods, method_meta, OSRF_BUFFER_C_STR( method_name ));
 
 		} // end for each global method
 	} // end for each class in IDL
 
 	buffer_free( method_name );
 	osrfHashIteratorFree( class_itr );
-
-	return 0;
 }
 
 /**
@@ -307,31 +378,50 @@ int osrfAppChildInit( void ) {
 	@param ctx Pointer to the method context.
 	@return Zero if successful, or -1 if not.
 
-	Branch on the method type: create, retrieve, update, delete, search, or id_list.
+	Branch on the method type: create, retrieve, update, delete, search, id_list, count,
+	or exists.
 
 	The method parameters and the type of value returned to the client depend on the method
 	type.
 */
 int dispatchCRUDMethod( osrfMethodContext* ctx ) {
 
+	oilsReloadIDL( ctx );
+
 	// Get the method type, then can branch on it
 	osrfHash* method_meta = (osrfHash*) ctx->method->userData;
 	const char* methodtype = osrfHashGet( method_meta, "methodtype" );
 
+	// The class may have been dropped from a reloaded IDL
+	if( !osrfHashGet( method_meta, "class" )) {
+		osrfAppSessionStatus( ctx->session, OSRF_STATUS_NOTFOUND, "osrfMethodException",
+			ctx->request, "Class is no longer defined in the IDL" );
+		return -1;
+	}
+
+	int rc;
 	if( !strcmp( methodtype, "create" ))
-		return doCreate( ctx );
+		rc = doCreate( ctx );
 	else if( !strcmp(methodtype, "retrieve" ))
-		return doRetrieve( ctx );
+		rc = doRetrieve( ctx );
 	else if( !strcmp(methodtype, "update" ))
-		return doUpdate( ctx );
+		rc = doUpdate( ctx );
 	else if( !strcmp(methodtype, "delete" ))
-		return doDelete( ctx );
+		rc = doDelete( ctx );
 	else if( !strcmp(methodtype, "search" ))
-		return doSearch( ctx );
+		rc = doSearch( ctx );
 	else if( !strcmp(methodtype, "id_list" ))
-		return doIdList( ctx );
+		rc = doIdList( ctx );
+	else if( !strcmp(methodtype, "count" ))
+		rc = doCount( ctx );
+	else if( !strcmp(methodtype, "exists" ))
+		rc = doExists( ctx );
 	else {
 		osrfAppRespondComplete( ctx, NULL );      // should be unreachable...
-		return 0;
+		rc = 0;
 	}
+
+	// The client has its answer by now, so this is a good time to look for a changed IDL
+	oilsCheckIDL( ctx );
+	return rc;
 }
@@ -4,13 +4,18 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
 #include <dbi/dbi.h>
 #include "opensrf/utils.h"
 #include "opensrf/log.h"
 #include "opensrf/osrf_application.h"
+#include "opensrf/osrf_cache.h"
 #include "openils/oils_utils.h"
 #include "openils/oils_sql.h"
 
@@ -65,10 +70,175 @@ struct QueryFrameStruct {
 	int in_use;            // boolean
 };
 
+/**
+	@brief Where one column of a result set goes in a fieldmapper object.
+
+	Every row of a result set has the same columns, so we look them up in the IDL once
+	per result set (see planFieldmapperColumns()) instead of once per row.  We do the
+	same for json_query, whose rows become hashes keyed on column name instead (see
+	planJSONColumns()).
+*/
+typedef struct {
+	int fmIndex;              // array_position in the IDL, or -1 to ignore the column
+	unsigned short type;      // dbi type of the column
+	unsigned int attr;        // dbi attributes of the column
+	const char* name;         // name of the column, owned by the dbi_result
+} FieldmapperColumn;
+
+/* How doCreate() renders a non-NULL value of a field whose primitive is "number" */
+#define WRITE_NUM_NONE    0   // datatype not recognized; nothing is written
+#define WRITE_NUM_INT     1
+#define WRITE_NUM_INT8    2
+#define WRITE_NUM_NUMERIC 3
+
+/**
+	@brief How to write one field of a class in an INSERT or UPDATE.
+*/
+typedef struct {
+	const char* name;         // column name, owned by the IDL
+	const char* datatype;     // datatype from the IDL, or NULL
+	int position;             // array_position in the IDL, or -1 if there isn't one
+	int number;               // boolean; true if the primitive is "number"
+	int insert_type;          // WRITE_NUM_*, for doCreate()
+	int update_type;          // WRITE_NUM_INT, WRITE_NUM_NUMERIC or WRITE_NUM_NONE (quote)
+	int in_update;            // boolean; true if doUpdate() may SET this column
+	int null_in_update;       // boolean; true if doUpdate() may SET this column to NULL
+} WriteColumn;
+
+/**
+	@brief The fields of a class as doCreate() and doUpdate() write them.
+
+	Every object of a class is written the same way, so we walk the IDL's field hash and
+	compare datatype strings once per class (see writeLayoutFor()) instead of once per
+	object written.  The layouts last until the IDL is reloaded.
+*/
+typedef struct {
+	WriteColumn* columns;     // in the order of the class's field hash
+	unsigned int count;       // number of non-virtual fields
+	char* insert_head;        // "INSERT INTO table (col,col,...)"
+	char* update_head;        // "UPDATE table SET"
+} WriteLayout;
+
+/**
+	@brief Where one literal value goes in a cached query plan.
+*/
+typedef struct {
+	size_t offset;            // where in the SQL template to insert the value
+	unsigned int literal;     // which literal, in the order that planLiterals() finds them
+	int quoted;               // boolean; true if the value must be quoted as a string
+} PlanSlot;
+
+struct QueryPlanStruct;
+typedef struct QueryPlanStruct QueryPlan;
+
+/**
+	@brief The SQL compiled from one shape of json_query, minus its literal values.
+
+	A shape that we can't turn into a template is cached anyway, with a NULL template,
+	so that we don't keep trying.
+*/
+struct QueryPlanStruct {
+	QueryPlan* prev;          // more recently used
+	QueryPlan* next;          // less recently used
+	char* key;                // fingerprint of the query shape
+	char* text;               // SQL, without literals, LIMIT, OFFSET or semicolon
+	PlanSlot* slots;          // in order of offset
+	unsigned int slot_count;  // same as the number of literals
+	unsigned long serial;     // distinguishes the name of the prepared statement
+	int prepared;             // 1 if prepared on our connection, -1 if it can't be, else 0
+	osrfStringArray* classes; // names of the classes that the query reads
+};
+
+/**
+	@brief Rows waiting to be sent to the client together, in a single response.
+
+	See initResponseBatch().
+*/
+typedef struct {
+	osrfMethodContext* ctx;
+	jsonObject* rows;            // JSON_ARRAY of rows waiting, or NULL if not batching
+	size_t bytes;                // approximate JSON size of the rows waiting
+	struct timeval started;      // when the first of the rows waiting arrived
+} ResponseBatch;
+
+/**
+	@brief The primary key values seen so far in a result set.
+
+	Integer values go into an open-addressing hash table; anything else goes into an
+	osrfHash.  See keySetAdd().
+*/
+typedef struct {
+	long long* ids;       // hash table of integer keys, or NULL if none yet
+	unsigned long size;   // number of slots in ids: a power of two
+	unsigned long count;  // number of slots in use
+	osrfHash* keys;       // keys that aren't integers, or NULL if none yet
+} KeySet;
+
+/**
+	@brief How to flesh one link field, for every row of a result set.
+
+	See planFleshLinks().
+*/
+typedef struct {
+	const char* name;             // name of the link field
+	osrfHash* link;               // link definition from the IDL
+	osrfHash* kid_class;          // IDL definition of the linked class
+	unsigned long position;       // array_position of the link field
+	unsigned long value_position; // array_position of the field holding the key value
+	long map_position;            // array_position of the mapped field, or -1 if none
+	long key_position;            // array_position of the key field in the kids, or -1
+	unsigned long map_size;       // number of entries in the link's map
+	int has_many;                 // boolean; true for has_many, false for has_a or might_have
+	int no_controller;            // boolean; true if PCRUD may not flesh this link
+	int count_only;               // boolean; true to store the number of kids instead
+	int batch;                    // boolean; true if we can fetch kids for many rows at once
+	osrfHash* identities;         // for a has_a, kids already fetched, keyed on primary key
+	jsonObject* where_clause;     // WHERE clause for the kids, with the latest key value
+	jsonObject* rest_of_query;    // the rest of the query for the kids
+	jsonObject* batch_query;      // for a flesh_limit, the query for the kids of many rows
+} FleshLink;
+
 static int timeout_needs_resetting;
 static time_t time_next_reset;
 
 static int verifyObjectClass ( osrfMethodContext*, const jsonObject* );
+static jsonObject* idListQuery( const jsonObject* rest_param, osrfHash* class_meta );
+static int countRows( osrfMethodContext* ctx, int exists );
+static int countMatches( osrfMethodContext* ctx, osrfHash* class_meta,
+		jsonObject* where_clause, const jsonObject* rest_param, int exists,
+		long long* count );
+static const jsonObject* fleshOption( const jsonObject* query_hash, const char* option,
+		const char* class, const char* field );
+static FleshLink* planFleshLinks( osrfHash* class_meta, osrfHash* fields, osrfHash* links,
+		osrfStringArray* link_fields, jsonObject* flesh_blob, const jsonObject* query_hash,
+		int flesh_depth, int need_to_verify, unsigned int* count );
+static void freeFleshLinks( FleshLink* flesh_links, unsigned int count );
+static osrfHash* identityMapFor( const char* class, const jsonObject* rest_of_query,
+		int verified );
+static void identityMapFree( char* key, void* item );
+static void identityFree( char* key, void* item );
+static int fleshFromIdentities( osrfMethodContext* ctx, FleshLink* fl,
+		jsonObject* res_list, int* err );
+static int fleshRow( osrfMethodContext* ctx, FleshLink* fl, jsonObject* cur, int* err );
+static int fleshAllRows( osrfMethodContext* ctx, FleshLink* fl, jsonObject* res_list,
+		int* err );
+static int fleshCounts( osrfMethodContext* ctx, FleshLink* fl, jsonObject* res_list,
+		int* err );
+static char* countingQuery( char* sql, const char* column, const char* group, int exists );
+static osrfStringArray* sqlFleshLinks( const jsonObject* query_hash, osrfHash* class_meta );
+static char* buildFleshColumns( const jsonObject* query_hash, osrfHash* class_meta,
+		int depth );
+static int appendFleshColumns( growing_buffer* buf, const jsonObject* query_hash,
+		osrfHash* class_meta, const char* alias, int depth, int* seq );
+static void appendClassColumns( growing_buffer* buf, const jsonObject* query_hash,
+		osrfHash* class_meta, const char* alias );
+static void fleshFromResult( dbi_result result, jsonObject* row, osrfHash* class_meta,
+		const jsonObject* query_hash, int depth );
+static void fleshFromJSON( jsonObject* row, osrfHash* class_meta, const jsonObject* json,
+		const jsonObject* query_hash, int depth );
+static jsonObject* fieldmapperFromJSON( const jsonObject* json, osrfHash* class_meta,
+		const jsonObject* query_hash, int depth );
+static char* jsonTimestamp( const char* s );
 
 static void setXactId( osrfMethodContext* ctx );
 static inline const char* getXactId( osrfMethodContext* ctx );
@@ -76,29 +246,51 @@ static inline void clearXactId( osrfMethodContext* ctx );
 
 static jsonObject* doFieldmapperSearch ( osrfMethodContext* ctx, osrfHash* class_meta,
 		jsonObject* where_hash, jsonObject* query_hash, int* err );
-static jsonObject* oilsMakeFieldmapperFromResult( dbi_result, osrfHash* );
+static FieldmapperColumn* planFieldmapperColumns( dbi_result, osrfHash*, unsigned int* );
+static const WriteLayout* writeLayoutFor( osrfHash* meta );
+static void freeWriteLayout( char* key, void* item );
+static void clearWriteLayouts( void );
+static jsonObject* oilsMakeFieldmapperFromResult( dbi_result, osrfHash*,
+		const FieldmapperColumn*, unsigned int );
 static jsonObject* oilsMakeJSONFromResult( dbi_result );
-
-static char* searchSimplePredicate ( const char* op, const char* class_alias,
-				osrfHash* field, const jsonObject* node );
-static char* searchFunctionPredicate ( const char*, osrfHash*, const jsonObject*, const char* );
+static FieldmapperColumn* planJSONColumns( dbi_result, unsigned int* );
+static jsonObject* oilsMakeJSONFromColumns( dbi_result, const FieldmapperColumn*,
+		unsigned int );
+
+static int searchSimplePredicate ( growing_buffer* sql_buf, const char* op,
+				const char* class_alias, osrfHash* field, const jsonObject* node );
+static int searchFunctionPredicate ( growing_buffer*, const char*, osrfHash*,
+		const jsonObject*, const char* );
 static char* searchFieldTransform ( const char*, osrfHash*, const jsonObject* );
-static char* searchFieldTransformPredicate ( const ClassInfo*, osrfHash*, const jsonObject*,
-		const char* );
-static char* searchBETWEENPredicate ( const char*, osrfHash*, const jsonObject* );
-static char* searchINPredicate ( const char*, osrfHash*,
+static int searchFieldTransformPredicate ( growing_buffer*, const ClassInfo*, osrfHash*,
+		const jsonObject*, const char* );
+static int searchBETWEENPredicate ( growing_buffer*, const char*, osrfHash*, const jsonObject* );
+static int searchINPredicate ( growing_buffer*, const char*, osrfHash*,
 								 jsonObject*, const char*, osrfMethodContext* );
+static int searchINArray( growing_buffer* sql_buf, const char* class_alias, osrfHash* field,
+		const jsonObject* node, const char* op );
+static int appendPredicate ( growing_buffer*, const ClassInfo*, osrfHash*, jsonObject*,
+		osrfMethodContext* );
 static char* searchPredicate ( const ClassInfo*, osrfHash*, jsonObject*, osrfMethodContext* );
 static char* searchJOIN ( const jsonObject*, const ClassInfo* left_info );
+static int appendWHERE ( growing_buffer* sql_buf, const jsonObject* search_hash,
+		const ClassInfo*, int, osrfMethodContext* );
 static char* searchWHERE ( const jsonObject* search_hash, const ClassInfo*, int, osrfMethodContext* );
 static char* buildSELECT( const jsonObject*, jsonObject* rest_of_query,
-	osrfHash* meta, osrfMethodContext* ctx );
+	osrfHash* meta, osrfMethodContext* ctx, const char* extra_cols );
 static char* buildOrderByFromArray( osrfMethodContext* ctx, const jsonObject* order_array );
+static int buildKeyset( osrfMethodContext* ctx, const jsonObject* order_hash,
+	const jsonObject* after, char** columns, char** predicate, char** order_by );
+static int getSortKeys( osrfMethodContext* ctx, const jsonObject* order_hash,
+	osrfStringArray* keys, growing_buffer* dirs );
+static jsonObject* makeAfterToken( dbi_result result, const jsonObject* limit );
+static jsonObject* takeAfterColumns( jsonObject* row );
 
 char* buildQuery( osrfMethodContext* ctx, jsonObject* query, int flags );
 
 char* SELECT ( osrfMethodContext*, jsonObject*, const jsonObject*, const jsonObject*,
-	const jsonObject*, const jsonObject*, const jsonObject*, const jsonObject*, int );
+	const jsonObject*, const jsonObject*, const jsonObject*, const jsonObject*,
+	const jsonObject*, int );
 
 static osrfStringArray* getPermLocationCache( osrfMethodContext*, const char* );
 static void setPermLocationCache( osrfMethodContext*, const char*, osrfStringArray* );
@@ -144,6 +336,98 @@ static int perm_at_threshold = 5;
 static int enforce_pcrud = 0;     // Boolean
 static char* modulename = NULL;
 
+static int in_list_threshold = 0;  // IN lists this long become arrays; zero means never
+static int allow_explain = 0;      // boolean; true if queries may ask for EXPLAIN output
+static double max_query_cost = 0;  // highest planner cost we'll run; zero means no limit
+static int query_timeout = 0;      // statement_timeout in milliseconds; zero means none
+
+// For sending rows in batches; see oilsSetResponseBatching()
+static int response_batch_rows = 50;    // most rows per response; zero means no batching
+static int response_batch_bytes = 0;    // most bytes per response; zero means no limit
+static int response_batch_ms = 250;     // longest a row may wait; zero means no limit
+
+// WriteLayouts for doCreate() and doUpdate(), keyed by class name; see writeLayoutFor()
+static osrfHash* write_layouts = NULL;
+
+// has_a targets already fetched while fleshing the current request; see identityMapFor()
+static osrfHash* identity_map = NULL;
+
+#define EXPLAIN_PLAN    1
+#define EXPLAIN_ANALYZE 2
+
+// Most subqueries we'll build to flesh in SQL; beyond that we flesh the usual way
+#define MAX_SQL_FLESH_LINKS 64
+
+// For reloading the IDL on the fly; see oilsReloadIDL()
+static int idl_reload_interval = 0;       // seconds between checks; zero means never
+static time_t idl_next_check = 0;
+static osrfHash* idl_ready = NULL;        // a reloaded IDL waiting to be installed
+static void (*idl_rebind)( void ) = NULL; // server's callback to repoint its methods
+
+static int extendIDL( dbi_conn handle, osrfHash* idl );
+
+// For caching the SQL compiled from json_query; see planQuery()
+#define PLAN_MAX_LITERALS 1000
+static unsigned int plan_cache_size = 0;  // maximum number of plans; zero means no cache
+static osrfHash* plan_cache = NULL;       // QueryPlans, keyed by fingerprint
+static QueryPlan* plan_newest = NULL;     // head of the list in order of use
+static QueryPlan* plan_oldest = NULL;     // tail of the list in order of use
+static char plan_nonce[ 12 ];             // makes our placeholders unguessable
+static int prepare_queries = 0;           // boolean; true if we run plans as prepared statements
+static unsigned long plan_serial = 0;     // for naming prepared statements
+
+// For caching the results of json_query; see resultCacheTTL()
+static int result_cache_max_ttl = 0;          // seconds; zero means no caching
+static int result_cache_expire = 0;           // boolean; true if writes must expire results
+static osrfStringArray* query_classes = NULL; // if not NULL, collects the classes queried
+
+static char* planQuery( osrfMethodContext* ctx, jsonObject* query, int flags );
+static char* planSearch( osrfMethodContext* ctx, const jsonObject* where_hash,
+	const jsonObject* query_hash, osrfHash* meta );
+static int planLiterals( jsonObject* query, osrfStringArray* values, growing_buffer* types );
+static int planWhere( jsonObject* node, osrfStringArray* values, growing_buffer* types );
+static int planPredicate( jsonObject* node, osrfStringArray* values, growing_buffer* types );
+static int planINList( jsonObject* list, osrfStringArray* values, growing_buffer* types );
+static int planList( jsonObject* list, unsigned long start, osrfStringArray* values,
+	growing_buffer* types );
+static int planLiteral( jsonObject* node, osrfStringArray* values, growing_buffer* types );
+static QueryPlan* findPlan( const char* key );
+static QueryPlan* cachePlan( char* key, char* sql, const char* types );
+static QueryPlan* compilePlan( char* sql, const char* types );
+static char* renderPlan( osrfMethodContext* ctx, QueryPlan* plan, const jsonObject* query,
+	const osrfStringArray* values );
+static int preparePlan( osrfMethodContext* ctx, QueryPlan* plan );
+static int isPlainInteger( const char* s );
+static void touchPlan( QueryPlan* plan );
+static void freePlan( char* key, void* item );
+static void clearPlanCache( void );
+static int resultCacheSetting( const char* service );
+static int resultCacheTTL( osrfMethodContext* ctx, const jsonObject* query );
+static char* makeResultKey( const jsonObject* query, int flags,
+	const osrfStringArray* classes );
+static char* getClassGeneration( const char* class );
+static char* bumpClassGeneration( const char* class );
+static void noteWrite( osrfMethodContext* ctx, const char* class );
+static void expireResults( osrfMethodContext* ctx, int committed );
+static int explainMode( osrfMethodContext* ctx, const jsonObject* explain );
+static jsonObject* explainQuery( osrfMethodContext* ctx, const char* sql, int mode );
+static int checkQueryCost( osrfMethodContext* ctx, const char* sql );
+static int runJSONQuery( osrfMethodContext* ctx, jsonObject* hash, jsonObject* rows );
+static void initResponseBatch( ResponseBatch* batch, osrfMethodContext* ctx,
+		const jsonObject* query );
+static void batchRespond( ResponseBatch* batch, jsonObject* row, int give );
+static void flushResponseBatch( ResponseBatch* batch );
+static void endResponseBatch( ResponseBatch* batch );
+static char* limitQueryTime( char* sql );
+static int queryMayRepeat( const jsonObject* query_hash, osrfHash* class_meta );
+static int joinMayRepeat( const jsonObject* join_hash, const char* left_class );
+static int joinNodeMayRepeat( const char* alias, const jsonObject* node,
+		const char* left_class );
+static void keySetInit( KeySet* set, unsigned long long expected );
+static unsigned long keySlot( long long id, unsigned long size );
+static int keySetAdd( KeySet* set, const jsonObject* key );
+static void keySetClear( KeySet* set );
+
 int writeAuditInfo( osrfMethodContext* ctx, const char* user_id, const char* ws_id);
 
 static char* _sanitize_tz_name( const char* tz );
@@ -155,12 +439,12 @@ static char* _sanitize_savepoint_name( const char* sp );
 */
 dbi_conn oilsConnectDB( const char* mod_name ) {
 
-	osrfLogDebug( OSRF_LOG_MARK, "Attempting to initialize libdbi..." );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Attempting to initialize libdbi..." );
 	if( dbi_initialize( NULL ) == -1 ) {
 		osrfLogError( OSRF_LOG_MARK, "Unable to initialize libdbi" );
 		return NULL;
 	} else
-		osrfLogDebug( OSRF_LOG_MARK, "... libdbi initialized." );
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "... libdbi initialized." );
 
 	char* driver = osrf_settings_host_value( "/apps/%s/app_settings/driver", mod_name );
 	char* user   = osrf_settings_host_value( "/apps/%s/app_settings/database/user", mod_name );
@@ -170,14 +454,14 @@ dbi_conn oilsConnectDB( const char* mod_name ) {
 	char* pw     = osrf_settings_host_value( "/apps/%s/app_settings/database/pw", mod_name );
 	char* pg_app = osrf_settings_host_value( "/apps/%s/app_settings/database/application_name", mod_name );
 
-	osrfLogDebug( OSRF_LOG_MARK, "Attempting to load the database driver [%s]...", driver );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Attempting to load the database driver [%s]...", driver );
 	dbi_conn handle = dbi_conn_new( driver );
 
 	if( !handle ) {
 		osrfLogError( OSRF_LOG_MARK, "Error loading database driver [%s]", driver );
 		return NULL;
 	}
-	osrfLogDebug( OSRF_LOG_MARK, "Database driver [%s] seems OK", driver );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Database driver [%s] seems OK", driver );
 
 	osrfLogInfo(OSRF_LOG_MARK, "%s connecting to database.  host=%s, "
 		"port=%s, user=%s, db=%s", mod_name, host, port, user, db );
@@ -338,7 +622,22 @@ char* oilsGetRelation( osrfHash* classdef ) {
 	fields, so that we know whether to enclose their values in quotes.
 */
 int oilsExtendIDL( dbi_conn handle ) {
-	osrfHashIterator* class_itr = osrfNewHashIterator( oilsIDL() );
+	int rc = extendIDL( handle, oilsIDL() );
+	child_initialized = 1;
+	return rc;
+}
+
+/**
+	@brief Add datatypes from the database to the fields of a given copy of the IDL.
+	@param handle Handle for a database connection
+	@param idl Pointer to the IDL hash to be extended.
+	@return Zero if successful, or 1 upon error.
+
+	This is the guts of oilsExtendIDL(), which extends the IDL currently installed.  We
+	also use it for a freshly loaded IDL before installing it.
+*/
+static int extendIDL( dbi_conn handle, osrfHash* idl ) {
+	osrfHashIterator* class_itr = osrfNewHashIterator( idl );
 	osrfHash* class = NULL;
 	growing_buffer* query_buf = buffer_init( 64 );
 	int results_found = 0;   // boolean
@@ -350,7 +649,7 @@ int oilsExtendIDL( dbi_conn handle ) {
 
 		// If the class is virtual, ignore it
 		if( str_is_true( osrfHashGet(class, "virtual") ) ) {
-			osrfLogDebug(OSRF_LOG_MARK, "Class %s is virtual, skipping", classname );
+			OILS_LOG_DEBUG(OSRF_LOG_MARK, "Class %s is virtual, skipping", classname );
 			continue;
 		}
 
@@ -363,7 +662,7 @@ int oilsExtendIDL( dbi_conn handle ) {
 
 		free(tabledef );
 
-		osrfLogDebug( OSRF_LOG_MARK, "%s Investigatory SQL = %s",
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s Investigatory SQL = %s",
 				modulename, OSRF_BUFFER_C_STR( query_buf ) );
 
 		dbi_result result = dbi_conn_query( handle, OSRF_BUFFER_C_STR( query_buf ) );
@@ -374,14 +673,14 @@ int oilsExtendIDL( dbi_conn handle ) {
 			const char* columnName;
 			while( (columnName = dbi_result_get_field_name(result, columnIndex)) ) {
 
-				osrfLogInternal( OSRF_LOG_MARK, "Looking for column named [%s]...",
+				OILS_LOG_INTERNAL( OSRF_LOG_MARK, "Looking for column named [%s]...",
 						columnName );
 
 				/* fetch the fieldmapper index */
 				osrfHash* _f = osrfHashGet(fields, columnName);
 				if( _f ) {
 
-					osrfLogDebug(OSRF_LOG_MARK, "Found [%s] in IDL hash...", columnName);
+					OILS_LOG_DEBUG(OSRF_LOG_MARK, "Found [%s] in IDL hash...", columnName);
 
 					/* determine the field type and storage attributes */
 
@@ -427,7 +726,7 @@ int oilsExtendIDL( dbi_conn handle ) {
 							osrfHashSet( _f, "BYTEA", "datatype" );
 					}
 
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"Setting [%s] to primitive [%s] and datatype [%s]...",
 						columnName,
@@ -441,7 +740,7 @@ int oilsExtendIDL( dbi_conn handle ) {
 		} else {
 			const char* msg;
 			int errnum = dbi_conn_error( handle, &msg );
-			osrfLogDebug( OSRF_LOG_MARK, "No data found for class [%s]: %d, %s", classname,
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "No data found for class [%s]: %d, %s", classname,
 				errnum, msg ? msg : "(No description available)" );
 			// We don't check the database connection here.  It's routine to get failures at
 			// this point; we routinely try to query tables that don't exist, because they
@@ -451,7 +750,6 @@ int oilsExtendIDL( dbi_conn handle ) {
 
 	buffer_free( query_buf );
 	osrfHashIteratorFree( class_itr );
-	child_initialized = 1;
 
 	if( !results_found ) {
 		osrfLogError( OSRF_LOG_MARK,
@@ -466,6 +764,336 @@ int oilsExtendIDL( dbi_conn handle ) {
 		return 0;
 }
 
+/**
+	@brief Enable reloading the IDL in a running drone.
+	@param rebind Pointer to a callback function, or NULL.
+
+	The setting app_settings/idl_reload_interval specifies how often, in seconds, a drone
+	checks whether the IDL file has changed (see oilsCheckIDL()).  If it is absent or zero,
+	we never check.
+
+	After installing a new IDL, oilsReloadIDL() calls @a rebind so that the server can point
+	the metadata of its class-specific methods at the new class definitions, and register
+	methods for any new classes.  The old IDL is freed as soon as @a rebind returns.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name.
+*/
+void oilsSetIDLReload( void (*rebind)( void ) ) {
+	idl_rebind = rebind;
+	idl_reload_interval = 0;
+
+	char* interval = osrf_settings_host_value(
+		"/apps/%s/app_settings/idl_reload_interval", modulename );
+	if( interval ) {
+		idl_reload_interval = atoi( interval );
+		if( idl_reload_interval < 0 )
+			idl_reload_interval = 0;
+		free( interval );
+	}
+
+	if( idl_reload_interval )
+		osrfLogInfo( OSRF_LOG_MARK, "%s will check for IDL changes every %d seconds",
+			modulename, idl_reload_interval );
+}
+
+/**
+	@brief Load a fresh copy of the IDL if the IDL file has changed.
+	@param ctx Pointer to the method context of the request just served.
+	@return 1 if a new IDL is ready to be installed, or zero if not.
+
+	Call this at the end of a method, after the final response has gone to the client.
+	Parsing the IDL and looking up the datatypes of its columns take a while, and this way
+	no client waits for them.  The next request installs the new IDL (see oilsReloadIDL()).
+
+	We load and extend the new IDL completely before setting it aside to be installed.  If
+	anything goes wrong, we keep using the old one, and don't try again until the file
+	changes again.
+
+	We don't load in the middle of a transaction, since some of the queries that extend the
+	IDL are expected to fail, and would abort the transaction.
+*/
+int oilsCheckIDL( osrfMethodContext* ctx ) {
+	if( idl_reload_interval <= 0 || getXactId( ctx ))
+		return 0;
+
+	time_t now = time( NULL );
+	if( now < idl_next_check )
+		return 0;
+	idl_next_check = now + idl_reload_interval;
+
+	if( !oilsIDLModified() )
+		return 0;
+
+	osrfLogInfo( OSRF_LOG_MARK, "%s: IDL file has changed; reloading", modulename );
+
+	osrfHash* new_idl = oilsIDLLoad( NULL );
+	if( !new_idl ) {
+		osrfLogError( OSRF_LOG_MARK, "%s: Unable to reload IDL; keeping the old one",
+			modulename );
+		return 0;
+	}
+
+	if( extendIDL( dbhandle, new_idl )) {
+		osrfLogError( OSRF_LOG_MARK, "%s: Unable to extend reloaded IDL; keeping the old one",
+			modulename );
+		oilsIDLFree( new_idl );
+		return 0;
+	}
+
+	oilsIDLFinalize( new_idl, -1 );
+
+	// If an earlier copy is still waiting, this one supersedes it
+	oilsIDLFree( idl_ready );
+	idl_ready = new_idl;
+	return 1;
+}
+
+/**
+	@brief Install the copy of the IDL loaded by oilsCheckIDL(), if there is one.
+	@param ctx Pointer to the method context of the request about to be served.
+	@return 1 if a new IDL was installed, or zero if not.
+
+	Call this at the top of a method, before looking at the IDL.  Since a drone serves one
+	request at a time, nothing points into the current IDL at that point except the metadata
+	of the registered methods, which the rebind callback takes care of.  So we can swap in
+	the new IDL and free the old one right away.
+
+	We don't install a new IDL in the middle of a transaction, so that every request within
+	a transaction sees the same IDL.
+*/
+int oilsReloadIDL( osrfMethodContext* ctx ) {
+	if( !idl_ready || getXactId( ctx ))
+		return 0;
+
+	osrfHash* new_idl = idl_ready;
+	idl_ready = NULL;
+
+	osrfHash* old_idl = oilsIDLSwap( new_idl );
+	if( idl_rebind )
+		idl_rebind();
+	oilsIDLFree( old_idl );
+	clearPlanCache();
+	clearWriteLayouts();
+
+	osrfLogInfo( OSRF_LOG_MARK, "%s: Reloaded IDL with %lu classes", modulename,
+		(unsigned long) osrfHashGetCount( new_idl ));
+	return 1;
+}
+
+/**
+	@brief Set how long an IN list must be before we send it as an array.
+
+	The setting app_settings/in_list_array_threshold specifies the number of values at
+	which an IN or NOT IN list becomes a single array literal (see searchINArray()).  If it
+	is absent or zero, IN lists are always sent value by value.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name.
+*/
+void oilsSetInListThreshold( void ) {
+	in_list_threshold = 0;
+
+	char* threshold = osrf_settings_host_value(
+		"/apps/%s/app_settings/in_list_array_threshold", modulename );
+	if( threshold ) {
+		in_list_threshold = atoi( threshold );
+		if( in_list_threshold < 0 )
+			in_list_threshold = 0;
+		free( threshold );
+	}
+}
+
+/**
+	@brief Decide whether clients may ask for EXPLAIN output instead of rows.
+
+	The setting app_settings/allow_explain says whether json_query, search, and id_list
+	honor an "explain" entry in the query (see explainMode()).  If it is absent, we allow
+	EXPLAIN for cstore and reporter-store, which are private services, but not for pcrud,
+	where the plan would reveal row counts and values the user may not be entitled to see.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name and the
+	PCRUD flag.
+*/
+void oilsSetExplain( void ) {
+	char* allow = osrf_settings_host_value( "/apps/%s/app_settings/allow_explain", modulename );
+	if( allow ) {
+		allow_explain = str_is_true( allow );
+		free( allow );
+	} else
+		allow_explain = !enforce_pcrud;
+}
+
+/**
+	@brief Set limits on the queries that clients may run.
+
+	The setting app_settings/max_query_cost specifies the highest total cost, as estimated
+	by the PostgreSQL planner, of a query that we will run on behalf of json_query, search,
+	or id_list (see checkQueryCost()).  If it is absent or zero, we don't check.
+
+	The setting app_settings/statement_timeout specifies, in milliseconds, how long
+	PostgreSQL may spend on any one of those queries before cancelling it (see
+	limitQueryTime()).  If it is absent or zero, the database's own setting applies.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name.
+*/
+void oilsSetQueryLimits( void ) {
+	max_query_cost = 0;
+	query_timeout = 0;
+
+	char* cost = osrf_settings_host_value( "/apps/%s/app_settings/max_query_cost", modulename );
+	if( cost ) {
+		max_query_cost = strtod( cost, NULL );
+		if( max_query_cost < 0 )
+			max_query_cost = 0;
+		free( cost );
+	}
+
+	char* timeout = osrf_settings_host_value(
+		"/apps/%s/app_settings/statement_timeout", modulename );
+	if( timeout ) {
+		query_timeout = atoi( timeout );
+		if( query_timeout < 0 )
+			query_timeout = 0;
+		free( timeout );
+	}
+
+	if( max_query_cost || query_timeout )
+		osrfLogInfo( OSRF_LOG_MARK, "%s will reject queries costing more than %.0f "
+			"and cancel them after %d ms (zero means no limit)",
+			modulename, max_query_cost, query_timeout );
+}
+
+/**
+	@brief Configure the sending of rows in batches.
+
+	A client may ask, with "batch_responses":true in a json_query, search, or id_list, to
+	get its rows in batches: each response is then an array of rows, instead of a single
+	row (see initResponseBatch()).  We send a batch when it reaches any of these limits:
+
+	- app_settings/response_batch_rows: the number of rows.  If it is zero, we don't
+	  batch at all, and ignore the client's request.  If it is absent, we use 50.
+	- app_settings/response_batch_bytes: the approximate size of the rows, as JSON.  If
+	  it is absent or zero, there is no such limit.  Otherwise we serialize each row
+	  one extra time, in order to measure it.
+	- app_settings/response_batch_ms: how long, in milliseconds, the first row of the
+	  batch has waited.  If it is zero, there is no such limit.  If it is absent, we
+	  use 250.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name.
+*/
+void oilsSetResponseBatching( void ) {
+	response_batch_rows = 50;
+	response_batch_bytes = 0;
+	response_batch_ms = 250;
+
+	char* rows = osrf_settings_host_value(
+		"/apps/%s/app_settings/response_batch_rows", modulename );
+	if( rows ) {
+		response_batch_rows = atoi( rows );
+		if( response_batch_rows < 0 )
+			response_batch_rows = 0;
+		free( rows );
+	}
+
+	char* bytes = osrf_settings_host_value(
+		"/apps/%s/app_settings/response_batch_bytes", modulename );
+	if( bytes ) {
+		response_batch_bytes = atoi( bytes );
+		if( response_batch_bytes < 0 )
+			response_batch_bytes = 0;
+		free( bytes );
+	}
+
+	char* ms = osrf_settings_host_value(
+		"/apps/%s/app_settings/response_batch_ms", modulename );
+	if( ms ) {
+		response_batch_ms = atoi( ms );
+		if( response_batch_ms < 0 )
+			response_batch_ms = 0;
+		free( ms );
+	}
+}
+
+/**
+	@brief Enable caching of the results of json_query.
+
+	The setting app_settings/result_cache_max_ttl specifies the longest time, in seconds,
+	for which we will cache the results of a json_query in memcached, when the query asks
+	for caching (see resultCacheTTL()).  If it is absent or zero, we never cache results.
+	PCRUD never caches, since its results depend on the user's permissions.
+
+	Writes expire cached results (see noteWrite()) only if cstore or reporter-store on
+	this host caches them, whether or not this service does.  Otherwise there's nothing
+	to expire, and we spare every write the trips to memcached.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name and the
+	PCRUD flag.
+*/
+void oilsSetResultCache( void ) {
+	result_cache_max_ttl = enforce_pcrud ? 0 : resultCacheSetting( modulename );
+	result_cache_expire = resultCacheSetting( "open-ils.cstore" ) > 0
+		|| resultCacheSetting( "open-ils.reporter-store" ) > 0;
+}
+
+// Get the result_cache_max_ttl setting of a service; zero if absent or invalid
+static int resultCacheSetting( const char* service ) {
+	int max_ttl = 0;
+	char* setting = osrf_settings_host_value(
+		"/apps/%s/app_settings/result_cache_max_ttl", service );
+	if( setting ) {
+		max_ttl = atoi( setting );
+		if( max_ttl < 0 )
+			max_ttl = 0;
+		free( setting );
+	}
+	return max_ttl;
+}
+
+/**
+	@brief Enable caching of the SQL compiled from json_query.
+
+	The setting app_settings/query_plan_cache_size specifies how many shapes of query each
+	drone remembers (see planQuery()).  If it is absent or zero, we compile every query
+	from scratch.
+
+	Call this function after oilsSetSQLOptions(), since we need the module name.
+*/
+void oilsSetQueryPlanCache( void ) {
+	clearPlanCache();
+	plan_cache_size = 0;
+
+	char* size = osrf_settings_host_value(
+		"/apps/%s/app_settings/query_plan_cache_size", modulename );
+	if( size ) {
+		int n = atoi( size );
+		if( n > 0 )
+			plan_cache_size = n;
+		free( size );
+	}
+
+	char* prepare = osrf_settings_host_value(
+		"/apps/%s/app_settings/prepare_queries", modulename );
+	prepare_queries = str_is_true( prepare );
+	free( prepare );
+
+	if( !plan_cache_size )
+		return;
+
+	// Pick a random nonce, so that a client can't fake one of our placeholders
+	unsigned long long seed =
+		(unsigned long long) time( NULL ) ^ ( (unsigned long long) getpid() << 16 );
+	FILE* urandom = fopen( "/dev/urandom", "r" );
+	if( urandom ) {
+		unsigned long long r;
+		if( fread( &r, sizeof( r ), 1, urandom ) == 1 )
+			seed ^= r;
+		fclose( urandom );
+	}
+	snprintf( plan_nonce, sizeof( plan_nonce ), "%010llu", seed % 10000000000ULL );
+
+	osrfLogInfo( OSRF_LOG_MARK, "%s will cache up to %u query plans%s",
+		modulename, plan_cache_size, prepare_queries ? " as prepared statements" : "" );
+}
+
 /**
 	@brief Free an osrfHash that stores a transaction ID.
 	@param blob A pointer to the osrfHash to be freed, cast to a void pointer.
@@ -526,6 +1154,8 @@ void userDataFree( void* blob ) {
 	- Transaction id of a pending transaction; a character string.  Key: "xact_id".
 	- Authkey; a character string.  Key: "authkey".
 	- User object from the authentication server; a jsonObject.  Key: "user_login".
+	- Names of the classes written by the pending transaction; an osrfStringArray.
+	  Key: "written_classes".
 
 	If we ever store anything else in userData, we will need to revisit this function so
 	that it will free whatever else needs freeing.
@@ -537,6 +1167,8 @@ static void sessionDataFree( char* key, void* item ) {
 		jsonObjectFree( (jsonObject*) item );
 	else if( !strcmp( key, "pcache" ) )
 		osrfHashFree( (osrfHash*) item );
+	else if( !strcmp( key, "written_classes" ) )
+		osrfStringArrayFree( (osrfStringArray*) item );
 }
 
 static void pcacheFree( char* key, void* item ) {
@@ -1175,6 +1807,7 @@ int commitTransaction( osrfMethodContext* ctx ) {
 		osrfAppRespondComplete( ctx, ret );
 		jsonObjectFree( ret );
 		clearXactId( ctx );
+		expireResults( ctx, 1 );
 		return 0;
 	}
 }
@@ -1229,6 +1862,7 @@ int rollbackTransaction( osrfMethodContext* ctx ) {
 		osrfAppRespondComplete( ctx, ret );
 		jsonObjectFree( ret );
 		clearXactId( ctx );
+		expireResults( ctx, 0 );
 		return 0;
 	}
 }
@@ -1327,17 +1961,14 @@ int doIdList( osrfMethodContext* ctx ) {
 		timeout_needs_resetting = 1;
 
 	jsonObject* where_clause;
-	jsonObject* rest_of_query;
-
-	// We use the where clause without change.  But we need to massage the rest of the
-	// query, so we work with a copy of it instead of modifying the original.
+	const jsonObject* rest_param;
 
 	if( enforce_pcrud ) {
-		where_clause  = jsonObjectGetIndex( ctx->params, 1 );
-		rest_of_query = jsonObjectClone( jsonObjectGetIndex( ctx->params, 2 ) );
+		where_clause = jsonObjectGetIndex( ctx->params, 1 );
+		rest_param   = jsonObjectGetIndex( ctx->params, 2 );
 	} else {
-		where_clause  = jsonObjectGetIndex( ctx->params, 0 );
-		rest_of_query = jsonObjectClone( jsonObjectGetIndex( ctx->params, 1 ) );
+		where_clause = jsonObjectGetIndex( ctx->params, 0 );
+		rest_param   = jsonObjectGetIndex( ctx->params, 1 );
 	}
 
 	if( !where_clause ) { 
@@ -1345,32 +1976,13 @@ int doIdList( osrfMethodContext* ctx ) {
 		return -1;
 	}
 
-	// Eliminate certain SQL clauses, if present.
-	if( rest_of_query ) {
-		jsonObjectRemoveKey( rest_of_query, "select" );
-		jsonObjectRemoveKey( rest_of_query, "no_i18n" );
-		jsonObjectRemoveKey( rest_of_query, "flesh" );
-		jsonObjectRemoveKey( rest_of_query, "flesh_fields" );
-	} else {
-		rest_of_query = jsonNewObjectType( JSON_HASH );
-	}
-
-	jsonObjectSetKey( rest_of_query, "no_i18n", jsonNewBoolObject( 1 ) );
-
 	// Get the class metadata
 	osrfHash* method_meta = (osrfHash*) ctx->method->userData;
 	osrfHash* class_meta = osrfHashGet( method_meta, "class" );
 
-	// Build a SELECT list containing just the primary key,
-	// i.e. like { "classname":["keyname"] }
-	jsonObject* col_list_obj = jsonNewObjectType( JSON_ARRAY );
-
-	// Load array with name of primary key
-	jsonObjectPush( col_list_obj, jsonNewObject( osrfHashGet( class_meta, "primarykey" ) ) );
-	jsonObject* select_clause = jsonNewObjectType( JSON_HASH );
-	jsonObjectSetKey( select_clause, osrfHashGet( class_meta, "classname" ), col_list_obj );
-
-	jsonObjectSetKey( rest_of_query, "select", select_clause );
+	// We use the where clause without change.  But we need to massage the rest of the
+	// query, so we work with a copy of it instead of modifying the original.
+	jsonObject* rest_of_query = idListQuery( rest_param, class_meta );
 
 	// Do the query
 	int err = 0;
@@ -1399,79 +2011,327 @@ int doIdList( osrfMethodContext* ctx ) {
 }
 
 /**
-	@brief Verify that we have a valid class reference.
-	@param ctx Pointer to the method context.
-	@param param Pointer to the method parameters.
-	@return 1 if the class reference is valid, or zero if it isn't.
+	@brief Rework the rest of a query so as to select just the primary key.
+	@param rest_param Pointer to the other SQL clauses passed by the client, if any.
+	@param class_meta Pointer to the class metadata.
+	@return A JSON_HASH with the same clauses, minus any SELECT list or fleshing, plus a
+	SELECT list naming the primary key.
 
-	The class of the method params must match the class to which the method id devoted.
-	For PCRUD there are additional restrictions.
+	The id_list, count, and exists methods all look at the primary keys of the matching
+	rows and nothing else.
+
+	The calling code is responsible for freeing the returned object by calling
+	jsonObjectFree().
 */
-static int verifyObjectClass ( osrfMethodContext* ctx, const jsonObject* param ) {
+static jsonObject* idListQuery( const jsonObject* rest_param, osrfHash* class_meta ) {
+	jsonObject* rest_of_query = jsonObjectClone( rest_param );
 
-	osrfHash* method_meta = (osrfHash*) ctx->method->userData;
-	osrfHash* class = osrfHashGet( method_meta, "class" );
+	// Eliminate certain SQL clauses, if present.
+	if( rest_of_query ) {
+		jsonObjectRemoveKey( rest_of_query, "select" );
+		jsonObjectRemoveKey( rest_of_query, "no_i18n" );
+		jsonObjectRemoveKey( rest_of_query, "flesh" );
+		jsonObjectRemoveKey( rest_of_query, "flesh_fields" );
+	} else {
+		rest_of_query = jsonNewObjectType( JSON_HASH );
+	}
 
-	// Compare the method's class to the parameters' class
-	if( !param->classname || (strcmp( osrfHashGet(class, "classname"), param->classname ))) {
+	jsonObjectSetKey( rest_of_query, "no_i18n", jsonNewBoolObject( 1 ) );
 
-		// Oops -- they don't match.  Complain.
-		growing_buffer* msg = buffer_init( 128 );
-		buffer_fadd(
-			msg,
-			"%s: %s method for type %s was passed a %s",
-			modulename,
-			osrfHashGet( method_meta, "methodtype" ),
-			osrfHashGet( class, "classname" ),
-			param->classname ? param->classname : "(null)"
-		);
+	// Build a SELECT list containing just the primary key,
+	// i.e. like { "classname":["keyname"] }
+	jsonObject* col_list_obj = jsonNewObjectType( JSON_ARRAY );
 
-		char* m = buffer_release( msg );
-		osrfAppSessionStatus( ctx->session, OSRF_STATUS_BADREQUEST, "osrfMethodException",
-				ctx->request, m );
-		free( m );
+	// Load array with name of primary key
+	jsonObjectPush( col_list_obj, jsonNewObject( osrfHashGet( class_meta, "primarykey" ) ) );
+	jsonObject* select_clause = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( select_clause, osrfHashGet( class_meta, "classname" ), col_list_obj );
 
-		return 0;
-	}
+	jsonObjectSetKey( rest_of_query, "select", select_clause );
 
-	if( enforce_pcrud )
-		return verifyObjectPCRUD( ctx, class, param, 1 );
-	else
-		return 1;
+	return rest_of_query;
 }
 
 /**
-	@brief (PCRUD only) Verify that the user is properly logged in.
+	@brief Implement the "count" method.
 	@param ctx Pointer to the method context.
-	@return If the user is logged in, a pointer to the user object from the authentication
-	server; otherwise NULL.
+	@return Zero if successful, or -1 if not.
+
+	Method parameters: the same as for id_list.
+
+	Return to client: the number of rows that id_list would return.
 */
-static const jsonObject* verifyUserPCRUD( osrfMethodContext* ctx ) {
-	return verifyUserPCRUDfull( ctx, 0 );
+int doCount( osrfMethodContext* ctx ) {
+	return countRows( ctx, 0 );
 }
 
-static const jsonObject* verifyUserPCRUDfull( osrfMethodContext* ctx, int anon_ok ) {
+/**
+	@brief Implement the "exists" method.
+	@param ctx Pointer to the method context.
+	@return Zero if successful, or -1 if not.
 
-	// Get the authkey (the first method parameter)
-	const char* auth = jsonObjectGetString( jsonObjectGetIndex( ctx->params, 0 ) );
+	Method parameters: the same as for id_list.
 
-	jsonObject* user = NULL;
+	Return to client: true if id_list would return anything, or false if not.
+*/
+int doExists( osrfMethodContext* ctx ) {
+	return countRows( ctx, 1 );
+}
 
-	// If we are /not/ in anonymous mode
-	if( strcmp( "ANONYMOUS", auth ) ) {
-		// See if we have the same authkey, and a user object,
-		// locally cached from a previous call
-		const char* cached_authkey = getAuthkey( ctx );
-		if( cached_authkey && !strcmp( cached_authkey, auth ) ) {
-			const jsonObject* cached_user = getUserLogin( ctx );
-			if( cached_user )
-				return cached_user;
-		}
+/**
+	@brief Implement the count and exists methods.
+	@param ctx Pointer to the method context.
+	@param exists Boolean: true to test for any rows, false to count them.
+	@return Zero if successful, or -1 if not.
+*/
+static int countRows( osrfMethodContext* ctx, int exists ) {
+	if( osrfMethodVerifyContext( ctx )) {
+		osrfLogError( OSRF_LOG_MARK, "Invalid method context" );
+		return -1;
+	}
 
-		// We have no matching authentication data in the cache.  Authenticate from scratch.
-		jsonObject* auth_object = jsonNewObject( auth );
-	
-		// Fetch the user object from the authentication server
+	if( enforce_pcrud )
+		timeout_needs_resetting = 1;
+
+	jsonObject* where_clause;
+	const jsonObject* rest_param;
+
+	if( enforce_pcrud ) {
+		where_clause = jsonObjectGetIndex( ctx->params, 1 );
+		rest_param   = jsonObjectGetIndex( ctx->params, 2 );
+	} else {
+		where_clause = jsonObjectGetIndex( ctx->params, 0 );
+		rest_param   = jsonObjectGetIndex( ctx->params, 1 );
+	}
+
+	if( !where_clause ) {
+		osrfLogError( OSRF_LOG_MARK, "No WHERE clause parameter supplied" );
+		return -1;
+	}
+
+	// Get the class metadata
+	osrfHash* method_meta = (osrfHash*) ctx->method->userData;
+	osrfHash* class_meta = osrfHashGet( method_meta, "class" );
+
+	long long count = 0;
+	if( countMatches( ctx, class_meta, where_clause, rest_param, exists, &count )) {
+		osrfAppRespondComplete( ctx, NULL );
+		return -1;
+	}
+
+	jsonObject* answer = exists ? jsonNewBoolObject( count > 0 )
+		: jsonNewNumberObject( (double) count );
+	osrfAppRespondComplete( ctx, answer );
+	jsonObjectFree( answer );
+	return 0;
+}
+
+/**
+	@brief Count the rows that satisfy a WHERE clause, or see if there are any.
+	@param ctx Pointer to the method context.
+	@param class_meta Pointer to the class metadata.
+	@param where_clause Pointer to the WHERE clause.
+	@param rest_param Pointer to the other SQL clauses, as for id_list, if any.
+	@param exists Boolean: true to test for any rows, false to count them.
+	@param count Pointer through which to return the count, or for @a exists, a number
+	greater than zero if there are any rows.
+	@return Zero if successful, or -1 if not.
+
+	For cstore and reporter-store we let the database do the counting, by wrapping the
+	query that id_list would run (see countingQuery()).  For PCRUD, the permission checks
+	happen row by row in doFieldmapperSearch(), so we count what survives them; that
+	still spares the client from receiving every id.
+*/
+static int countMatches( osrfMethodContext* ctx, osrfHash* class_meta,
+		jsonObject* where_clause, const jsonObject* rest_param, int exists,
+		long long* count ) {
+
+	jsonObject* rest_of_query = idListQuery( rest_param, class_meta );
+
+	if( enforce_pcrud ) {
+		int err = 0;
+		jsonObject* list =
+			doFieldmapperSearch( ctx, class_meta, where_clause, rest_of_query, &err );
+		jsonObjectFree( rest_of_query );
+		if( err )
+			return -1;
+		*count = list->size;
+		jsonObjectFree( list );
+		return 0;
+	}
+
+	char* sql = buildSELECT( where_clause, rest_of_query, class_meta, ctx, NULL );
+	jsonObjectFree( rest_of_query );
+	if( !sql ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Problem building query" );
+		return -1;
+	}
+
+	// Count distinct keys, since joins may repeat a row, and id_list doesn't
+	sql = countingQuery( sql, osrfHashGet( class_meta, "primarykey" ), NULL, exists );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+
+	// XXX for now...
+	dbhandle = writehandle;
+
+	// Guard against runaway counts, but not the ones we do for fleshing
+	osrfHash* session_data = (osrfHash*) ctx->session->userData;
+	if( !session_data || !osrfHashGetFmt( session_data, "rs_size_req_%d", ctx->request )) {
+		if( checkQueryCost( ctx, sql )) {
+			free( sql );
+			return -1;
+		}
+		sql = limitQueryTime( sql );
+	}
+
+	dbi_result result = dbi_conn_query( dbhandle, sql );
+	if( !result ) {
+		const char* msg;
+		int errnum = dbi_conn_error( dbhandle, &msg );
+		osrfLogError( OSRF_LOG_MARK, "%s: Error counting %s with query [%s]: %d %s",
+			modulename, osrfHashGet( class_meta, "fieldmapper" ), sql, errnum,
+			msg ? msg : "(No description available)" );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_INTERNALSERVERERROR,
+			"osrfMethodException",
+			ctx->request,
+			"Severe query error -- see error log for more details"
+		);
+		if( !oilsIsDBConnected( dbhandle ))
+			osrfAppSessionPanic( ctx->session );
+		free( sql );
+		return -1;
+	}
+
+	*count = 0;
+	if( dbi_result_first_row( result ))
+		*count = exists ? dbi_result_get_int_idx( result, 1 )
+			: dbi_result_get_longlong_idx( result, 1 );
+	dbi_result_free( result );
+	free( sql );
+	return 0;
+}
+
+/**
+	@brief Turn a query into one that counts its rows, or tests for any.
+	@param sql The query, which must have been allocated by malloc().
+	@param column The name of a column to count distinct values of, or NULL to count rows.
+	@param group The name of a column to group the count by, or NULL.  If present, then
+	@a column must be present too, and @a exists must be false.
+	@param exists Boolean: true to test for rows, false to count them.
+	@return The new query.
+
+	To count, we return a single row with a bigint column named "count".  To test, we
+	return a single row with an int column named "exists", holding 1 or 0.  Either way the
+	original query becomes a subquery, so PostgreSQL can skip building its SELECT list, and
+	for EXISTS can stop at the first row.
+
+	To count by group, we return a row for each distinct value of @a group that occurs,
+	with that value in a column named "oils_key", and the count in a column named "count".
+
+	We free the original query.  The calling code is responsible for freeing the resulting
+	string by calling free().
+*/
+static char* countingQuery( char* sql, const char* column, const char* group, int exists ) {
+	// Lose the terminal semicolon, so that the query can be a subquery
+	size_t len = strlen( sql );
+	while( len && ( ';' == sql[ len - 1 ] || isspace( (unsigned char) sql[ len - 1 ] )))
+		sql[ --len ] = '\0';
+
+	growing_buffer* count_buf = buffer_init( len + 96 );
+	if( exists )
+		buffer_fadd( count_buf, "SELECT EXISTS ( %s )::INT AS \"exists\";", sql );
+	else if( group )
+		buffer_fadd( count_buf,
+			"SELECT \"%s\" AS \"oils_key\", count( DISTINCT \"%s\" ) AS \"count\" "
+			"FROM ( %s ) AS \"oils_count\" GROUP BY \"%s\";", group, column, sql, group );
+	else if( column )
+		buffer_fadd( count_buf,
+			"SELECT count( DISTINCT \"%s\" ) AS \"count\" FROM ( %s ) AS \"oils_count\";",
+			column, sql );
+	else
+		buffer_fadd( count_buf,
+			"SELECT count(*) AS \"count\" FROM ( %s ) AS \"oils_count\";", sql );
+
+	free( sql );
+	return buffer_release( count_buf );
+}
+
+/**
+	@brief Verify that we have a valid class reference.
+	@param ctx Pointer to the method context.
+	@param param Pointer to the method parameters.
+	@return 1 if the class reference is valid, or zero if it isn't.
+
+	The class of the method params must match the class to which the method id devoted.
+	For PCRUD there are additional restrictions.
+*/
+static int verifyObjectClass ( osrfMethodContext* ctx, const jsonObject* param ) {
+
+	osrfHash* method_meta = (osrfHash*) ctx->method->userData;
+	osrfHash* class = osrfHashGet( method_meta, "class" );
+
+	// Compare the method's class to the parameters' class
+	if( !param->classname || (strcmp( osrfHashGet(class, "classname"), param->classname ))) {
+
+		// Oops -- they don't match.  Complain.
+		growing_buffer* msg = buffer_init( 128 );
+		buffer_fadd(
+			msg,
+			"%s: %s method for type %s was passed a %s",
+			modulename,
+			osrfHashGet( method_meta, "methodtype" ),
+			osrfHashGet( class, "classname" ),
+			param->classname ? param->classname : "(null)"
+		);
+
+		char* m = buffer_release( msg );
+		osrfAppSessionStatus( ctx->session, OSRF_STATUS_BADREQUEST, "osrfMethodException",
+				ctx->request, m );
+		free( m );
+
+		return 0;
+	}
+
+	if( enforce_pcrud )
+		return verifyObjectPCRUD( ctx, class, param, 1 );
+	else
+		return 1;
+}
+
+/**
+	@brief (PCRUD only) Verify that the user is properly logged in.
+	@param ctx Pointer to the method context.
+	@return If the user is logged in, a pointer to the user object from the authentication
+	server; otherwise NULL.
+*/
+static const jsonObject* verifyUserPCRUD( osrfMethodContext* ctx ) {
+	return verifyUserPCRUDfull( ctx, 0 );
+}
+
+static const jsonObject* verifyUserPCRUDfull( osrfMethodContext* ctx, int anon_ok ) {
+
+	// Get the authkey (the first method parameter)
+	const char* auth = jsonObjectGetString( jsonObjectGetIndex( ctx->params, 0 ) );
+
+	jsonObject* user = NULL;
+
+	// If we are /not/ in anonymous mode
+	if( strcmp( "ANONYMOUS", auth ) ) {
+		// See if we have the same authkey, and a user object,
+		// locally cached from a previous call
+		const char* cached_authkey = getAuthkey( ctx );
+		if( cached_authkey && !strcmp( cached_authkey, auth ) ) {
+			const jsonObject* cached_user = getUserLogin( ctx );
+			if( cached_user )
+				return cached_user;
+		}
+
+		// We have no matching authentication data in the cache.  Authenticate from scratch.
+		jsonObject* auth_object = jsonNewObject( auth );
+	
+		// Fetch the user object from the authentication server
 		user = oilsUtilsQuickReq( "open-ils.auth", "open-ils.auth.session.retrieve", auth_object );
 		jsonObjectFree( auth_object );
 	
@@ -1538,7 +2398,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 		int *rs_size_from_hash = osrfHashGetFmt( (osrfHash *) ctx->session->userData, "rs_size_req_%d", ctx->request );
 		if (rs_size_from_hash) {
 			rs_size = *rs_size_from_hash;
-			osrfLogDebug(OSRF_LOG_MARK, "used rs_size from request-scoped hash: %d", rs_size);
+			OILS_LOG_DEBUG(OSRF_LOG_MARK, "used rs_size from request-scoped hash: %d", rs_size);
 		}
 	}
 
@@ -1551,8 +2411,9 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 	// but they aren't implemented yet.
 
 	int fetch = 0;
-	if( *method_type == 's' || *method_type == 'i' ) {
-		method_type = "retrieve"; // search and id_list are equivalent to retrieve for this
+	if( *method_type == 's' || *method_type == 'i' || *method_type == 'e'
+			|| !strcmp( method_type, "count" )) {
+		method_type = "retrieve"; // search, id_list, count, and exists are equivalent to retrieve for this
 		fetch = 1;
 	} else if( *method_type == 'u' || *method_type == 'd' ) {
 		fetch = 1; // MUST go to the db for the object for update and delete
@@ -1597,7 +2458,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 	// Get a list of permissions from the permacrud entry.
 	osrfStringArray* permission = osrfHashGet( pcrud, "permission" );
 	if( permission->size == 0 ) {
-		osrfLogDebug(
+		OILS_LOG_DEBUG(
 			OSRF_LOG_MARK,
 			"No permissions required for this action (class %s), passing through",
 			osrfHashGet(class, "classname")
@@ -1637,7 +2498,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 	if( str_is_true( osrfHashGet(pcrud, "global_required") ) ) {
 		// If the global_required attribute is present and true, then the only owning
 		// org unit is the root org unit, i.e. the one with no parent.
-		osrfLogDebug( OSRF_LOG_MARK,
+		OILS_LOG_DEBUG( OSRF_LOG_MARK,
 				"global-level permissions required, fetching top of the org tree" );
 
 		// no need to check perms for org tree root retrieval
@@ -1648,7 +2509,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
 		if( org_tree_root_id ) {
 			osrfStringArrayAdd( context_org_array, org_tree_root_id );
-			osrfLogDebug( OSRF_LOG_MARK, "top of the org tree is %s", org_tree_root_id );
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "top of the org tree is %s", org_tree_root_id );
 		} else  {
 			osrfStringArrayFree( context_org_array );
 			return 0;
@@ -1664,7 +2525,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 		// foreign key column(s) that we need.  So whenever possible, we do a fresh read
 		// of the row to make sure that we have what we need.
 
-	    osrfLogDebug( OSRF_LOG_MARK, "global-level permissions not required, "
+	    OILS_LOG_DEBUG( OSRF_LOG_MARK, "global-level permissions not required, "
 				"fetching context org ids" );
 
         pkey = osrfHashGet( class, "primarykey" );
@@ -1674,17 +2535,17 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 			// image that we already have.  If it doesn't have everything we need, too bad.
 			fetch = 0;
 			param = jsonObjectClone( obj );
-			osrfLogDebug( OSRF_LOG_MARK, "No primary key; using clone of object" );
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "No primary key; using clone of object" );
 		} else if( obj->classname ) {
 			pkey_value = oilsFMGetStringConst( obj, pkey );
 			if( !fetch )
 				param = jsonObjectClone( obj );
-			osrfLogDebug( OSRF_LOG_MARK, "Object supplied, using primary key value of %s",
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Object supplied, using primary key value of %s",
 				pkey_value );
 		} else {
 			pkey_value = jsonObjectGetString( obj );
 			fetch = 1;
-			osrfLogDebug( OSRF_LOG_MARK, "Object not supplied, using primary key value "
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Object not supplied, using primary key value "
 				"of %s and retrieving from the database", pkey_value );
 		}
 
@@ -1704,7 +2565,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
 		if( !param ) {
 			// The row doesn't exist.  Complain, and deny access.
-			osrfLogDebug( OSRF_LOG_MARK,
+			OILS_LOG_DEBUG( OSRF_LOG_MARK,
 					"Object not found in the database with primary key %s of %s",
 					pkey, pkey_value );
 
@@ -1734,7 +2595,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 			// The IDL provides a list of column names for the foreign keys denoting
 			// local context, i.e. columns identifying owing org units directly.  Look up
 			// the value of each one, and if it isn't null, add it to the list of org units.
-			osrfLogDebug( OSRF_LOG_MARK, "%d class-local context field(s) specified",
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%d class-local context field(s) specified",
 				local_context->size );
 			int i = 0;
 			const char* lcontext = NULL;
@@ -1742,7 +2603,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 				const char* fkey_value = oilsFMGetStringConst( param, lcontext );
 				if( fkey_value ) {    // if not null
 					osrfStringArrayAdd( context_org_array, fkey_value );
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"adding class-local field %s (value: %s) to the context org list",
 						lcontext,
@@ -1754,7 +2615,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
 		if( foreign_context ) {
 			unsigned long class_count = osrfHashGetCount( foreign_context );
-			osrfLogDebug( OSRF_LOG_MARK, "%d foreign context classes(s) specified", class_count );
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%d foreign context classes(s) specified", class_count );
 
 			if( class_count > 0 ) {
 
@@ -1768,7 +2629,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 					const char* class_name = osrfHashIteratorKey( class_itr );
 					osrfHash* fcontext = osrfHashGet( foreign_context, class_name );
 
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"%d foreign context fields(s) specified for class %s",
 						((osrfStringArray*)osrfHashGet(fcontext,"context"))->size,
@@ -1789,7 +2650,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
 					osrfHashSet((osrfHash*) ctx->session->userData, "1", "inside_verify");
 					jsonObject* _list = doFieldmapperSearch(
-						ctx, osrfHashGet( oilsIDL(), class_name ), _tmp_params, NULL, &err );
+						ctx, oilsIDLGetClass( class_name ), _tmp_params, NULL, &err );
 					osrfHashSet((osrfHash*) ctx->session->userData, "0", "inside_verify");
 
 					jsonObject* _fparam = NULL;
@@ -1821,7 +2682,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
 							// Get the class metadata for the class
 							// to which the foreign key points
-							osrfHash* foreign_class_meta = osrfHashGet( oilsIDL(),
+							osrfHash* foreign_class_meta = oilsIDLGetClass(
 									osrfHashGet( foreign_link_hash, "class" ));
 
 							// Get the name of the referenced key of that class
@@ -1900,7 +2761,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 						while ( (foreign_field = osrfStringArrayGetString( ctx_array, j++ )) ) {
 							osrfStringArrayAdd( context_org_array,
 								oilsFMGetStringConst( _fparam, foreign_field ));
-							osrfLogDebug( OSRF_LOG_MARK,
+							OILS_LOG_DEBUG( OSRF_LOG_MARK,
 								"adding foreign class %s field %s (value: %s) "
 									"to the context org list",
 								class_name,
@@ -1938,17 +2799,17 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 					// image that we already have.  If it doesn't have everything we need, too bad.
 					fetch = 0;
 					param = jsonObjectClone( obj );
-					osrfLogDebug( OSRF_LOG_MARK, "No primary key; using clone of object" );
+					OILS_LOG_DEBUG( OSRF_LOG_MARK, "No primary key; using clone of object" );
 				} else if( obj->classname ) {
 					pkey_value = oilsFMGetStringConst( obj, pkey );
 					if( !fetch )
 						param = jsonObjectClone( obj );
-					osrfLogDebug( OSRF_LOG_MARK, "Object supplied, using primary key value of %s",
+					OILS_LOG_DEBUG( OSRF_LOG_MARK, "Object supplied, using primary key value of %s",
 						pkey_value );
 				} else {
 					pkey_value = jsonObjectGetString( obj );
 					fetch = 1;
-					osrfLogDebug( OSRF_LOG_MARK, "Object not supplied, using primary key value "
+					OILS_LOG_DEBUG( OSRF_LOG_MARK, "Object not supplied, using primary key value "
 						"of %s and retrieving from the database", pkey_value );
 				}
 		
@@ -1967,7 +2828,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 	
 			if( !param ) {
 				// The row doesn't exist.  Complain, and deny access.
-				osrfLogDebug( OSRF_LOG_MARK,
+				OILS_LOG_DEBUG( OSRF_LOG_MARK,
 						"Object not found in the database with primary key %s of %s",
 						pkey, pkey_value );
 	
@@ -2008,7 +2869,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 		) {
     		dbi_result result;
 
-			osrfLogDebug(
+			OILS_LOG_DEBUG(
 				OSRF_LOG_MARK,
 				"Checking object permission [%s] for user %d "
 						"on object %s (class %s)",
@@ -2028,7 +2889,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 			);
 
 			if( result ) {
-				osrfLogDebug(
+				OILS_LOG_DEBUG(
 					OSRF_LOG_MARK,
 					"Received a result for object permission [%s] "
 							"for user %d on object %s (class %s)",
@@ -2043,7 +2904,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 					const char* has_perm = jsonObjectGetString(
 							jsonObjectGetKeyConst( return_val, "has_perm" ));
 
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"Status of object permission [%s] for user %d "
 								"on object %s (class %s) is %s",
@@ -2097,7 +2958,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 				);
 		
 				if( result ) {
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"Received a result for permission [%s] for user %d",
 						perm,
@@ -2105,11 +2966,15 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 					);
 		
 					if( dbi_result_first_row( result )) {
+						unsigned int column_count = 0;
+						FieldmapperColumn* columns = planJSONColumns( result, &column_count );
 	                    do {
-	    					jsonObject* return_val = oilsMakeJSONFromResult( result );
+	    					jsonObject* return_val =
+								oilsMakeJSONFromColumns( result, columns, column_count );
 		    				osrfStringArrayAdd( pcache, jsonObjectGetString( jsonObjectGetKeyConst( return_val, "at" ) ) );
 	                        jsonObjectFree( return_val );
 					    } while( dbi_result_next_row( result ));
+						free( columns );
 
 						setPermLocationCache(ctx, perm, pcache);
 					}
@@ -2137,7 +3002,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
                     osrfHashGet(pcrud, "owning_user") 
                 )
             ) {
-				osrfLogDebug(
+				OILS_LOG_DEBUG(
 					OSRF_LOG_MARK,
 					"Checking object permission [%s] for user %d "
 							"on object %s (class %s) at org %d",
@@ -2159,7 +3024,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 				);
 
 				if( result ) {
-					osrfLogDebug(
+					OILS_LOG_DEBUG(
 						OSRF_LOG_MARK,
 						"Received a result for object permission [%s] "
 								"for user %d on object %s (class %s) at org %d",
@@ -2175,7 +3040,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 						const char* has_perm = jsonObjectGetString(
 								jsonObjectGetKeyConst( return_val, "has_perm" ));
 
-						osrfLogDebug(
+						OILS_LOG_DEBUG(
 							OSRF_LOG_MARK,
 							"Status of object permission [%s] for user %d "
 									"on object %s (class %s) at org %d is %s",
@@ -2208,7 +3073,7 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 
             if (rs_size > perm_at_threshold) break;
 
-			osrfLogDebug( OSRF_LOG_MARK,
+			OILS_LOG_DEBUG( OSRF_LOG_MARK,
 					"Checking non-object permission [%s] for user %d at org %d",
 					perm, userid, atoi(context_org) );
 			result = dbi_conn_queryf(
@@ -2220,14 +3085,14 @@ static int verifyObjectPCRUD ( osrfMethodContext* ctx, osrfHash *class, const js
 			);
 
 			if( result ) {
-				osrfLogDebug( OSRF_LOG_MARK,
+				OILS_LOG_DEBUG( OSRF_LOG_MARK,
 					"Received a result for permission [%s] for user %d at org %d",
 					perm, userid, atoi( context_org ));
 				if( dbi_result_first_row( result )) {
 					jsonObject* return_val = oilsMakeJSONFromResult( result );
 					const char* has_perm = jsonObjectGetString(
 						jsonObjectGetKeyConst( return_val, "has_perm" ));
-					osrfLogDebug( OSRF_LOG_MARK,
+					OILS_LOG_DEBUG( OSRF_LOG_MARK,
 						"Status of permission [%s] for user %d at org %d is [%s]",
 						perm, userid, atoi( context_org ), has_perm );
 					if( *has_perm == 't' )
@@ -2286,7 +3151,7 @@ static const char* org_tree_root( osrfMethodContext* ctx ) {
 	int err = 0;
 	jsonObject* where_clause = single_hash( "parent_ou", NULL );
 	jsonObject* result = doFieldmapperSearch(
-		ctx, osrfHashGet( oilsIDL(), "aou" ), where_clause, NULL, &err );
+		ctx, oilsIDLGetClass( "aou" ), where_clause, NULL, &err );
 	jsonObjectFree( where_clause );
 
 	jsonObject* tree_top = jsonObjectGetIndex( result, 0 );
@@ -2309,7 +3174,7 @@ static const char* org_tree_root( osrfMethodContext* ctx ) {
 	}
 
 	const char* root_org_unit_id = oilsFMGetStringConst( tree_top, "id" );
-	osrfLogDebug( OSRF_LOG_MARK, "Top of the org tree is %s", root_org_unit_id );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Top of the org tree is %s", root_org_unit_id );
 
 	strcpy( cached_root_id, root_org_unit_id );
 	jsonObjectFree( result );
@@ -2360,7 +3225,7 @@ int doCreate( osrfMethodContext* ctx ) {
 		return -1;
 	}
 
-	osrfLogDebug( OSRF_LOG_MARK, "Object seems to be of the correct type" );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Object seems to be of the correct type" );
 
 	const char* trans_id = getXactId( ctx );
 	if( !trans_id ) {
@@ -2377,6 +3242,9 @@ int doCreate( osrfMethodContext* ctx ) {
 		return -1;
 	}
 
+	// Expire cached results from this class when the transaction commits
+	noteWrite( ctx, osrfHashGet( meta, "classname" ));
+
 	// The following test is harmless but redundant.  If a class is
 	// readonly, we don't register a create method for it.
 	if( str_is_true( osrfHashGet( meta, "readonly" ) ) ) {
@@ -2394,40 +3262,28 @@ int doCreate( osrfMethodContext* ctx ) {
 	// Set the last_xact_id
 	int index = oilsIDL_ntop( target->classname, "last_xact_id" );
 	if( index > -1 ) {
-		osrfLogDebug(OSRF_LOG_MARK, "Setting last_xact_id to %s on %s at position %d",
+		OILS_LOG_DEBUG(OSRF_LOG_MARK, "Setting last_xact_id to %s on %s at position %d",
 			trans_id, target->classname, index);
 		jsonObjectSetIndex( target, index, jsonNewObject( trans_id ));
 	}
 
-	osrfLogDebug( OSRF_LOG_MARK, "There is a transaction running..." );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "There is a transaction running..." );
 
 	dbhandle = writehandle;
 
-	osrfHash* fields = osrfHashGet( meta, "fields" );
 	char* pkey       = osrfHashGet( meta, "primarykey" );
 	char* seq        = osrfHashGet( meta, "sequence" );
 
-	growing_buffer* table_buf = buffer_init( 128 );
-	growing_buffer* col_buf   = buffer_init( 128 );
-	growing_buffer* val_buf   = buffer_init( 128 );
-
-	OSRF_BUFFER_ADD( table_buf, "INSERT INTO " );
-	OSRF_BUFFER_ADD( table_buf, osrfHashGet( meta, "tablename" ));
-	OSRF_BUFFER_ADD_CHAR( col_buf, '(' );
+	const WriteLayout* layout = writeLayoutFor( meta );
+	growing_buffer* val_buf = buffer_init( 128 );
 	buffer_add( val_buf,"VALUES (" );
 
+	unsigned int col_idx;
+	for( col_idx = 0; col_idx < layout->count; ++col_idx ) {
 
-	int first = 1;
-	osrfHash* field = NULL;
-	osrfHashIterator* field_itr = osrfNewHashIterator( fields );
-	while( (field = osrfHashIteratorNext( field_itr ) ) ) {
-
-		const char* field_name = osrfHashIteratorKey( field_itr );
-
-		if( str_is_true( osrfHashGet( field, "virtual" ) ) )
-			continue;
-
-		const jsonObject* field_object = oilsFMGetObject( target, field_name );
+		const WriteColumn* col = layout->columns + col_idx;
+		const jsonObject* field_object = col->position < 0 ? NULL
+			: jsonObjectGetIndex( target, col->position );
 
 		char* value;
 		if( field_object && field_object->classname ) {
@@ -2444,27 +3300,20 @@ int doCreate( osrfMethodContext* ctx ) {
 			value = jsonObjectToSimpleString( field_object );
 		}
 
-		if( first ) {
-			first = 0;
-		} else {
-			OSRF_BUFFER_ADD_CHAR( col_buf, ',' );
+		if( col_idx )
 			OSRF_BUFFER_ADD_CHAR( val_buf, ',' );
-		}
-
-		buffer_add( col_buf, field_name );
 
 		if( !field_object || field_object->type == JSON_NULL ) {
 			buffer_add( val_buf, "DEFAULT" );
 
-		} else if( !strcmp( get_primitive( field ), "number" )) {
-			const char* numtype = get_datatype( field );
-			if( !strcmp( numtype, "INT8" )) {
+		} else if( col->number ) {
+			if( WRITE_NUM_INT8 == col->insert_type ) {
 				buffer_fadd( val_buf, "%lld", atoll( value ));
 
-			} else if( !strcmp( numtype, "INT" )) {
+			} else if( WRITE_NUM_INT == col->insert_type ) {
 				buffer_fadd( val_buf, "%d", atoi( value ));
 
-			} else if( !strcmp( numtype, "NUMERIC" )) {
+			} else if( WRITE_NUM_NUMERIC == col->insert_type ) {
 				buffer_fadd( val_buf, "%f", atof( value ));
 			}
 		} else {
@@ -2481,8 +3330,6 @@ int doCreate( osrfMethodContext* ctx ) {
 					"Error quoting string -- please see the error log for more details"
 				);
 				free( value );
-				buffer_free( table_buf );
-				buffer_free( col_buf );
 				buffer_free( val_buf );
 				osrfAppRespondComplete( ctx, NULL );
 				return -1;
@@ -2492,23 +3339,16 @@ int doCreate( osrfMethodContext* ctx ) {
 		free( value );
 	}
 
-	osrfHashIteratorFree( field_itr );
-
-	OSRF_BUFFER_ADD_CHAR( col_buf, ')' );
 	OSRF_BUFFER_ADD_CHAR( val_buf, ')' );
 
-	char* table_str = buffer_release( table_buf );
-	char* col_str   = buffer_release( col_buf );
-	char* val_str   = buffer_release( val_buf );
+	char* val_str = buffer_release( val_buf );
 	growing_buffer* sql = buffer_init( 128 );
-	buffer_fadd( sql, "%s %s %s;", table_str, col_str, val_str );
-	free( table_str );
-	free( col_str );
+	buffer_fadd( sql, "%s %s;", layout->insert_head, val_str );
 	free( val_str );
 
 	char* query = buffer_release( sql );
 
-	osrfLogDebug( OSRF_LOG_MARK, "%s: Insert SQL [%s]", modulename, query );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Insert SQL [%s]", modulename, query );
 
 	jsonObject* obj = NULL;
 	int rc = 0;
@@ -2626,7 +3466,7 @@ int doRetrieve( osrfMethodContext* ctx ) {
 	// Get the value of the primary key, from a method parameter
 	const jsonObject* id_obj = jsonObjectGetIndex( ctx->params, id_pos );
 
-	osrfLogDebug(
+	OILS_LOG_DEBUG(
 		OSRF_LOG_MARK,
 		"%s retrieving %s object with primary key value of %s",
 		modulename,
@@ -2720,9 +3560,13 @@ static char* jsonNumberToDBString( osrfHash* field, const jsonObject* value ) {
 	return buffer_release( val_buf );
 }
 
-static char* searchINPredicate( const char* class_alias, osrfHash* field,
-		jsonObject* node, const char* op, osrfMethodContext* ctx ) {
-	growing_buffer* sql_buf = buffer_init( 32 );
+static int searchINPredicate( growing_buffer* sql_buf, const char* class_alias,
+		osrfHash* field, jsonObject* node, const char* op, osrfMethodContext* ctx ) {
+
+	// Send a long list of values as a single array
+	if( in_list_threshold > 0 && node->type == JSON_ARRAY
+			&& node->size >= (unsigned long) in_list_threshold )
+		return searchINArray( sql_buf, class_alias, field, node, op );
 
 	buffer_fadd(
 		sql_buf,
@@ -2743,8 +3587,7 @@ static char* searchINPredicate( const char* class_alias, osrfHash* field,
 		// subquery predicate
 		char* subpred = buildQuery( ctx, node, SUBSELECT );
 		if( ! subpred ) {
-			buffer_free( sql_buf );
-			return NULL;
+			return -1;
 		}
 
 		buffer_add( sql_buf, subpred );
@@ -2767,8 +3610,7 @@ static char* searchINPredicate( const char* class_alias, osrfHash* field,
 				osrfLogError( OSRF_LOG_MARK,
 						"%s: Expected string or number within IN list; found %s",
 						modulename, json_type( in_item->type ) );
-				buffer_free( sql_buf );
-				return NULL;
+				return -1;
 			}
 
 			// Append the literal value -- quoted if not a number
@@ -2791,27 +3633,110 @@ static char* searchINPredicate( const char* class_alias, osrfHash* field,
 					osrfLogError( OSRF_LOG_MARK,
 							"%s: Error quoting key string [%s]", modulename, key_string );
 					free( key_string );
-					buffer_free( sql_buf );
-					return NULL;
+					return -1;
 				}
 			}
 		}
 
 		if( in_item_first ) {
 			osrfLogError(OSRF_LOG_MARK, "%s: Empty IN list", modulename );
-			buffer_free( sql_buf );
-			return NULL;
+			return -1;
 		}
 	} else {
 		osrfLogError( OSRF_LOG_MARK, "%s: Expected object or array for IN clause; found %s",
 			modulename, json_type( node->type ));
-		buffer_free( sql_buf );
-		return NULL;
+		return -1;
 	}
 
 	OSRF_BUFFER_ADD_CHAR( sql_buf, ')' );
 
-	return buffer_release( sql_buf );
+	return 0;
+}
+
+/**
+	@brief Build an IN or NOT IN predicate from a long list of values, as an array.
+	@param sql_buf Pointer to the buffer to which we append the predicate.
+	@param class_alias Alias of the class to which the column belongs.
+	@param field Pointer to the IDL definition of the column.
+	@param node Pointer to a JSON_ARRAY of strings and/or numbers.
+	@param op The operator: "not in" for NOT IN, or anything else for IN.
+	@return 0 if successful, or -1 upon error.
+
+	Instead of IN ( v1, v2, ... ), we generate = ANY ( '{v1,v2,...}' ), or <> ALL for
+	NOT IN.  That's one literal for PostgreSQL to parse instead of thousands, and it can
+	plan the predicate without looking at every value.  We don't cast the array; like the
+	individual literals of an IN list, it takes on the type of the column.
+
+	For a numeric column, every value must look like a number.  Otherwise we reject the
+	list here, rather than let one bad value make PostgreSQL reject the whole array.
+
+	We append the predicate to @a sql_buf.
+*/
+static int searchINArray( growing_buffer* sql_buf, const char* class_alias, osrfHash* field,
+		const jsonObject* node, const char* op ) {
+
+	int numeric = !strcmp( get_primitive( field ), "number" );
+
+	// Build the array literal, with every element in double quotes
+	growing_buffer* array_buf = buffer_init( 16 * node->size + 16 );
+	OSRF_BUFFER_ADD_CHAR( array_buf, '{' );
+
+	unsigned long i;
+	for( i = 0; i < node->size; ++i ) {
+		const jsonObject* in_item = jsonObjectGetIndex( node, i );
+
+		// Sanity check
+		if( !in_item || ( in_item->type != JSON_STRING && in_item->type != JSON_NUMBER )) {
+			osrfLogError( OSRF_LOG_MARK,
+					"%s: Expected string or number within IN list; found %s",
+					modulename, in_item ? json_type( in_item->type ) : "nothing" );
+			buffer_free( array_buf );
+			return -1;
+		}
+
+		const char* value = jsonObjectGetString( in_item );
+		if( numeric && !jsonIsNumeric( value )) {
+			osrfLogError( OSRF_LOG_MARK,
+					"%s: Expected a number within IN list for %s; found \"%s\"",
+					modulename, osrfHashGet( field, "name" ), value );
+			buffer_free( array_buf );
+			return -1;
+		}
+
+		if( i )
+			OSRF_BUFFER_ADD_CHAR( array_buf, ',' );
+		OSRF_BUFFER_ADD_CHAR( array_buf, '"' );
+
+		for( ; *value; ++value ) {
+			if( '"' == *value || '\\' == *value )
+				OSRF_BUFFER_ADD_CHAR( array_buf, '\\' );
+			OSRF_BUFFER_ADD_CHAR( array_buf, *value );
+		}
+
+		OSRF_BUFFER_ADD_CHAR( array_buf, '"' );
+	}
+
+	OSRF_BUFFER_ADD_CHAR( array_buf, '}' );
+	char* array = buffer_release( array_buf );
+
+	if( !dbi_conn_quote_string( dbhandle, &array )) {
+		osrfLogError( OSRF_LOG_MARK, "%s: Error quoting array of %lu values for IN list",
+			modulename, node->size );
+		free( array );
+		return -1;
+	}
+
+	buffer_fadd(
+		sql_buf,
+		"\"%s\".%s %s ( %s )",
+		class_alias,
+		osrfHashGet( field, "name" ),
+		( op && !strcasecmp( op, "not in" )) ? "<> ALL" : "= ANY",
+		array
+	);
+	free( array );
+
+	return 0;
 }
 
 // Receive a JSON_ARRAY representing a function call.  The first
@@ -2875,17 +3800,17 @@ static char* searchValueTransform( const jsonObject* array ) {
 	return buffer_release( sql_buf );
 }
 
-static char* searchFunctionPredicate( const char* class_alias, osrfHash* field,
-		const jsonObject* node, const char* op ) {
+static int searchFunctionPredicate( growing_buffer* sql_buf, const char* class_alias,
+		osrfHash* field, const jsonObject* node, const char* op ) {
 
 	if( ! is_good_operator( op ) ) {
 		osrfLogError( OSRF_LOG_MARK, "%s: Invalid operator [%s]", modulename, op );
-		return NULL;
+		return -1;
 	}
 
 	char* val = searchValueTransform( node );
 	if( !val )
-		return NULL;
+		return -1;
 
 	const char* right_percent = "";
 	const char* real_op       = op;
@@ -2895,7 +3820,6 @@ static char* searchFunctionPredicate( const char* class_alias, osrfHash* field,
 		right_percent = "|| '%'";
 	}
 
-	growing_buffer* sql_buf = buffer_init( 32 );
 	buffer_fadd(
 		sql_buf,
 		"\"%s\".%s %s %s%s",
@@ -2908,7 +3832,7 @@ static char* searchFunctionPredicate( const char* class_alias, osrfHash* field,
 
 	free( val );
 
-	return buffer_release( sql_buf );
+	return 0;
 }
 
 // class_alias is a class name or other table alias
@@ -2994,59 +3918,63 @@ static char* searchFieldTransform( const char* class_alias, osrfHash* field,
 	return buffer_release( sql_buf );
 }
 
-static char* searchFieldTransformPredicate( const ClassInfo* class_info, osrfHash* field,
-		const jsonObject* node, const char* op ) {
+static int searchFieldTransformPredicate( growing_buffer* sql_buf, const ClassInfo* class_info,
+		osrfHash* field, const jsonObject* node, const char* op ) {
 
 	if( ! is_good_operator( op ) ) {
 		osrfLogError( OSRF_LOG_MARK, "%s: Error: Invalid operator %s", modulename, op );
-		return NULL;
+		return -1;
+	}
+
+	const char* right_percent = "";
+	const char* real_op       = op;
+
+	if( !strcasecmp( op, "startwith") ) {
+		real_op = "like";
+		right_percent = "|| '%'";
 	}
 
 	char* field_transform = searchFieldTransform( class_info->alias, field, node );
 	if( ! field_transform )
-		return NULL;
-	char* value = NULL;
-	int extra_parens = 0;   // boolean
+		return -1;
 
 	const jsonObject* value_obj = jsonObjectGetKeyConst( node, "value" );
-	if( ! value_obj ) {
-		value = searchWHERE( node, class_info, AND_OP_JOIN, NULL );
-		if( !value ) {
-			osrfLogError( OSRF_LOG_MARK, "%s: Error building condition for field transform",
-				modulename );
-			free( field_transform );
-			return NULL;
+	if( ! value_obj || value_obj->type == JSON_HASH ) {
+		// Compare to a condition, built right into the output
+		buffer_fadd( sql_buf, "(%s %s (", field_transform, real_op );
+		free( field_transform );
+		if( appendWHERE( sql_buf, value_obj ? value_obj : node, class_info,
+				AND_OP_JOIN, NULL )) {
+			osrfLogError( OSRF_LOG_MARK, value_obj
+				? "%s: Error building predicate for field transform"
+				: "%s: Error building condition for field transform", modulename );
+			return -1;
 		}
-		extra_parens = 1;
-	} else if( value_obj->type == JSON_ARRAY ) {
-		value = searchValueTransform( value_obj );
-		if( !value ) {
-			osrfLogError( OSRF_LOG_MARK,
-				"%s: Error building value transform for field transform", modulename );
-			free( field_transform );
-			return NULL;
-		}
-	} else if( value_obj->type == JSON_HASH ) {
-		value = searchWHERE( value_obj, class_info, AND_OP_JOIN, NULL );
+		buffer_fadd( sql_buf, "%s ))", right_percent );
+		return 0;
+	}
+
+	char* value = NULL;
+	if( value_obj->type == JSON_ARRAY ) {
+		value = searchValueTransform( value_obj );
 		if( !value ) {
-			osrfLogError( OSRF_LOG_MARK, "%s: Error building predicate for field transform",
-				modulename );
+			osrfLogError( OSRF_LOG_MARK,
+				"%s: Error building value transform for field transform", modulename );
 			free( field_transform );
-			return NULL;
+			return -1;
 		}
-		extra_parens = 1;
 	} else if( value_obj->type == JSON_NUMBER ) {
 		value = jsonNumberToDBString( field, value_obj );
 	} else if( value_obj->type == JSON_NULL ) {
 		osrfLogError( OSRF_LOG_MARK,
 			"%s: Error building predicate for field transform: null value", modulename );
 		free( field_transform );
-		return NULL;
+		return -1;
 	} else if( value_obj->type == JSON_BOOL ) {
 		osrfLogError( OSRF_LOG_MARK,
 			"%s: Error building predicate for field transform: boolean value", modulename );
 		free( field_transform );
-		return NULL;
+		return -1;
 	} else {
 		if( !strcmp( get_primitive( field ), "number") ) {
 			value = jsonNumberToDBString( field, value_obj );
@@ -3057,54 +3985,25 @@ static char* searchFieldTransformPredicate( const ClassInfo* class_info, osrfHas
 					modulename, value );
 				free( value );
 				free( field_transform );
-				return NULL;
+				return -1;
 			}
 		}
 	}
 
-	const char* left_parens  = "";
-	const char* right_parens = "";
-
-	if( extra_parens ) {
-		left_parens  = "(";
-		right_parens = ")";
-	}
-
-	const char* right_percent = "";
-	const char* real_op       = op;
-
-	if( !strcasecmp( op, "startwith") ) {
-		real_op = "like";
-		right_percent = "|| '%'";
-	}
-
-	growing_buffer* sql_buf = buffer_init( 32 );
-
-	buffer_fadd(
-		sql_buf,
-		"%s%s %s %s %s%s %s%s",
-		left_parens,
-		field_transform,
-		real_op,
-		left_parens,
-		value,
-		right_percent,
-		right_parens,
-		right_parens
-	);
+	buffer_fadd( sql_buf, "%s %s %s%s ", field_transform, real_op, value, right_percent );
 
 	free( value );
 	free( field_transform );
 
-	return buffer_release( sql_buf );
+	return 0;
 }
 
-static char* searchSimplePredicate( const char* op, const char* class_alias,
-		osrfHash* field, const jsonObject* node ) {
+static int searchSimplePredicate( growing_buffer* sql_buf, const char* op,
+		const char* class_alias, osrfHash* field, const jsonObject* node ) {
 
 	if( ! is_good_operator( op ) ) {
 		osrfLogError( OSRF_LOG_MARK, "%s: Invalid operator [%s]", modulename, op );
-		return NULL;
+		return -1;
 	}
 
 	char* val = NULL;
@@ -3127,7 +4026,7 @@ static char* searchSimplePredicate( const char* op, const char* class_alias,
 				osrfLogError( OSRF_LOG_MARK, "%s: Error quoting key string [%s]",
 					modulename, val );
 				free( val );
-				return NULL;
+				return -1;
 			}
 		}
 	} else {
@@ -3147,16 +4046,14 @@ static char* searchSimplePredicate( const char* op, const char* class_alias,
 		right_percent = "|| '%'";
 	}
 
-	growing_buffer* sql_buf = buffer_init( 32 );
 	buffer_fadd( sql_buf, "\"%s\".%s %s %s%s", class_alias, osrfHashGet(field, "name"), real_op, val, right_percent );
-	char* pred = buffer_release( sql_buf );
 
 	free( val );
 
-	return pred;
+	return 0;
 }
 
-static char* searchBETWEENPredicate( const char* class_alias,
+static int searchBETWEENPredicate( growing_buffer* sql_buf, const char* class_alias,
 		osrfHash* field, const jsonObject* node ) {
 
 	const jsonObject* x_node = jsonObjectGetIndex( node, 0 );
@@ -3164,11 +4061,11 @@ static char* searchBETWEENPredicate( const char* class_alias,
 
 	if( NULL == y_node ) {
 		osrfLogError( OSRF_LOG_MARK, "%s: Not enough operands for BETWEEN operator", modulename );
-		return NULL;
+		return -1;
 	}
 	else if( NULL != jsonObjectGetIndex( node, 2 ) ) {
 		osrfLogError( OSRF_LOG_MARK, "%s: Too many operands for BETWEEN operator", modulename );
-		return NULL;
+		return -1;
 	}
 
 	char* x_string;
@@ -3187,25 +4084,37 @@ static char* searchBETWEENPredicate( const char* class_alias,
 					modulename, x_string, y_string );
 			free( x_string );
 			free( y_string );
-			return NULL;
+			return -1;
 		}
 	}
 
-	growing_buffer* sql_buf = buffer_init( 32 );
 	buffer_fadd( sql_buf, "\"%s\".%s BETWEEN %s AND %s",
 			class_alias, osrfHashGet( field, "name" ), x_string, y_string );
 	free( x_string );
 	free( y_string );
 
-	return buffer_release( sql_buf );
+	return 0;
 }
 
-static char* searchPredicate( const ClassInfo* class_info, osrfHash* field,
-							  jsonObject* node, osrfMethodContext* ctx ) {
+/**
+	@brief Build a predicate comparing a column to something.
+	@param sql_buf Pointer to the buffer to which we append the predicate.
+	@param class_info Pointer to the class to which the column belongs.
+	@param field Pointer to the IDL definition of the column.
+	@param node Pointer to what the column is compared to.
+	@param ctx Pointer to the method context.
+	@return 0 if successful, or -1 upon error.
+
+	Like the functions it calls, this one appends straight to the caller's buffer instead
+	of building a string of its own for the caller to copy.  Upon error, what it has
+	appended is garbage, and the caller should discard the whole buffer.
+*/
+static int appendPredicate( growing_buffer* sql_buf, const ClassInfo* class_info,
+		osrfHash* field, jsonObject* node, osrfMethodContext* ctx ) {
 
-	char* pred = NULL;
+	int rc = -1;
 	if( node->type == JSON_ARRAY ) { // equality IN search
-		pred = searchINPredicate( class_info->alias, field, node, NULL, ctx );
+		rc = searchINPredicate( sql_buf, class_info->alias, field, node, NULL, ctx );
 	} else if( node->type == JSON_HASH ) { // other search
 		jsonIterator* pred_itr = jsonNewIterator( node );
 		if( !jsonIteratorHasNext( pred_itr ) ) {
@@ -3219,37 +4128,58 @@ static char* searchPredicate( const ClassInfo* class_info, osrfHash* field,
 				osrfLogError( OSRF_LOG_MARK, "%s: Multiple predicates for field \"%s\"",
 						modulename, osrfHashGet(field, "name" ));
 			} else if( !(strcasecmp( pred_itr->key,"between" )) )
-				pred = searchBETWEENPredicate( class_info->alias, field, pred_node );
+				rc = searchBETWEENPredicate( sql_buf, class_info->alias, field, pred_node );
 			else if( !(strcasecmp( pred_itr->key,"in" ))
 					|| !(strcasecmp( pred_itr->key,"not in" )) )
-				pred = searchINPredicate(
-					class_info->alias, field, pred_node, pred_itr->key, ctx );
+				rc = searchINPredicate(
+					sql_buf, class_info->alias, field, pred_node, pred_itr->key, ctx );
 			else if( pred_node->type == JSON_ARRAY )
-				pred = searchFunctionPredicate(
-					class_info->alias, field, pred_node, pred_itr->key );
+				rc = searchFunctionPredicate(
+					sql_buf, class_info->alias, field, pred_node, pred_itr->key );
 			else if( pred_node->type == JSON_HASH )
-				pred = searchFieldTransformPredicate(
-					class_info, field, pred_node, pred_itr->key );
+				rc = searchFieldTransformPredicate(
+					sql_buf, class_info, field, pred_node, pred_itr->key );
 			else
-				pred = searchSimplePredicate( pred_itr->key, class_info->alias, field, pred_node );
+				rc = searchSimplePredicate(
+					sql_buf, pred_itr->key, class_info->alias, field, pred_node );
 		}
 		jsonIteratorFree( pred_itr );
 
 	} else if( node->type == JSON_NULL ) { // IS NULL search
-		growing_buffer* _p = buffer_init( 64 );
 		buffer_fadd(
-			_p,
+			sql_buf,
 			"\"%s\".%s IS NULL",
 			class_info->alias,
 			osrfHashGet( field, "name" )
 		);
-		pred = buffer_release( _p );
+		rc = 0;
 	} else { // equality search
-		pred = searchSimplePredicate( "=", class_info->alias, field, node );
+		rc = searchSimplePredicate( sql_buf, "=", class_info->alias, field, node );
 	}
 
-	return pred;
+	return rc;
+}
+
+/**
+	@brief Build a predicate comparing a column to something, as a string.
+	@param class_info Pointer to the class to which the column belongs.
+	@param field Pointer to the IDL definition of the column.
+	@param node Pointer to what the column is compared to.
+	@param ctx Pointer to the method context.
+	@return Pointer to the predicate, or NULL upon error.
 
+	This is a wrapper for appendPredicate(), for callers that need the predicate by itself.
+
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* searchPredicate( const ClassInfo* class_info, osrfHash* field,
+							  jsonObject* node, osrfMethodContext* ctx ) {
+	growing_buffer* sql_buf = buffer_init( 64 );
+	if( appendPredicate( sql_buf, class_info, field, node, ctx )) {
+		buffer_free( sql_buf );
+		return NULL;
+	} else
+		return buffer_release( sql_buf );
 }
 
 
@@ -3535,12 +4465,8 @@ static char* searchJOIN( const jsonObject* join_hash, const ClassInfo* left_info
 					buffer_add( join_buf, " AND " );
 				}
 	
-				char* jpred = searchWHERE( filter, right_info, AND_OP_JOIN, NULL );
-				if( jpred ) {
-					OSRF_BUFFER_ADD_CHAR( join_buf, ' ' );
-					OSRF_BUFFER_ADD( join_buf, jpred );
-					free( jpred );
-				} else {
+				OSRF_BUFFER_ADD_CHAR( join_buf, ' ' );
+				if( appendWHERE( join_buf, filter, right_info, AND_OP_JOIN, NULL )) {
 					osrfLogError(
 						OSRF_LOG_MARK,
 						"%s: JOIN failed.  Invalid conditional expression.",
@@ -3605,8 +4531,10 @@ static char* searchJOIN( const jsonObject* join_hash, const ClassInfo* left_info
 { +class : { -or|-and : [ { field : { op : value }, ... }, ...] ... }, ... }
 [ { +class : { -or|-and : [ { field : { op : value }, ... }, ...] ... }, ... }, ... ]
 
-Generate code to express a set of conditions, as for a WHERE clause.  Parameters:
+Generate code to express a set of conditions, as for a WHERE clause, and append it to
+a buffer.  Return 0 if successful, or -1 upon error.  Parameters:
 
+sql_buf is the buffer to which the conditions are appended.
 search_hash is the JSON expression of the conditions.
 meta is the class definition from the IDL, for the relevant table.
 opjoin_type indicates whether multiple conditions, if present, should be
@@ -3617,12 +4545,12 @@ osrfMethodContext is loaded with all sorts of stuff, but all we do with it here
 
 */
 
-static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_info,
-		int opjoin_type, osrfMethodContext* ctx ) {
+static int appendWHERE( growing_buffer* sql_buf, const jsonObject* search_hash,
+		const ClassInfo* class_info, int opjoin_type, osrfMethodContext* ctx ) {
 
-	osrfLogDebug(
+	OILS_LOG_DEBUG(
 		OSRF_LOG_MARK,
-		"%s: Entering searchWHERE; search_hash addr = %p, meta addr = %p, "
+		"%s: Entering appendWHERE; search_hash addr = %p, meta addr = %p, "
 		"opjoin_type = %d, ctx addr = %p",
 		modulename,
 		search_hash,
@@ -3631,8 +4559,6 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 		ctx
 	);
 
-	growing_buffer* sql_buf = buffer_init( 128 );
-
 	jsonObject* node = NULL;
 
 	int first = 1;
@@ -3643,8 +4569,7 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 				"%s: Invalid predicate structure: empty JSON array",
 				modulename
 			);
-			buffer_free( sql_buf );
-			return NULL;
+			return -1;
 		}
 
 		unsigned long i = 0;
@@ -3658,18 +4583,14 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 					buffer_add( sql_buf, " AND " );
 			}
 
-			char* subpred = searchWHERE( node, class_info, opjoin_type, ctx );
-			if( ! subpred ) {
-				buffer_free( sql_buf );
-				return NULL;
-			}
-
-			buffer_fadd( sql_buf, "( %s )", subpred );
-			free( subpred );
+			OSRF_BUFFER_ADD( sql_buf, "( " );
+			if( appendWHERE( sql_buf, node, class_info, opjoin_type, ctx ))
+				return -1;
+			OSRF_BUFFER_ADD( sql_buf, " )" );
 		}
 
 	} else if( search_hash->type == JSON_HASH ) {
-		osrfLogDebug( OSRF_LOG_MARK,
+		OILS_LOG_DEBUG( OSRF_LOG_MARK,
 			"%s: In WHERE clause, condition type is JSON_HASH", modulename );
 		jsonIterator* search_itr = jsonNewIterator( search_hash );
 		if( !jsonIteratorHasNext( search_itr ) ) {
@@ -3679,8 +4600,7 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 				modulename
 			);
 			jsonIteratorFree( search_itr );
-			buffer_free( sql_buf );
-			return NULL;
+			return -1;
 		}
 
 		while( (node = jsonIteratorNext( search_itr )) ) {
@@ -3707,8 +4627,7 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 							search_itr->key + 1
 					);
 					jsonIteratorFree( search_itr );
-					buffer_free( sql_buf );
-					return NULL;
+					return -1;
 				}
 
 				if( node->type == JSON_STRING ) {
@@ -3724,60 +4643,46 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 							alias_info->alias
 						);
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
 
 					buffer_fadd( sql_buf, " \"%s\".%s ", alias_info->alias, fieldname );
 				} else {
 					// It's something more complicated
-					char* subpred = searchWHERE( node, alias_info, AND_OP_JOIN, ctx );
-					if( ! subpred ) {
+					OSRF_BUFFER_ADD( sql_buf, "( " );
+					if( appendWHERE( sql_buf, node, alias_info, AND_OP_JOIN, ctx )) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
-
-					buffer_fadd( sql_buf, "( %s )", subpred );
-					free( subpred );
+					OSRF_BUFFER_ADD( sql_buf, " )" );
 				}
 			} else if( '-' == search_itr->key[ 0 ] ) {
 				if( !strcasecmp( "-or", search_itr->key )) {
-					char* subpred = searchWHERE( node, class_info, OR_OP_JOIN, ctx );
-					if( ! subpred ) {
+					OSRF_BUFFER_ADD( sql_buf, "( " );
+					if( appendWHERE( sql_buf, node, class_info, OR_OP_JOIN, ctx )) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
-
-					buffer_fadd( sql_buf, "( %s )", subpred );
-					free( subpred );
+					OSRF_BUFFER_ADD( sql_buf, " )" );
 				} else if( !strcasecmp( "-and", search_itr->key )) {
-					char* subpred = searchWHERE( node, class_info, AND_OP_JOIN, ctx );
-					if( ! subpred ) {
+					OSRF_BUFFER_ADD( sql_buf, "( " );
+					if( appendWHERE( sql_buf, node, class_info, AND_OP_JOIN, ctx )) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
-
-					buffer_fadd( sql_buf, "( %s )", subpred );
-					free( subpred );
+					OSRF_BUFFER_ADD( sql_buf, " )" );
 				} else if( !strcasecmp("-not",search_itr->key) ) {
-					char* subpred = searchWHERE( node, class_info, AND_OP_JOIN, ctx );
-					if( ! subpred ) {
+					OSRF_BUFFER_ADD( sql_buf, " NOT ( " );
+					if( appendWHERE( sql_buf, node, class_info, AND_OP_JOIN, ctx )) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
-
-					buffer_fadd( sql_buf, " NOT ( %s )", subpred );
-					free( subpred );
+					OSRF_BUFFER_ADD( sql_buf, " )" );
 				} else if( !strcasecmp( "-exists", search_itr->key )) {
 					char* subpred = buildQuery( ctx, node, SUBSELECT );
 					if( ! subpred ) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
 
 					buffer_fadd( sql_buf, "EXISTS ( %s )", subpred );
@@ -3786,8 +4691,7 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 					char* subpred = buildQuery( ctx, node, SUBSELECT );
 					if( ! subpred ) {
 						jsonIteratorFree( search_itr );
-						buffer_free( sql_buf );
-						return NULL;
+						return -1;
 					}
 
 					buffer_fadd( sql_buf, "NOT EXISTS ( %s )", subpred );
@@ -3800,8 +4704,7 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 							search_itr->key
 					);
 					jsonIteratorFree( search_itr );
-					buffer_free( sql_buf );
-					return NULL;
+					return -1;
 				}
 
 			} else {
@@ -3821,19 +4724,13 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 						class ? class : "?"
 					);
 					jsonIteratorFree( search_itr );
-					buffer_free( sql_buf );
-					return NULL;
+					return -1;
 				}
 
-				char* subpred = searchPredicate( class_info, field, node, ctx );
-				if( ! subpred ) {
-					buffer_free( sql_buf );
+				if( appendPredicate( sql_buf, class_info, field, node, ctx )) {
 					jsonIteratorFree( search_itr );
-					return NULL;
+					return -1;
 				}
-
-				buffer_add( sql_buf, subpred );
-				free( subpred );
 			}
 		}
 		jsonIteratorFree( search_itr );
@@ -3847,12 +4744,35 @@ static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_
 			modulename,
 			predicate_string
 		);
-		buffer_free( sql_buf );
 		free( predicate_string );
-		return NULL;
+		return -1;
 	}
 
-	return buffer_release( sql_buf );
+	return 0;
+}
+
+/**
+	@brief Build a set of conditions, as for a WHERE clause, as a string.
+	@param search_hash Pointer to the JSON expression of the conditions.
+	@param class_info Pointer to the class to which unqualified columns belong.
+	@param opjoin_type AND_OP_JOIN or OR_OP_JOIN, to say how to combine the conditions.
+	@param ctx Pointer to the method context.
+	@return Pointer to the conditions, or NULL upon error.
+
+	This is a wrapper for appendWHERE(), for callers that need the conditions by
+	themselves.  Where possible, call appendWHERE() instead, so as to build the conditions
+	right where they belong.
+
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* searchWHERE( const jsonObject* search_hash, const ClassInfo* class_info,
+		int opjoin_type, osrfMethodContext* ctx ) {
+	growing_buffer* sql_buf = buffer_init( 128 );
+	if( appendWHERE( sql_buf, search_hash, class_info, opjoin_type, ctx )) {
+		buffer_free( sql_buf );
+		return NULL;
+	} else
+		return buffer_release( sql_buf );
 }
 
 /* Build a JSON_ARRAY of field names for a given table alias
@@ -4177,6 +5097,7 @@ char* buildQuery( osrfMethodContext* ctx, jsonObject* query, int flags ) {
 			jsonObjectGetKeyConst( query, "order_by" ),
 			jsonObjectGetKeyConst( query, "limit" ),
 			jsonObjectGetKeyConst( query, "offset" ),
+			jsonObjectGetKeyConst( query, "after" ),
 			flags
 		);
 		pop_query_frame();
@@ -4194,6 +5115,7 @@ char* SELECT (
 		/* ORDER BY */ const jsonObject* order_hash,
 		/* LIMIT    */ const jsonObject* limit,
 		/* OFFSET   */ const jsonObject* offset,
+		/* AFTER    */ const jsonObject* after,
 		/* flags    */ int flags
 ) {
 	const char* locale = osrf_message_get_last_locale();
@@ -4210,7 +5132,7 @@ char* SELECT (
 	int gfirst = 1;
 	//int hfirst = 1;
 
-	osrfLogDebug(OSRF_LOG_MARK, "cstore SELECT locale: %s", locale ? locale : "(none)" );
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "cstore SELECT locale: %s", locale ? locale : "(none)" );
 
 	// punt if there's no FROM clause
 	if( !join_hash || ( join_hash->type == JSON_HASH && !join_hash->size )) {
@@ -4855,10 +5777,43 @@ char* SELECT (
 		return NULL;
 	}
 
+	// For keyset pagination, add the sort keys to the SELECT list
+	char* after_cols = NULL;
+	char* after_pred = NULL;
+	char* after_order = NULL;
+	if( after ) {
+		if( from_function || ( flags & SUBSELECT )) {
+			osrfLogError( OSRF_LOG_MARK,
+				"%s: \"after\" clause is not allowed in a subquery or function query",
+				modulename );
+			if( ctx )
+				osrfAppSessionStatus(
+					ctx->session,
+					OSRF_STATUS_INTERNALSERVERERROR,
+					"osrfMethodException",
+					ctx->request,
+					"Misplaced \"after\" clause in JSON query"
+				);
+		}
+
+		if( from_function || ( flags & SUBSELECT )
+				|| buildKeyset( ctx, order_hash, after, &after_cols, &after_pred, &after_order )) {
+			free( col_list );
+			free( table );
+			buffer_free( group_buf );
+			if( defaultselhash )
+				jsonObjectFree( defaultselhash );
+			free( join_clause );
+			return NULL;
+		}
+	}
+
 	// Put it all together
 	growing_buffer* sql_buf = buffer_init( 128 );
-	buffer_fadd(sql_buf, "SELECT %s FROM %s AS \"%s\" ", col_list, table, core_class );
+	buffer_fadd(sql_buf, "SELECT %s%s FROM %s AS \"%s\" ", col_list,
+		after_cols ? after_cols : "", table, core_class );
 	free( col_list );
+	free( after_cols );
 	free( table );
 
 	// Append the join clause, if any
@@ -4872,13 +5827,18 @@ char* SELECT (
 
 	if( !from_function ) {
 
+		// The keyset predicate goes in the WHERE clause, unless the sort keys may be
+		// aggregates, in which case it goes in the HAVING clause.
+		char* where_after = aggregate_found ? NULL : after_pred;
+
 		// Build a WHERE clause, if there is one
 		if( search_hash ) {
 			buffer_add( sql_buf, " WHERE " );
 
 			// and it's on the WHERE clause
-			char* pred = searchWHERE( search_hash, &curr_query->core, AND_OP_JOIN, ctx );
-			if( ! pred ) {
+			if( where_after )
+				OSRF_BUFFER_ADD( sql_buf, "( " );
+			if( appendWHERE( sql_buf, search_hash, &curr_query->core, AND_OP_JOIN, ctx )) {
 				if( ctx ) {
 					osrfAppSessionStatus(
 						ctx->session,
@@ -4892,12 +5852,15 @@ char* SELECT (
 				buffer_free( sql_buf );
 				if( defaultselhash )
 					jsonObjectFree( defaultselhash );
+				free( after_pred );
+				free( after_order );
 				return NULL;
 			}
 
-			buffer_add( sql_buf, pred );
-			free( pred );
-		}
+			if( where_after )
+				buffer_fadd( sql_buf, " ) AND %s", where_after );
+		} else if( where_after )
+			buffer_fadd( sql_buf, " WHERE %s", where_after );
 
 		// Build a HAVING clause, if there is one
 		if( having_hash ) {
@@ -4919,12 +5882,29 @@ char* SELECT (
 				buffer_free( sql_buf );
 				if( defaultselhash )
 					jsonObjectFree( defaultselhash );
+				free( after_pred );
+				free( after_order );
 				return NULL;
 			}
 		}
 
+		if( after_pred && !where_after ) {
+			if( having_buf && *having_buf ) {
+				growing_buffer* having_after = buffer_init( 128 );
+				buffer_fadd( having_after, "( %s ) AND %s", having_buf, after_pred );
+				free( having_buf );
+				having_buf = buffer_release( having_after );
+			} else {
+				free( having_buf );
+				having_buf = strdup( after_pred );
+			}
+		}
+		free( after_pred );
+
 		// Build an ORDER BY clause, if there is one
-		if( NULL == order_hash )
+		if( after_order )
+			order_by_list = after_order;    // keyset pagination has already built it
+		else if( NULL == order_hash )
 			;  // No ORDER BY? do nothing
 		else if( JSON_ARRAY == order_hash->type ) {
 			order_by_list = buildOrderByFromArray( ctx, order_hash );
@@ -5362,7 +6342,7 @@ static char* buildOrderByFromArray( osrfMethodContext* ctx, const jsonObject* or
 
 		const ClassInfo* order_class_info = search_alias( class_alias );
 		if( ! order_class_info ) {
-			osrfLogInternal( OSRF_LOG_MARK, "%s: ORDER BY clause references class \"%s\" "
+			OILS_LOG_INTERNAL( OSRF_LOG_MARK, "%s: ORDER BY clause references class \"%s\" "
 				"not in FROM clause, skipping it", modulename, class_alias );
 			continue;
 		}
@@ -5458,88 +6438,499 @@ static char* buildOrderByFromArray( osrfMethodContext* ctx, const jsonObject* or
 }
 
 /**
-	@brief Build a SELECT statement.
-	@param search_hash Pointer to a JSON_HASH or JSON_ARRAY encoding the WHERE clause.
-	@param rest_of_query Pointer to a JSON_HASH containing any other SQL clauses.
-	@param meta Pointer to the class metadata for the core class.
+	@brief Build the pieces of a SELECT statement needed for keyset pagination.
 	@param ctx Pointer to the method context.
-	@return Pointer to a character string containing the WHERE clause; or NULL upon error.
-
-	Within the rest_of_query hash, the meaningful keys are "join", "select", "no_i18n",
-	"order_by", "limit", and "offset".
-
-	The SELECT statements built here are distinct from those built for the json_query method.
+	@param order_hash Pointer to the ORDER BY clause, in either of its formats.
+	@param after Pointer to the "after" clause: a JSON_ARRAY of sort key values.
+	@param columns Pointer through which to return extra columns for the SELECT list.
+	@param predicate Pointer through which to return the predicate selecting the rows
+	after the ones whose key is in @a after, or NULL if @a after is empty.
+	@param order_by Pointer through which to return the ORDER BY list.
+	@return 0 if successful, or -1 upon error.
+
+	Instead of skipping some number of rows with OFFSET, the client sends the sort key of
+	the last row it received, and we look for rows whose keys sort after it.  PostgreSQL
+	can then go straight to the right place in an index, so that the last page costs no
+	more than the first.  An empty array asks for the first page.
+
+	We return each sort key as an extra column named "oils_after_0", "oils_after_1", etc.,
+	in text form so that it survives the round trip exactly.  From the last row, the
+	caller builds the "after" clause for the next page (see makeAfterToken()).  We also
+	rebuild the ORDER BY list from the same expressions, so that it sorts the rows the
+	same way that the predicate compares them.
+
+	When all the keys sort in the same direction, the predicate is a single row
+	comparison, which PostgreSQL can match to a multicolumn index.  Otherwise we have to
+	spell it out as a series of ORs.
+
+	Keys whose values may be null don't work, since null never compares greater or less
+	than anything.  For a well-defined order, the last key should be unique, such as the
+	primary key.
+
+	The calling code is responsible for freeing the returned strings by calling free().
 */
-static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_query,
-	osrfHash* meta, osrfMethodContext* ctx ) {
-
-	const char* locale = osrf_message_get_last_locale();
+static int buildKeyset( osrfMethodContext* ctx, const jsonObject* order_hash,
+		const jsonObject* after, char** columns, char** predicate, char** order_by ) {
 
-	osrfHash* fields = osrfHashGet( meta, "fields" );
-	const char* core_class = osrfHashGet( meta, "classname" );
+	*columns = *predicate = *order_by = NULL;
 
-	const jsonObject* join_hash = jsonObjectGetKeyConst( rest_of_query, "join" );
+	osrfStringArray* keys = osrfNewStringArray( 4 );
+	growing_buffer* dirs = buffer_init( 8 );
+	const char* problem = NULL;
 
-	jsonObject* selhash = NULL;
-	jsonObject* defaultselhash = NULL;
+	if( getSortKeys( ctx, order_hash, keys, dirs )) {
+		osrfStringArrayFree( keys );
+		buffer_free( dirs );
+		return -1;
+	} else if( !keys->size )
+		problem = "no ORDER BY clause to paginate";
+	else if( after->type != JSON_ARRAY )
+		problem = "\"after\" clause is not an array";
+	else if( after->size && after->size != keys->size )
+		problem = "\"after\" clause doesn't match the ORDER BY clause";
+
+	// Quote the values of the sort keys
+	osrfStringArray* values = osrfNewStringArray( 4 );
+	unsigned long i;
+	for( i = 0; !problem && i < after->size; ++i ) {
+		const jsonObject* item = jsonObjectGetIndex( after, i );
+		if( item->type != JSON_STRING && item->type != JSON_NUMBER ) {
+			problem = "\"after\" clause contains something other than a string or number";
+			break;
+		}
 
-	growing_buffer* sql_buf = buffer_init( 128 );
-	growing_buffer* select_buf = buffer_init( 128 );
+		char* value = strdup( jsonObjectGetString( item ));
+		if( !dbi_conn_quote_string( dbhandle, &value )) {
+			problem = "unable to quote value in \"after\" clause";
+			free( value );
+			break;
+		}
 
-	if( !(selhash = jsonObjectGetKey( rest_of_query, "select" )) ) {
-		defaultselhash = jsonNewObjectType( JSON_HASH );
-		selhash = defaultselhash;
+		osrfStringArrayAdd( values, value );
+		free( value );
 	}
 
-	// If there's no SELECT list for the core class, build one
-	if( !jsonObjectGetKeyConst( selhash, core_class ) ) {
-		jsonObject* field_list = jsonNewObjectType( JSON_ARRAY );
+	if( problem ) {
+		osrfLogError( OSRF_LOG_MARK, "%s: Keyset pagination: %s", modulename, problem );
+		if( ctx )
+			osrfAppSessionStatus(
+				ctx->session,
+				OSRF_STATUS_INTERNALSERVERERROR,
+				"osrfMethodException",
+				ctx->request,
+				"Invalid \"after\" clause -- see error log for more details"
+			);
+		osrfStringArrayFree( values );
+		osrfStringArrayFree( keys );
+		buffer_free( dirs );
+		return -1;
+	}
 
-		// Add every non-virtual field to the field list
-		osrfHash* field_def = NULL;
-		osrfHashIterator* field_itr = osrfNewHashIterator( fields );
-		while( ( field_def = osrfHashIteratorNext( field_itr ) ) ) {
-			if( ! str_is_true( osrfHashGet( field_def, "virtual" ) ) ) {
-				const char* field = osrfHashIteratorKey( field_itr );
-				jsonObjectPush( field_list, jsonNewObject( field ) );
+	const char* dir = OSRF_BUFFER_C_STR( dirs );
+	int mixed = strchr( dir, 'A' ) && strchr( dir, 'D' );
+	growing_buffer* col_buf = buffer_init( 64 );
+	growing_buffer* order_buf = buffer_init( 64 );
+	for( i = 0; i < keys->size; ++i ) {
+		const char* key = osrfStringArrayGetString( keys, i );
+		buffer_fadd( col_buf, ", (%s)::TEXT AS \"oils_after_%lu\"", key, i );
+		buffer_fadd( order_buf, "%s%s %s", i ? ", " : "", key,
+			'D' == dir[ i ] ? "DESC" : "ASC" );
+	}
+	*columns = buffer_release( col_buf );
+	*order_by = buffer_release( order_buf );
+
+	if( values->size ) {
+		growing_buffer* pred_buf = buffer_init( 128 );
+		if( 1 == keys->size )
+			buffer_fadd( pred_buf, "%s %c %s", osrfStringArrayGetString( keys, 0 ),
+				'D' == dir[ 0 ] ? '<' : '>', osrfStringArrayGetString( values, 0 ));
+		else if( !mixed ) {
+			// ( k1, k2, ... ) > ( v1, v2, ... )
+			OSRF_BUFFER_ADD( pred_buf, "( " );
+			for( i = 0; i < keys->size; ++i )
+				buffer_fadd( pred_buf, "%s%s", i ? ", " : "",
+					osrfStringArrayGetString( keys, i ));
+			buffer_fadd( pred_buf, " ) %c ( ", 'D' == dir[ 0 ] ? '<' : '>' );
+			for( i = 0; i < keys->size; ++i )
+				buffer_fadd( pred_buf, "%s%s", i ? ", " : "",
+					osrfStringArrayGetString( values, i ));
+			OSRF_BUFFER_ADD( pred_buf, " )" );
+		} else {
+			// ( k1 > v1 OR ( k1 = v1 AND ( k2 < v2 OR ( k2 = v2 AND ... ))))
+			for( i = 0; i < keys->size; ++i ) {
+				const char* key = osrfStringArrayGetString( keys, i );
+				const char* value = osrfStringArrayGetString( values, i );
+				buffer_fadd( pred_buf, "( %s %c %s", key, 'D' == dir[ i ] ? '<' : '>', value );
+				if( i + 1 < keys->size )
+					buffer_fadd( pred_buf, " OR ( %s = %s AND ", key, value );
 			}
+			for( i = 0; i < keys->size; ++i )
+				OSRF_BUFFER_ADD( pred_buf, i + 1 < keys->size ? " ))" : " )" );
 		}
-		osrfHashIteratorFree( field_itr );
-		jsonObjectSetKey( selhash, core_class, field_list );
+		*predicate = buffer_release( pred_buf );
 	}
 
-	// Build a list of columns for the SELECT clause
-	int first = 1;
-	const jsonObject* snode = NULL;
-	jsonIterator* class_itr = jsonNewIterator( selhash );
-	while( (snode = jsonIteratorNext( class_itr )) ) {        // For each class
+	osrfStringArrayFree( values );
+	osrfStringArrayFree( keys );
+	buffer_free( dirs );
+	return 0;
+}
 
-		// If the class isn't in the IDL, ignore it
-		const char* cname = class_itr->key;
-		osrfHash* idlClass = osrfHashGet( oilsIDL(), cname );
-		if( !idlClass )
-			continue;
+/**
+	@brief Collect the sort keys of an ORDER BY clause.
+	@param ctx Pointer to the method context.
+	@param order_hash Pointer to the ORDER BY clause, in either of its formats.
+	@param keys Pointer to an osrfStringArray to which we append the SQL expression for
+	each sort key.
+	@param dirs Pointer to a growing_buffer to which we append a character for each sort
+	key: 'D' if it is descending, or 'A' if it is ascending.
+	@return 0 if successful, or -1 upon error.
+
+	This function accepts the same ORDER BY clauses as SELECT() and buildSELECT(), except
+	for a class whose sort fields are given as a string of raw SQL.  Unlike them, it
+	qualifies every column with its class alias, and it treats anything they would ignore
+	as an error.
+*/
+static int getSortKeys( osrfMethodContext* ctx, const jsonObject* order_hash,
+		osrfStringArray* keys, growing_buffer* dirs ) {
+	if( !order_hash )
+		return 0;
 
-		// If the class isn't the core class, and isn't in the JOIN clause, ignore it
-		if( strcmp( core_class, class_itr->key )) {
-			if( !join_hash )
-				continue;
+	const char* problem = NULL;
+	const char* bad_name = "";
 
-			jsonObject* found = jsonObjectFindPath( join_hash, "//%s", class_itr->key );
-			if( !found->size ) {
-				jsonObjectFree( found );
-				continue;
+	if( JSON_ARRAY == order_hash->type ) {
+		unsigned long order_idx = 0;
+		jsonObject* order_spec;
+		while( !problem && (order_spec = jsonObjectGetIndex( order_hash, order_idx++ ))) {
+			if( JSON_HASH != order_spec->type ) {
+				problem = "Malformed field specification";
+				break;
 			}
 
-			jsonObjectFree( found );
-		}
-
-		const jsonObject* node = NULL;
-		jsonIterator* select_itr = jsonNewIterator( snode );
-		while( (node = jsonIteratorNext( select_itr )) ) {
-			const char* item_str = jsonObjectGetString( node );
-			osrfHash* field = osrfHashGet( osrfHashGet( idlClass, "fields" ), item_str );
-			char* fname = osrfHashGet( field, "name" );
+			const char* class_alias =
+				jsonObjectGetString( jsonObjectGetKeyConst( order_spec, "class" ));
+			const char* field =
+				jsonObjectGetString( jsonObjectGetKeyConst( order_spec, "field" ));
+			const ClassInfo* order_class_info = class_alias ? search_alias( class_alias ) : NULL;
+			osrfHash* field_def = ( order_class_info && field ) ?
+				osrfHashGet( order_class_info->fields, field ) : NULL;
+			if( !field_def || str_is_true( osrfHashGet( field_def, "virtual" ))) {
+				problem = "Invalid class or field";
+				bad_name = field ? field : "";
+				break;
+			}
+
+			char* key = NULL;
+			jsonObject* compare_to = jsonObjectGetKey( order_spec, "compare" );
+			if( jsonObjectGetKeyConst( order_spec, "transform" ))
+				key = searchFieldTransform( class_alias, field_def, order_spec );
+			else if( compare_to ) {
+				char* compare_str = searchPredicate( order_class_info, field_def,
+					compare_to, ctx );
+				if( compare_str ) {
+					growing_buffer* key_buf = buffer_init( 64 );
+					buffer_fadd( key_buf, "(%s)", compare_str );
+					free( compare_str );
+					key = buffer_release( key_buf );
+				}
+			} else {
+				growing_buffer* key_buf = buffer_init( 32 );
+				buffer_fadd( key_buf, "\"%s\".%s", class_alias, field );
+				key = buffer_release( key_buf );
+			}
+
+			if( !key ) {
+				problem = "Unable to build sort key";
+				bad_name = field;
+				break;
+			}
+
+			osrfStringArrayAdd( keys, key );
+			free( key );
+
+			const char* direction =
+				jsonObjectGetString( jsonObjectGetKeyConst( order_spec, "direction" ));
+			OSRF_BUFFER_ADD_CHAR( dirs,
+				( direction && ( 'd' == direction[ 0 ] || 'D' == direction[ 0 ] )) ? 'D' : 'A' );
+		}
+
+	} else if( JSON_HASH == order_hash->type ) {
+		jsonObject* snode;
+		jsonIterator* class_itr = jsonNewIterator( order_hash );
+		while( !problem && (snode = jsonIteratorNext( class_itr )) ) {
+
+			const char* class_alias = class_itr->key;
+			const ClassInfo* order_class_info = search_alias( class_alias );
+			if( !order_class_info ) {
+				problem = "Invalid class";
+				bad_name = class_alias;
+				break;
+			}
+
+			if( JSON_HASH == snode->type ) {
+				jsonObject* onode;
+				jsonIterator* order_itr = jsonNewIterator( snode );
+				while( (onode = jsonIteratorNext( order_itr )) ) {
+					const char* field = order_itr->key;
+					osrfHash* field_def = osrfHashGet( order_class_info->fields, field );
+					if( !field_def || str_is_true( osrfHashGet( field_def, "virtual" ))) {
+						problem = "Invalid field";
+						bad_name = field;
+						break;
+					}
+
+					char* key = NULL;
+					const char* direction = NULL;
+					if( JSON_HASH == onode->type ) {
+						if( jsonObjectGetKeyConst( onode, "transform" ))
+							key = searchFieldTransform( class_alias, field_def, onode );
+						direction = jsonObjectGetString(
+							jsonObjectGetKeyConst( onode, "direction" ));
+					} else if( JSON_STRING == onode->type )
+						direction = jsonObjectGetString( onode );
+					else {
+						problem = "Malformed sort field";
+						bad_name = field;
+						break;
+					}
+
+					if( !key ) {
+						growing_buffer* key_buf = buffer_init( 32 );
+						buffer_fadd( key_buf, "\"%s\".%s", class_alias, field );
+						key = buffer_release( key_buf );
+					}
+
+					osrfStringArrayAdd( keys, key );
+					free( key );
+					OSRF_BUFFER_ADD_CHAR( dirs,
+						( direction && ( 'd' == direction[ 0 ] || 'D' == direction[ 0 ] ))
+						? 'D' : 'A' );
+				}
+				jsonIteratorFree( order_itr );
+
+			} else if( JSON_ARRAY == snode->type ) {
+				unsigned long order_idx = 0;
+				jsonObject* onode;
+				while(( onode = jsonObjectGetIndex( snode, order_idx++ ) )) {
+					const char* field = jsonObjectGetString( onode );
+					osrfHash* field_def = field ?
+						osrfHashGet( order_class_info->fields, field ) : NULL;
+					if( !field_def || str_is_true( osrfHashGet( field_def, "virtual" ))) {
+						problem = "Invalid field";
+						bad_name = field ? field : "";
+						break;
+					}
+
+					growing_buffer* key_buf = buffer_init( 32 );
+					buffer_fadd( key_buf, "\"%s\".%s", class_alias, field );
+					char* key = buffer_release( key_buf );
+					osrfStringArrayAdd( keys, key );
+					free( key );
+					OSRF_BUFFER_ADD_CHAR( dirs, 'A' );
+				}
+
+			} else {
+				problem = "Unsupported sort specification";
+				bad_name = class_alias;
+			}
+		}
+		jsonIteratorFree( class_itr );
+
+	} else
+		problem = "Malformed ORDER BY clause";
+
+	if( problem ) {
+		osrfLogError( OSRF_LOG_MARK, "%s: %s \"%s\" in ORDER BY clause for keyset pagination",
+			modulename, problem, bad_name );
+		if( ctx )
+			osrfAppSessionStatus(
+				ctx->session,
+				OSRF_STATUS_INTERNALSERVERERROR,
+				"osrfMethodException",
+				ctx->request,
+				"Invalid ORDER BY clause for keyset pagination -- "
+					"see error log for more details"
+			);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+	@brief Build a continuation token for keyset pagination.
+	@param result The result set of a query built with an "after" clause.
+	@param limit Pointer to the query's LIMIT, if any.
+	@return Pointer to a JSON_HASH with a single entry, "after".
+
+	If the query returned a full page, then "after" holds the sort keys of the last row,
+	ready to be passed back as the "after" clause of the query for the next page.
+	Otherwise there is no next page, and "after" is null.
+
+	The calling code is responsible for freeing the returned jsonObject by calling
+	jsonObjectFree().
+*/
+static jsonObject* makeAfterToken( dbi_result result, const jsonObject* limit ) {
+	jsonObject* after = NULL;
+
+	const char* limit_str = jsonObjectGetString( limit );
+	unsigned long long row_count = dbi_result_get_numrows( result );
+	if( limit_str && row_count && row_count >= (unsigned long long) atoi( limit_str )
+			&& dbi_result_last_row( result )) {
+		jsonObject* row = oilsMakeJSONFromResult( result );
+		after = takeAfterColumns( row );
+		jsonObjectFree( row );
+	}
+
+	jsonObject* token = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( token, "after", after ? after : jsonNewObject( NULL ));
+	return token;
+}
+
+/**
+	@brief Remove the sort key columns for keyset pagination from a row.
+	@param row Pointer to a row as returned by oilsMakeJSONFromResult().
+	@return Pointer to a JSON_ARRAY of the sort key values, possibly empty.
+
+	See buildKeyset() for how these columns get there.
+
+	The calling code is responsible for freeing the returned jsonObject by calling
+	jsonObjectFree().
+*/
+static jsonObject* takeAfterColumns( jsonObject* row ) {
+	jsonObject* after = jsonNewObjectType( JSON_ARRAY );
+	char name[ 32 ];
+	int i;
+	for( i = 0; ; ++i ) {
+		snprintf( name, sizeof( name ), "oils_after_%d", i );
+		const jsonObject* value = jsonObjectGetKeyConst( row, name );
+		if( !value )
+			break;
+		jsonObjectPush( after, jsonObjectClone( value ));
+		jsonObjectRemoveKey( row, name );
+	}
+	return after;
+}
+
+/**
+	@brief Build a SELECT statement.
+	@param search_hash Pointer to a JSON_HASH or JSON_ARRAY encoding the WHERE clause.
+	@param rest_of_query Pointer to a JSON_HASH containing any other SQL clauses.
+	@param meta Pointer to the class metadata for the core class.
+	@param ctx Pointer to the method context.
+	@param extra_cols Additional columns for the SELECT list, each preceded by a comma;
+		or NULL if there aren't any (see buildFleshColumns()).
+	@return Pointer to a character string containing the WHERE clause; or NULL upon error.
+
+	Within the rest_of_query hash, the meaningful keys are "join", "select", "no_i18n",
+	"order_by", "limit", "offset", "after" (see buildKeyset()), and "limit_per".
+
+	"limit_per" is a hash such as {"field":"usr","limit":5}.  It limits the number of rows
+	for each value of the named field of the core class, rather than for the query as a
+	whole, so that fleshAllRows() can fetch the first few kids of many rows at once.  The
+	rows are numbered within each value, in the order given by "order_by", and we keep the
+	first few of each.  It can't be combined with "after".
+
+	The SELECT statements built here are distinct from those built for the json_query method.
+*/
+static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_query,
+	osrfHash* meta, osrfMethodContext* ctx, const char* extra_cols ) {
+
+	const char* locale = osrf_message_get_last_locale();
+
+	osrfHash* fields = osrfHashGet( meta, "fields" );
+	const char* core_class = osrfHashGet( meta, "classname" );
+
+	const jsonObject* join_hash = jsonObjectGetKeyConst( rest_of_query, "join" );
+
+	// Validate any limit per key value
+	const char* partition_field = NULL;
+	int partition_limit = 0;
+	const jsonObject* limit_per = jsonObjectGetKeyConst( rest_of_query, "limit_per" );
+	if( limit_per ) {
+		partition_field = jsonObjectGetString( jsonObjectGetKeyConst( limit_per, "field" ));
+		const char* limit_str =
+			jsonObjectGetString( jsonObjectGetKeyConst( limit_per, "limit" ));
+		osrfHash* partition_def = partition_field ?
+			osrfHashGet( fields, partition_field ) : NULL;
+		if( !partition_def || str_is_true( osrfHashGet( partition_def, "virtual" ))
+				|| !limit_str || jsonObjectGetKeyConst( rest_of_query, "after" )) {
+			osrfLogError( OSRF_LOG_MARK, "%s: Invalid \"limit_per\" clause for class %s",
+				modulename, core_class );
+			if( ctx )
+				osrfAppSessionStatus(
+					ctx->session,
+					OSRF_STATUS_INTERNALSERVERERROR,
+					"osrfMethodException",
+					ctx->request,
+					"Invalid limit_per clause -- see error log for more details"
+				);
+			return NULL;
+		}
+		partition_limit = atoi( limit_str );
+	}
+
+	jsonObject* selhash = NULL;
+	jsonObject* defaultselhash = NULL;
+
+	growing_buffer* sql_buf = buffer_init( 128 );
+	growing_buffer* select_buf = buffer_init( 128 );
+
+	if( !(selhash = jsonObjectGetKey( rest_of_query, "select" )) ) {
+		defaultselhash = jsonNewObjectType( JSON_HASH );
+		selhash = defaultselhash;
+	}
+
+	// If there's no SELECT list for the core class, build one
+	if( !jsonObjectGetKeyConst( selhash, core_class ) ) {
+		jsonObject* field_list = jsonNewObjectType( JSON_ARRAY );
+
+		// Add every non-virtual field to the field list
+		osrfHash* field_def = NULL;
+		osrfHashIterator* field_itr = osrfNewHashIterator( fields );
+		while( ( field_def = osrfHashIteratorNext( field_itr ) ) ) {
+			if( ! str_is_true( osrfHashGet( field_def, "virtual" ) ) ) {
+				const char* field = osrfHashIteratorKey( field_itr );
+				jsonObjectPush( field_list, jsonNewObject( field ) );
+			}
+		}
+		osrfHashIteratorFree( field_itr );
+		jsonObjectSetKey( selhash, core_class, field_list );
+	}
+
+	// Build a list of columns for the SELECT clause
+	int first = 1;
+	const jsonObject* snode = NULL;
+	jsonIterator* class_itr = jsonNewIterator( selhash );
+	while( (snode = jsonIteratorNext( class_itr )) ) {        // For each class
+
+		// If the class isn't in the IDL, ignore it
+		const char* cname = class_itr->key;
+		osrfHash* idlClass = oilsIDLGetClass( cname );
+		if( !idlClass )
+			continue;
+
+		// If the class isn't the core class, and isn't in the JOIN clause, ignore it
+		if( strcmp( core_class, class_itr->key )) {
+			if( !join_hash )
+				continue;
+
+			jsonObject* found = jsonObjectFindPath( join_hash, "//%s", class_itr->key );
+			if( !found->size ) {
+				jsonObjectFree( found );
+				continue;
+			}
+
+			jsonObjectFree( found );
+		}
+
+		const jsonObject* node = NULL;
+		jsonIterator* select_itr = jsonNewIterator( snode );
+		while( (node = jsonIteratorNext( select_itr )) ) {
+			const char* item_str = jsonObjectGetString( node );
+			osrfHash* field = osrfHashGet( osrfHashGet( idlClass, "fields" ), item_str );
+			char* fname = osrfHashGet( field, "name" );
 
 			if( !field )
 				continue;
@@ -5586,10 +6977,6 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 	if( !table )
 		table = strdup( "(null)" );
 
-	buffer_fadd( sql_buf, "SELECT %s FROM %s AS \"%s\"", col_list, table, core_class );
-	free( col_list );
-	free( table );
-
 	// Clear the query stack (as a fail-safe precaution against possible
 	// leftover garbage); then push the first query frame onto the stack.
 	clear_query_stack();
@@ -5603,31 +6990,64 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 				ctx->request,
 				"Unable to build query frame for core class"
 			);
+		free( col_list );
+		free( table );
+		buffer_free( sql_buf );
+		if( defaultselhash )
+			jsonObjectFree( defaultselhash );
+		return NULL;
+	}
+
+	// Build the JOIN clauses, if any, so that the ORDER BY clause can refer to them
+	char* join_clause = NULL;
+	if( join_hash )
+		join_clause = searchJOIN( join_hash, &curr_query->core );
+
+	// For keyset pagination, add the sort keys to the SELECT list
+	char* after_cols = NULL;
+	char* after_pred = NULL;
+	char* after_order = NULL;
+	const jsonObject* after = jsonObjectGetKeyConst( rest_of_query, "after" );
+	if( after && buildKeyset( ctx, jsonObjectGetKeyConst( rest_of_query, "order_by" ),
+			after, &after_cols, &after_pred, &after_order )) {
+		free( col_list );
+		free( table );
+		free( join_clause );
 		buffer_free( sql_buf );
 		if( defaultselhash )
 			jsonObjectFree( defaultselhash );
+		clear_query_stack();
 		return NULL;
 	}
 
+	buffer_fadd( sql_buf, "SELECT %s%s%s%s FROM %s AS \"%s\"", col_list,
+		after_cols ? after_cols : "", extra_cols ? extra_cols : "",
+		partition_field ? ", row_number() OVER \"oils_partition\" AS \"oils_rank\"" : "",
+		table, core_class );
+	free( col_list );
+	free( after_cols );
+	free( table );
+
 	// Add the JOIN clauses, if any
 	if( join_hash ) {
-		char* join_clause = searchJOIN( join_hash, &curr_query->core );
 		OSRF_BUFFER_ADD_CHAR( sql_buf, ' ' );
 		OSRF_BUFFER_ADD( sql_buf, join_clause );
 		free( join_clause );
 	}
 
-	osrfLogDebug( OSRF_LOG_MARK, "%s pre-predicate SQL =  %s",
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s pre-predicate SQL =  %s",
 		modulename, OSRF_BUFFER_C_STR( sql_buf ));
 
 	OSRF_BUFFER_ADD( sql_buf, " WHERE " );
 
 	// Add the conditions in the WHERE clause
-	char* pred = searchWHERE( search_hash, &curr_query->core, AND_OP_JOIN, ctx );
-	if( !pred ) {
-		osrfAppSessionStatus(
-			ctx->session,
-			OSRF_STATUS_INTERNALSERVERERROR,
+	if( after_pred )
+		OSRF_BUFFER_ADD( sql_buf, "( " );
+	if( appendWHERE( sql_buf, search_hash, &curr_query->core, AND_OP_JOIN, ctx )) {
+		if( ctx )
+			osrfAppSessionStatus(
+				ctx->session,
+				OSRF_STATUS_INTERNALSERVERERROR,
 				"osrfMethodException",
 				ctx->request,
 				"Severe query error -- see error log for more details"
@@ -5635,17 +7055,26 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 		buffer_free( sql_buf );
 		if( defaultselhash )
 			jsonObjectFree( defaultselhash );
+		free( after_pred );
+		free( after_order );
 		clear_query_stack();
 		return NULL;
 	} else {
-		buffer_add( sql_buf, pred );
-		free( pred );
+		if( after_pred )
+			buffer_fadd( sql_buf, " ) AND %s", after_pred );
+		free( after_pred );
 	}
 
 	// Add the ORDER BY, LIMIT, and/or OFFSET clauses, if present
 	if( rest_of_query ) {
 		const jsonObject* order_by = NULL;
-		if( ( order_by = jsonObjectGetKeyConst( rest_of_query, "order_by" )) ){
+		char* partition_order = NULL;
+		if( after_order ) {
+			// Keyset pagination has already built the ORDER BY list
+			OSRF_BUFFER_ADD( sql_buf, " ORDER BY " );
+			OSRF_BUFFER_ADD( sql_buf, after_order );
+			free( after_order );
+		} else if( ( order_by = jsonObjectGetKeyConst( rest_of_query, "order_by" )) ){
 
 			char* order_by_list = NULL;
 
@@ -5693,14 +7122,15 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 									field_str = searchFieldTransform(
 										class_itr->key, field_def, onode );
 									if( ! field_str ) {
-										osrfAppSessionStatus(
-											ctx->session,
-											OSRF_STATUS_INTERNALSERVERERROR,
-											"osrfMethodException",
-											ctx->request,
-											"Severe query error in ORDER BY clause -- "
-											"see error log for more details"
-										);
+										if( ctx )
+											osrfAppSessionStatus(
+												ctx->session,
+												OSRF_STATUS_INTERNALSERVERERROR,
+												"osrfMethodException",
+												ctx->request,
+												"Severe query error in ORDER BY clause -- "
+												"see error log for more details"
+											);
 										jsonIteratorFree( order_itr );
 										jsonIteratorFree( class_itr );
 										buffer_free( order_buf );
@@ -5791,7 +7221,10 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 					"no ORDER BY generated" );
 			}
 
-			if( order_by_list && *order_by_list ) {
+			if( partition_field ) {
+				partition_order = order_by_list;    // for the WINDOW clause, below
+				order_by_list = NULL;
+			} else if( order_by_list && *order_by_list ) {
 				OSRF_BUFFER_ADD( sql_buf, " ORDER BY " );
 				OSRF_BUFFER_ADD( sql_buf, order_by_list );
 			}
@@ -5799,6 +7232,25 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 			free( order_by_list );
 		}
 
+		// For a limit per key value, number the rows within each key value, in the
+		// requested order; then keep the first few of each, in the same order
+		if( partition_field ) {
+			buffer_fadd( sql_buf, " WINDOW \"oils_partition\" AS ( PARTITION BY \"%s\".%s",
+				core_class, partition_field );
+			if( partition_order && *partition_order ) {
+				OSRF_BUFFER_ADD( sql_buf, " ORDER BY " );
+				OSRF_BUFFER_ADD( sql_buf, partition_order );
+			}
+			OSRF_BUFFER_ADD( sql_buf, " )" );
+			free( partition_order );
+
+			char* ranked = buffer_release( sql_buf );
+			sql_buf = buffer_init( strlen( ranked ) + 128 );
+			buffer_fadd( sql_buf, "SELECT * FROM ( %s ) AS \"oils_ranked\" "
+				"WHERE \"oils_rank\" <= %d ORDER BY \"oils_rank\"", ranked, partition_limit );
+			free( ranked );
+		}
+
 		const jsonObject* limit = jsonObjectGetKeyConst( rest_of_query, "limit" );
 		if( limit ) {
 			const char* str = jsonObjectGetString( limit );
@@ -5832,528 +7284,3259 @@ static char* buildSELECT ( const jsonObject* search_hash, jsonObject* rest_of_qu
 	return buffer_release( sql_buf );
 }
 
-int doJSONSearch ( osrfMethodContext* ctx ) {
-	if(osrfMethodVerifyContext( ctx )) {
-		osrfLogError( OSRF_LOG_MARK,  "Invalid method context" );
-		return -1;
-	}
+/**
+	@brief Compile a json_query into SQL, using a cached plan if we have one.
+	@param query Pointer to the query.
+	@param flags Bitflags as passed to buildQuery().
+	@return A pointer to the SQL, or NULL if there's no usable plan for the query.
 
-	osrfLogDebug( OSRF_LOG_MARK, "Received query request" );
+	Clients tend to send the same few shapes of query over and over, with different values.
+	So we strip the literal values out of the WHERE and HAVING clauses (see planLiterals()),
+	and use what's left as a fingerprint of the query's shape.  The first time we see a
+	shape, we compile it with placeholders in place of the literals, and cache the
+	resulting SQL, minus the placeholders, as a template (see compilePlan()).  After that,
+	we merely plug the new values into the template.
 
-	int err = 0;
+	When we return NULL, the caller should compile the query the usual way, with
+	buildQuery(), which will also complain about anything wrong with it.  Likewise for
+	UNION, INTERSECT, and EXCEPT queries, which we don't try to cache.
 
-	jsonObject* hash = jsonObjectGetIndex( ctx->params, 0 );
+	The cache holds up to plan_cache_size shapes, and discards the least recently used
+	one to make room for a new one.
 
-	int flags = 0;
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* planQuery( osrfMethodContext* ctx, jsonObject* query, int flags ) {
+	if( !plan_cache_size || !query || query->type != JSON_HASH )
+		return NULL;
 
-	if( obj_is_true( jsonObjectGetKeyConst( hash, "distinct" )))
-		flags |= SELECT_DISTINCT;
+	if( jsonObjectGetKeyConst( query, "union" ) ||
+		jsonObjectGetKeyConst( query, "intersect" ) ||
+		jsonObjectGetKeyConst( query, "except" ))
+		return NULL;
 
-	if( obj_is_true( jsonObjectGetKeyConst( hash, "no_i18n" )))
-		flags |= DISABLE_I18N;
+	// Replace the literals in a copy of the query with placeholders.  LIMIT and OFFSET
+	// come last in the SQL, so we leave them out of the template and add them later.
+	jsonObject* shape = jsonObjectClone( query );
+	jsonObjectRemoveKey( shape, "limit" );
+	jsonObjectRemoveKey( shape, "offset" );
 
-	osrfLogDebug( OSRF_LOG_MARK, "Building SQL ..." );
-	clear_query_stack();       // a possibly needless precaution
-	char* sql = buildQuery( ctx, hash, flags );
-	clear_query_stack();
+	osrfStringArray* values = osrfNewStringArray( 16 );
+	growing_buffer* types = buffer_init( 16 );
+	char* sql = NULL;
 
-	if( !sql ) {
-		err = -1;
-		return err;
-	}
+	if( planLiterals( shape, values, types )) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Too many literals to cache query plan", modulename );
+	} else {
+		// The SQL also depends on the flags and the locale
+		const char* locale = osrf_message_get_last_locale();
+		growing_buffer* key_buf = buffer_init( 256 );
+		buffer_fadd( key_buf, "Q|%d|%s|", flags, locale ? locale : "" );
+		char* json = jsonObjectToJSON( shape );
+		OSRF_BUFFER_ADD( key_buf, json );
+		free( json );
+		char* key = buffer_release( key_buf );
+
+		QueryPlan* plan = findPlan( key );
+		if( plan )
+			free( key );
+		else {
+			// Note which classes the query reads, for the result cache
+			osrfStringArray* collector = query_classes;
+			query_classes = osrfNewStringArray( 4 );
+			clear_query_stack();
+			char* template = buildQuery( NULL, shape, flags );
+			clear_query_stack();
+			plan = cachePlan( key, template, OSRF_BUFFER_C_STR( types ));
+			plan->classes = query_classes;
+			query_classes = collector;
+		}
 
-	osrfLogDebug( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+		if( query_classes && plan->classes ) {
+			int i;
+			for( i = 0; i < plan->classes->size; ++i ) {
+				const char* class = osrfStringArrayGetString( plan->classes, i );
+				if( !osrfStringArrayContains( query_classes, class ))
+					osrfStringArrayAdd( query_classes, class );
+			}
+		}
 
-	// XXX for now...
-	dbhandle = writehandle;
+		sql = renderPlan( ctx, plan, query, values );
+	}
 
-	dbi_result result = dbi_conn_query( dbhandle, sql );
+	jsonObjectFree( shape );
+	osrfStringArrayFree( values );
+	buffer_free( types );
+	return sql;
+}
 
-	if( result ) {
-		osrfLogDebug( OSRF_LOG_MARK, "Query returned with no errors" );
+/**
+	@brief Build the SQL for a fieldmapper search, using a cached plan if we have one.
+	@param ctx Pointer to the method context.
+	@param where_hash Pointer to the WHERE clause, as passed to buildSELECT().
+	@param query_hash Pointer to the rest of the query, as passed to buildSELECT().
+	@param meta Pointer to the class metadata for the core class.
+	@return A pointer to the SQL, or NULL if there's no usable plan for the query.
 
-		if( dbi_result_first_row( result )) {
-			/* JSONify the result */
-			osrfLogDebug( OSRF_LOG_MARK, "Query returned at least one row" );
+	This is the counterpart of planQuery() for the retrieve, search, and id_list methods,
+	and for fleshing, all of which call doFieldmapperSearch().  The fingerprint covers the
+	class, the locale, the WHERE clause minus its literals, and whichever other parts of
+	the query buildSELECT() pays attention to.
 
-			do {
-				jsonObject* return_val = oilsMakeJSONFromResult( result );
-				osrfAppRespond( ctx, return_val );
-				jsonObjectFree( return_val );
-			} while( dbi_result_next_row( result ));
+	When we return NULL, the caller should call buildSELECT() instead.
 
-		} else {
-			osrfLogDebug( OSRF_LOG_MARK, "%s returned no results for query %s", modulename, sql );
-		}
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* planSearch( osrfMethodContext* ctx, const jsonObject* where_hash,
+		const jsonObject* query_hash, osrfHash* meta ) {
+	if( !plan_cache_size || !where_hash )
+		return NULL;
 
-		osrfAppRespondComplete( ctx, NULL );
+	// Copy the parts of the query that buildSELECT() looks at, apart from LIMIT and OFFSET
+	static const char* rest_keys[] =
+		{ "join", "select", "no_i18n", "order_by", "after", "limit_per", NULL };
+	jsonObject* where = jsonObjectClone( where_hash );
+	jsonObject* rest = jsonNewObjectType( JSON_HASH );
+	int i;
+	for( i = 0; rest_keys[ i ]; ++i ) {
+		const jsonObject* item = jsonObjectGetKeyConst( query_hash, rest_keys[ i ] );
+		if( item )
+			jsonObjectSetKey( rest, rest_keys[ i ], jsonObjectClone( item ));
+	}
 
-		/* clean up the query */
-		dbi_result_free( result );
+	osrfStringArray* values = osrfNewStringArray( 16 );
+	growing_buffer* types = buffer_init( 16 );
+	char* sql = NULL;
 
+	jsonObject* after = jsonObjectGetKey( rest, "after" );
+	if( planWhere( where, values, types )
+			|| ( after && after->type == JSON_ARRAY && planList( after, 0, values, types ))) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Too many literals to cache query plan", modulename );
 	} else {
-		err = -1;
-		const char* msg;
-		int errnum = dbi_conn_error( dbhandle, &msg );
-		osrfLogError( OSRF_LOG_MARK, "%s: Error with query [%s]: %d %s",
-			modulename, sql, errnum, msg ? msg : "(No description available)" );
-		osrfAppSessionStatus(
-			ctx->session,
-			OSRF_STATUS_INTERNALSERVERERROR,
-			"osrfMethodException",
-			ctx->request,
-			"Severe query error -- see error log for more details"
-		);
+		const char* locale = osrf_message_get_last_locale();
+		growing_buffer* key_buf = buffer_init( 256 );
+		buffer_fadd( key_buf, "S|%s|%s|", (char*) osrfHashGet( meta, "classname" ),
+			locale ? locale : "" );
+		char* json = jsonObjectToJSON( where );
+		OSRF_BUFFER_ADD( key_buf, json );
+		free( json );
+		OSRF_BUFFER_ADD_CHAR( key_buf, '|' );
+		json = jsonObjectToJSON( rest );
+		OSRF_BUFFER_ADD( key_buf, json );
+		free( json );
+		char* key = buffer_release( key_buf );
+
+		QueryPlan* plan = findPlan( key );
+		if( plan )
+			free( key );
+		else
+			plan = cachePlan( key, buildSELECT( where, rest, meta, NULL, NULL ),
+				OSRF_BUFFER_C_STR( types ));
+
+		sql = renderPlan( ctx, plan, query_hash, values );
+	}
+
+	jsonObjectFree( where );
+	jsonObjectFree( rest );
+	osrfStringArrayFree( values );
+	buffer_free( types );
+	return sql;
+}
+
+/**
+	@brief Replace the literals of a query with placeholders.
+	@param query Pointer to the query, which we modify in place.
+	@param values Pointer to an osrfStringArray to which we append the literal values.
+	@param types Pointer to a growing_buffer to which we append a character for each
+	literal: 'n' for a number or 's' for a string.
+	@return 0 if successful, or -1 if there are too many literals.
+
+	We only look for literals in the places where the SQL compiler treats them as values
+	to be compared to a column: the WHERE and HAVING clauses, including any subqueries
+	therein, and the sort keys of an "after" clause.  Everything else is left alone, to
+	become part of the query's fingerprint.
+
+	Each placeholder is a string of digits, so that it can stand in for a number as well as
+	for a string.  It consists of an '8', the ten digits of plan_nonce, and the five-digit
+	position of the literal in @a values.
+*/
+static int planLiterals( jsonObject* query, osrfStringArray* values, growing_buffer* types ) {
+	if( !query || query->type != JSON_HASH )
+		return 0;
+
+	if( jsonObjectGetKeyConst( query, "union" ) ||
+		jsonObjectGetKeyConst( query, "intersect" ) ||
+		jsonObjectGetKeyConst( query, "except" ))
+		return 0;
+
+	jsonObject* where = jsonObjectGetKey( query, "where" );
+	if( where && planWhere( where, values, types ))
+		return -1;
+
+	jsonObject* having = jsonObjectGetKey( query, "having" );
+	if( having && planWhere( having, values, types ))
+		return -1;
+
+	jsonObject* after = jsonObjectGetKey( query, "after" );
+	if( after && after->type == JSON_ARRAY && planList( after, 0, values, types ))
+		return -1;
+
+	return 0;
+}
+
+/**
+	@brief Replace the literals of a WHERE or HAVING clause with placeholders.
+	@param node Pointer to the clause, or some part of it.
+	@param values Pointer to an osrfStringArray to which we append the literal values.
+	@param types Pointer to a growing_buffer recording the types of the literals.
+	@return 0 if successful, or -1 if there are too many literals.
+
+	This function follows the same structure as searchWHERE().  Anything that searchWHERE()
+	would reject, we leave alone.
+*/
+static int planWhere( jsonObject* node, osrfStringArray* values, growing_buffer* types ) {
+	int rc = 0;
+	jsonObject* item = NULL;
+
+	if( node->type == JSON_ARRAY ) {
+		unsigned long i = 0;
+		while( !rc && (item = jsonObjectGetIndex( node, i++ )) )
+			rc = planWhere( item, values, types );
+
+	} else if( node->type == JSON_HASH ) {
+		jsonIterator* itr = jsonNewIterator( node );
+		while( !rc && (item = jsonIteratorNext( itr )) ) {
+			const char* key = itr->key;
+			if( '+' == key[ 0 ] ) {
+				// A string is the name of a column, not a literal
+				if( item->type != JSON_STRING )
+					rc = planWhere( item, values, types );
+			} else if( '-' == key[ 0 ] ) {
+				if( !strcasecmp( key, "-or" ) || !strcasecmp( key, "-and" )
+						|| !strcasecmp( key, "-not" ))
+					rc = planWhere( item, values, types );
+				else if( !strcasecmp( key, "-exists" ) || !strcasecmp( key, "-not-exists" ))
+					rc = planLiterals( item, values, types );
+			} else
+				rc = planPredicate( item, values, types );
+		}
+		jsonIteratorFree( itr );
+	}
+
+	return rc;
+}
+
+/**
+	@brief Replace the literals of a predicate on a column with placeholders.
+	@param node Pointer to what the column is compared to.
+	@param values Pointer to an osrfStringArray to which we append the literal values.
+	@param types Pointer to a growing_buffer recording the types of the literals.
+	@return 0 if successful, or -1 if there are too many literals.
+
+	This function follows the same structure as searchPredicate().  Function names, field
+	transforms, and the like are part of the query's shape, not literals.
+*/
+static int planPredicate( jsonObject* node, osrfStringArray* values, growing_buffer* types ) {
+	int rc = 0;
+
+	if( node->type == JSON_ARRAY ) {               // IN list
+		rc = planINList( node, values, types );
+	} else if( node->type == JSON_HASH ) {
+		jsonIterator* itr = jsonNewIterator( node );
+		jsonObject* pred = jsonIteratorNext( itr );
+		const char* op = itr->key;
+
+		if( !pred || jsonIteratorHasNext( itr ))
+			;   // Invalid; let searchPredicate() complain about it
+		else if( !strcasecmp( op, "between" )) {
+			if( pred->type == JSON_ARRAY )
+				rc = planList( pred, 0, values, types );
+		} else if( !strcasecmp( op, "in" ) || !strcasecmp( op, "not in" )) {
+			if( pred->type == JSON_ARRAY )
+				rc = planINList( pred, values, types );
+			else if( pred->type == JSON_HASH )
+				rc = planLiterals( pred, values, types );   // subquery
+		} else if( pred->type == JSON_ARRAY ) {
+			rc = planList( pred, 1, values, types );       // function name, then parameters
+		} else if( pred->type == JSON_HASH ) {
+			// Field transform
+			jsonObject* params = jsonObjectGetKey( pred, "params" );
+			if( params && params->type == JSON_ARRAY )
+				rc = planList( params, 0, values, types );
+
+			jsonObject* value = jsonObjectGetKey( pred, "value" );
+			if( !rc && value ) {
+				if( value->type == JSON_ARRAY )
+					rc = planList( value, 1, values, types );
+				else if( value->type == JSON_HASH )
+					rc = planWhere( value, values, types );
+				else
+					rc = planLiteral( value, values, types );
+			}
+		} else
+			rc = planLiteral( pred, values, types );
+
+		jsonIteratorFree( itr );
+	} else
+		rc = planLiteral( node, values, types );
+
+	return rc;
+}
+
+/**
+	@brief Replace the literals of an IN list with placeholders.
+	@param list Pointer to the JSON_ARRAY.
+	@param values Pointer to an osrfStringArray to which we append the literal values.
+	@param types Pointer to a growing_buffer recording the types of the literals.
+	@return 0 if successful, or -1 if the list is too long to cache.
+
+	A list long enough to be sent as an array (see searchINArray()) is rejected, since its
+	values don't appear as separate literals in the SQL.
+*/
+static int planINList( jsonObject* list, osrfStringArray* values, growing_buffer* types ) {
+	if( in_list_threshold > 0 && list->size >= (unsigned long) in_list_threshold )
+		return -1;
+	else
+		return planList( list, 0, values, types );
+}
+
+/**
+	@brief Replace the literals in a JSON array with placeholders.
+	@param list Pointer to the JSON_ARRAY.
+	@param start Index of the first entry to consider.
+	@param values Pointer to an osrfStringArray to which we append the literal values.
+	@param types Pointer to a growing_buffer recording the types of the literals.
+	@return 0 if successful, or -1 if there are too many literals.
+*/
+static int planList( jsonObject* list, unsigned long start, osrfStringArray* values,
+		growing_buffer* types ) {
+	jsonObject* item = NULL;
+	while( (item = jsonObjectGetIndex( list, start++ )) ) {
+		if( planLiteral( item, values, types ))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Replace a literal with a placeholder.
+	@param node Pointer to the literal.
+	@param values Pointer to an osrfStringArray to which we append the literal value.
+	@param types Pointer to a growing_buffer recording the types of the literals.
+	@return 0 if successful, or -1 if there are too many literals.
+
+	Only strings and numbers are literals.  Nulls and booleans change the shape of the SQL,
+	so we leave them alone.
+*/
+static int planLiteral( jsonObject* node, osrfStringArray* values, growing_buffer* types ) {
+	if( node->type != JSON_STRING && node->type != JSON_NUMBER )
+		return 0;
+	else if( values->size >= PLAN_MAX_LITERALS )
+		return -1;
+
+	char mark[ 24 ];
+	snprintf( mark, sizeof( mark ), "8%s%05d", plan_nonce, values->size );
+	osrfStringArrayAdd( values, jsonObjectGetString( node ));
+
+	if( JSON_NUMBER == node->type ) {
+		OSRF_BUFFER_ADD_CHAR( types, 'n' );
+		jsonObjectSetNumberString( node, mark );
+	} else {
+		OSRF_BUFFER_ADD_CHAR( types, 's' );
+		jsonObjectSetString( node, mark );
+	}
+
+	return 0;
+}
+
+/**
+	@brief Look up a cached plan.
+	@param key The fingerprint of the query.
+	@return Pointer to the QueryPlan, or NULL if there isn't one.
+*/
+static QueryPlan* findPlan( const char* key ) {
+	QueryPlan* plan = plan_cache ? osrfHashGet( plan_cache, key ) : NULL;
+	if( plan ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Found cached query plan", modulename );
+		touchPlan( plan );
+	}
+	return plan;
+}
+
+/**
+	@brief Make a plan out of newly compiled SQL, and cache it.
+	@param key The fingerprint of the query, which the plan takes ownership of.
+	@param sql The SQL compiled from the query with placeholders, or NULL if it wouldn't
+	compile.  We free it.
+	@param types The types of the literals, as recorded by planLiterals().
+	@return Pointer to the new QueryPlan, which may or may not have a template.
+
+	If the cache is full, we discard the least recently used plan to make room.
+*/
+static QueryPlan* cachePlan( char* key, char* sql, const char* types ) {
+	QueryPlan* plan = compilePlan( sql, types );
+	plan->key = key;
+
+	if( !plan_cache ) {
+		plan_cache = osrfNewHash();
+		osrfHashSetCallback( plan_cache, freePlan );
+	}
+	osrfHashSet( plan_cache, plan, "%s", key );
+	touchPlan( plan );
+
+	while( osrfHashGetCount( plan_cache ) > plan_cache_size && plan_oldest != plan )
+		osrfHashRemove( plan_cache, "%s", plan_oldest->key );
+
+	return plan;
+}
+
+/**
+	@brief Turn SQL compiled with placeholders in place of the literals into a template.
+	@param sql The SQL, or NULL if the query wouldn't compile.  We free it.
+	@param types The types of the literals, as recorded by planLiterals().
+	@return Pointer to a newly allocated QueryPlan.
+
+	We find each placeholder in the compiled SQL and cut it out, along with the quotes
+	around it if it was quoted as a string, recording where it was.  If anything looks
+	amiss -- a placeholder that shows up twice or not at all, or a string that doesn't get
+	quoted -- the SQL compiler must have done something with a value besides inserting it,
+	and we can't use a template.  In that case, or if the query didn't compile at all, we
+	return a plan without a template, so that we won't try again.
+*/
+static QueryPlan* compilePlan( char* sql, const char* types ) {
+	QueryPlan* plan = safe_malloc( sizeof( QueryPlan ));
+	plan->prev = NULL;
+	plan->next = NULL;
+	plan->key = NULL;
+	plan->text = NULL;
+	plan->slots = NULL;
+	plan->slot_count = 0;
+	plan->serial = 0;
+	plan->prepared = 0;
+
+	size_t len = sql ? strlen( sql ) : 0;
+	if( !len || sql[ len - 1 ] != ';' ) {
+		free( sql );
+		return plan;
+	}
+	sql[ len - 1 ] = '\0';     // We'll put the semicolon back after LIMIT and OFFSET
+
+	unsigned int literal_count = strlen( types );
+	unsigned int* seen = safe_malloc( ( literal_count + 1 ) * sizeof( unsigned int ));
+	memset( seen, 0, ( literal_count + 1 ) * sizeof( unsigned int ));
+	plan->slots = safe_malloc( ( literal_count + 1 ) * sizeof( PlanSlot ));
+
+	char prefix[ 16 ];
+	snprintf( prefix, sizeof( prefix ), "8%s", plan_nonce );
+	size_t prefix_len = strlen( prefix );
+
+	growing_buffer* text_buf = buffer_init( len );
+	const char* done = sql;    // start of what we haven't copied yet
+	const char* hit = NULL;
+	int ok = 1;                // boolean
+
+	while( ok && (hit = strstr( done, prefix )) ) {
+		const char* end = hit + prefix_len;
+		unsigned int literal = 0;
+		int i;
+		for( i = 0; i < 5 && isdigit( (unsigned char) *end ); ++i )
+			literal = literal * 10 + ( *end++ - '0' );
+
+		if( i < 5 || isdigit( (unsigned char) *end ) || literal >= literal_count
+				|| seen[ literal ]++ ) {
+			ok = 0;
+			break;
+		}
+
+		const char* start = hit;
+		int quoted = hit > done && '\'' == hit[ -1 ] && '\'' == *end;
+		if( quoted ) {
+			--start;
+			++end;
+		} else if( types[ literal ] != 'n' ) {
+			ok = 0;     // Only a number may go in without quotes
+			break;
+		}
+
+		buffer_add_n( text_buf, done, start - done );
+		PlanSlot* slot = plan->slots + plan->slot_count++;
+		slot->offset = buffer_length( text_buf );
+		slot->literal = literal;
+		slot->quoted = quoted;
+		done = end;
+	}
+
+	unsigned int i;
+	for( i = 0; ok && i < literal_count; ++i ) {
+		if( seen[ i ] != 1 )
+			ok = 0;
+	}
+
+	if( ok ) {
+		OSRF_BUFFER_ADD( text_buf, done );
+		plan->text = buffer_release( text_buf );
+	} else {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Unable to make a template of query plan", modulename );
+		buffer_free( text_buf );
+		free( plan->slots );
+		plan->slots = NULL;
+		plan->slot_count = 0;
+	}
+
+	free( seen );
+	free( sql );
+	return plan;
+}
+
+/**
+	@brief Fill in the template of a cached plan with the values of a query.
+	@param ctx Pointer to the method context.
+	@param plan Pointer to the QueryPlan.
+	@param query Pointer to the JSON_HASH holding the LIMIT and OFFSET, if any.
+	@param values The literal values of the query, as collected by planLiterals().
+	@return A pointer to the SQL, or NULL if the plan has no template or we can't quote
+	a value.
+
+	Each value is rendered exactly as the SQL compiler would have rendered it: quoted as a
+	string, or inserted as is if it's a number going into a numeric context.
+
+	If the prepare_queries setting is true, we return an EXECUTE statement for the plan
+	instead, preparing it first if necessary (see preparePlan()).  We fall back to plain
+	SQL for a number that isn't a small integer, since in a prepared statement it would
+	be coerced to the type of the parameter rather than compared as is.
+
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* renderPlan( osrfMethodContext* ctx, QueryPlan* plan, const jsonObject* query,
+		const osrfStringArray* values ) {
+	if( !plan->text )
+		return NULL;
+
+	// Render the values, in order of their position in the query
+	char** args = safe_malloc( ( plan->slot_count + 1 ) * sizeof( char* ));
+	memset( args, 0, ( plan->slot_count + 1 ) * sizeof( char* ));
+	int plain = 0;      // boolean; true if a value is unfit for a prepared statement
+	int ok = 1;         // boolean
+	unsigned int i;
+
+	for( i = 0; i < plan->slot_count; ++i ) {
+		const PlanSlot* slot = plan->slots + i;
+		const char* value = osrfStringArrayGetString( values, slot->literal );
+		char* arg = strdup( value );
+		if( slot->quoted ) {
+			if( !dbi_conn_quote_string( dbhandle, &arg )) {
+				osrfLogError( OSRF_LOG_MARK, "%s: Error quoting key string [%s]",
+					modulename, value );
+				free( arg );
+				ok = 0;
+				break;
+			}
+		} else if( !isPlainInteger( value ))
+			plain = 1;
+		args[ slot->literal ] = arg;
+	}
+
+	char* sql = NULL;
+	if( ok ) {
+		const char* limit = jsonObjectGetString( jsonObjectGetKeyConst( query, "limit" ));
+		const char* offset = jsonObjectGetString( jsonObjectGetKeyConst( query, "offset" ));
+		growing_buffer* sql_buf = buffer_init( strlen( plan->text ) + 64 );
+
+		if( prepare_queries && !plain && preparePlan( ctx, plan )) {
+			buffer_fadd( sql_buf, "EXECUTE oils_plan_%lu(", plan->serial );
+			for( i = 0; i < plan->slot_count; ++i ) {
+				OSRF_BUFFER_ADD( sql_buf, i ? ", " : " " );
+				OSRF_BUFFER_ADD( sql_buf, args[ i ] );
+			}
+			OSRF_BUFFER_ADD( sql_buf, plan->slot_count ? ", " : " " );
+			if( limit )
+				buffer_fadd( sql_buf, "%d, ", atoi( limit ));
+			else
+				OSRF_BUFFER_ADD( sql_buf, "NULL, " );
+			if( offset )
+				buffer_fadd( sql_buf, "%d );", atoi( offset ));
+			else
+				OSRF_BUFFER_ADD( sql_buf, "NULL );" );
+		} else {
+			size_t done = 0;
+			for( i = 0; i < plan->slot_count; ++i ) {
+				const PlanSlot* slot = plan->slots + i;
+				buffer_add_n( sql_buf, plan->text + done, slot->offset - done );
+				OSRF_BUFFER_ADD( sql_buf, args[ slot->literal ] );
+				done = slot->offset;
+			}
+			OSRF_BUFFER_ADD( sql_buf, plan->text + done );
+
+			// Add LIMIT and OFFSET the same way that the SQL compiler does
+			if( limit )
+				buffer_fadd( sql_buf, " LIMIT %d", atoi( limit ));
+			if( offset )
+				buffer_fadd( sql_buf, " OFFSET %d", atoi( offset ));
+			OSRF_BUFFER_ADD_CHAR( sql_buf, ';' );
+		}
+
+		sql = buffer_release( sql_buf );
+	}
+
+	for( i = 0; i < plan->slot_count; ++i )
+		free( args[ i ] );
+	free( args );
+	return sql;
+}
+
+/**
+	@brief Make sure that a plan is prepared as a statement on our database connection.
+	@param ctx Pointer to the method context.
+	@param plan Pointer to the QueryPlan, which must have a template.
+	@return 1 if the plan is prepared, or 0 if not.
+
+	The statement takes one parameter for each literal, in order, followed by one each for
+	LIMIT and OFFSET, which are NULL when absent.  We let PostgreSQL infer the types of the
+	parameters from context, just as it would for the quoted literals in plain SQL.
+
+	We don't prepare anything inside a transaction, since a failure would abort it.  If a
+	plan fails to prepare, we don't try again.
+*/
+static int preparePlan( osrfMethodContext* ctx, QueryPlan* plan ) {
+	if( plan->prepared )
+		return plan->prepared > 0;
+	else if( !ctx || getXactId( ctx ))
+		return 0;
+
+	plan->serial = ++plan_serial;
+	growing_buffer* prep_buf = buffer_init( strlen( plan->text ) + 64 );
+	buffer_fadd( prep_buf, "PREPARE oils_plan_%lu AS ", plan->serial );
+
+	size_t done = 0;
+	unsigned int i;
+	for( i = 0; i < plan->slot_count; ++i ) {
+		const PlanSlot* slot = plan->slots + i;
+		buffer_add_n( prep_buf, plan->text + done, slot->offset - done );
+		buffer_fadd( prep_buf, "$%u", slot->literal + 1 );
+		done = slot->offset;
+	}
+	OSRF_BUFFER_ADD( prep_buf, plan->text + done );
+	buffer_fadd( prep_buf, " LIMIT $%u OFFSET $%u;", plan->slot_count + 1, plan->slot_count + 2 );
+
+	dbi_result result = dbi_conn_query( dbhandle, OSRF_BUFFER_C_STR( prep_buf ));
+	if( result ) {
+		dbi_result_free( result );
+		plan->prepared = 1;
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Prepared query plan oils_plan_%lu", modulename,
+			plan->serial );
+	} else {
+		const char* msg;
+		int errnum = dbi_conn_error( dbhandle, &msg );
+		osrfLogWarning( OSRF_LOG_MARK, "%s: Unable to prepare query plan [%s]: %d %s",
+			modulename, OSRF_BUFFER_C_STR( prep_buf ), errnum,
+			msg ? msg : "(No description available)" );
+		plan->prepared = -1;
+	}
+
+	buffer_free( prep_buf );
+	return plan->prepared > 0;
+}
+
+/**
+	@brief Determine whether a string is an integer small enough for any integer type.
+	@param s The string.
+	@return 1 if it is, or 0 if not.
+*/
+static int isPlainInteger( const char* s ) {
+	if( '-' == *s )
+		++s;
+
+	int digits = 0;
+	while( isdigit( (unsigned char) *s )) {
+		++s;
+		++digits;
+	}
+
+	return *s == '\0' && digits > 0 && digits <= 9;
+}
+
+/**
+	@brief Mark a cached plan as the most recently used.
+	@param plan Pointer to the QueryPlan, which may or may not already be in the list.
+*/
+static void touchPlan( QueryPlan* plan ) {
+	if( plan == plan_newest )
+		return;
+
+	// Unlink it, if it's in the list
+	if( plan->prev )
+		plan->prev->next = plan->next;
+	if( plan->next )
+		plan->next->prev = plan->prev;
+	else if( plan == plan_oldest )
+		plan_oldest = plan->prev;
+
+	// Put it at the head of the list
+	plan->prev = NULL;
+	plan->next = plan_newest;
+	if( plan_newest )
+		plan_newest->prev = plan;
+	plan_newest = plan;
+	if( !plan_oldest )
+		plan_oldest = plan;
+}
+
+/**
+	@brief Free a cached QueryPlan.
+	@param key The fingerprint of the plan (not used).
+	@param item Pointer to the QueryPlan, cast to a void pointer.
+
+	This function is a callback, installed in the plan cache.
+*/
+static void freePlan( char* key, void* item ) {
+	QueryPlan* plan = item;
+
+	if( plan->prev )
+		plan->prev->next = plan->next;
+	else if( plan == plan_newest )
+		plan_newest = plan->next;
+
+	if( plan->next )
+		plan->next->prev = plan->prev;
+	else if( plan == plan_oldest )
+		plan_oldest = plan->prev;
+
+	if( plan->prepared > 0 && dbhandle ) {
+		dbi_result result = dbi_conn_queryf( dbhandle, "DEALLOCATE oils_plan_%lu;",
+			plan->serial );
+		if( result )
+			dbi_result_free( result );
+	}
+
+	free( plan->key );
+	free( plan->text );
+	free( plan->slots );
+	osrfStringArrayFree( plan->classes );
+	free( plan );
+}
+
+/**
+	@brief Discard all cached query plans.
+
+	We do this when the IDL changes, since the plans were compiled from the old one.
+*/
+static void clearPlanCache( void ) {
+	if( plan_cache ) {
+		osrfHashFree( plan_cache );
+		plan_cache = NULL;
+	}
+	plan_newest = NULL;
+	plan_oldest = NULL;
+}
+
+/**
+	@brief Decide how long to cache the results of a json_query.
+	@param ctx Pointer to the method context.
+	@param query Pointer to the query.
+	@return The number of seconds to cache the results, or zero if we shouldn't.
+
+	A client asks for caching with a "cache" entry in the query, e.g. {"ttl":300}.  We
+	honor it only if the result cache is enabled (see oilsSetResultCache()), and never
+	within a transaction, where the results may include uncommitted changes.
+*/
+static int resultCacheTTL( osrfMethodContext* ctx, const jsonObject* query ) {
+	if( !result_cache_max_ttl || getXactId( ctx ))
+		return 0;
+
+	const char* ttl_str = jsonObjectGetString(
+		jsonObjectGetKeyConst( jsonObjectGetKeyConst( query, "cache" ), "ttl" ));
+	if( !ttl_str )
+		return 0;
+
+	int ttl = atoi( ttl_str );
+	if( ttl <= 0 )
+		return 0;
+	else if( ttl > result_cache_max_ttl )
+		return result_cache_max_ttl;
+	else
+		return ttl;
+}
+
+/**
+	@brief Build the memcached key for the results of a json_query.
+	@param query Pointer to the query.
+	@param flags Bitflags as passed to buildQuery().
+	@param classes Pointer to the names of the classes that the query reads.
+	@return Pointer to the key.
+
+	The key covers everything that affects the results: the query itself, the locale,
+	the time zone in which we format timestamps, and the current generation of each class
+	that the query reads (see getClassGeneration()).  When a class changes, its generation
+	changes, and with it the key, so that we never find the stale results again.
+
+	We key on the query rather than on the SQL, since with prepare_queries the SQL refers
+	to prepared statements that differ from one drone to the next.
+
+	The calling code is responsible for freeing the key by calling free().
+*/
+static char* makeResultKey( const jsonObject* query, int flags,
+		const osrfStringArray* classes ) {
+	const char* locale = osrf_message_get_last_locale();
+	const char* tz = getenv( "TZ" );
+
+	growing_buffer* key_buf = buffer_init( 256 );
+	buffer_fadd( key_buf, "%s|%d|%s|%s|", modulename, flags,
+		locale ? locale : "", tz ? tz : "" );
+	char* json = jsonObjectToJSON( query );
+	OSRF_BUFFER_ADD( key_buf, json );
+	free( json );
+
+	int i;
+	for( i = 0; i < classes->size; ++i ) {
+		const char* class = osrfStringArrayGetString( classes, i );
+		char* generation = getClassGeneration( class );
+		buffer_fadd( key_buf, "|%s=%s", class, generation );
+		free( generation );
+	}
+
+	char* digest = md5sum( "%s", OSRF_BUFFER_C_STR( key_buf ));
+	buffer_free( key_buf );
+
+	key_buf = buffer_init( 48 );
+	buffer_fadd( key_buf, "oils_result_%s", digest );
+	free( digest );
+	return buffer_release( key_buf );
+}
+
+/**
+	@brief Get the current generation of a class, for keying cached results.
+	@param class Name of the class.
+	@return Pointer to the generation, as a string.
+
+	The generation is an arbitrary string stored in memcached, and replaced whenever a
+	transaction that changes the class commits (see expireResults()).  If it isn't there,
+	because nobody has asked for it yet or because memcached has evicted it, we make up a
+	new one.
+
+	The calling code is responsible for freeing the string by calling free().
+*/
+static char* getClassGeneration( const char* class ) {
+	char* generation = osrfCacheGetString( "oils_result_gen_%s", class );
+	if( generation )
+		return generation;
+	else
+		return bumpClassGeneration( class );
+}
+
+/**
+	@brief Replace the generation of a class with a new one.
+	@param class Name of the class.
+	@return Pointer to the new generation, as a string.
+
+	The new generation combines the time, our process id, and a counter, so that no other
+	drone will come up with the same one.
+
+	The calling code is responsible for freeing the string by calling free().
+*/
+static char* bumpClassGeneration( const char* class ) {
+	static unsigned int counter = 0;
+
+	char generation[ 64 ];
+	snprintf( generation, sizeof( generation ), "%ld.%ld.%u",
+		(long) time( NULL ), (long) getpid(), ++counter );
+
+	growing_buffer* key_buf = buffer_init( 48 );
+	buffer_fadd( key_buf, "oils_result_gen_%s", class );
+	osrfCachePutString( OSRF_BUFFER_C_STR( key_buf ), generation, 0 );
+	buffer_free( key_buf );
+
+	return strdup( generation );
+}
+
+/**
+	@brief Remember that the current transaction writes to a class.
+	@param ctx Pointer to the method context.
+	@param class Name of the class.
+
+	When the transaction commits, we'll expire any cached results that read from the class
+	(see expireResults()).  We do this whether or not this service caches results itself,
+	since other services may be caching results from the same database; but if none of
+	them does, we don't bother.
+*/
+static void noteWrite( osrfMethodContext* ctx, const char* class ) {
+	if( !( result_cache_expire && ctx && ctx->session && ctx->session->userData && class ))
+		return;
+
+	osrfHash* cache = ctx->session->userData;
+	osrfStringArray* written = osrfHashGet( cache, "written_classes" );
+	if( !written ) {
+		written = osrfNewStringArray( 4 );
+		osrfHashSet( cache, written, "written_classes" );
+	}
+
+	if( !osrfStringArrayContains( written, class ))
+		osrfStringArrayAdd( written, class );
+}
+
+/**
+	@brief Expire the cached results that read from the classes written by a transaction.
+	@param ctx Pointer to the method context.
+	@param committed Boolean; true if the transaction committed, false if it rolled back.
+
+	Call this function when a transaction ends.  If it committed, we give a new generation
+	to each class that it wrote to, which makes the results cached for the old generation
+	unreachable.  Either way we forget the list of classes.
+*/
+static void expireResults( osrfMethodContext* ctx, int committed ) {
+	if( !( ctx && ctx->session && ctx->session->userData ))
+		return;
+
+	osrfHash* cache = ctx->session->userData;
+	osrfStringArray* written = osrfHashGet( cache, "written_classes" );
+	if( !written )
+		return;
+
+	if( committed ) {
+		int i;
+		for( i = 0; i < written->size; ++i )
+			free( bumpClassGeneration( osrfStringArrayGetString( written, i )));
+	}
+
+	osrfHashRemove( cache, "written_classes" );
+}
+
+/**
+	@brief Determine whether, and how, a query asks to be explained.
+	@param ctx Pointer to the method context.
+	@param explain Pointer to the "explain" entry of the query, if any.
+	@return 0 for an ordinary query, EXPLAIN_PLAN for the planner's estimates,
+	EXPLAIN_ANALYZE for the plan as actually executed, or -1 if the query asks for an
+	explanation that this service doesn't give.
+
+	The "explain" entry may be true, or the string "analyze".  Anything else that isn't
+	true is ignored, like other boolean options.  For PCRUD, the user must also be logged
+	in.
+*/
+static int explainMode( osrfMethodContext* ctx, const jsonObject* explain ) {
+	int mode = 0;
+	if( explain && explain->type == JSON_STRING && !strcasecmp( explain->value.s, "analyze" ))
+		mode = EXPLAIN_ANALYZE;
+	else if( obj_is_true( explain ))
+		mode = EXPLAIN_PLAN;
+
+	if( mode && !allow_explain ) {
+		osrfLogWarning( OSRF_LOG_MARK, "%s: EXPLAIN requested but not allowed", modulename );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_FORBIDDEN,
+			"osrfMethodException",
+			ctx->request,
+			"EXPLAIN is not enabled for this service"
+		);
+		return -1;
+	}
+
+	// With no rows to check, PCRUD would otherwise never look at the authkey
+	if( mode && enforce_pcrud && !verifyUserPCRUD( ctx ))
+		return -1;
+
+	return mode;
+}
+
+/**
+	@brief Ask PostgreSQL how it runs a query.
+	@param ctx Pointer to the method context.
+	@param sql The query.
+	@param mode EXPLAIN_PLAN or EXPLAIN_ANALYZE.
+	@return A JSON_HASH with the SQL under "sql" and PostgreSQL's plan, in its JSON
+	format, under "plan"; or NULL upon error.
+
+	With EXPLAIN_ANALYZE, PostgreSQL really runs the query, and reports actual row counts,
+	timings, and buffer usage along with its estimates.  The query is then subject to the
+	same time limit as when it runs for real.
+
+	The calling code is responsible for freeing the returned object by calling
+	jsonObjectFree().
+*/
+static jsonObject* explainQuery( osrfMethodContext* ctx, const char* sql, int mode ) {
+	char* explain_sql = NULL;
+	if( EXPLAIN_ANALYZE == mode ) {
+		growing_buffer* explain_buf = buffer_init( strlen( sql ) + 48 );
+		buffer_fadd( explain_buf, "EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) %s", sql );
+		explain_sql = limitQueryTime( buffer_release( explain_buf ));
+	}
+
+	dbi_result result = explain_sql
+		? dbi_conn_query( dbhandle, explain_sql )
+		: dbi_conn_queryf( dbhandle, "EXPLAIN (FORMAT JSON) %s", sql );
+	free( explain_sql );
+	if( !result ) {
+		const char* msg;
+		int errnum = dbi_conn_error( dbhandle, &msg );
+		osrfLogError( OSRF_LOG_MARK, "%s: Error explaining query [%s]: %d %s",
+			modulename, sql, errnum, msg ? msg : "(No description available)" );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_INTERNALSERVERERROR,
+			"osrfMethodException",
+			ctx->request,
+			"Severe query error -- see error log for more details"
+		);
+		if( !oilsIsDBConnected( dbhandle ))
+			osrfAppSessionPanic( ctx->session );
+		return NULL;
+	}
+
+	// The plan comes back as one row with one column, holding a JSON array
+	jsonObject* plan = NULL;
+	if( dbi_result_first_row( result )) {
+		const char* text = dbi_result_get_string_idx( result, 1 );
+		if( text ) {
+			plan = jsonParse( text );
+			if( !plan )
+				plan = jsonNewObject( text );
+		}
+	}
+	dbi_result_free( result );
+
+	jsonObject* explanation = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( explanation, "sql", jsonNewObject( sql ));
+	jsonObjectSetKey( explanation, "plan", plan ? plan : jsonNewObjectType( JSON_NULL ));
+	return explanation;
+}
+
+/**
+	@brief Refuse to run a query that the planner expects to be too expensive.
+	@param ctx Pointer to the method context.
+	@param sql The query.
+	@return 0 if we may run the query, or -1 if not.
+
+	If app_settings/max_query_cost is set, we EXPLAIN the query first and compare the
+	planner's estimate of its total cost to the limit.  That costs an extra round trip,
+	but the planner doesn't touch any rows, and it catches the occasional query with a
+	missing WHERE clause or an accidental cross join before it ties up the database.
+
+	If we refuse, we tell the client why.
+*/
+static int checkQueryCost( osrfMethodContext* ctx, const char* sql ) {
+	if( max_query_cost <= 0 )
+		return 0;
+
+	jsonObject* explanation = explainQuery( ctx, sql, EXPLAIN_PLAN );
+	if( !explanation )
+		return -1;
+
+	// The plan is an array holding one object, whose "Plan" is the top node of the tree
+	const jsonObject* plan = jsonObjectGetKeyConst(
+		jsonObjectGetIndex( jsonObjectGetKeyConst( explanation, "plan" ), 0 ), "Plan" );
+	const jsonObject* cost_obj = jsonObjectGetKeyConst( plan, "Total Cost" );
+	double cost = cost_obj ? jsonObjectGetNumber( cost_obj ) : 0.0;
+	jsonObjectFree( explanation );
+
+	if( cost <= max_query_cost )
+		return 0;
+
+	osrfLogWarning( OSRF_LOG_MARK, "%s: Rejected query with estimated cost %.0f "
+		"(limit %.0f): %s", modulename, cost, max_query_cost, sql );
+
+	growing_buffer* msg = buffer_init( 128 );
+	buffer_fadd( msg, "%s: Query rejected: estimated cost %.0f exceeds the limit of %.0f",
+		modulename, cost, max_query_cost );
+	char* m = buffer_release( msg );
+	osrfAppSessionStatus( ctx->session, OSRF_STATUS_BADREQUEST, "osrfMethodException",
+		ctx->request, m );
+	free( m );
+
+	return -1;
+}
+
+/**
+	@brief Apply the configured statement_timeout to a query.
+	@param sql The query, which must have been allocated by malloc().
+	@return The query to run in its place.
+
+	If app_settings/statement_timeout is set, we return a new string that prefixes the
+	query with SET LOCAL statement_timeout, and free the original.  Otherwise we return
+	the original.
+
+	PostgreSQL runs a string of several statements as a single transaction, so the SET
+	LOCAL lasts just for this query -- or, inside an explicit transaction, until the end
+	of that transaction.  Either way it needs no round trip of its own, and it can't leak
+	into whatever the drone does next.
+
+	The calling code is responsible for freeing the resulting string by calling free().
+*/
+static char* limitQueryTime( char* sql ) {
+	if( query_timeout <= 0 )
+		return sql;
+
+	growing_buffer* sql_buf = buffer_init( strlen( sql ) + 48 );
+	buffer_fadd( sql_buf, "SET LOCAL statement_timeout = %d; ", query_timeout );
+	OSRF_BUFFER_ADD( sql_buf, sql );
+	free( sql );
+	return buffer_release( sql_buf );
+}
+
+/**
+	@brief Get ready to send rows to the client, in batches if the client asks.
+	@param batch Pointer to the ResponseBatch to be initialized.
+	@param ctx Pointer to the method context.
+	@param query Pointer to the query, which may ask for "batch_responses".
+
+	If the query has "batch_responses":true, and batching is enabled (see
+	oilsSetResponseBatching()), then batchRespond() collects rows and sends them several
+	at a time, as a JSON_ARRAY in a single response.  That way there are fewer messages
+	for the router and the XMPP server to handle.  Otherwise batchRespond() sends each row
+	as a response of its own, the way older clients expect.
+
+	Either way, call endResponseBatch() when done, to send any rows still waiting.
+*/
+static void initResponseBatch( ResponseBatch* batch, osrfMethodContext* ctx,
+		const jsonObject* query ) {
+	batch->ctx = ctx;
+	batch->rows = NULL;
+	batch->bytes = 0;
+	if( response_batch_rows > 0
+			&& obj_is_true( jsonObjectGetKeyConst( query, "batch_responses" )))
+		batch->rows = jsonNewObjectType( JSON_ARRAY );
+}
+
+/**
+	@brief Send a row to the client, or hold it to send later with other rows.
+	@param batch Pointer to a ResponseBatch, as set up by initResponseBatch().
+	@param row Pointer to the row.
+	@param give Boolean: true if we may take over the row, which the caller must then
+		neither use nor free; false if we must leave it alone.
+*/
+static void batchRespond( ResponseBatch* batch, jsonObject* row, int give ) {
+	if( !batch->rows ) {
+		osrfAppRespond( batch->ctx, row );
+		if( give )
+			jsonObjectFree( row );
+		return;
+	}
+
+	if( !batch->rows->size )
+		gettimeofday( &batch->started, NULL );
+
+	if( response_batch_bytes ) {
+		char* json = jsonObjectToJSON( row );
+		batch->bytes += strlen( json );
+		free( json );
+	}
+
+	jsonObjectPush( batch->rows, give ? row : jsonObjectClone( row ));
+
+	int full = batch->rows->size >= (unsigned long) response_batch_rows
+		|| ( response_batch_bytes && batch->bytes >= (size_t) response_batch_bytes );
+
+	if( !full && response_batch_ms ) {
+		struct timeval now;
+		gettimeofday( &now, NULL );
+		long waited = ( now.tv_sec - batch->started.tv_sec ) * 1000
+			+ ( now.tv_usec - batch->started.tv_usec ) / 1000;
+		full = waited >= response_batch_ms;
+	}
+
+	if( full )
+		flushResponseBatch( batch );
+}
+
+/**
+	@brief Send whatever rows are waiting in a ResponseBatch.
+	@param batch Pointer to the ResponseBatch.
+*/
+static void flushResponseBatch( ResponseBatch* batch ) {
+	if( batch->rows && batch->rows->size ) {
+		osrfAppRespond( batch->ctx, batch->rows );
+		jsonObjectFree( batch->rows );
+		batch->rows = jsonNewObjectType( JSON_ARRAY );
+		batch->bytes = 0;
+	}
+}
+
+/**
+	@brief Send whatever rows are waiting in a ResponseBatch, and free its resources.
+	@param batch Pointer to the ResponseBatch.
+*/
+static void endResponseBatch( ResponseBatch* batch ) {
+	flushResponseBatch( batch );
+	jsonObjectFree( batch->rows );
+	batch->rows = NULL;
+}
+
+/**
+	@brief Run a json_query, and either send the results to the client or collect them.
+	@param ctx Pointer to the method context.
+	@param hash Pointer to the query.
+	@param rows Pointer to a JSON_ARRAY in which to collect the results, or NULL to send
+	each one to the client as it comes.
+	@return 0 if successful, or -1 upon error.
+
+	The results are the rows, followed by a keyset token if the query has an "after"
+	clause; or, for a "count_only" query, a single row {"count":n}; or, for an "explain"
+	query, the explanation alone.  Upon error we have told
+	the client about it, and @a rows may hold some results already.
+
+	When sending the rows, we send them in batches if the query asks for
+	"batch_responses" (see initResponseBatch()).  The keyset token still comes by itself.
+*/
+static int runJSONQuery( osrfMethodContext* ctx, jsonObject* hash, jsonObject* rows ) {
+	int err = 0;
+
+	int flags = 0;
+
+	if( obj_is_true( jsonObjectGetKeyConst( hash, "distinct" )))
+		flags |= SELECT_DISTINCT;
+
+	if( obj_is_true( jsonObjectGetKeyConst( hash, "no_i18n" )))
+		flags |= DISABLE_I18N;
+
+	int explain = explainMode( ctx, jsonObjectGetKeyConst( hash, "explain" ));
+	if( explain < 0 )
+		return -1;
+
+	int count_only = obj_is_true( jsonObjectGetKeyConst( hash, "count_only" ));
+
+	// If the client asks us to cache the results, note which classes the query reads
+	int ttl = explain ? 0 : resultCacheTTL( ctx, hash );
+	if( ttl )
+		query_classes = osrfNewStringArray( 4 );
+
+	// When explaining or counting, build the SQL from scratch, so as to have the literal
+	// query rather than an EXECUTE of a prepared statement
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Building SQL ..." );
+	char* sql = ( explain || count_only ) ? NULL : planQuery( ctx, hash, flags );
+	if( !sql ) {
+		clear_query_stack();       // a possibly needless precaution
+		sql = buildQuery( ctx, hash, flags );
+		clear_query_stack();
+	}
+
+	// Return just the number of rows, if asked
+	if( sql && count_only )
+		sql = countingQuery( sql, NULL, NULL, 0 );
+
+	osrfStringArray* classes = query_classes;
+	query_classes = NULL;
+
+	if( !sql ) {
+		osrfStringArrayFree( classes );
+		err = -1;
+		return err;
+	}
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+
+	// Look for cached results
+	char* result_key = NULL;
+	jsonObject* responses = rows;    // what we return, for collecting or caching
+	if( ttl ) {
+		result_key = makeResultKey( hash, flags, classes );
+		osrfStringArrayFree( classes );
+
+		jsonObject* cached = osrfCacheGetObject( "%s", result_key );
+		if( cached && JSON_ARRAY == cached->type ) {
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Returning cached results", modulename );
+			ResponseBatch batch;
+			initResponseBatch( &batch, ctx, hash );
+			unsigned long i;
+			for( i = 0; i < cached->size; ++i ) {
+				jsonObject* cached_row = jsonObjectGetIndex( cached, i );
+				if( rows )
+					jsonObjectPush( rows, jsonObjectClone( cached_row ));
+				else if( i + 1 == cached->size && jsonObjectGetKeyConst( hash, "after" )) {
+					endResponseBatch( &batch );       // the keyset token comes by itself
+					osrfAppRespond( ctx, cached_row );
+				} else
+					batchRespond( &batch, cached_row, 0 );
+			}
+			endResponseBatch( &batch );
+			jsonObjectFree( cached );
+			free( result_key );
+			free( sql );
+			return 0;
+		}
+
+		jsonObjectFree( cached );
+		if( !responses )
+			responses = jsonNewObjectType( JSON_ARRAY );
+	}
+
+	// XXX for now...
+	dbhandle = writehandle;
+
+	// Return the plan instead of the rows, if asked
+	if( explain ) {
+		jsonObject* explanation = explainQuery( ctx, sql, explain );
+		free( sql );
+		if( !explanation )
+			return -1;
+		if( rows )
+			jsonObjectPush( rows, explanation );
+		else {
+			osrfAppRespond( ctx, explanation );
+			jsonObjectFree( explanation );
+		}
+		return 0;
+	}
+
+	if( checkQueryCost( ctx, sql )) {
+		if( responses != rows )
+			jsonObjectFree( responses );
+		free( result_key );
+		free( sql );
+		return -1;
+	}
+	sql = limitQueryTime( sql );
+
+	dbi_result result = dbi_conn_query( dbhandle, sql );
+
+	if( result ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Query returned with no errors" );
+
+		int keyset = ( !count_only && jsonObjectGetKeyConst( hash, "after" )) ? 1 : 0;
+
+		ResponseBatch batch;
+		initResponseBatch( &batch, ctx, hash );
+
+		if( dbi_result_first_row( result )) {
+			/* JSONify the result */
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Query returned at least one row" );
+			unsigned int column_count = 0;
+			FieldmapperColumn* columns = planJSONColumns( result, &column_count );
+
+			do {
+				jsonObject* return_val =
+					oilsMakeJSONFromColumns( result, columns, column_count );
+				if( keyset )
+					jsonObjectFree( takeAfterColumns( return_val ));
+				if( !rows )         // hand it over, unless we're keeping it
+					batchRespond( &batch, return_val, !responses );
+				if( responses )
+					jsonObjectPush( responses, return_val );
+			} while( dbi_result_next_row( result ));
+			free( columns );
+
+		} else {
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s returned no results for query %s", modulename, sql );
+		}
+
+		endResponseBatch( &batch );
+
+		// For keyset pagination, tell the client where to start the next page
+		if( keyset ) {
+			jsonObject* token = makeAfterToken( result, jsonObjectGetKeyConst( hash, "limit" ));
+			if( !rows )
+				osrfAppRespond( ctx, token );
+			if( responses )
+				jsonObjectPush( responses, token );
+			else
+				jsonObjectFree( token );
+		}
+
+		if( ttl )
+			osrfCachePutObject( result_key, responses, ttl );
+
+		/* clean up the query */
+		dbi_result_free( result );
+
+	} else {
+		err = -1;
+		const char* msg;
+		int errnum = dbi_conn_error( dbhandle, &msg );
+		osrfLogError( OSRF_LOG_MARK, "%s: Error with query [%s]: %d %s",
+			modulename, sql, errnum, msg ? msg : "(No description available)" );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_INTERNALSERVERERROR,
+			"osrfMethodException",
+			ctx->request,
+			"Severe query error -- see error log for more details"
+		);
+		if( !oilsIsDBConnected( dbhandle ))
+			osrfAppSessionPanic( ctx->session );
+	}
+
+	if( responses != rows )
+		jsonObjectFree( responses );
+	free( result_key );
+	free( sql );
+	return err;
+}
+
+/**
+	@brief Implement the "json_query" method.
+	@param ctx Pointer to the method context.
+	@return Zero if successful, or -1 if not.
+
+	Method parameters:
+	- query, as a JSON_HASH
+
+	Return to client: the rows that satisfy the query, one per response.
+*/
+int doJSONSearch ( osrfMethodContext* ctx ) {
+	if(osrfMethodVerifyContext( ctx )) {
+		osrfLogError( OSRF_LOG_MARK,  "Invalid method context" );
+		return -1;
+	}
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Received query request" );
+
+	oilsReloadIDL( ctx );
+
+	jsonObject* hash = jsonObjectGetIndex( ctx->params, 0 );
+
+	if( runJSONQuery( ctx, hash, NULL ))
+		return -1;
+
+	osrfAppRespondComplete( ctx, NULL );
+	oilsCheckIDL( ctx );
+	return 0;
+}
+
+/**
+	@brief Implement the "json_query.batch" method.
+	@param ctx Pointer to the method context.
+	@return Zero if successful, or -1 if not.
+
+	Method parameters:
+	- queries, as a JSON_ARRAY of query hashes like those for json_query
+
+	Return to client: one response per query, in order, of the form
+	{"index":n,"rows":[...]}, where n is the position of the query in the array, and the
+	rows are what json_query would have returned for it.
+
+	This saves a screen that needs several unrelated queries the overhead of a request
+	apiece.  The queries run one after another, in the same session and on the same
+	connection, so inside a transaction they all see the same data.  If one fails, we stop
+	there, and the client has the results of those before it.
+*/
+int doJSONBatch ( osrfMethodContext* ctx ) {
+	if(osrfMethodVerifyContext( ctx )) {
+		osrfLogError( OSRF_LOG_MARK,  "Invalid method context" );
+		return -1;
+	}
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Received batch query request" );
+
+	oilsReloadIDL( ctx );
+
+	const jsonObject* queries = jsonObjectGetIndex( ctx->params, 0 );
+	if( !queries || queries->type != JSON_ARRAY ) {
+		osrfLogError( OSRF_LOG_MARK, "%s: Batch query expects an array of queries; found %s",
+			modulename, queries ? json_type( queries->type ) : "nothing" );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_BADREQUEST,
+			"osrfMethodException",
+			ctx->request,
+			"Batch query expects an array of queries"
+		);
+		return -1;
+	}
+
+	unsigned long i;
+	for( i = 0; i < queries->size; ++i ) {
+		jsonObject* rows = jsonNewObjectType( JSON_ARRAY );
+		if( runJSONQuery( ctx, jsonObjectGetIndex( queries, i ), rows )) {
+			osrfLogError( OSRF_LOG_MARK, "%s: Batch query failed at query %lu",
+				modulename, i );
+			jsonObjectFree( rows );
+			return -1;
+		}
+
+		jsonObject* group = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( group, "index", jsonNewNumberObject( (double) i ));
+		jsonObjectSetKey( group, "rows", rows );
+		osrfAppRespond( ctx, group );
+		jsonObjectFree( group );
+	}
+
+	osrfAppRespondComplete( ctx, NULL );
+	oilsCheckIDL( ctx );
+	return 0;
+}
+
+/**
+	@brief Determine whether a fieldmapper search might return the same row more than once.
+	@param query_hash Pointer to the rest of the query, as passed to buildSELECT().
+	@param class_meta Pointer to the class metadata for the core class.
+	@return 1 if a row might be repeated, or 0 if not.
+
+	Only a join can repeat a row of the core class, and only if it can match a row with
+	more than one row of the joined class, as when joining to the child side of a
+	has_many.  A class defined by a source_definition gets no such assurance, since we
+	can't tell whether its primary key is really unique.
+*/
+static int queryMayRepeat( const jsonObject* query_hash, osrfHash* class_meta ) {
+	if( osrfHashGet( class_meta, "source_definition" ))
+		return 1;
+
+	return joinMayRepeat( jsonObjectGetKeyConst( query_hash, "join" ),
+		osrfHashGet( class_meta, "classname" ));
+}
+
+/**
+	@brief Determine whether a JOIN clause might match a row with more than one row.
+	@param join_hash Pointer to the JOIN clause, in any of the forms that searchJOIN()
+	accepts, or NULL.
+	@param left_class Name of the class on the left side of the join.
+	@return 1 if a row might be matched more than once, or 0 if not.
+
+	When in doubt, we say it might.
+*/
+static int joinMayRepeat( const jsonObject* join_hash, const char* left_class ) {
+	if( !join_hash )
+		return 0;
+
+	if( JSON_STRING == join_hash->type )
+		return joinNodeMayRepeat( jsonObjectGetString( join_hash ), NULL, left_class );
+
+	if( JSON_ARRAY == join_hash->type ) {
+		unsigned long i;
+		for( i = 0; i < join_hash->size; ++i )
+			if( joinMayRepeat( jsonObjectGetIndex( join_hash, i ), left_class ))
+				return 1;
+		return 0;
+	}
+
+	if( JSON_HASH != join_hash->type )
+		return 1;
+
+	int repeat = 0;
+	const jsonObject* node;
+	jsonIterator* itr = jsonNewIterator( join_hash );
+	while( !repeat && ( node = jsonIteratorNext( itr )))
+		repeat = joinNodeMayRepeat( itr->key, node, left_class );
+	jsonIteratorFree( itr );
+	return repeat;
+}
+
+/**
+	@brief Determine whether one joined class might match a row with more than one row.
+	@param alias The alias of the joined class.
+	@param node Pointer to the join's options, or NULL if there aren't any.
+	@param left_class Name of the class on the left side of the join.
+	@return 1 if a row might be matched more than once, or 0 if not.
+
+	We find the join column of the joined class the same way searchJOIN() does.  If it's
+	the primary key, and nothing joined to this class can repeat a row either, each row
+	on the left matches at most one row.
+*/
+static int joinNodeMayRepeat( const char* alias, const jsonObject* node,
+		const char* left_class ) {
+
+	const char* class = jsonObjectGetString( jsonObjectGetKeyConst( node, "class" ));
+	if( !class )
+		class = alias;
+
+	osrfHash* left_meta = oilsIDLGetClass( left_class );
+	osrfHash* right_meta = oilsIDLGetClass( class );
+	if( !left_meta || !right_meta || osrfHashGet( right_meta, "source_definition" ))
+		return 1;
+
+	// A RIGHT or FULL join may add rows, and an OR may match any number of them
+	const char* type = jsonObjectGetString( jsonObjectGetKeyConst( node, "type" ));
+	if( type && ( !strcasecmp( type, "right" ) || !strcasecmp( type, "full" )))
+		return 1;
+	const char* filter_op = jsonObjectGetString( jsonObjectGetKeyConst( node, "filter_op" ));
+	if( jsonObjectGetKeyConst( node, "filter" ) && filter_op && !strcasecmp( filter_op, "or" ))
+		return 1;
+
+	const char* fkey  = jsonObjectGetString( jsonObjectGetKeyConst( node, "fkey" ));
+	const char* field = jsonObjectGetString( jsonObjectGetKeyConst( node, "field" ));
+
+	if( !field ) {
+		osrfHash* left_links = osrfHashGet( left_meta, "links" );
+		osrfHash* link = NULL;
+		if( fkey ) {
+			link = osrfHashGet( left_links, fkey );
+		} else {
+			osrfHashIterator* itr = osrfNewHashIterator( left_links );
+			while( ( link = osrfHashIteratorNext( itr ))) {
+				const char* other_class = osrfHashGet( link, "class" );
+				const char* reltype = osrfHashGet( link, "reltype" );
+				if( other_class && !strcmp( other_class, class )
+						&& reltype && strcmp( reltype, "has_many" ))
+					break;
+			}
+			osrfHashIteratorFree( itr );
+		}
+
+		if( link ) {
+			const char* other_class = osrfHashGet( link, "class" );
+			const char* reltype = osrfHashGet( link, "reltype" );
+			if( other_class && !strcmp( other_class, class )
+					&& reltype && strcmp( reltype, "has_many" ))
+				field = osrfHashGet( link, "key" );
+		} else if( !fkey ) {
+			// Look for a link from the joined class back to the left class
+			osrfHashIterator* itr = osrfNewHashIterator( osrfHashGet( right_meta, "links" ));
+			while( ( link = osrfHashIteratorNext( itr ))) {
+				const char* other_class = osrfHashGet( link, "class" );
+				const char* reltype = osrfHashGet( link, "reltype" );
+				if( other_class && !strcmp( other_class, left_class )
+						&& reltype && strcmp( reltype, "has_many" )) {
+					field = osrfHashIteratorKey( itr );
+					break;
+				}
+			}
+			osrfHashIteratorFree( itr );
+		}
+	}
+
+	const char* pkey = osrfHashGet( right_meta, "primarykey" );
+	if( !field || !pkey || strcmp( field, pkey ))
+		return 1;
+
+	return joinMayRepeat( jsonObjectGetKeyConst( node, "join" ), class );
+}
+
+#define KEYSET_EMPTY LLONG_MIN
+
+/**
+	@brief Prepare an empty KeySet.
+	@param set Pointer to the KeySet.
+	@param expected How many keys we expect to add, so that the hash table won't have to
+	grow.
+*/
+static void keySetInit( KeySet* set, unsigned long long expected ) {
+	set->size = 16;
+	while( set->size < expected * 2 && set->size < ( ULONG_MAX >> 2 ))
+		set->size <<= 1;
+	set->ids = NULL;
+	set->count = 0;
+	set->keys = NULL;
+}
+
+/**
+	@brief Choose the slot at which to start looking for an integer key.
+	@param id The key value.
+	@param size The number of slots in the table: a power of two.
+	@return The slot number.
+*/
+static unsigned long keySlot( long long id, unsigned long size ) {
+	unsigned long long h = (unsigned long long) id * 0x9E3779B97F4A7C15ULL;
+	return (unsigned long) ( h ^ ( h >> 32 )) & ( size - 1 );
+}
+
+/**
+	@brief Add a primary key value to a KeySet, unless it's already there.
+	@param set Pointer to the KeySet.
+	@param key Pointer to the key value.
+	@return 1 if the value is new (or NULL, which never matches anything), or 0 if it
+	was already in the set.
+
+	An integer costs a probe or two into a table of long longs, without allocating or
+	formatting anything.
+*/
+static int keySetAdd( KeySet* set, const jsonObject* key ) {
+	if( !key || JSON_NULL == key->type )
+		return 1;
+
+	if( JSON_NUMBER == key->type ) {
+		double d = jsonObjectGetNumber( key );
+		// Within 2^53, where a double holds every integer exactly; so never KEYSET_EMPTY
+		if( d >= -9007199254740992.0 && d <= 9007199254740992.0 && d == (long long) d ) {
+			long long id = (long long) d;
+			if( ( set->count + 1 ) * 2 > set->size || !set->ids ) {
+				// Allocate the table, or double it and rehash what's there
+				unsigned long old_size = set->ids ? set->size : 0;
+				long long* old_ids = set->ids;
+				if( old_ids )
+					set->size <<= 1;
+				set->ids = safe_malloc( set->size * sizeof( long long ));
+				unsigned long i;
+				for( i = 0; i < set->size; ++i )
+					set->ids[ i ] = KEYSET_EMPTY;
+				for( i = 0; i < old_size; ++i ) {
+					if( old_ids[ i ] != KEYSET_EMPTY ) {
+						unsigned long j = keySlot( old_ids[ i ], set->size );
+						while( set->ids[ j ] != KEYSET_EMPTY )
+							j = ( j + 1 ) & ( set->size - 1 );
+						set->ids[ j ] = old_ids[ i ];
+					}
+				}
+				free( old_ids );
+			}
+
+			unsigned long i = keySlot( id, set->size );
+			while( set->ids[ i ] != KEYSET_EMPTY ) {
+				if( set->ids[ i ] == id )
+					return 0;
+				i = ( i + 1 ) & ( set->size - 1 );
+			}
+			set->ids[ i ] = id;
+			++set->count;
+			return 1;
+		}
+	}
+
+	const char* str = jsonObjectGetString( key );
+	if( !str )
+		return 1;
+	if( !set->keys )
+		set->keys = osrfNewHash();
+	else if( osrfHashGet( set->keys, str ))
+		return 0;
+	osrfHashSet( set->keys, set, "%s", str );   // any non-NULL item will do
+	return 1;
+}
+
+/**
+	@brief Free whatever a KeySet has allocated.
+	@param set Pointer to the KeySet.
+*/
+static void keySetClear( KeySet* set ) {
+	free( set->ids );
+	set->ids = NULL;
+	set->count = 0;
+	if( set->keys ) {
+		osrfHashFree( set->keys );
+		set->keys = NULL;
+	}
+}
+
+// The last parameter, err, is used to report an error condition by updating an int owned by
+// the calling code.
+
+// In case of an error, we set *err to -1.  If there is no error, *err is left unchanged.
+// It is the responsibility of the calling code to initialize *err before the
+// call, so that it will be able to make sense of the result.
+
+// Note also that we return NULL if and only if we set *err to -1.  So the err parameter is
+// redundant anyway.
+static jsonObject* doFieldmapperSearch( osrfMethodContext* ctx, osrfHash* class_meta,
+		jsonObject* where_hash, jsonObject* query_hash, int* err ) {
+
+	const char* tz = _sanitize_tz_name(ctx->session->session_tz);
+
+	// XXX for now...
+	dbhandle = writehandle;
+
+	char* core_class = osrfHashGet( class_meta, "classname" );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "entering doFieldmapperSearch() with core_class %s", core_class );
+
+	char* pkey = osrfHashGet( class_meta, "primarykey" );
+
+	if (!ctx->session->userData)
+		(void) initSessionCache( ctx );
+
+	char *methodtype = osrfHashGet( (osrfHash *) ctx->method->userData, "methodtype" );
+	char *inside_verify = osrfHashGet( (osrfHash*) ctx->session->userData, "inside_verify" );
+	int need_to_verify = (inside_verify ? !atoi(inside_verify) : 1);
+
+	int i_respond_directly = 0;
+	int flesh_depth = 0;
+
+	// Only a search or id_list may ask for EXPLAIN, and only at the top level
+	int explain = 0;
+	if( *methodtype == 's' || *methodtype == 'i' ) {
+		explain = explainMode( ctx, jsonObjectGetKeyConst( query_hash, "explain" ));
+		if( explain < 0 ) {
+			*err = -1;
+			return NULL;
+		}
+	}
+
+	// The following two steps are for verifyObjectPCRUD()'s benefit.
+	// 1. get the flesh depth
+	const jsonObject* _tmp = jsonObjectGetKeyConst( query_hash, "flesh" );
+	if( _tmp ) {
+		flesh_depth = (int) jsonObjectGetNumber( _tmp );
+		if( flesh_depth == -1 || flesh_depth > max_flesh_depth )
+			flesh_depth = max_flesh_depth;
+	}
+
+	// If asked, and if we can, flesh in the same statement (see buildFleshColumns())
+	char* flesh_cols = NULL;
+	if( !enforce_pcrud && flesh_depth > 0
+			&& obj_is_true( jsonObjectGetKeyConst( query_hash, "flesh_sql" )))
+		flesh_cols = buildFleshColumns( query_hash, class_meta, flesh_depth );
+	int fleshed_in_sql = flesh_cols ? 1 : 0;
+
+	char* sql = ( explain || flesh_cols ) ? NULL
+		: planSearch( ctx, where_hash, query_hash, class_meta );
+	if( !sql )
+		sql = buildSELECT( where_hash, query_hash, class_meta, ctx, flesh_cols );
+	free( flesh_cols );
+	if( !sql ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Problem building query, returning NULL" );
+		*err = -1;
+		return NULL;
+	}
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+
+	// Setting the timezone if requested and not in a transaction
+	if (!getXactId(ctx)) {
+		if (tz) {
+			setenv("TZ",tz,1);
+			tzset();
+			dbi_result tz_res = dbi_conn_queryf( writehandle, "SET timezone TO '%s'; -- cstore", tz );
+			if( !tz_res ) {
+				osrfLogError( OSRF_LOG_MARK, "%s: Error setting timezone %s", modulename, tz);
+				osrfAppSessionStatus( ctx->session, OSRF_STATUS_INTERNALSERVERERROR,
+					"osrfMethodException", ctx->request, "Error setting timezone" );
+				if( !oilsIsDBConnected( writehandle )) {
+					osrfAppSessionPanic( ctx->session );
+					return NULL;
+				}
+			} else {
+				dbi_result_free( tz_res );
+			}
+		} else {
+			unsetenv("TZ");
+			tzset();
+			dbi_result res = dbi_conn_queryf( writehandle, "SET timezone TO DEFAULT; -- cstore" );
+			if( !res ) {
+				osrfLogError( OSRF_LOG_MARK, "%s: Error resetting timezone", modulename);
+				if( !oilsIsDBConnected( writehandle )) {
+					osrfAppSessionPanic( ctx->session );
+					return NULL;
+				}
+			} else {
+				dbi_result_free( res );
+			}
+		}
+	}
+
+	// Return the plan instead of the rows, if asked; the caller gets no rows
+	if( explain ) {
+		jsonObject* explanation = explainQuery( ctx, sql, explain );
+		free( sql );
+		if( !explanation ) {
+			*err = -1;
+			return NULL;
+		}
+		osrfAppRespond( ctx, explanation );
+		jsonObjectFree( explanation );
+		return jsonNewObjectType( JSON_ARRAY );
+	}
+
+	// Guard against runaway searches.  Spare the searches we do for fleshing or for
+	// checking permissions, which come after the top level has noted its result size.
+	if( ( *methodtype == 's' || *methodtype == 'i' || *methodtype == 'e'
+			|| !strcmp( methodtype, "count" )) && !osrfHashGetFmt(
+			(osrfHash*) ctx->session->userData, "rs_size_req_%d", ctx->request )) {
+		if( checkQueryCost( ctx, sql )) {
+			free( sql );
+			*err = -1;
+			return NULL;
+		}
+		sql = limitQueryTime( sql );
+	}
+
+	dbi_result result = dbi_conn_query( dbhandle, sql );
+
+	if( NULL == result ) {
+		const char* msg;
+		int errnum = dbi_conn_error( dbhandle, &msg );
+		osrfLogError(OSRF_LOG_MARK, "%s: Error retrieving %s with query [%s]: %d %s",
+			modulename, osrfHashGet( class_meta, "fieldmapper" ), sql, errnum,
+			msg ? msg : "(No description available)" );
 		if( !oilsIsDBConnected( dbhandle ))
 			osrfAppSessionPanic( ctx->session );
+		osrfAppSessionStatus(
+			ctx->session,
+			OSRF_STATUS_INTERNALSERVERERROR,
+			"osrfMethodException",
+			ctx->request,
+			"Severe query error -- see error log for more details"
+		);
+		*err = -1;
+		free( sql );
+		return NULL;
+
+	} else {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Query returned with no errors" );
+
+	}
+
+	jsonObject* res_list = jsonNewObjectType( JSON_ARRAY );
+	jsonObject* row_obj = NULL;
+
+	// 2. figure out one consistent rs_size for verifyObjectPCRUD to use
+	// over the whole life of this request.  This means if we've already set
+	// up a rs_size_req_%d, do nothing.
+	//	a. Incidentally, we can also use this opportunity to set i_respond_directly
+	int *rs_size = osrfHashGetFmt( (osrfHash *) ctx->session->userData, "rs_size_req_%d", ctx->request );
+	if( !rs_size ) {	// pointer null, so value not set in hash
+		// i_respond_directly can only be true at the /top/ of a recursive search, if even that.
+		i_respond_directly = ( *methodtype == 'r' || *methodtype == 'i' || *methodtype == 's' );
+
+		rs_size = (int *) safe_malloc( sizeof(int) );	// will be freed by sessionDataFree()
+		unsigned long long result_count = dbi_result_get_numrows( result );
+		*rs_size = (int) result_count * (flesh_depth + 1);	// yes, we could lose some bits, but come on
+		osrfHashSet( (osrfHash *) ctx->session->userData, rs_size, "rs_size_req_%d", ctx->request );
+	}
+
+	if( dbi_result_first_row( result )) {
+
+		// Convert each row to a JSON_ARRAY of column values, and enclose those objects
+		// in a JSON_ARRAY of rows.  If two or more rows have the same key value, then
+		// eliminate the duplicates -- unless the query can't produce any.
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Query returned at least one row" );
+		int dedup = queryMayRepeat( query_hash, class_meta );
+		KeySet seen;
+		keySetInit( &seen, dedup ? dbi_result_get_numrows( result ) : 0 );
+		osrfHash* pkey_def = pkey ? osrfHashGet( osrfHashGet( class_meta, "fields" ), pkey )
+			: NULL;
+		const char* pkey_pos = pkey_def ? osrfHashGet( pkey_def, "array_position" ) : NULL;
+		unsigned long pkey_position = pkey_pos ? atoi( pkey_pos ) : 0;
+		if( !pkey_pos )
+			dedup = 0;
+		unsigned int column_count = 0;
+		FieldmapperColumn* columns =
+			planFieldmapperColumns( result, class_meta, &column_count );
+		do {
+			row_obj = oilsMakeFieldmapperFromResult( result, class_meta,
+				columns, column_count );
+			if( dedup && !keySetAdd( &seen, jsonObjectGetIndex( row_obj, pkey_position ))) {
+				jsonObjectFree( row_obj );
+			} else {
+				if( !enforce_pcrud || !need_to_verify ||
+						verifyObjectPCRUD( ctx, class_meta, row_obj, 0 /* means check user data for rs_size */ )) {
+					if( fleshed_in_sql )
+						fleshFromResult( result, row_obj, class_meta, query_hash, flesh_depth );
+					jsonObjectPush( res_list, row_obj );
+				} else
+					jsonObjectFree( row_obj );
+			}
+		} while( dbi_result_next_row( result ));
+		free( columns );
+		keySetClear( &seen );
+
+	} else {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s returned no results for query %s",
+			modulename, sql );
+	}
+
+	// For keyset pagination, we'll tell the client where to start the next page.  That
+	// depends on the last row from the database, whether or not we return it.
+	jsonObject* after_token = NULL;
+	if( i_respond_directly && jsonObjectGetKeyConst( query_hash, "after" ))
+		after_token = makeAfterToken( result, jsonObjectGetKeyConst( query_hash, "limit" ));
+
+	/* clean up the query */
+	dbi_result_free( result );
+	free( sql );
+
+	// If we're asked to flesh, and there's anything to flesh, then flesh it
+	// (formerly we would skip fleshing if in pcrud mode, but now we support
+	// fleshing even in PCRUD).
+	if( res_list->size ) {
+		jsonObject* temp_blob;	// We need a non-zero flesh depth, and a list of fields to flesh
+		jsonObject* flesh_fields; 
+		jsonObject* flesh_blob = NULL;
+		osrfStringArray* link_fields = NULL;
+		osrfHash* links = NULL;
+		int want_flesh = 0;
+
+		if( query_hash && !fleshed_in_sql ) {
+			temp_blob = jsonObjectGetKey( query_hash, "flesh_fields" );
+			if( temp_blob && flesh_depth > 0 ) {
+
+				flesh_blob = jsonObjectClone( temp_blob );
+				flesh_fields = jsonObjectGetKey( flesh_blob, core_class );
+
+				links = osrfHashGet( class_meta, "links" );
+
+				// Make an osrfStringArray of the names of fields to be fleshed
+				if( flesh_fields ) {
+					if( flesh_fields->size == 1 ) {
+						const char* _t = jsonObjectGetString(
+							jsonObjectGetIndex( flesh_fields, 0 ) );
+						if( !strcmp( _t, "*" ))
+							link_fields = osrfHashKeys( links );
+					}
+
+					if( !link_fields ) {
+						jsonObject* _f;
+						link_fields = osrfNewStringArray( 1 );
+						jsonIterator* _i = jsonNewIterator( flesh_fields );
+						while ((_f = jsonIteratorNext( _i ))) {
+							osrfStringArrayAdd( link_fields, jsonObjectGetString( _f ) );
+						}
+						jsonIteratorFree( _i );
+					}
+				}
+				want_flesh = link_fields ? 1 : 0;
+			}
+		}
+
+		osrfHash* fields = osrfHashGet( class_meta, "fields" );
+
+		// The outermost search to flesh anything owns the identity map, which lasts
+		// until all the fleshing for the request is done
+		int owns_identity_map = 0;
+		if( want_flesh && !identity_map ) {
+			identity_map = osrfNewHash();
+			osrfHashSetCallback( identity_map, &identityMapFree );
+			owns_identity_map = 1;
+		}
+
+		// Look up each link once, and build the query for its kids, before visiting
+		// any rows.  Every row uses the same query, apart from the key value.
+		FleshLink* flesh_links = NULL;
+		unsigned int flesh_link_count = 0;
+		if( want_flesh )
+			flesh_links = planFleshLinks( class_meta, fields, links, link_fields,
+				flesh_blob, query_hash, flesh_depth, need_to_verify, &flesh_link_count );
+
+		// Flesh one link at a time.  Where we can, fetch the kids for all the rows
+		// at once; otherwise fetch them row by row.
+		unsigned int link_idx;
+		for( link_idx = 0; link_idx < flesh_link_count; ++link_idx ) {
+			FleshLink* fl = flesh_links + link_idx;
+			int rc = 0;
+
+			if( fl->identities ) {
+				rc = fleshFromIdentities( ctx, fl, res_list, err );
+			} else if( fl->count_only && fl->key_position >= 0 && res_list->size > 1 ) {
+				rc = fleshCounts( ctx, fl, res_list, err );
+			} else if( fl->batch && res_list->size > 1 ) {
+				rc = fleshAllRows( ctx, fl, res_list, err );
+			} else {
+				jsonObject* cur;
+				unsigned long res_idx = 0;
+				while( !rc && (cur = jsonObjectGetIndex( res_list, res_idx++ ) ))
+					rc = fleshRow( ctx, fl, cur, err );
+			}
+
+			if( rc ) {
+				freeFleshLinks( flesh_links, flesh_link_count );
+				if( owns_identity_map ) {
+					osrfHashFree( identity_map );
+					identity_map = NULL;
+				}
+				osrfStringArrayFree( link_fields );
+				jsonObjectFree( res_list );
+				jsonObjectFree( flesh_blob );
+				jsonObjectFree( after_token );
+				return NULL;
+			}
+		}
+
+		// Iterate over the JSON_ARRAY of rows
+		if( i_respond_directly ) {
+			ResponseBatch batch;
+			initResponseBatch( &batch, ctx, query_hash );
+			jsonObject* cur;
+			unsigned long res_idx = 0;
+			while((cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+				if ( *methodtype == 'i' ) {
+					batchRespond( &batch, (jsonObject*)
+						oilsFMGetObject( cur, osrfHashGet( class_meta, "primarykey" ) ), 0 );
+				} else {
+					batchRespond( &batch, cur, 0 );
+				}
+			}
+			endResponseBatch( &batch );
+		}
+		freeFleshLinks( flesh_links, flesh_link_count );
+		if( owns_identity_map ) {
+			osrfHashFree( identity_map );
+			identity_map = NULL;
+		}
+		jsonObjectFree( flesh_blob );
+		osrfStringArrayFree( link_fields );
+	}
+
+	if( i_respond_directly ) {
+		if( after_token ) {
+			osrfAppRespond( ctx, after_token );
+			jsonObjectFree( after_token );
+		}
+		jsonObjectFree( res_list );
+		return jsonNewObjectType( JSON_ARRAY );
+	} else {
+		return res_list;
+	}
+}
+
+/**
+	@brief Prepare to flesh the links of a set of rows.
+	@param class_meta Pointer to the IDL definition of the class being fleshed.
+	@param fields Pointer to the field definitions of that class.
+	@param links Pointer to the link definitions of that class.
+	@param link_fields Pointer to the names of the links to be fleshed.
+	@param flesh_blob Pointer to our copy of flesh_fields, which we may update.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param flesh_depth How many levels of fleshing remain, including this one.
+	@param need_to_verify Boolean: true if PCRUD must check permissions on the kids.
+	@param count Pointer through which to return the number of FleshLinks.
+	@return Pointer to an array of FleshLinks, to be freed by freeFleshLinks().
+
+	We skip any name in @a link_fields that isn't a valid link.  For each one that is, we
+	look up what we need from the IDL, and build the query for the kids, so that we can
+	do all of that once instead of once per row.  The query is the same for every row
+	except for the key value in the WHERE clause.
+
+	For a mapped link, we add the mapped field to @a flesh_blob, so that the linking rows
+	get fleshed with the objects they map to.  We do that for all the links before we
+	build any queries, so that every row sees the same @a flesh_blob.
+*/
+static FleshLink* planFleshLinks( osrfHash* class_meta, osrfHash* fields, osrfHash* links,
+		osrfStringArray* link_fields, jsonObject* flesh_blob, const jsonObject* query_hash,
+		int flesh_depth, int need_to_verify, unsigned int* count ) {
+
+	const char* core_class = osrfHashGet( class_meta, "classname" );
+	FleshLink* flesh_links = safe_malloc( ( link_fields->size + 1 ) * sizeof( FleshLink ));
+	unsigned int link_count = 0;
+
+	int i = 0;
+	const char* link_field;
+	while( (link_field = osrfStringArrayGetString( link_fields, i++ )) ) {
+
+		osrfHash* kid_link = osrfHashGet( links, link_field );
+		if( !kid_link )
+			continue;     // Not a link field; skip it
+
+		osrfHash* field = osrfHashGet( fields, link_field );
+		if( !field )
+			continue;     // Not a field at all; skip it (IDL is ill-formed)
+
+		osrfHash* kid_idl = oilsIDLGetClass( osrfHashGet( kid_link, "class" ));
+		if( !kid_idl )
+			continue;   // The class it links to doesn't exist; skip it
+
+		const char* reltype = osrfHashGet( kid_link, "reltype" );
+		if( !reltype )
+			continue;   // No reltype; skip it (IDL is ill-formed)
+
+		FleshLink* fl = flesh_links + link_count++;
+		memset( fl, 0, sizeof( FleshLink ));
+		fl->name = link_field;
+		fl->link = kid_link;
+		fl->kid_class = kid_idl;
+		fl->position = (unsigned long) atoi( osrfHashGet( field, "array_position" ));
+		fl->has_many = !strcmp( reltype, "has_many" );
+		fl->map_position = -1;
+		fl->key_position = -1;
+
+		osrfHash* key_field = osrfHashGet( osrfHashGet( kid_idl, "fields" ),
+			osrfHashGet( kid_link, "key" ));
+		if( key_field )
+			fl->key_position = atoi( osrfHashGet( key_field, "array_position" ));
+
+		osrfHash* value_field = field;
+
+		if(    !strcmp( reltype, "has_many" )
+			|| !strcmp( reltype, "might_have" ) ) { // has_many or might_have
+			value_field = osrfHashGet(
+				fields, osrfHashGet( class_meta, "primarykey" ) );
+		}
+		fl->value_position =
+			(unsigned long) atoi( osrfHashGet( value_field, "array_position" ));
+
+		int kid_has_controller = osrfStringArrayContains( osrfHashGet(kid_idl, "controller"), modulename );
+		// fleshing pcrud case: we require the controller in need_to_verify mode
+		if ( !kid_has_controller && enforce_pcrud && need_to_verify ) {
+			osrfLogInfo( OSRF_LOG_MARK, "%s is not listed as a controller for %s; moving on", modulename, core_class );
+			fl->no_controller = 1;
+			continue;
+		}
+
+		osrfStringArray* link_map = osrfHashGet( kid_link, "map" );
+		fl->map_size = link_map->size;
+
+		if( link_map->size > 0 ) {
+			jsonObject* _kid_key = jsonNewObjectType( JSON_ARRAY );
+			jsonObjectPush(
+				_kid_key,
+				jsonNewObject( osrfStringArrayGetString( link_map, 0 ) )
+			);
+
+			jsonObjectSetKey(
+				flesh_blob,
+				osrfHashGet( kid_link, "class" ),
+				_kid_key
+			);
+
+			osrfHash* mapped_field = osrfHashGet( osrfHashGet( kid_idl, "fields" ),
+				osrfStringArrayGetString( link_map, 0 ));
+			if( mapped_field )
+				fl->map_position = atoi( osrfHashGet( mapped_field, "array_position" ));
+		};
+
+		OILS_LOG_DEBUG(
+			OSRF_LOG_MARK,
+			"Link field: %s, remote class: %s, fkey: %s, reltype: %s",
+			osrfHashGet( kid_link, "field" ),
+			osrfHashGet( kid_link, "class" ),
+			osrfHashGet( kid_link, "key" ),
+			osrfHashGet( kid_link, "reltype" )
+		);
+	}
+
+	// Now build the queries
+	unsigned int n;
+	for( n = 0; n < link_count; ++n ) {
+		FleshLink* fl = flesh_links + n;
+		if( fl->no_controller )
+			continue;
+
+		// construct WHERE clause; each row supplies its own key value
+		fl->where_clause = jsonNewObjectType( JSON_HASH );
+
+		// For a has_many, the client may want just the number of kids
+		if( fl->has_many && fleshOption( query_hash, "flesh_count", core_class, fl->name )) {
+			fl->count_only = 1;
+			continue;
+		}
+
+		// construct the rest of the query, mostly
+		// by copying pieces of the previous level of query
+		jsonObject* rest_of_query = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( rest_of_query, "flesh",
+			jsonNewNumberObject( flesh_depth - 1 + fl->map_size )
+		);
+
+		if( flesh_blob )
+			jsonObjectSetKey( rest_of_query, "flesh_fields",
+				jsonObjectClone( flesh_blob ));
+
+		// Pass the per-link options down, for deeper levels of fleshing
+		static const char* flesh_options[] =
+			{ "flesh_limit", "flesh_order_by", "flesh_count", NULL };
+		int opt;
+		for( opt = 0; flesh_options[ opt ]; ++opt ) {
+			const jsonObject* option =
+				jsonObjectGetKeyConst( query_hash, flesh_options[ opt ] );
+			if( option )
+				jsonObjectSetKey( rest_of_query, flesh_options[ opt ],
+					jsonObjectClone( option ));
+		}
+
+		// A has_many may have its own ordering and limit
+		const jsonObject* kid_order = fl->has_many ? fleshOption( query_hash,
+			"flesh_order_by", core_class, fl->name ) : NULL;
+		const jsonObject* kid_limit = fl->has_many ? fleshOption( query_hash,
+			"flesh_limit", core_class, fl->name ) : NULL;
+
+		if( kid_order ) {
+			jsonObjectSetKey( rest_of_query, "order_by",
+				jsonObjectClone( kid_order ));
+		} else if( jsonObjectGetKeyConst( query_hash, "order_by" )) {
+			jsonObjectSetKey( rest_of_query, "order_by",
+				jsonObjectClone( jsonObjectGetKeyConst( query_hash, "order_by" ))
+			);
+		}
+
+		if( kid_limit )
+			jsonObjectSetKey( rest_of_query, "limit", jsonObjectClone( kid_limit ));
+
+		const jsonObject* select = jsonObjectGetKeyConst( query_hash, "select" );
+		if( select ) {
+			jsonObjectSetKey( rest_of_query, "select", jsonObjectClone( select ));
+		}
+
+		fl->rest_of_query = rest_of_query;
+
+		// We can fetch the kids for all the rows at once, and sort them out
+		// afterwards, provided that: we know where to find the key in each kid;
+		// and the kids will include the key.
+		fl->batch = fl->key_position >= 0;
+		if( fl->batch && select ) {
+			const jsonObject* kid_select = jsonObjectGetKeyConst(
+				select, osrfHashGet( fl->kid_class, "classname" ));
+			if( kid_select ) {
+				fl->batch = 0;
+				if( JSON_ARRAY == kid_select->type ) {
+					const char* key = osrfHashGet( fl->link, "key" );
+					unsigned long c;
+					for( c = 0; c < kid_select->size; ++c ) {
+						const char* col = jsonObjectGetString(
+							jsonObjectGetIndex( kid_select, c ));
+						if( col && !strcmp( col, key )) {
+							fl->batch = 1;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		// A limit applies to each row's kids, not to all of them together
+		if( fl->batch && kid_limit ) {
+			jsonObject* limit_per = jsonNewObjectType( JSON_HASH );
+			jsonObjectSetKey( limit_per, "field",
+				jsonNewObject( osrfHashGet( fl->link, "key" )));
+			jsonObjectSetKey( limit_per, "limit", jsonObjectClone( kid_limit ));
+			fl->batch_query = jsonObjectClone( rest_of_query );
+			jsonObjectRemoveKey( fl->batch_query, "limit" );
+			jsonObjectSetKey( fl->batch_query, "limit_per", limit_per );
+		}
+
+		// A has_a links to a row by its primary key, so the same kid may turn up again
+		// and again.  Fetch each one only once per request.
+		if( fl->batch && fl->map_position < 0 && identity_map
+				&& !strcmp( osrfHashGet( fl->link, "reltype" ), "has_a" )
+				&& !strcmp( osrfHashGet( fl->link, "key" ),
+					osrfHashGet( fl->kid_class, "primarykey" )))
+			fl->identities = identityMapFor( osrfHashGet( fl->kid_class, "classname" ),
+				rest_of_query, enforce_pcrud && need_to_verify );
+	}
+
+	*count = link_count;
+	return flesh_links;
+}
+
+/**
+	@brief Find the part of the identity map for a given class and query.
+	@param class Name of the class of the kids.
+	@param rest_of_query Pointer to the query used to fetch and flesh the kids.
+	@param verified Boolean: true if PCRUD checks permissions on the kids.
+	@return Pointer to an osrfHash of kids already fetched with that query, keyed on
+		primary key; or NULL if there's no identity map.
+
+	While fleshing a request, we keep each has_a kid we fetch in an identity map, so
+	that when another row links to the same kid, at any level of fleshing, we can copy
+	it instead of fetching it again.  We keep a kid that we looked for and didn't find
+	as a JSON_NULL, so that we don't look for it again either.
+
+	Since the query determines how the kid is fleshed, and which columns it has, the
+	identity map is keyed on the class and the query, and each entry is itself an
+	osrfHash keyed on primary key.
+
+	PCRUD's own lookups within verifyObjectPCRUD() fetch and flesh without checking
+	permissions.  What they find must not be handed to a search that does check them, so
+	the key includes whether the kids were verified.  The outermost call to doFieldmapperSearch() that
+	does any fleshing creates the identity map, and frees it when it's done.
+*/
+static osrfHash* identityMapFor( const char* class, const jsonObject* rest_of_query,
+		int verified ) {
+	if( !identity_map )
+		return NULL;
+
+	char* query_text = jsonObjectToJSON( rest_of_query );
+	growing_buffer* key_buf = buffer_init( 128 );
+	buffer_fadd( key_buf, "%s %s %s", class, verified ? "verified" : "unverified",
+		query_text );
+	free( query_text );
+
+	osrfHash* identities = osrfHashGet( identity_map, OSRF_BUFFER_C_STR( key_buf ));
+	if( !identities ) {
+		identities = osrfNewHash();
+		osrfHashSetCallback( identities, &identityFree );
+		osrfHashSet( identity_map, identities, OSRF_BUFFER_C_STR( key_buf ));
+	}
+
+	buffer_free( key_buf );
+	return identities;
+}
+
+static void identityMapFree( char* key, void* item ) {
+	osrfHashFree( (osrfHash*) item );
+}
+
+static void identityFree( char* key, void* item ) {
+	jsonObjectFree( (jsonObject*) item );
+}
+
+/**
+	@brief Free an array of FleshLinks and the queries they own.
+	@param flesh_links Pointer to the array, as returned by planFleshLinks().
+	@param count The number of FleshLinks in the array.
+*/
+static void freeFleshLinks( FleshLink* flesh_links, unsigned int count ) {
+	if( !flesh_links )
+		return;
+
+	unsigned int i;
+	for( i = 0; i < count; ++i ) {
+		jsonObjectFree( flesh_links[ i ].where_clause );
+		jsonObjectFree( flesh_links[ i ].rest_of_query );
+		jsonObjectFree( flesh_links[ i ].batch_query );
+	}
+	free( flesh_links );
+}
+
+/**
+	@brief Flesh one link field of one row.
+	@param ctx Pointer to the method context.
+	@param fl Pointer to a FleshLink describing the link.
+	@param cur Pointer to the row to be fleshed.
+	@param err Pointer through which to report an error.
+	@return Zero if successful, or -1 if not.
+*/
+static int fleshRow( osrfMethodContext* ctx, FleshLink* fl, jsonObject* cur, int* err ) {
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Starting to flesh %s", fl->name );
+
+	// fleshing pcrud case: we require the controller in need_to_verify mode
+	if( fl->no_controller ) {
+		jsonObjectSetIndex( cur, fl->position,
+			jsonNewObjectType( fl->has_many ? JSON_ARRAY : JSON_NULL ));
+		return 0;
 	}
 
-	free( sql );
-	return err;
+	const char* search_key = jsonObjectGetString(
+		jsonObjectGetIndex( cur, fl->value_position ));
+
+	if( !search_key ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Nothing to search for!" );
+		return 0;
+	}
+
+	// Point the WHERE clause at this row
+	jsonObjectSetKey( fl->where_clause,
+		osrfHashGet( fl->link, "key" ), jsonNewObject( search_key ));
+
+	// For a has_many, the client may want just the number of kids
+	if( fl->count_only ) {
+		long long kid_count = 0;
+		if( countMatches( ctx, fl->kid_class, fl->where_clause, NULL, 0,
+				&kid_count )) {
+			*err = -1;
+			return -1;
+		}
+		jsonObjectSetIndex( cur, fl->position,
+			jsonNewNumberObject( (double) kid_count ));
+		return 0;
+	}
+
+	// do the query, recursively, to expand the fleshable field
+	jsonObject* kids = doFieldmapperSearch( ctx, fl->kid_class,
+		fl->where_clause, fl->rest_of_query, err );
+
+	if( *err )
+		return -1;
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Search for %s return %d linked objects",
+		osrfHashGet( fl->link, "class" ), kids->size );
+
+	// For a mapped link, replace each linking row with the object it maps to,
+	// moving that object rather than copying it
+	if( fl->map_position >= 0 ) {
+		unsigned long k;
+		for( k = 0; k < kids->size; ++k ) {
+			jsonObject* mapped = jsonObjectExtractIndex(
+				jsonObjectGetIndex( kids, k ), (unsigned long) fl->map_position );
+			jsonObjectSetIndex( kids, k, mapped );
+		}
+	}
+
+	// Hand the kids over to the parent row
+	if( fl->has_many ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Storing fleshed objects in %s", fl->name );
+		jsonObjectSetIndex( cur, fl->position, kids );
+		kids = NULL;
+	} else if( kids->size > 0 ) {   // has_a or might_have
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Storing fleshed objects in %s", fl->name );
+		jsonObjectSetIndex( cur, fl->position, jsonObjectExtractIndex( kids, 0 ));
+	}
+
+	jsonObjectFree( kids );
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Fleshing of %s complete", fl->name );
+	if( OILS_LOG_ENABLED( OSRF_LOG_DEBUG )) {
+		char* json = jsonObjectToJSON( cur );
+		osrfLogDebug( OSRF_LOG_MARK, "%s", json );
+		free( json );
+	}
+	return 0;
 }
 
-// The last parameter, err, is used to report an error condition by updating an int owned by
-// the calling code.
+/**
+	@brief Flesh a has_a field of every row in a result set, by way of the identity map.
+	@param ctx Pointer to the method context.
+	@param fl Pointer to a FleshLink describing the link.
+	@param res_list Pointer to a JSON_ARRAY of rows to be fleshed.
+	@param err Pointer through which to report an error.
+	@return Zero if successful, or -1 if not.
 
-// In case of an error, we set *err to -1.  If there is no error, *err is left unchanged.
-// It is the responsibility of the calling code to initialize *err before the
-// call, so that it will be able to make sense of the result.
+	We fetch, with a single query, only those kids that aren't already in the identity
+	map (see identityMapFor()), and add them to it.  Then each row gets a copy of its
+	kid from the identity map.
+*/
+static int fleshFromIdentities( osrfMethodContext* ctx, FleshLink* fl,
+		jsonObject* res_list, int* err ) {
 
-// Note also that we return NULL if and only if we set *err to -1.  So the err parameter is
-// redundant anyway.
-static jsonObject* doFieldmapperSearch( osrfMethodContext* ctx, osrfHash* class_meta,
-		jsonObject* where_hash, jsonObject* query_hash, int* err ) {
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Starting to flesh %s for %lu rows from identity map",
+		fl->name, (unsigned long) res_list->size );
 
-	const char* tz = _sanitize_tz_name(ctx->session->session_tz);
+	// Collect the distinct key values that we haven't looked for yet
+	osrfHash* wanted = osrfNewHash();
+	jsonObject* keys = jsonNewObjectType( JSON_ARRAY );
+	jsonObject* cur;
+	unsigned long res_idx = 0;
+	while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+		const char* search_key = jsonObjectGetString(
+			jsonObjectGetIndex( cur, fl->value_position ));
+		if( search_key && !osrfHashGet( fl->identities, search_key )
+				&& !osrfHashGet( wanted, search_key )) {
+			jsonObject* key_obj = jsonNewObject( search_key );
+			osrfHashSet( wanted, key_obj, search_key );
+			jsonObjectPush( keys, key_obj );
+		}
+	}
+	osrfHashFree( wanted );
 
-	// XXX for now...
-	dbhandle = writehandle;
+	if( keys->size > 0 ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Fetching %lu new %s objects",
+			(unsigned long) keys->size, osrfHashGet( fl->link, "class" ));
 
-	char* core_class = osrfHashGet( class_meta, "classname" );
-	osrfLogDebug( OSRF_LOG_MARK, "entering doFieldmapperSearch() with core_class %s", core_class );
+		jsonObjectSetKey( fl->where_clause, osrfHashGet( fl->link, "key" ), keys );
 
-	char* pkey = osrfHashGet( class_meta, "primarykey" );
+		jsonObject* kids = doFieldmapperSearch( ctx, fl->kid_class,
+			fl->where_clause, fl->rest_of_query, err );
+		if( *err )
+			return -1;
 
-	if (!ctx->session->userData)
-		(void) initSessionCache( ctx );
+		unsigned long k;
+		for( k = 0; k < kids->size; ++k ) {
+			jsonObject* kid = jsonObjectExtractIndex( kids, k );
+			const char* kid_key = jsonObjectGetString(
+				jsonObjectGetIndex( kid, (unsigned long) fl->key_position ));
+			if( kid_key && !osrfHashGet( fl->identities, kid_key ))
+				osrfHashSet( fl->identities, kid, kid_key );
+			else
+				jsonObjectFree( kid );
+		}
+		jsonObjectFree( kids );
 
-	char *methodtype = osrfHashGet( (osrfHash *) ctx->method->userData, "methodtype" );
-	char *inside_verify = osrfHashGet( (osrfHash*) ctx->session->userData, "inside_verify" );
-	int need_to_verify = (inside_verify ? !atoi(inside_verify) : 1);
+		// Remember the ones we didn't find, too
+		for( k = 0; k < keys->size; ++k ) {
+			const char* key = jsonObjectGetString( jsonObjectGetIndex( keys, k ));
+			if( !osrfHashGet( fl->identities, key ))
+				osrfHashSet( fl->identities, jsonNewObject( NULL ), key );
+		}
+	} else {
+		jsonObjectFree( keys );
+	}
 
-	int i_respond_directly = 0;
-	int flesh_depth = 0;
+	// Hand out copies to the rows
+	res_idx = 0;
+	while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+		const char* search_key = jsonObjectGetString(
+			jsonObjectGetIndex( cur, fl->value_position ));
+		const jsonObject* kid = search_key ? osrfHashGet( fl->identities, search_key ) : NULL;
+		if( kid && JSON_NULL != kid->type )
+			jsonObjectSetIndex( cur, fl->position, jsonObjectClone( kid ));
+	}
 
-	char* sql = buildSELECT( where_hash, query_hash, class_meta, ctx );
-	if( !sql ) {
-		osrfLogDebug( OSRF_LOG_MARK, "Problem building query, returning NULL" );
-		*err = -1;
-		return NULL;
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Fleshing of %s complete", fl->name );
+	return 0;
+}
+
+/**
+	@brief Flesh one link field of every row in a result set, with a single query.
+	@param ctx Pointer to the method context.
+	@param fl Pointer to a FleshLink describing the link.
+	@param res_list Pointer to a JSON_ARRAY of rows to be fleshed.
+	@param err Pointer through which to report an error.
+	@return Zero if successful, or -1 if not.
+
+	Instead of one query per row, we issue one query for the kids of all the rows, with
+	an IN list of the distinct key values, and then hand each kid to the row(s) it
+	belongs to.  Since the query is ordered as it would be for a single row, each row
+	gets its kids in the same order as before.  For a flesh_limit, the query limits the
+	kids for each key value instead of all of them together (see "limit_per" under
+	buildSELECT()).
+
+	A kid goes to the first row that wants it without being copied.  Any other row
+	that wants the same kid, as when many rows have the same has_a, gets a copy.
+*/
+static int fleshAllRows( osrfMethodContext* ctx, FleshLink* fl, jsonObject* res_list,
+		int* err ) {
+
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Starting to flesh %s for %lu rows",
+		fl->name, (unsigned long) res_list->size );
+
+	// Collect the distinct key values.  For each one, set up an empty JSON_ARRAY
+	// to hold the kids (for has_many) or a JSON_NULL to hold its kid (otherwise).
+	osrfHash* kid_map = osrfNewHash();
+	jsonObject* keys = jsonNewObjectType( JSON_ARRAY );
+	jsonObject* cur;
+	unsigned long res_idx = 0;
+	while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+		const char* search_key = jsonObjectGetString(
+			jsonObjectGetIndex( cur, fl->value_position ));
+		if( search_key && !osrfHashGet( kid_map, search_key )) {
+			osrfHashSet( kid_map,
+				jsonNewObjectType( fl->has_many ? JSON_ARRAY : JSON_NULL ), search_key );
+			jsonObjectPush( keys, jsonNewObject( search_key ));
+		}
 	}
 
-	osrfLogDebug( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+	int rc = 0;
+	if( keys->size > 0 ) {
+		jsonObjectSetKey( fl->where_clause, osrfHashGet( fl->link, "key" ), keys );
+		keys = NULL;
 
-	// Setting the timezone if requested and not in a transaction
-	if (!getXactId(ctx)) {
-		if (tz) {
-			setenv("TZ",tz,1);
-			tzset();
-			dbi_result tz_res = dbi_conn_queryf( writehandle, "SET timezone TO '%s'; -- cstore", tz );
-			if( !tz_res ) {
-				osrfLogError( OSRF_LOG_MARK, "%s: Error setting timezone %s", modulename, tz);
-				osrfAppSessionStatus( ctx->session, OSRF_STATUS_INTERNALSERVERERROR,
-					"osrfMethodException", ctx->request, "Error setting timezone" );
-				if( !oilsIsDBConnected( writehandle )) {
-					osrfAppSessionPanic( ctx->session );
-					return NULL;
-				}
-			} else {
-				dbi_result_free( tz_res );
-			}
+		// do the query, once, to expand the fleshable field for every row
+		jsonObject* kids = doFieldmapperSearch( ctx, fl->kid_class, fl->where_clause,
+			fl->batch_query ? fl->batch_query : fl->rest_of_query, err );
+
+		if( *err ) {
+			rc = -1;
 		} else {
-			unsetenv("TZ");
-			tzset();
-			dbi_result res = dbi_conn_queryf( writehandle, "SET timezone TO DEFAULT; -- cstore" );
-			if( !res ) {
-				osrfLogError( OSRF_LOG_MARK, "%s: Error resetting timezone", modulename);
-				if( !oilsIsDBConnected( writehandle )) {
-					osrfAppSessionPanic( ctx->session );
-					return NULL;
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Search for %s return %d linked objects",
+				osrfHashGet( fl->link, "class" ), kids->size );
+
+			// Sort the kids out by key value
+			unsigned long k;
+			for( k = 0; k < kids->size; ++k ) {
+				jsonObject* kid = jsonObjectExtractIndex( kids, k );
+				const char* kid_key = jsonObjectGetString(
+					jsonObjectGetIndex( kid, (unsigned long) fl->key_position ));
+				jsonObject* holder = kid_key ? osrfHashGet( kid_map, kid_key ) : NULL;
+
+				// Keep the object that the linking row maps to.  The linking row
+				// owns kid_key, so we don't free it until we're done here.
+				jsonObject* link_row = NULL;
+				if( holder && fl->map_position >= 0 ) {
+					link_row = kid;
+					kid = jsonObjectExtractIndex( link_row, (unsigned long) fl->map_position );
+					if( !kid )
+						kid = jsonNewObject( NULL );
 				}
-			} else {
-				dbi_result_free( res );
+
+				if( !holder ) {
+					jsonObjectFree( kid );      // Not anybody's kid (shouldn't happen)
+				} else if( fl->has_many ) {
+					jsonObjectPush( holder, kid );
+				} else if( JSON_NULL == holder->type && !holder->parent ) {
+					jsonObjectFree( holder );   // Replace the placeholder with the kid
+					osrfHashSet( kid_map, kid, kid_key );
+				} else {
+					jsonObjectFree( kid );      // Only the first one counts
+				}
+				jsonObjectFree( link_row );
 			}
+			jsonObjectFree( kids );
+
+			// Hand the kids over to the rows
+			res_idx = 0;
+			while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+				const char* search_key = jsonObjectGetString(
+					jsonObjectGetIndex( cur, fl->value_position ));
+				jsonObject* holder = search_key ? osrfHashGet( kid_map, search_key ) : NULL;
+				if( !holder || ( !fl->has_many && JSON_NULL == holder->type ))
+					continue;
+
+				if( holder->parent )
+					jsonObjectSetIndex( cur, fl->position, jsonObjectClone( holder ));
+				else
+					jsonObjectSetIndex( cur, fl->position, holder );
+			}
+
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Fleshing of %s complete", fl->name );
 		}
 	}
 
+	// Free whatever kids and placeholders no row took over
+	osrfHashIterator* itr = osrfNewHashIterator( kid_map );
+	jsonObject* holder;
+	while(( holder = osrfHashIteratorNext( itr ) )) {
+		if( !holder->parent )
+			jsonObjectFree( holder );
+	}
+	osrfHashIteratorFree( itr );
+	osrfHashFree( kid_map );
+	jsonObjectFree( keys );
 
-	dbi_result result = dbi_conn_query( dbhandle, sql );
+	return rc;
+}
 
-	if( NULL == result ) {
-		const char* msg;
-		int errnum = dbi_conn_error( dbhandle, &msg );
-		osrfLogError(OSRF_LOG_MARK, "%s: Error retrieving %s with query [%s]: %d %s",
-			modulename, osrfHashGet( class_meta, "fieldmapper" ), sql, errnum,
-			msg ? msg : "(No description available)" );
-		if( !oilsIsDBConnected( dbhandle ))
-			osrfAppSessionPanic( ctx->session );
-		osrfAppSessionStatus(
-			ctx->session,
-			OSRF_STATUS_INTERNALSERVERERROR,
-			"osrfMethodException",
-			ctx->request,
-			"Severe query error -- see error log for more details"
-		);
-		*err = -1;
-		free( sql );
-		return NULL;
+/**
+	@brief Count the kids of a has_many for every row in a result set, with a single query.
+	@param ctx Pointer to the method context.
+	@param fl Pointer to a FleshLink describing the link, for a flesh_count.
+	@param res_list Pointer to a JSON_ARRAY of rows to be fleshed.
+	@param err Pointer through which to report an error.
+	@return Zero if successful, or -1 if not.
 
-	} else {
-		osrfLogDebug( OSRF_LOG_MARK, "Query returned with no errors" );
+	This is the counterpart of fleshAllRows() for flesh_count.  Instead of calling
+	countMatches() for each row, we count the kids of all the rows at once, grouped by
+	key value.  For PCRUD, as in countMatches(), the permission checks happen row by row,
+	so we fetch the keys of the kids and count the ones that survive.
+*/
+static int fleshCounts( osrfMethodContext* ctx, FleshLink* fl, jsonObject* res_list,
+		int* err ) {
 
-	}
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "Starting to count %s for %lu rows",
+		fl->name, (unsigned long) res_list->size );
 
-	jsonObject* res_list = jsonNewObjectType( JSON_ARRAY );
-	jsonObject* row_obj = NULL;
+	const char* key = osrfHashGet( fl->link, "key" );
+	const char* pkey = osrfHashGet( fl->kid_class, "primarykey" );
 
-	// The following two steps are for verifyObjectPCRUD()'s benefit.
-	// 1. get the flesh depth
-	const jsonObject* _tmp = jsonObjectGetKeyConst( query_hash, "flesh" );
-	if( _tmp ) {
-		flesh_depth = (int) jsonObjectGetNumber( _tmp );
-		if( flesh_depth == -1 || flesh_depth > max_flesh_depth )
-			flesh_depth = max_flesh_depth;
+	// Collect the distinct key values, each with a count of zero so far
+	jsonObject* counts = jsonNewObjectType( JSON_HASH );
+	jsonObject* keys = jsonNewObjectType( JSON_ARRAY );
+	jsonObject* cur;
+	unsigned long res_idx = 0;
+	while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+		const char* search_key = jsonObjectGetString(
+			jsonObjectGetIndex( cur, fl->value_position ));
+		if( search_key && !jsonObjectGetKeyConst( counts, search_key )) {
+			jsonObjectSetKey( counts, search_key, jsonNewNumberObject( 0 ));
+			jsonObjectPush( keys, jsonNewObject( search_key ));
+		}
 	}
 
-	// 2. figure out one consistent rs_size for verifyObjectPCRUD to use
-	// over the whole life of this request.  This means if we've already set
-	// up a rs_size_req_%d, do nothing.
-	//	a. Incidentally, we can also use this opportunity to set i_respond_directly
-	int *rs_size = osrfHashGetFmt( (osrfHash *) ctx->session->userData, "rs_size_req_%d", ctx->request );
-	if( !rs_size ) {	// pointer null, so value not set in hash
-		// i_respond_directly can only be true at the /top/ of a recursive search, if even that.
-		i_respond_directly = ( *methodtype == 'r' || *methodtype == 'i' || *methodtype == 's' );
-
-		rs_size = (int *) safe_malloc( sizeof(int) );	// will be freed by sessionDataFree()
-		unsigned long long result_count = dbi_result_get_numrows( result );
-		*rs_size = (int) result_count * (flesh_depth + 1);	// yes, we could lose some bits, but come on
-		osrfHashSet( (osrfHash *) ctx->session->userData, rs_size, "rs_size_req_%d", ctx->request );
+	if( !keys->size ) {
+		jsonObjectFree( keys );
+		jsonObjectFree( counts );
+		return 0;
 	}
 
-	if( dbi_result_first_row( result )) {
+	jsonObjectSetKey( fl->where_clause, key, keys );
 
-		// Convert each row to a JSON_ARRAY of column values, and enclose those objects
-		// in a JSON_ARRAY of rows.  If two or more rows have the same key value, then
-		// eliminate the duplicates.
-		osrfLogDebug( OSRF_LOG_MARK, "Query returned at least one row" );
-		osrfHash* dedup = osrfNewHash();
-		do {
-			row_obj = oilsMakeFieldmapperFromResult( result, class_meta );
-			char* pkey_val = oilsFMGetString( row_obj, pkey );
-			if( osrfHashGet( dedup, pkey_val ) ) {
-				jsonObjectFree( row_obj );
-				free( pkey_val );
+	// Select the key of each kid, as well as its primary key
+	jsonObject* rest_of_query = idListQuery( NULL, fl->kid_class );
+	if( strcmp( key, pkey ))
+		jsonObjectPush( jsonObjectGetKey( jsonObjectGetKey( rest_of_query, "select" ),
+			osrfHashGet( fl->kid_class, "classname" )), jsonNewObject( key ));
+
+	int rc = 0;
+	if( enforce_pcrud ) {
+		jsonObject* kids = doFieldmapperSearch( ctx, fl->kid_class,
+			fl->where_clause, rest_of_query, err );
+		if( *err ) {
+			rc = -1;
+		} else {
+			unsigned long k;
+			for( k = 0; k < kids->size; ++k ) {
+				const char* kid_key = jsonObjectGetString( jsonObjectGetIndex(
+					jsonObjectGetIndex( kids, k ), (unsigned long) fl->key_position ));
+				const jsonObject* count = kid_key ?
+					jsonObjectGetKeyConst( counts, kid_key ) : NULL;
+				if( count )
+					jsonObjectSetKey( counts, kid_key,
+						jsonNewNumberObject( jsonObjectGetNumber( count ) + 1 ));
+			}
+			jsonObjectFree( kids );
+		}
+	} else {
+		char* sql = buildSELECT( fl->where_clause, rest_of_query, fl->kid_class, ctx, NULL );
+		if( !sql ) {
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "Problem building query" );
+			rc = -1;
+		} else {
+			// Count distinct keys, as countMatches() does, for each key value
+			sql = countingQuery( sql, pkey, key, 0 );
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s SQL =  %s", modulename, sql );
+
+			// XXX for now...
+			dbhandle = writehandle;
+
+			dbi_result result = dbi_conn_query( dbhandle, sql );
+			if( !result ) {
+				const char* msg;
+				int errnum = dbi_conn_error( dbhandle, &msg );
+				osrfLogError( OSRF_LOG_MARK, "%s: Error counting %s with query [%s]: %d %s",
+					modulename, osrfHashGet( fl->kid_class, "fieldmapper" ), sql, errnum,
+					msg ? msg : "(No description available)" );
+				osrfAppSessionStatus(
+					ctx->session,
+					OSRF_STATUS_INTERNALSERVERERROR,
+					"osrfMethodException",
+					ctx->request,
+					"Severe query error -- see error log for more details"
+				);
+				if( !oilsIsDBConnected( dbhandle ))
+					osrfAppSessionPanic( ctx->session );
+				rc = -1;
 			} else {
-				if( !enforce_pcrud || !need_to_verify ||
-						verifyObjectPCRUD( ctx, class_meta, row_obj, 0 /* means check user data for rs_size */ )) {
-					osrfHashSet( dedup, pkey_val, pkey_val );
-					jsonObjectPush( res_list, row_obj );
+				if( dbi_result_first_row( result )) {
+					unsigned int column_count = 0;
+					FieldmapperColumn* columns = planJSONColumns( result, &column_count );
+					do {
+						jsonObject* row =
+							oilsMakeJSONFromColumns( result, columns, column_count );
+						const char* kid_key = jsonObjectGetString(
+							jsonObjectGetKeyConst( row, "oils_key" ));
+						if( kid_key && jsonObjectGetKeyConst( counts, kid_key ))
+							jsonObjectSetKey( counts, kid_key,
+								jsonObjectClone( jsonObjectGetKeyConst( row, "count" )));
+						jsonObjectFree( row );
+					} while( dbi_result_next_row( result ));
+					free( columns );
 				}
+				dbi_result_free( result );
 			}
-		} while( dbi_result_next_row( result ));
-		osrfHashFree( dedup );
+			free( sql );
+		}
+	}
+	jsonObjectFree( rest_of_query );
 
+	if( rc ) {
+		*err = -1;
 	} else {
-		osrfLogDebug( OSRF_LOG_MARK, "%s returned no results for query %s",
-			modulename, sql );
+		// Hand the counts over to the rows
+		res_idx = 0;
+		while(( cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+			const char* search_key = jsonObjectGetString(
+				jsonObjectGetIndex( cur, fl->value_position ));
+			const jsonObject* count = search_key ?
+				jsonObjectGetKeyConst( counts, search_key ) : NULL;
+			if( count )
+				jsonObjectSetIndex( cur, fl->position,
+					jsonNewNumberObject( jsonObjectGetNumber( count )));
+		}
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Counting of %s complete", fl->name );
 	}
 
-	/* clean up the query */
-	dbi_result_free( result );
-	free( sql );
+	jsonObjectFree( counts );
+	return rc;
+}
 
-	// If we're asked to flesh, and there's anything to flesh, then flesh it
-	// (formerly we would skip fleshing if in pcrud mode, but now we support
-	// fleshing even in PCRUD).
-	if( res_list->size ) {
-		jsonObject* temp_blob;	// We need a non-zero flesh depth, and a list of fields to flesh
-		jsonObject* flesh_fields; 
-		jsonObject* flesh_blob = NULL;
-		osrfStringArray* link_fields = NULL;
-		osrfHash* links = NULL;
-		int want_flesh = 0;
+/**
+	@brief Look up a per-link fleshing option.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param option Name of the option: "flesh_limit", "flesh_order_by", or "flesh_count".
+	@param class Name of the class being fleshed.
+	@param field Name of the link field being fleshed.
+	@return Pointer to the value of the option for that link, or NULL if there isn't one.
+
+	Like flesh_fields, each option is keyed on the class name.  For flesh_limit and
+	flesh_order_by, the value for a class is a hash keyed on field name, e.g.
+	{"au":{"circulations":5}}.  For flesh_count, the value for a class is an array of
+	field names, as in flesh_fields, and we return the matching entry.
+*/
+static const jsonObject* fleshOption( const jsonObject* query_hash, const char* option,
+		const char* class, const char* field ) {
+	const jsonObject* by_class = jsonObjectGetKeyConst(
+		jsonObjectGetKeyConst( query_hash, option ), class );
+	if( !by_class )
+		return NULL;
+
+	if( JSON_HASH == by_class->type )
+		return jsonObjectGetKeyConst( by_class, field );
+	else if( JSON_ARRAY == by_class->type ) {
+		unsigned long i;
+		for( i = 0; i < by_class->size; ++i ) {
+			const jsonObject* item = jsonObjectGetIndex( by_class, i );
+			const char* name = jsonObjectGetString( item );
+			if( name && !strcmp( name, field ))
+				return item;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+	@brief List the links of a class that a query wants fleshed.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param class_meta Pointer to the IDL definition of the class.
+	@return Pointer to an osrfStringArray of link field names, or NULL if there aren't any.
+
+	We look at flesh_fields the same way doFieldmapperSearch() does, but we leave out
+	any name that isn't a well-formed link to a class in the IDL.
+
+	The calling code is responsible for freeing the returned osrfStringArray by calling
+	osrfStringArrayFree().
+*/
+static osrfStringArray* sqlFleshLinks( const jsonObject* query_hash, osrfHash* class_meta ) {
+	const jsonObject* flesh_fields = jsonObjectGetKeyConst(
+		jsonObjectGetKeyConst( query_hash, "flesh_fields" ),
+		osrfHashGet( class_meta, "classname" ));
+	if( !flesh_fields || JSON_ARRAY != flesh_fields->type )
+		return NULL;
+
+	osrfHash* links = osrfHashGet( class_meta, "links" );
+	osrfHash* fields = osrfHashGet( class_meta, "fields" );
+	osrfStringArray* names = NULL;
+
+	if( flesh_fields->size == 1 ) {
+		const char* _t = jsonObjectGetString( jsonObjectGetIndex( flesh_fields, 0 ));
+		if( _t && !strcmp( _t, "*" ))
+			names = osrfHashKeys( links );
+	}
+
+	if( !names ) {
+		names = osrfNewStringArray( flesh_fields->size );
+		unsigned long i;
+		for( i = 0; i < flesh_fields->size; ++i ) {
+			const char* name = jsonObjectGetString( jsonObjectGetIndex( flesh_fields, i ));
+			if( name )
+				osrfStringArrayAdd( names, name );
+		}
+	}
+
+	osrfStringArray* link_names = osrfNewStringArray( names->size );
+	int i = 0;
+	const char* name;
+	while( (name = osrfStringArrayGetString( names, i++ )) ) {
+		osrfHash* kid_link = osrfHashGet( links, name );
+		if( kid_link && osrfHashGet( fields, name )
+				&& oilsIDLGetClass( osrfHashGet( kid_link, "class" ))
+				&& osrfHashGet( kid_link, "reltype" ))
+			osrfStringArrayAdd( link_names, name );
+	}
+	osrfStringArrayFree( names );
+
+	if( !link_names->size ) {
+		osrfStringArrayFree( link_names );
+		link_names = NULL;
+	}
+
+	return link_names;
+}
+
+/**
+	@brief Compile the fleshing for a search into its SELECT list.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param class_meta Pointer to the IDL definition of the core class.
+	@param depth How many levels of fleshing to do.
+	@return Pointer to a list of extra columns for buildSELECT(), or NULL if we can't
+		flesh this query in SQL.
+
+	For each link to be fleshed, we add a correlated subquery to the SELECT list, named
+	"oils_flesh_" plus the name of the link field.  The subquery returns the linked row
+	(for a has_a or might_have) or a JSON array of linked rows (for a has_many), by way
+	of row_to_json() and json_agg().  The linked rows have subqueries of their own for
+	the next level of fleshing.  So the database returns each row already fleshed, in a
+	single statement, and fleshFromResult() turns the JSON into fieldmapper objects.
+
+	We don't try this for a mapped link, for flesh_count, or for flesh_order_by; nor if
+	the "select" or "order_by" clauses mention a linked class.  Nor do we build more than
+	MAX_SQL_FLESH_LINKS subqueries.  In any of those cases we return NULL, and the
+	caller should flesh the usual way.
+
+	The calling code is responsible for freeing the returned string by calling free().
+*/
+static char* buildFleshColumns( const jsonObject* query_hash, osrfHash* class_meta,
+		int depth ) {
+
+	if( jsonObjectGetKeyConst( query_hash, "flesh_count" )
+			|| jsonObjectGetKeyConst( query_hash, "flesh_order_by" ))
+		return NULL;
+
+	const jsonObject* order_by = jsonObjectGetKeyConst( query_hash, "order_by" );
+	if( order_by && JSON_HASH != order_by->type )
+		return NULL;
+
+	growing_buffer* buf = buffer_init( 256 );
+	int seq = 0;
+	if( appendFleshColumns( buf, query_hash, class_meta,
+			osrfHashGet( class_meta, "classname" ), depth, &seq ) || !seq ) {
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Can't flesh %s in SQL; fleshing the usual way",
+			modulename, osrfHashGet( class_meta, "classname" ));
+		buffer_free( buf );
+		return NULL;
+	}
 
-		if( query_hash ) {
-			temp_blob = jsonObjectGetKey( query_hash, "flesh_fields" );
-			if( temp_blob && flesh_depth > 0 ) {
+	return buffer_release( buf );
+}
 
-				flesh_blob = jsonObjectClone( temp_blob );
-				flesh_fields = jsonObjectGetKey( flesh_blob, core_class );
+/**
+	@brief Add a fleshing subquery to a SELECT list for each link of a class.
+	@param buf Pointer to the growing_buffer holding the SELECT list.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param class_meta Pointer to the IDL definition of the class being fleshed.
+	@param alias The alias of that class in the enclosing query.
+	@param depth How many levels of fleshing remain, including this one.
+	@param seq Pointer to a counter for generating unique aliases.
+	@return Zero if successful, or -1 if we can't flesh this way.
+
+	See buildFleshColumns().
+*/
+static int appendFleshColumns( growing_buffer* buf, const jsonObject* query_hash,
+		osrfHash* class_meta, const char* alias, int depth, int* seq ) {
 
-				links = osrfHashGet( class_meta, "links" );
+	if( depth <= 0 )
+		return 0;
 
-				// Make an osrfStringArray of the names of fields to be fleshed
-				if( flesh_fields ) {
-					if( flesh_fields->size == 1 ) {
-						const char* _t = jsonObjectGetString(
-							jsonObjectGetIndex( flesh_fields, 0 ) );
-						if( !strcmp( _t, "*" ))
-							link_fields = osrfHashKeys( links );
-					}
+	osrfStringArray* link_names = sqlFleshLinks( query_hash, class_meta );
+	if( !link_names )
+		return 0;
 
-					if( !link_fields ) {
-						jsonObject* _f;
-						link_fields = osrfNewStringArray( 1 );
-						jsonIterator* _i = jsonNewIterator( flesh_fields );
-						while ((_f = jsonIteratorNext( _i ))) {
-							osrfStringArrayAdd( link_fields, jsonObjectGetString( _f ) );
-						}
-						jsonIteratorFree( _i );
-					}
-				}
-				want_flesh = link_fields ? 1 : 0;
-			}
+	const char* class = osrfHashGet( class_meta, "classname" );
+	osrfHash* links = osrfHashGet( class_meta, "links" );
+	const jsonObject* select = jsonObjectGetKeyConst( query_hash, "select" );
+	const jsonObject* order_by = jsonObjectGetKeyConst( query_hash, "order_by" );
+
+	int rc = 0;
+	int i = 0;
+	const char* link_field;
+	while( !rc && (link_field = osrfStringArrayGetString( link_names, i++ )) ) {
+		osrfHash* kid_link = osrfHashGet( links, link_field );
+		osrfHash* kid_meta = oilsIDLGetClass( osrfHashGet( kid_link, "class" ));
+		const char* kid_class = osrfHashGet( kid_meta, "classname" );
+		const char* reltype = osrfHashGet( kid_link, "reltype" );
+		osrfStringArray* link_map = osrfHashGet( kid_link, "map" );
+
+		if( ( link_map && link_map->size > 0 )
+				|| jsonObjectGetKeyConst( select, kid_class )
+				|| jsonObjectGetKeyConst( order_by, kid_class )
+				|| *seq >= MAX_SQL_FLESH_LINKS ) {
+			rc = -1;
+			break;
 		}
 
-		osrfHash* fields = osrfHashGet( class_meta, "fields" );
+		int has_many = !strcmp( reltype, "has_many" );
 
-		// Iterate over the JSON_ARRAY of rows
-		jsonObject* cur;
-		unsigned long res_idx = 0;
-		while((cur = jsonObjectGetIndex( res_list, res_idx++ ) )) {
+		// For a has_a, the link field holds the key; otherwise the primary key does
+		const char* value_col = link_field;
+		if( has_many || !strcmp( reltype, "might_have" ))
+			value_col = osrfHashGet( class_meta, "primarykey" );
 
-			int i = 0;
-			const char* link_field;
+		char* relation = oilsGetRelation( kid_meta );
+		if( !relation ) {
+			rc = -1;
+			break;
+		}
 
-			// Iterate over the list of fleshable fields
-			if ( want_flesh ) {
-				while( (link_field = osrfStringArrayGetString(link_fields, i++)) ) {
+		int n = ++(*seq);
+		char kid_alias[ 32 ];
+		snprintf( kid_alias, sizeof( kid_alias ), "oils_t%d", n );
 
-					osrfLogDebug( OSRF_LOG_MARK, "Starting to flesh %s", link_field );
+		if( has_many )
+			buffer_fadd( buf, ", ( SELECT json_agg( row_to_json( \"oils_f%d\" ) )"
+				" FROM ( SELECT", n );
+		else
+			buffer_fadd( buf, ", ( SELECT row_to_json( \"oils_f%d\" ) FROM ( SELECT", n );
 
-					osrfHash* kid_link = osrfHashGet( links, link_field );
-					if( !kid_link )
-						continue;     // Not a link field; skip it
+		appendClassColumns( buf, query_hash, kid_meta, kid_alias );
+		rc = appendFleshColumns( buf, query_hash, kid_meta, kid_alias, depth - 1, seq );
 
-					osrfHash* field = osrfHashGet( fields, link_field );
-					if( !field )
-						continue;     // Not a field at all; skip it (IDL is ill-formed)
+		buffer_fadd( buf, " FROM %s AS \"%s\" WHERE \"%s\".%s = \"%s\".%s",
+			relation, kid_alias, kid_alias, osrfHashGet( kid_link, "key" ),
+			alias, value_col );
+		free( relation );
 
-					osrfHash* kid_idl = osrfHashGet( oilsIDL(),
-						osrfHashGet( kid_link, "class" ));
-					if( !kid_idl )
-						continue;   // The class it links to doesn't exist; skip it
+		if( has_many ) {
+			const jsonObject* kid_limit =
+				fleshOption( query_hash, "flesh_limit", class, link_field );
+			if( kid_limit )
+				buffer_fadd( buf, " LIMIT %ld", (long) jsonObjectGetNumber( kid_limit ));
+		} else {
+			OSRF_BUFFER_ADD( buf, " LIMIT 1" );
+		}
 
-					const char* reltype = osrfHashGet( kid_link, "reltype" );
-					if( !reltype )
-						continue;   // No reltype; skip it (IDL is ill-formed)
+		buffer_fadd( buf, " ) AS \"oils_f%d\" ) AS \"oils_flesh_%s\"", n, link_field );
+	}
 
-					osrfHash* value_field = field;
+	osrfStringArrayFree( link_names );
+	return rc;
+}
 
-					if(    !strcmp( reltype, "has_many" )
-						|| !strcmp( reltype, "might_have" ) ) { // has_many or might_have
-						value_field = osrfHashGet(
-							fields, osrfHashGet( class_meta, "primarykey" ) );
-					}
+/**
+	@brief Add the columns of a class to a SELECT list for a fleshing subquery.
+	@param buf Pointer to the growing_buffer holding the SELECT list.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param class_meta Pointer to the IDL definition of the class.
+	@param alias The alias of the class in the subquery.
+
+	We select the same columns, and translate them the same way, as buildSELECT() does
+	when there's no "select" clause for the class.
+*/
+static void appendClassColumns( growing_buffer* buf, const jsonObject* query_hash,
+		osrfHash* class_meta, const char* alias ) {
 
-					int kid_has_controller = osrfStringArrayContains( osrfHashGet(kid_idl, "controller"), modulename );
-					// fleshing pcrud case: we require the controller in need_to_verify mode
-					if ( !kid_has_controller && enforce_pcrud && need_to_verify ) {
-						osrfLogInfo( OSRF_LOG_MARK, "%s is not listed as a controller for %s; moving on", modulename, core_class );
-
-						jsonObjectSetIndex(
-							cur,
-							(unsigned long) atoi( osrfHashGet(field, "array_position") ),
-							jsonNewObjectType(
-								!strcmp( reltype, "has_many" ) ? JSON_ARRAY : JSON_NULL
-							)
-						);
-						continue;
-					}
+	const char* locale = osrf_message_get_last_locale();
+	if( obj_is_true( jsonObjectGetKeyConst( query_hash, "no_i18n" )))
+		locale = NULL;
 
-					osrfStringArray* link_map = osrfHashGet( kid_link, "map" );
+	const char* cname = osrfHashGet( class_meta, "classname" );
+	int first = 1;
+	osrfHash* field = NULL;
+	osrfHashIterator* field_itr = osrfNewHashIterator( osrfHashGet( class_meta, "fields" ));
+	while( ( field = osrfHashIteratorNext( field_itr ) ) ) {
+		if( str_is_true( osrfHashGet( field, "virtual" )))
+			continue;
 
-					if( link_map->size > 0 ) {
-						jsonObject* _kid_key = jsonNewObjectType( JSON_ARRAY );
-						jsonObjectPush(
-							_kid_key,
-							jsonNewObject( osrfStringArrayGetString( link_map, 0 ) )
-						);
+		if( osrfStringArrayContains( osrfHashGet( field, "suppress_controller" ), modulename ))
+			continue;
 
-						jsonObjectSetKey(
-							flesh_blob,
-							osrfHashGet( kid_link, "class" ),
-							_kid_key
-						);
-					};
+		const char* fname = osrfHashIteratorKey( field_itr );
 
-					osrfLogDebug(
-						OSRF_LOG_MARK,
-						"Link field: %s, remote class: %s, fkey: %s, reltype: %s",
-						osrfHashGet( kid_link, "field" ),
-						osrfHashGet( kid_link, "class" ),
-						osrfHashGet( kid_link, "key" ),
-						osrfHashGet( kid_link, "reltype" )
-					);
+		if( first )
+			first = 0;
+		else
+			OSRF_BUFFER_ADD_CHAR( buf, ',' );
 
-					const char* search_key = jsonObjectGetString(
-						jsonObjectGetIndex( cur,
-							atoi( osrfHashGet( value_field, "array_position" ) )
-						)
-					);
+		if( locale && str_is_true( osrfHashGet( field, "i18n" ))) {
+			char* pkey = osrfHashGet( class_meta, "primarykey" );
+			char* tname = osrfHashGet( class_meta, "tablename" );
 
-					if( !search_key ) {
-						osrfLogDebug( OSRF_LOG_MARK, "Nothing to search for!" );
-						continue;
-					}
+			buffer_fadd( buf, " oils_i18n_xlate('%s', '%s', '%s', "
+					"'%s', \"%s\".%s::TEXT, '%s') AS \"%s\"",
+					tname, cname, fname, pkey, alias, pkey, locale, fname );
+		} else {
+			buffer_fadd( buf, " \"%s\".%s", alias, fname );
+		}
+	}
+	osrfHashIteratorFree( field_itr );
+}
 
-					osrfLogDebug( OSRF_LOG_MARK, "Creating param objects..." );
+/**
+	@brief Flesh a row from the fleshing columns of a result set.
+	@param result An open dbi_result, positioned at the row.
+	@param row Pointer to the row, already converted to a fieldmapper object.
+	@param class_meta Pointer to the IDL definition of the row's class.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param depth How many levels of fleshing to do.
+
+	See buildFleshColumns() for where the columns come from.
+*/
+static void fleshFromResult( dbi_result result, jsonObject* row, osrfHash* class_meta,
+		const jsonObject* query_hash, int depth ) {
 
-					// construct WHERE clause
-					jsonObject* where_clause  = jsonNewObjectType( JSON_HASH );
-					jsonObjectSetKey(
-						where_clause,
-						osrfHashGet( kid_link, "key" ),
-						jsonNewObject( search_key )
-					);
+	osrfStringArray* link_names = sqlFleshLinks( query_hash, class_meta );
+	if( !link_names )
+		return;
 
-					// construct the rest of the query, mostly
-					// by copying pieces of the previous level of query
-					jsonObject* rest_of_query = jsonNewObjectType( JSON_HASH );
-					jsonObjectSetKey( rest_of_query, "flesh",
-						jsonNewNumberObject( flesh_depth - 1 + link_map->size )
-					);
+	// Collect the columns into a hash, as they'd appear in a fleshed kid
+	jsonObject* json = jsonNewObjectType( JSON_HASH );
+	char col[ 256 ];
+	int i = 0;
+	const char* link_field;
+	while( (link_field = osrfStringArrayGetString( link_names, i++ )) ) {
+		snprintf( col, sizeof( col ), "oils_flesh_%s", link_field );
+		if( !dbi_result_field_is_null( result, col )) {
+			jsonObject* value = jsonParse( dbi_result_get_string( result, col ));
+			if( value )
+				jsonObjectSetKey( json, col, value );
+		}
+	}
+	osrfStringArrayFree( link_names );
 
-					if( flesh_blob )
-						jsonObjectSetKey( rest_of_query, "flesh_fields",
-							jsonObjectClone( flesh_blob ));
+	fleshFromJSON( row, class_meta, json, query_hash, depth );
+	jsonObjectFree( json );
+}
 
-					if( jsonObjectGetKeyConst( query_hash, "order_by" )) {
-						jsonObjectSetKey( rest_of_query, "order_by",
-							jsonObjectClone( jsonObjectGetKeyConst( query_hash, "order_by" ))
-						);
-					}
+/**
+	@brief Store fleshed links in a fieldmapper object, from the JSON built by the database.
+	@param row Pointer to the fieldmapper object.
+	@param class_meta Pointer to the IDL definition of the object's class.
+	@param json Pointer to a JSON_HASH with an "oils_flesh_" entry for each link.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param depth How many levels of fleshing remain, including this one.
+
+	As when fleshing the usual way, a has_many always gets an array, possibly empty;
+	a has_a or might_have with nothing to link to keeps whatever it had.
+*/
+static void fleshFromJSON( jsonObject* row, osrfHash* class_meta, const jsonObject* json,
+		const jsonObject* query_hash, int depth ) {
 
-					if( jsonObjectGetKeyConst( query_hash, "select" )) {
-						jsonObjectSetKey( rest_of_query, "select",
-							jsonObjectClone( jsonObjectGetKeyConst( query_hash, "select" ))
-						);
-					}
+	if( depth <= 0 )
+		return;
 
-					// do the query, recursively, to expand the fleshable field
-					jsonObject* kids = doFieldmapperSearch( ctx, kid_idl,
-						where_clause, rest_of_query, err );
+	osrfStringArray* link_names = sqlFleshLinks( query_hash, class_meta );
+	if( !link_names )
+		return;
 
-					jsonObjectFree( where_clause );
-					jsonObjectFree( rest_of_query );
+	osrfHash* links = osrfHashGet( class_meta, "links" );
+	osrfHash* fields = osrfHashGet( class_meta, "fields" );
+	char col[ 256 ];
+	int i = 0;
+	const char* link_field;
+	while( (link_field = osrfStringArrayGetString( link_names, i++ )) ) {
+		osrfHash* kid_link = osrfHashGet( links, link_field );
+		osrfHash* kid_meta = oilsIDLGetClass( osrfHashGet( kid_link, "class" ));
+		unsigned long position = (unsigned long) atoi(
+			osrfHashGet( osrfHashGet( fields, link_field ), "array_position" ));
+
+		snprintf( col, sizeof( col ), "oils_flesh_%s", link_field );
+		const jsonObject* value = jsonObjectGetKeyConst( json, col );
+
+		if( !strcmp( osrfHashGet( kid_link, "reltype" ), "has_many" )) {
+			jsonObject* kids = jsonNewObjectType( JSON_ARRAY );
+			if( value && JSON_ARRAY == value->type ) {
+				unsigned long k;
+				for( k = 0; k < value->size; ++k )
+					jsonObjectPush( kids, fieldmapperFromJSON(
+						jsonObjectGetIndex( value, k ), kid_meta, query_hash, depth - 1 ));
+			}
+			jsonObjectSetIndex( row, position, kids );
+		} else if( value && JSON_HASH == value->type ) {
+			jsonObjectSetIndex( row, position,
+				fieldmapperFromJSON( value, kid_meta, query_hash, depth - 1 ));
+		}
+	}
+	osrfStringArrayFree( link_names );
+}
 
-					if( *err ) {
-						osrfStringArrayFree( link_fields );
-						jsonObjectFree( res_list );
-						jsonObjectFree( flesh_blob );
-						return NULL;
-					}
+/**
+	@brief Convert a row, as built by row_to_json(), into a fieldmapper object.
+	@param json Pointer to a JSON_HASH of column values, keyed on field name.
+	@param class_meta Pointer to the IDL definition of the row's class.
+	@param query_hash Pointer to the query, as passed to doFieldmapperSearch().
+	@param depth How many levels of fleshing remain below this row.
+	@return Pointer to the fieldmapper object.
 
-					osrfLogDebug( OSRF_LOG_MARK, "Search for %s return %d linked objects",
-						osrfHashGet( kid_link, "class" ), kids->size );
-
-					// Traverse the result set
-					jsonObject* X = NULL;
-					if( link_map->size > 0 && kids->size > 0 ) {
-						X = kids;
-						kids = jsonNewObjectType( JSON_ARRAY );
-
-						jsonObject* _k_node;
-						unsigned long res_idx = 0;
-						while((_k_node = jsonObjectGetIndex( X, res_idx++ ) )) {
-							jsonObjectPush(
-								kids,
-								jsonObjectClone(
-									jsonObjectGetIndex(
-										_k_node,
-										(unsigned long) atoi(
-											osrfHashGet(
-												osrfHashGet(
-													osrfHashGet(
-														osrfHashGet(
-															oilsIDL(),
-															osrfHashGet( kid_link, "class" )
-														),
-														"fields"
-													),
-													osrfStringArrayGetString( link_map, 0 )
-												),
-												"array_position"
-											)
-										)
-									)
-								)
-							);
-						} // end while loop traversing X
-					}
+	We render values the way oilsMakeFieldmapperFromResult() does: booleans as "t" or
+	"f", and timestamps without fractional seconds and with a colonless offset.
 
-					if (kids->size > 0) {
-
-						if((   !strcmp( osrfHashGet( kid_link, "reltype" ), "has_a" )
-							|| !strcmp( osrfHashGet( kid_link, "reltype" ), "might_have" ))
-						) {
-							osrfLogDebug(OSRF_LOG_MARK, "Storing fleshed objects in %s",
-								osrfHashGet( kid_link, "field" ));
-							jsonObjectSetIndex(
-								cur,
-								(unsigned long) atoi( osrfHashGet( field, "array_position" ) ),
-								jsonObjectClone( jsonObjectGetIndex( kids, 0 ))
-							);
-						}
-					}
+	The calling code is responsible for freeing the returned object by calling
+	jsonObjectFree().
+*/
+static jsonObject* fieldmapperFromJSON( const jsonObject* json, osrfHash* class_meta,
+		const jsonObject* query_hash, int depth ) {
 
-					if( !strcmp( osrfHashGet( kid_link, "reltype" ), "has_many" )) {
-						// has_many
-						osrfLogDebug( OSRF_LOG_MARK, "Storing fleshed objects in %s",
-							osrfHashGet( kid_link, "field" ) );
-						jsonObjectSetIndex(
-							cur,
-							(unsigned long) atoi( osrfHashGet( field, "array_position" ) ),
-							jsonObjectClone( kids )
-						);
-					}
+	jsonObject* object = jsonNewObjectType( JSON_ARRAY );
+	jsonObjectSetClass( object, osrfHashGet( class_meta, "classname" ));
 
-					if( X ) {
-						jsonObjectFree( kids );
-						kids = X;
-					}
+	osrfHash* field = NULL;
+	osrfHashIterator* field_itr = osrfNewHashIterator( osrfHashGet( class_meta, "fields" ));
+	while( ( field = osrfHashIteratorNext( field_itr ) ) ) {
+		const jsonObject* value = jsonObjectGetKeyConst( json, osrfHashIteratorKey( field_itr ));
+		if( !value )
+			continue;
 
-					jsonObjectFree( kids );
+		unsigned long position = (unsigned long) atoi( osrfHashGet( field, "array_position" ));
+		const char* datatype = osrfHashGet( field, "datatype" );
+
+		if( JSON_BOOL == value->type ) {
+			jsonObjectSetIndex( object, position,
+				jsonNewObject( jsonBoolIsTrue( value ) ? "t" : "f" ));
+		} else if( JSON_STRING == value->type && datatype
+				&& !strcmp( datatype, "TIMESTAMP" )) {
+			char* ts = jsonTimestamp( jsonObjectGetString( value ));
+			jsonObjectSetIndex( object, position, jsonNewObject( ts ));
+			free( ts );
+		} else {
+			jsonObjectSetIndex( object, position, jsonObjectClone( value ));
+		}
+	}
+	osrfHashIteratorFree( field_itr );
 
-					osrfLogDebug( OSRF_LOG_MARK, "Fleshing of %s complete",
-						osrfHashGet( kid_link, "field" ) );
-					osrfLogDebug( OSRF_LOG_MARK, "%s", jsonObjectToJSON( cur ));
+	fleshFromJSON( object, class_meta, json, query_hash, depth );
+	return object;
+}
 
-				} // end while loop traversing list of fleshable fields
-			}
+/**
+	@brief Reformat a date or time from JSON output the way we format a DBI datetime.
+	@param s A date, time, or timestamp as rendered by PostgreSQL in JSON, e.g.
+		"2015-03-04T12:34:56.789-05:00".
+	@return Pointer to the reformatted string, e.g. "2015-03-04T12:34:56-0500".
 
-			if( i_respond_directly ) {
-				if ( *methodtype == 'i' ) {
-					osrfAppRespond( ctx,
-						oilsFMGetObject( cur, osrfHashGet( class_meta, "primarykey" ) ) );
-				} else {
-					osrfAppRespond( ctx, cur );
-				}
-			}
-		} // end while loop traversing res_list
-		jsonObjectFree( flesh_blob );
-		osrfStringArrayFree( link_fields );
-	}
+	We drop any fractional seconds, and any colon in the time zone offset.  Dates come
+	through unchanged.
 
-	if( i_respond_directly ) {
-		jsonObjectFree( res_list );
-		return jsonNewObjectType( JSON_ARRAY );
-	} else {
-		return res_list;
+	The calling code is responsible for freeing the returned string by calling free().
+*/
+static char* jsonTimestamp( const char* s ) {
+	char* out = strdup( s );
+	const char* time_part = strchr( s, 'T' );
+	if( !time_part && strchr( s, ':' ))
+		time_part = s;        // A time without a date
+	if( !time_part )
+		return out;           // A date without a time
+
+	char* dest = out + ( time_part - s );
+	const char* src = time_part;
+	int in_offset = 0;
+	while( *src ) {
+		if( '.' == *src && !in_offset ) {
+			++src;
+			while( isdigit( (unsigned char) *src ))
+				++src;
+			continue;
+		}
+		if( ( '+' == *src || '-' == *src ) && src > time_part )
+			in_offset = 1;
+		else if( ':' == *src && in_offset ) {
+			++src;
+			continue;
+		}
+		*dest++ = *src++;
 	}
+	*dest = '\0';
+	return out;
 }
 
-
 int doUpdate( osrfMethodContext* ctx ) {
 	if( osrfMethodVerifyContext( ctx )) {
 		osrfLogError( OSRF_LOG_MARK, "Invalid method context" );
@@ -6388,6 +10571,9 @@ int doUpdate( osrfMethodContext* ctx ) {
 		return -1;
 	}
 
+	// Expire cached results from this class when the transaction commits
+	noteWrite( ctx, osrfHashGet( meta, "classname" ));
+
 	// The following test is harmless but redundant.  If a class is
 	// readonly, we don't register an update method for it.
 	if( str_is_true( osrfHashGet( meta, "readonly" ) ) ) {
@@ -6407,17 +10593,16 @@ int doUpdate( osrfMethodContext* ctx ) {
 	// Set the last_xact_id
 	int index = oilsIDL_ntop( target->classname, "last_xact_id" );
 	if( index > -1 ) {
-		osrfLogDebug( OSRF_LOG_MARK, "Setting last_xact_id to %s on %s at position %d",
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Setting last_xact_id to %s on %s at position %d",
 				trans_id, target->classname, index );
 		jsonObjectSetIndex( target, index, jsonNewObject( trans_id ));
 	}
 
 	char* pkey = osrfHashGet( meta, "primarykey" );
-	osrfHash* fields = osrfHashGet( meta, "fields" );
 
 	char* id = oilsFMGetString( target, pkey );
 
-	osrfLogDebug(
+	OILS_LOG_DEBUG(
 		OSRF_LOG_MARK,
 		"%s updating %s object with %s = %s",
 		modulename,
@@ -6427,27 +10612,22 @@ int doUpdate( osrfMethodContext* ctx ) {
 	);
 
 	dbhandle = writehandle;
+	const WriteLayout* layout = writeLayoutFor( meta );
 	growing_buffer* sql = buffer_init( 128 );
-	buffer_fadd( sql,"UPDATE %s SET", osrfHashGet( meta, "tablename" ));
+	OSRF_BUFFER_ADD( sql, layout->update_head );
 
 	int first = 1;
-	osrfHash* field_def = NULL;
-	osrfHashIterator* field_itr = osrfNewHashIterator( fields );
-	while( ( field_def = osrfHashIteratorNext( field_itr ) ) ) {
-
-		// Skip virtual fields, and the primary key
-		if( str_is_true( osrfHashGet( field_def, "virtual") ) )
-			continue;
-
-		if (osrfStringArrayContains( osrfHashGet(field_def, "suppress_controller"), modulename ))
-			continue;
+	unsigned int col_idx;
+	for( col_idx = 0; col_idx < layout->count; ++col_idx ) {
 
-
-		const char* field_name = osrfHashIteratorKey( field_itr );
-		if( ! strcmp( field_name, pkey ) )
+		// Skip the primary key, and any fields suppressed for this controller
+		const WriteColumn* col = layout->columns + col_idx;
+		if( !col->in_update )
 			continue;
 
-		const jsonObject* field_object = oilsFMGetObject( target, field_name );
+		const char* field_name = col->name;
+		const jsonObject* field_object = col->position < 0 ? NULL
+			: jsonObjectGetIndex( target, col->position );
 
 		int value_is_numeric = 0;    // boolean
 		char* value;
@@ -6467,12 +10647,11 @@ int doUpdate( osrfMethodContext* ctx ) {
 				value_is_numeric = 1;
 		}
 
-		osrfLogDebug( OSRF_LOG_MARK, "Updating %s object with %s = %s",
+		OILS_LOG_DEBUG( OSRF_LOG_MARK, "Updating %s object with %s = %s",
 				osrfHashGet( meta, "fieldmapper" ), field_name, value);
 
 		if( !field_object || field_object->type == JSON_NULL ) {
-			if( !( !( strcmp( osrfHashGet( meta, "classname" ), "au" ) )
-					&& !( strcmp( field_name, "passwd" ) )) ) { // arg at the special case!
+			if( col->null_in_update ) {
 				if( first )
 					first = 0;
 				else
@@ -6480,16 +10659,15 @@ int doUpdate( osrfMethodContext* ctx ) {
 				buffer_fadd( sql, " %s = NULL", field_name );
 			}
 
-		} else if( value_is_numeric || !strcmp( get_primitive( field_def ), "number") ) {
+		} else if( value_is_numeric || col->number ) {
 			if( first )
 				first = 0;
 			else
 				OSRF_BUFFER_ADD_CHAR( sql, ',' );
 
-			const char* numtype = get_datatype( field_def );
-			if( !strncmp( numtype, "INT", 3 ) ) {
+			if( WRITE_NUM_INT == col->update_type ) {
 				buffer_fadd( sql, " %s = %ld", field_name, atol( value ) );
-			} else if( !strcmp( numtype, "NUMERIC" ) ) {
+			} else if( WRITE_NUM_NUMERIC == col->update_type ) {
 				buffer_fadd( sql, " %s = %f", field_name, atof( value ) );
 			} else {
 				// Must really be intended as a string, so quote it
@@ -6507,14 +10685,13 @@ int doUpdate( osrfMethodContext* ctx ) {
 					);
 					free( value );
 					free( id );
-					osrfHashIteratorFree( field_itr );
 					buffer_free( sql );
 					osrfAppRespondComplete( ctx, NULL );
 					return -1;
 				}
 			}
 
-			osrfLogDebug( OSRF_LOG_MARK, "%s is of type %s", field_name, numtype );
+			OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s is of type %s", field_name, col->datatype );
 
 		} else {
 			if( dbi_conn_quote_string( dbhandle, &value ) ) {
@@ -6534,7 +10711,6 @@ int doUpdate( osrfMethodContext* ctx ) {
 				);
 				free( value );
 				free( id );
-				osrfHashIteratorFree( field_itr );
 				buffer_free( sql );
 				osrfAppRespondComplete( ctx, NULL );
 				return -1;
@@ -6545,8 +10721,6 @@ int doUpdate( osrfMethodContext* ctx ) {
 
 	} // end while
 
-	osrfHashIteratorFree( field_itr );
-
 	jsonObject* obj = jsonNewObject( id );
 
 	if( strcmp( get_primitive( osrfHashGet( osrfHashGet(meta, "fields"), pkey )), "number" ))
@@ -6555,7 +10729,7 @@ int doUpdate( osrfMethodContext* ctx ) {
 	buffer_fadd( sql, " WHERE %s = %s;", pkey, id );
 
 	char* query = buffer_release( sql );
-	osrfLogDebug( OSRF_LOG_MARK, "%s: Update SQL [%s]", modulename, query );
+	OILS_LOG_DEBUG( OSRF_LOG_MARK, "%s: Update SQL [%s]", modulename, query );
 
 	dbi_result result = dbi_conn_query( dbhandle, query );
 	free( query );
@@ -6618,6 +10792,9 @@ int doDelete( osrfMethodContext* ctx ) {
 		return -1;
 	}
 
+	// Expire cached results from this class when the transaction commits
+	noteWrite( ctx, osrfHashGet( meta, "classname" ));
+
 	// The following test is harmless but redundant.  If a class is
 	// readonly, we don't register a delete method for it.
 	if( str_is_true( osrfHashGet( meta, "readonly" ) ) ) {
@@ -6656,7 +10833,7 @@ int doDelete( osrfMethodContext* ctx ) {
 		id = jsonObjectToSimpleString( jsonObjectGetIndex( ctx->params, _obj_pos ));
 	}
 
-	osrfLogDebug(
+	OILS_LOG_DEBUG(
 		OSRF_LOG_MARK,
 		"%s deleting %s object with %s = %s",
 		modulename,
@@ -6709,18 +10886,184 @@ int doDelete( osrfMethodContext* ctx ) {
 	return rc;
 }
 
+/**
+	@brief Work out where each column of a result set goes in a fieldmapper object.
+	@param result The result set of a query against a single class.
+	@param meta Pointer to the class metadata for the core class.
+	@param count Pointer through which to return the number of columns.
+	@return Pointer to a newly allocated array of FieldmapperColumns, one per column.
+
+	If a column is not defined in the IDL, or if it has no array_position defined for it in
+	the IDL, or if it is defined as virtual, mark it to be ignored.
+
+	The IDL lookups are the same for every row, so we do them once here, and let
+	oilsMakeFieldmapperFromResult() apply the outcome to each row.
+
+	The calling code is responsible for freeing the array.
+*/
+static FieldmapperColumn* planFieldmapperColumns( dbi_result result, osrfHash* meta,
+		unsigned int* count ) {
+
+	osrfHash* fields = osrfHashGet( meta, "fields" );
+
+	unsigned int column_count = 0;
+	while( dbi_result_get_field_name( result, column_count + 1 ))
+		++column_count;
+
+	FieldmapperColumn* columns =
+		safe_malloc( ( column_count ? column_count : 1 ) * sizeof( FieldmapperColumn ));
+
+	unsigned int i;
+	for( i = 0; i < column_count; ++i ) {
+		unsigned int columnIndex = i + 1;
+		const char* columnName = dbi_result_get_field_name( result, columnIndex );
+
+		columns[ i ].fmIndex = -1;
+		columns[ i ].type = dbi_result_get_field_type_idx( result, columnIndex );
+		columns[ i ].attr = dbi_result_get_field_attribs_idx( result, columnIndex );
+		columns[ i ].name = columnName;
+
+		osrfHash* _f = osrfHashGet( fields, columnName );
+		if( !_f ) {
+			OILS_LOG_INTERNAL( OSRF_LOG_MARK, "Column [%s] is not in the IDL", columnName );
+			continue;
+		}
+
+		if( str_is_true( osrfHashGet( _f, "virtual" )))
+			continue;   // skip this column: IDL says it's virtual
+
+		const char* pos = (char*) osrfHashGet( _f, "array_position" );
+		if( !pos )      // IDL has no sequence number for it.  This shouldn't happen,
+			continue;    // since we assign sequence numbers dynamically as we load the IDL.
+
+		columns[ i ].fmIndex = atoi( pos );
+		OILS_LOG_INTERNAL( OSRF_LOG_MARK, "Found column [%s] at position [%s]",
+			columnName, pos );
+	}
+
+	*count = column_count;
+	return columns;
+}
+
+/**
+	@brief Find or build the layout that doCreate() and doUpdate() use for a class.
+	@param meta Pointer to the class metadata.
+	@return Pointer to the layout, which remains owned by the cache.
+
+	The layout stays valid until the IDL is reloaded, which never happens in the middle
+	of a request.
+*/
+static const WriteLayout* writeLayoutFor( osrfHash* meta ) {
+	const char* classname = osrfHashGet( meta, "classname" );
+	WriteLayout* layout = write_layouts ? osrfHashGet( write_layouts, classname ) : NULL;
+	if( layout )
+		return layout;
+
+	osrfHash* fields = osrfHashGet( meta, "fields" );
+	const char* pkey = osrfHashGet( meta, "primarykey" );
+	int is_au = !strcmp( classname, "au" );
+
+	layout = safe_malloc( sizeof( WriteLayout ));
+	layout->columns = safe_malloc(
+		( osrfHashGetCount( fields ) + 1 ) * sizeof( WriteColumn ));
+	layout->count = 0;
+
+	growing_buffer* insert_buf = buffer_init( 128 );
+	buffer_fadd( insert_buf, "INSERT INTO %s (", (char*) osrfHashGet( meta, "tablename" ));
+
+	osrfHash* field = NULL;
+	osrfHashIterator* field_itr = osrfNewHashIterator( fields );
+	while( (field = osrfHashIteratorNext( field_itr ) ) ) {
+
+		if( str_is_true( osrfHashGet( field, "virtual" ) ) )
+			continue;
+
+		WriteColumn* col = layout->columns + layout->count;
+		col->name = osrfHashIteratorKey( field_itr );
+		const char* pos = osrfHashGet( field, "array_position" );
+		col->position = pos ? atoi( pos ) : -1;
+		col->number = !strcmp( get_primitive( field ), "number" );
+
+		// Look at the datatype the way doCreate() and doUpdate() always have: only a
+		// number is expected to have one.
+		col->datatype = col->number ? get_datatype( field ) : osrfHashGet( field, "datatype" );
+		col->insert_type = WRITE_NUM_NONE;
+		col->update_type = WRITE_NUM_NONE;
+		if( col->datatype ) {
+			if( !strcmp( col->datatype, "INT8" ))
+				col->insert_type = WRITE_NUM_INT8;
+			else if( !strcmp( col->datatype, "INT" ))
+				col->insert_type = WRITE_NUM_INT;
+			else if( !strcmp( col->datatype, "NUMERIC" ))
+				col->insert_type = WRITE_NUM_NUMERIC;
+
+			if( !strncmp( col->datatype, "INT", 3 ))
+				col->update_type = WRITE_NUM_INT;
+			else if( !strcmp( col->datatype, "NUMERIC" ))
+				col->update_type = WRITE_NUM_NUMERIC;
+		}
+
+		col->in_update = !( pkey && !strcmp( col->name, pkey ))
+			&& !osrfStringArrayContains( osrfHashGet( field, "suppress_controller" ),
+				modulename );
+		col->null_in_update = !( is_au && !strcmp( col->name, "passwd" ));  // arg!
+
+		if( layout->count )
+			OSRF_BUFFER_ADD_CHAR( insert_buf, ',' );
+		buffer_add( insert_buf, col->name );
+		++layout->count;
+	}
+	osrfHashIteratorFree( field_itr );
+
+	OSRF_BUFFER_ADD_CHAR( insert_buf, ')' );
+	layout->insert_head = buffer_release( insert_buf );
+
+	growing_buffer* update_buf = buffer_init( 64 );
+	buffer_fadd( update_buf, "UPDATE %s SET", (char*) osrfHashGet( meta, "tablename" ));
+	layout->update_head = buffer_release( update_buf );
+
+	if( !write_layouts ) {
+		write_layouts = osrfNewHash();
+		osrfHashSetCallback( write_layouts, freeWriteLayout );
+	}
+	osrfHashSet( write_layouts, layout, "%s", classname );
+	return layout;
+}
+
+/**
+	@brief Free a WriteLayout; callback for the write_layouts hash.
+	@param key The class name (not used).
+	@param item Pointer to the WriteLayout.
+*/
+static void freeWriteLayout( char* key, void* item ) {
+	WriteLayout* layout = item;
+	free( layout->columns );
+	free( layout->insert_head );
+	free( layout->update_head );
+	free( layout );
+}
+
+/**
+	@brief Discard the cached WriteLayouts, which point into the IDL.
+*/
+static void clearWriteLayouts( void ) {
+	if( write_layouts ) {
+		osrfHashFree( write_layouts );
+		write_layouts = NULL;
+	}
+}
+
 /**
 	@brief Translate a row returned from the database into a jsonObject of type JSON_ARRAY.
 	@param result An iterator for a result set; we only look at the current row.
 	@param @meta Pointer to the class metadata for the core class.
+	@param columns Pointer to the column layout from planFieldmapperColumns().
+	@param column_count Number of entries in @a columns.
 	@return Pointer to the resulting jsonObject if successful; otherwise NULL.
 
-	If a column is not defined in the IDL, or if it has no array_position defined for it in
-	the IDL, or if it is defined as virtual, ignore it.
-
-	Otherwise, translate the column value into a jsonObject of type JSON_NULL, JSON_NUMBER,
-	or JSON_STRING.  Then insert this jsonObject into the JSON_ARRAY according to its
-	array_position in the IDL.
+	Translate each column value not marked to be ignored into a jsonObject of type
+	JSON_NULL, JSON_NUMBER, or JSON_STRING.  Then insert this jsonObject into the JSON_ARRAY
+	according to its array_position in the IDL.
 
 	A field defined in the IDL but not represented in the returned row will leave a hole
 	in the JSON_ARRAY.  In effect it will be treated as a null value.
@@ -6732,46 +11075,25 @@ int doDelete( osrfMethodContext* ctx ) {
 	The calling code is responsible for freeing the the resulting jsonObject by calling
 	jsonObjectFree().
 */
-static jsonObject* oilsMakeFieldmapperFromResult( dbi_result result, osrfHash* meta) {
-	if( !( result && meta )) return NULL;
+static jsonObject* oilsMakeFieldmapperFromResult( dbi_result result, osrfHash* meta,
+		const FieldmapperColumn* columns, unsigned int column_count ) {
+	if( !( result && meta && columns )) return NULL;
 
 	jsonObject* object = jsonNewObjectType( JSON_ARRAY );
 	jsonObjectSetClass( object, osrfHashGet( meta, "classname" ));
-	osrfLogInternal( OSRF_LOG_MARK, "Setting object class to %s ", object->classname );
-
-	osrfHash* fields = osrfHashGet( meta, "fields" );
+	OILS_LOG_INTERNAL( OSRF_LOG_MARK, "Setting object class to %s ", object->classname );
 
-	int columnIndex = 1;
-	const char* columnName;
+	unsigned int i;
 
 	/* cycle through the columns in the row returned from the database */
-	while( (columnName = dbi_result_get_field_name( result, columnIndex )) ) {
-
-		osrfLogInternal( OSRF_LOG_MARK, "Looking for column named [%s]...", (char*) columnName );
-
-		int fmIndex = -1;  // Will be set to the IDL's sequence number for this field
-
-		/* determine the field type and storage attributes */
-		unsigned short type = dbi_result_get_field_type_idx( result, columnIndex );
-		int attr            = dbi_result_get_field_attribs_idx( result, columnIndex );
-
-		// Fetch the IDL's sequence number for the field.  If the field isn't in the IDL,
-		// or if it has no sequence number there, or if it's virtual, skip it.
-		osrfHash* _f = osrfHashGet( fields, (char*) columnName );
-		if( _f ) {
+	for( i = 0; i < column_count; ++i ) {
 
-			if( str_is_true( osrfHashGet( _f, "virtual" )))
-				continue;   // skip this column: IDL says it's virtual
-
-			const char* pos = (char*) osrfHashGet( _f, "array_position" );
-			if( !pos )      // IDL has no sequence number for it.  This shouldn't happen,
-				continue;    // since we assign sequence numbers dynamically as we load the IDL.
+		int fmIndex = columns[ i ].fmIndex;  // the IDL's sequence number for this field
+		if( fmIndex < 0 )
+			continue;
 
-			fmIndex = atoi( pos );
-			osrfLogInternal( OSRF_LOG_MARK, "... Found column at position [%s]...", pos );
-		} else {
-			continue;     // This field is not defined in the IDL
-		}
+		unsigned int columnIndex = i + 1;
+		int attr = columns[ i ].attr;
 
 		// Stuff the column value into a slot in the JSON_ARRAY, indexed according to the
 		// sequence number from the IDL (which is likely to be different from the sequence
@@ -6780,7 +11102,7 @@ static jsonObject* oilsMakeFieldmapperFromResult( dbi_result result, osrfHash* m
 			jsonObjectSetIndex( object, fmIndex, jsonNewObject( NULL ));
 		} else {
 
-			switch( type ) {
+			switch( columns[ i ].type ) {
 
 				case DBI_TYPE_INTEGER :
 
@@ -6811,67 +11133,117 @@ static jsonObject* oilsMakeFieldmapperFromResult( dbi_result result, osrfHash* m
 
 				case DBI_TYPE_DATETIME : {
 
-					char dt_string[ 256 ] = "";
-					struct tm gmdt;
+					char dt_string[ OILS_DATETIME_BUFSIZE ];
 
 					// Fetch the date column as a time_t
 					time_t _tmp_dt = dbi_result_get_datetime_idx( result, columnIndex );
 
 					// Translate the time_t to a human-readable string
-					if( !( attr & DBI_DATETIME_DATE )) {
-						gmtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%T", &gmdt );
-					} else if( !( attr & DBI_DATETIME_TIME )) {
-						gmtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%04Y-%m-%d", &gmdt );
-					} else {
-						localtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%04Y-%m-%dT%T%z", &gmdt );
-					}
+					oilsUtilsFormatDatetime( dt_string, _tmp_dt,
+						attr & DBI_DATETIME_DATE, attr & DBI_DATETIME_TIME );
 
 					jsonObjectSetIndex( object, fmIndex, jsonNewObject( dt_string ));
 
 					break;
 				}
 				case DBI_TYPE_BINARY :
-					osrfLogError( OSRF_LOG_MARK,
-						"Can't do binary at column %s : index %d", columnName, columnIndex );
+					osrfLogError( OSRF_LOG_MARK, "Can't do binary at column %s : index %u",
+						dbi_result_get_field_name( result, columnIndex ), columnIndex );
 			} // End switch
 		}
-		++columnIndex;
-	} // End while
+	} // End for
 
 	return object;
 }
 
+/**
+	@brief Translate the current row of a result set into a JSON_HASH keyed on column name.
+	@param result An iterator for a result set; we only look at the current row.
+	@return Pointer to the resulting jsonObject if successful; otherwise NULL.
+
+	This is for looking at one row.  For many rows of the same result set, call
+	planJSONColumns() once, and then oilsMakeJSONFromColumns() for each row.
+
+	The calling code is responsible for freeing the returned jsonObject by calling
+	jsonObjectFree().
+*/
 static jsonObject* oilsMakeJSONFromResult( dbi_result result ) {
 	if( !result ) return NULL;
 
+	unsigned int column_count = 0;
+	FieldmapperColumn* columns = planJSONColumns( result, &column_count );
+	jsonObject* object = oilsMakeJSONFromColumns( result, columns, column_count );
+	free( columns );
+
+	return object;
+}
+
+/**
+	@brief Note the name, type, and attributes of each column of a result set.
+	@param result The result set of a query.
+	@param count Pointer through which to return the number of columns.
+	@return Pointer to a newly allocated array of FieldmapperColumns, one per column.
+
+	Every row has the same columns, so we ask libdbi about them once per result set,
+	and let oilsMakeJSONFromColumns() apply the answers to each row.
+
+	The calling code is responsible for freeing the array, and must not use it after
+	freeing the dbi_result, which owns the column names.
+*/
+static FieldmapperColumn* planJSONColumns( dbi_result result, unsigned int* count ) {
+	unsigned int column_count = 0;
+	while( dbi_result_get_field_name( result, column_count + 1 ))
+		++column_count;
+
+	FieldmapperColumn* columns =
+		safe_malloc( ( column_count ? column_count : 1 ) * sizeof( FieldmapperColumn ));
+
+	unsigned int i;
+	for( i = 0; i < column_count; ++i ) {
+		unsigned int columnIndex = i + 1;
+		columns[ i ].fmIndex = i;
+		columns[ i ].name = dbi_result_get_field_name( result, columnIndex );
+		columns[ i ].type = dbi_result_get_field_type_idx( result, columnIndex );
+		columns[ i ].attr = dbi_result_get_field_attribs_idx( result, columnIndex );
+	}
+
+	*count = column_count;
+	return columns;
+}
+
+/**
+	@brief Translate the current row of a result set into a JSON_HASH keyed on column name.
+	@param result An iterator for a result set; we only look at the current row.
+	@param columns Pointer to the column layout from planJSONColumns().
+	@param column_count Number of entries in @a columns.
+	@return Pointer to the resulting jsonObject if successful; otherwise NULL.
+
+	The calling code is responsible for freeing the returned jsonObject by calling
+	jsonObjectFree().
+*/
+static jsonObject* oilsMakeJSONFromColumns( dbi_result result,
+		const FieldmapperColumn* columns, unsigned int column_count ) {
+	if( !( result && columns )) return NULL;
+
 	jsonObject* object = jsonNewObject( NULL );
 
 	time_t _tmp_dt;
-	char dt_string[ 256 ];
-	struct tm gmdt;
+	char dt_string[ OILS_DATETIME_BUFSIZE ];
 
-	int columnIndex = 1;
-	int attr;
-	unsigned short type;
-	const char* columnName;
+	unsigned int i;
 
 	/* cycle through the column list */
-	while(( columnName = dbi_result_get_field_name( result, columnIndex ))) {
-
-		osrfLogInternal( OSRF_LOG_MARK, "Looking for column named [%s]...", (char*) columnName );
+	for( i = 0; i < column_count; ++i ) {
 
-		/* determine the field type and storage attributes */
-		type = dbi_result_get_field_type_idx( result, columnIndex );
-		attr = dbi_result_get_field_attribs_idx( result, columnIndex );
+		unsigned int columnIndex = i + 1;
+		const char* columnName = columns[ i ].name;
+		int attr = columns[ i ].attr;
 
 		if( dbi_result_field_is_null_idx( result, columnIndex )) {
 			jsonObjectSetKey( object, columnName, jsonNewObject( NULL ));
 		} else {
 
-			switch( type ) {
+			switch( columns[ i ].type ) {
 
 				case DBI_TYPE_INTEGER :
 
@@ -6896,32 +11268,20 @@ static jsonObject* oilsMakeJSONFromResult( dbi_result result ) {
 
 				case DBI_TYPE_DATETIME :
 
-					memset( dt_string, '\0', sizeof( dt_string ));
-					memset( &gmdt, '\0', sizeof( gmdt ));
-
 					_tmp_dt = dbi_result_get_datetime_idx( result, columnIndex );
 
-					if( !( attr & DBI_DATETIME_DATE )) {
-						gmtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%T", &gmdt );
-					} else if( !( attr & DBI_DATETIME_TIME )) {
-						gmtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%04Y-%m-%d", &gmdt );
-					} else {
-						localtime_r( &_tmp_dt, &gmdt );
-						strftime( dt_string, sizeof( dt_string ), "%04Y-%m-%dT%T%z", &gmdt );
-					}
+					oilsUtilsFormatDatetime( dt_string, _tmp_dt,
+						attr & DBI_DATETIME_DATE, attr & DBI_DATETIME_TIME );
 
 					jsonObjectSetKey( object, columnName, jsonNewObject( dt_string ));
 					break;
 
 				case DBI_TYPE_BINARY :
 					osrfLogError( OSRF_LOG_MARK,
-						"Can't do binary at column %s : index %d", columnName, columnIndex );
+						"Can't do binary at column %s : index %u", columnName, columnIndex );
 			}
 		}
-		++columnIndex;
-	} // end while loop traversing result
+	} // end for loop traversing columns
 
 	return object;
 }
@@ -7247,7 +11607,7 @@ static int build_class_info( ClassInfo* info, const char* alias, const char* cla
 		alias = class;
 
 	// Look up class info in the IDL
-	osrfHash* class_def = osrfHashGet( oilsIDL(), class );
+	osrfHash* class_def = oilsIDLGetClass( class );
 	if( ! class_def ) {
 		osrfLogError( OSRF_LOG_MARK,
 					  "%s ERROR: Class %s not defined in IDL", modulename, class );
@@ -7301,6 +11661,10 @@ static int build_class_info( ClassInfo* info, const char* alias, const char* cla
 
 	info->source_def = source_def;
 
+	// Note the class, if someone wants to know what the query reads
+	if( query_classes && !osrfStringArrayContains( query_classes, class ))
+		osrfStringArrayAdd( query_classes, class );
+
 	info->class_def = class_def;
 	info->links     = links;
 	info->fields    = fields;
@@ -1,9 +1,22 @@
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "openils/oils_utils.h"
 #include "openils/oils_idl.h"
 
+static osrfHash* init_idl( const char* idl_filename, int lazy );
+
 osrfHash* oilsInitIDL(const char* idl_filename) {
+	return init_idl( idl_filename, 0 );
+}
+
+osrfHash* oilsInitIDLLazy(const char* idl_filename) {
+	return init_idl( idl_filename, 1 );
+}
+
+static osrfHash* init_idl( const char* idl_filename, int lazy ) {
 
 	char* freeable_filename = NULL;
 	const char* filename;
@@ -22,7 +35,8 @@ osrfHash* oilsInitIDL(const char* idl_filename) {
 
 	osrfLogInfo(OSRF_LOG_MARK, "Parsing IDL %s", filename);
 
-	if (!oilsIDLInit( filename )) {
+	osrfHash* idl = lazy ? oilsIDLInitLazy( filename ) : oilsIDLInit( filename );
+	if (!idl) {
 		osrfLogError(OSRF_LOG_MARK, "Problem loading IDL file [%s]!", filename);
 		if(freeable_filename)
 			free(freeable_filename);
@@ -31,7 +45,7 @@ osrfHash* oilsInitIDL(const char* idl_filename) {
 
 	if(freeable_filename)
 		free(freeable_filename);
-	return oilsIDL();
+	return idl;
 }
 
 /**
@@ -91,10 +105,10 @@ const jsonObject* oilsFMGetObject( const jsonObject* object, const char* field )
 
 int oilsFMSetString( jsonObject* object, const char* field, const char* string ) {
 	if(!(object && field && string)) return -1;
-	osrfLogInternal(OSRF_LOG_MARK, "oilsFMSetString(): Collecing position for field %s", field);
+	OILS_LOG_INTERNAL(OSRF_LOG_MARK, "oilsFMSetString(): Collecing position for field %s", field);
 	int pos = fm_ntop(object->classname, field);
 	if( pos > -1 ) {
-		osrfLogInternal(OSRF_LOG_MARK, "oilsFMSetString(): Setting string "
+		OILS_LOG_INTERNAL(OSRF_LOG_MARK, "oilsFMSetString(): Setting string "
 				"%s at field %s [position %d]", string, field, pos );
 		jsonObjectSetIndex( object, pos, jsonNewObject(string) );
 		return 0;
@@ -243,7 +257,7 @@ jsonObject* oilsUtilsQuickReq( const char* service, const char* method,
 		const jsonObject* params ) {
 	if(!(service && method)) return NULL;
 
-	osrfLogDebug(OSRF_LOG_MARK, "oilsUtilsQuickReq(): %s - %s", service, method );
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "oilsUtilsQuickReq(): %s - %s", service, method );
 
 	// Open an application session with the service, and send the request
 	osrfAppSession* session = osrfAppSessionClientInit( service );
@@ -278,7 +292,7 @@ jsonObject* oilsUtilsQuickReqCtx( osrfMethodContext* ctx, const char* service,
                 const char* method, const jsonObject* params ) {
 	if(!(service && method && ctx)) return NULL;
 
-	osrfLogDebug(OSRF_LOG_MARK, "oilsUtilsQuickReqCtx(): %s - %s (%s)", service, method, ctx->session->session_tz );
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "oilsUtilsQuickReqCtx(): %s - %s (%s)", service, method, ctx->session->session_tz );
 
 	// Open an application session with the service, and send the request
 	osrfAppSession* session = osrfAppSessionClientInit( service );
@@ -365,7 +379,7 @@ jsonObject* oilsUtilsFetchUserByUsername( osrfMethodContext* ctx, const char* na
 
 	jsonObjectFree(params);
 	long id = oilsFMGetObjectId(user);
-	osrfLogDebug(OSRF_LOG_MARK, "Fetched user %s:%ld", name, id);
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Fetched user %s:%ld", name, id);
 	return user;
 }
 
@@ -422,7 +436,7 @@ char* oilsUtilsFetchOrgSetting( int orgid, const char* setting ) {
 	char* value = jsonObjectToSimpleString( jsonObjectGetKeyConst( set, "value" ));
 	jsonObjectFree(params);
 	jsonObjectFree(set);
-	osrfLogDebug(OSRF_LOG_MARK, "Fetched org [%d] setting: %s => %s", orgid, setting, value);
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Fetched org [%d] setting: %s => %s", orgid, setting, value);
 	return value;
 }
 
@@ -431,7 +445,7 @@ char* oilsUtilsFetchOrgSetting( int orgid, const char* setting ) {
 char* oilsUtilsLogin( const char* uname, const char* passwd, const char* type, int orgId ) {
 	if(!(uname && passwd)) return NULL;
 
-	osrfLogDebug(OSRF_LOG_MARK, "Logging in with username %s", uname );
+	OILS_LOG_DEBUG(OSRF_LOG_MARK, "Logging in with username %s", uname );
 	char* token = NULL;
 
 	jsonObject* params = jsonParseFmt("[\"%s\"]", uname);
@@ -564,3 +578,170 @@ long oilsUtilsIntervalToSeconds( const char* s ) {
 	jsonObjectFree( result );
 	return seconds;
 }
+
+/* Cache of local UTC offsets, one slot per hour of UTC time (see local_offset()) */
+#define OFFSET_BUCKET_SECONDS 3600
+#define OFFSET_CACHE_SLOTS    1021
+
+typedef struct {
+	time_t bucket;   // UTC time divided by OFFSET_BUCKET_SECONDS
+	long offset;     // seconds east of UTC throughout that bucket
+	int valid;
+} OffsetSlot;
+
+static OffsetSlot offset_cache[ OFFSET_CACHE_SLOTS ];
+static char* offset_cache_tz = NULL;   // value of TZ when the cache was filled
+static int offset_cache_primed = 0;
+
+/**
+	@brief Empty the offset cache if the TZ environment variable has changed.
+*/
+static void check_offset_tz( void ) {
+	const char* tz = getenv( "TZ" );
+	if( offset_cache_primed ) {
+		if( !tz && !offset_cache_tz )
+			return;
+		if( tz && offset_cache_tz && !strcmp( tz, offset_cache_tz ))
+			return;
+	}
+
+	free( offset_cache_tz );
+	offset_cache_tz = tz ? strdup( tz ) : NULL;
+	memset( offset_cache, 0, sizeof( offset_cache ));
+	offset_cache_primed = 1;
+	tzset();
+}
+
+/**
+	@brief Look up the local UTC offset at a given moment.
+	@param when The moment in question.
+	@return The offset in seconds east of UTC.
+
+	A bucket is cached only when the offset is the same at its first and last second,
+	so an hour containing a zone transition is always resolved with localtime_r().
+*/
+static long local_offset( time_t when ) {
+	struct tm tm;
+
+	check_offset_tz();
+
+	time_t bucket = when / OFFSET_BUCKET_SECONDS;
+	if( when % OFFSET_BUCKET_SECONDS < 0 )
+		--bucket;
+	OffsetSlot* slot = &offset_cache[ ( bucket % OFFSET_CACHE_SLOTS + OFFSET_CACHE_SLOTS )
+		% OFFSET_CACHE_SLOTS ];
+	if( slot->valid && slot->bucket == bucket )
+		return slot->offset;
+
+	time_t start = bucket * OFFSET_BUCKET_SECONDS;
+	time_t end = start + OFFSET_BUCKET_SECONDS - 1;
+	localtime_r( &start, &tm );
+	long offset = tm.tm_gmtoff;
+	localtime_r( &end, &tm );
+	if( tm.tm_gmtoff != offset ) {
+		localtime_r( &when, &tm );
+		return tm.tm_gmtoff;
+	}
+
+	slot->bucket = bucket;
+	slot->offset = offset;
+	slot->valid = 1;
+	return offset;
+}
+
+static char* put_digits( char* p, long n, int width ) {
+	int i;
+	for( i = width - 1; i >= 0; --i ) {
+		p[ i ] = '0' + n % 10;
+		n /= 10;
+	}
+	return p + width;
+}
+
+/**
+	@brief Format a time_t as a date and/or time string.
+	@param buf Buffer of at least OILS_DATETIME_BUFSIZE bytes to receive the string.
+	@param when The moment to be formatted.
+	@param want_date Zero for a time-only column, rendered in UTC as "HH:MM:SS".
+	@param want_time Zero for a date-only column, rendered in UTC as "YYYY-MM-DD".
+	@return The length of the formatted string.
+
+	With both flags set, the result is local time with its offset, as in
+	"2013-04-01T16:30:00-0400".  The output is the same as strftime() with "%T",
+	"%04Y-%m-%d" or "%04Y-%m-%dT%T%z", but the digits are computed directly and the
+	local offset comes from a cache, so that a column of timestamps doesn't cost a
+	localtime_r() and a strftime() per row.  Years outside 0 through 9999 are
+	handed to strftime().
+
+	The offset cache is static, so this function is not thread-safe.
+*/
+int oilsUtilsFormatDatetime( char* buf, time_t when, int want_date, int want_time ) {
+
+	long offset = 0;
+	if( want_date && want_time )
+		offset = local_offset( when );
+
+	long long t = (long long) when + offset;
+	long long days = t / 86400;
+	long secs = (long) ( t % 86400 );
+	if( secs < 0 ) {
+		secs += 86400;
+		--days;
+	}
+
+	char* p = buf;
+	if( want_date ) {
+		// Convert days since the epoch to a proleptic Gregorian date
+		long long z = days + 719468;
+		long long era = ( z >= 0 ? z : z - 146096 ) / 146097;
+		long doe = (long) ( z - era * 146097 );
+		long yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+		long doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+		long mp = ( 5 * doy + 2 ) / 153;
+		long day = doy - ( 153 * mp + 2 ) / 5 + 1;
+		long month = mp < 10 ? mp + 3 : mp - 9;
+		long long year = yoe + era * 400 + ( month <= 2 );
+
+		if( year < 0 || year > 9999 ) {
+			struct tm tm;
+			if( want_time ) {
+				localtime_r( &when, &tm );
+				return strftime( buf, OILS_DATETIME_BUFSIZE, "%04Y-%m-%dT%T%z", &tm );
+			} else {
+				gmtime_r( &when, &tm );
+				return strftime( buf, OILS_DATETIME_BUFSIZE, "%04Y-%m-%d", &tm );
+			}
+		}
+
+		p = put_digits( p, (long) year, 4 );
+		*p++ = '-';
+		p = put_digits( p, month, 2 );
+		*p++ = '-';
+		p = put_digits( p, day, 2 );
+		if( want_time )
+			*p++ = 'T';
+	}
+
+	if( want_time || !want_date ) {
+		p = put_digits( p, secs / 3600, 2 );
+		*p++ = ':';
+		p = put_digits( p, secs / 60 % 60, 2 );
+		*p++ = ':';
+		p = put_digits( p, secs % 60, 2 );
+	}
+
+	if( want_date && want_time ) {
+		// Like %z: sign, then hours and minutes, dropping any odd seconds
+		long minutes = offset / 60;
+		if( offset < 0 ) {
+			*p++ = '-';
+			minutes = -offset / 60;
+		} else
+			*p++ = '+';
+		p = put_digits( p, minutes / 60, 2 );
+		p = put_digits( p, minutes % 60, 2 );
+	}
+
+	*p = '\0';
+	return p - buf;
+}
@@ -135,7 +135,7 @@ int main( int argc, char* argv[] ) {
 		printf( "JSON query: %s\n", json_query );
 
 	osrfLogSetLevel( OSRF_LOG_WARNING );    // Suppress informational messages
-	(void) oilsIDLInit( idl_file_name );    // Load IDL into memory
+	(void) oilsIDLInitLazy( idl_file_name );    // Load IDL classes as needed
 
 	// Load a database driver, connect to it, and install the connection in
 	// the cstore module.  We don't actually connect to a database, but we
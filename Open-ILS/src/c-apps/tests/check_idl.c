@@ -1,14 +1,23 @@
 #include <check.h>
 #include <ctype.h>
 #include <limits.h>
+#include <string.h>
 #include "openils/oils_utils.h"
 #include "openils/oils_idl.h"
 
+#define IDL_FILE "../../../examples/fm_IDL.xml"
+
 osrfHash * my_idl;
 
 //Set up the test fixture
 void setup (void) {
-    my_idl = oilsInitIDL("../../../examples/fm_IDL.xml");
+    my_idl = oilsInitIDL(IDL_FILE);
+}
+
+//Set up the test fixture for a lazily loaded IDL.  Each test runs in
+//its own forked process, so each one starts with nothing loaded.
+void setup_lazy (void) {
+    my_idl = oilsIDLInitLazy(IDL_FILE);
 }
 
 //Clean up the test fixture
@@ -16,6 +25,47 @@ void teardown (void) {
     free(my_idl);
 }
 
+//Helpers
+
+static int same_str (const char* a, const char* b) {
+    if (!a || !b)
+        return a == b;
+    return !strcmp(a, b);
+}
+
+//Compare the named string attribute of every entry of two hashes of hashes
+static int same_entries (osrfHash* a, osrfHash* b, const char* attr) {
+    if (!a || !b)
+        return a == b;
+    if (osrfHashGetCount(a) != osrfHashGetCount(b))
+        return 0;
+
+    int same = 1;
+    osrfHashIterator* itr = osrfNewHashIterator(a);
+    osrfHash* entry;
+    while (same && (entry = osrfHashIteratorNext(itr))) {
+        osrfHash* other = osrfHashGet(b, osrfHashIteratorKey(itr));
+        same = other && same_str(osrfHashGet(entry, attr), osrfHashGet(other, attr));
+    }
+    osrfHashIteratorFree(itr);
+    return same;
+}
+
+static int same_class (osrfHash* a, osrfHash* b) {
+    static const char* attrs[] = { "classname", "tablename", "source_definition",
+        "primarykey", "sequence", "virtual", "fieldmapper", "restrict_primary" };
+    int i;
+    for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++)
+        if (!same_str(osrfHashGet(a, attrs[i]), osrfHashGet(b, attrs[i])))
+            return 0;
+
+    return same_entries(osrfHashGet(a, "fields"), osrfHashGet(b, "fields"), "array_position")
+        && same_entries(osrfHashGet(a, "fields"), osrfHashGet(b, "fields"), "primitive")
+        && same_entries(osrfHashGet(a, "links"), osrfHashGet(b, "links"), "class")
+        && same_entries(osrfHashGet(a, "links"), osrfHashGet(b, "links"), "key")
+        && same_entries(osrfHashGet(a, "links"), osrfHashGet(b, "links"), "reltype");
+}
+
 //Tests
 
 START_TEST (test_loading_idl)
@@ -24,6 +74,58 @@ START_TEST (test_loading_idl)
 }
 END_TEST
 
+START_TEST (test_lazy_builds_one_class)
+{
+    ck_assert(my_idl);
+    ck_assert_int_eq(osrfHashGetCount(my_idl), 0);
+
+    osrfHash* au = oilsIDLGetClass("au");
+    ck_assert(au);
+    ck_assert_str_eq(osrfHashGet(au, "classname"), "au");
+    ck_assert_int_eq(osrfHashGetCount(my_idl), 1);
+    ck_assert(!osrfHashGet(my_idl, "aou"));
+
+    // Looking it up again doesn't build it again
+    ck_assert(oilsIDLGetClass("au") == au);
+    ck_assert_int_eq(osrfHashGetCount(my_idl), 1);
+}
+END_TEST
+
+START_TEST (test_lazy_unknown_class)
+{
+    ck_assert(!oilsIDLGetClass("no_such_class"));
+    ck_assert(!oilsIDLGetClass(NULL));
+    ck_assert_int_eq(osrfHashGetCount(my_idl), 0);
+}
+END_TEST
+
+START_TEST (test_lazy_matches_eager)
+{
+    osrfHash* au = oilsIDLGetClass("au");
+    ck_assert(au);
+
+    // Asking for the whole IDL builds everything else
+    ck_assert(oilsIDL() == my_idl);
+    osrfHash* eager = oilsIDLLoad(IDL_FILE);
+    ck_assert(eager);
+    ck_assert_int_gt(osrfHashGetCount(eager), 1);
+    ck_assert_int_eq(osrfHashGetCount(my_idl), osrfHashGetCount(eager));
+
+    // The class built earlier is still the one in the IDL
+    ck_assert(osrfHashGet(my_idl, "au") == au);
+
+    osrfHashIterator* itr = osrfNewHashIterator(eager);
+    osrfHash* class_def;
+    while ((class_def = osrfHashIteratorNext(itr))) {
+        const char* classname = osrfHashIteratorKey(itr);
+        ck_assert_msg(same_class(osrfHashGet(my_idl, classname), class_def),
+            "Class %s differs between lazy and eager loads", classname);
+    }
+    osrfHashIteratorFree(itr);
+    oilsIDLFree(eager);
+}
+END_TEST
+
 //END Tests
 
 Suite *idl_suite (void) {
@@ -35,8 +137,16 @@ Suite *idl_suite (void) {
   //Add tests to test case
   tcase_add_test(tc_core, test_loading_idl);
 
-  //Add test case to test suite
+  //Same for the lazily loaded IDL
+  TCase *tc_lazy = tcase_create("Lazy");
+  tcase_add_checked_fixture(tc_lazy, setup_lazy, NULL);
+  tcase_add_test(tc_lazy, test_lazy_builds_one_class);
+  tcase_add_test(tc_lazy, test_lazy_unknown_class);
+  tcase_add_test(tc_lazy, test_lazy_matches_eager);
+
+  //Add test cases to test suite
   suite_add_tcase(s, tc_core);
+  suite_add_tcase(s, tc_lazy);
 
   return s;
 }
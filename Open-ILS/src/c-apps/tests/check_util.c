@@ -1,6 +1,8 @@
 #include <check.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include "openils/oils_utils.h"
 #include "openils/oils_idl.h"
 
@@ -24,6 +26,37 @@ START_TEST (test_oilsUtilsIsDBTrue)
 }
 END_TEST
 
+START_TEST (test_oilsUtilsFormatDatetime)
+{
+    char buf[ OILS_DATETIME_BUFSIZE ];
+    setenv( "TZ", "EST5EDT,M3.2.0,M11.1.0", 1 );
+
+    // 2013-04-01 20:30:05 UTC
+    ck_assert_int_eq( oilsUtilsFormatDatetime( buf, 1364848205, 0, 1 ), 8 );
+    ck_assert_str_eq( buf, "20:30:05" );
+    ck_assert_int_eq( oilsUtilsFormatDatetime( buf, 1364848205, 1, 0 ), 10 );
+    ck_assert_str_eq( buf, "2013-04-01" );
+    ck_assert_int_eq( oilsUtilsFormatDatetime( buf, 1364848205, 1, 1 ), 24 );
+    ck_assert_str_eq( buf, "2013-04-01T16:30:05-0400" );
+
+    // Either side of the spring-forward transition, 2013-03-10 07:00:00 UTC
+    oilsUtilsFormatDatetime( buf, 1362898799, 1, 1 );
+    ck_assert_str_eq( buf, "2013-03-10T01:59:59-0500" );
+    oilsUtilsFormatDatetime( buf, 1362898800, 1, 1 );
+    ck_assert_str_eq( buf, "2013-03-10T03:00:00-0400" );
+
+    // Before the epoch
+    oilsUtilsFormatDatetime( buf, -1, 1, 1 );
+    ck_assert_str_eq( buf, "1969-12-31T18:59:59-0500" );
+
+    // A change of TZ is noticed
+    setenv( "TZ", "IST-5:30", 1 );
+    oilsUtilsFormatDatetime( buf, 1364848205, 1, 1 );
+    ck_assert_str_eq( buf, "2013-04-02T02:00:05+0530" );
+    unsetenv( "TZ" );
+}
+END_TEST
+
 //END Tests
 
 Suite *util_suite (void) {
@@ -34,6 +67,7 @@ Suite *util_suite (void) {
 
   //Add tests to test case
   tcase_add_test(tc_core, test_oilsUtilsIsDBTrue);
+  tcase_add_test(tc_core, test_oilsUtilsFormatDatetime);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
@@ -58,7 +58,7 @@ int main( int argc, char* argv[] ) {
 		osrf_settings_retrieve(hostname);
 	}
 
-	if (!oilsInitIDL( idl_filename )) {
+	if (!oilsInitIDLLazy( idl_filename )) {
 		fprintf(stderr, "IDL file could not be loaded. Exiting...\n");
 		return -1;
 	}